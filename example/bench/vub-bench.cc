@@ -0,0 +1,1303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <execution>
+#include <functional>
+#include <random>
+#include <cmath>
+#include "helper.h"
+#include "gpu-device.h"
+#include "device-scan.h"
+#include "profiler.h"
+#include "cpu-backend.h"
+#include "device-spmv.h"
+#include "device-radix-sort.h"
+#include "device-merge-sort.h"
+#include "device-segmented-sort.h"
+#include "device-top-k.h"
+
+/* Sweeps every primitive over sizes from 1K elements up to what fits in
+ * device memory, on the GPU and on the CPU, and writes one CSV row per
+ * (primitive, element type, engine, size).
+ *
+ * Rows are put next to two references measured at the same size:
+ *  - a buffer copy on the same engine, which reads and writes as many
+ *    bytes as a scan and so is the bandwidth a scan can hope for;
+ *  - the parallel std:: algorithm on the CPU.
+ *
+ * The CPU backend (engine "cpu-<simd level>") is measured too.
+ *
+ * Reductions go through DeviceScan, which writes out the scan as well, so
+ * their GPU rows can't get much past half of the copy bandwidth.
+ *
+ * Exclusive scans of other element types (see ScanType) are measured on
+ * the GPU only, on the same inputs: "u8" and "u16" into uint32 offsets,
+ * "f32" and "f16" into float sums. The types the device can't store are
+ * skipped.
+ *
+ * Sorts and selections run on random keys, and their CPU references on a
+ * copy of the keys, whose time is included. The GPU rows are "sort"
+ * (DeviceRadixSort), "sort-merge" (DeviceMergeSort), "sort-segmented"
+ * (DeviceSegmentedSort, over segments with power-law lengths),
+ * "select-nth" (the median, with DeviceSelectNth) and "top-k" (with
+ * DeviceTopK). Without the profiler, the sorts in place include copying
+ * the keys in. Float keys (type "f32") go through all of them but the
+ * radix sort, which only sorts uints; sort-merge uses Comparator::floats.
+ *
+ * SpMV rows ("spmv-merge" and "spmv-rows", with as many nonzeros as
+ * elements) run on power-law matrices, where most nonzeros are in a few
+ * rows. Their copy reference moves as many bytes as they do; they have no
+ * CPU reference.
+ *
+ * Runs on anything with a compute queue, including lavapipe:
+ *   VK_ICD_FILENAMES=/usr/share/vulkan/icd.d/lvp_icd.x86_64.json vub-bench */
+
+struct BenchOptions {
+  uint64 minElements = 1024;
+  uint64 maxElements = 1ull << 28;
+  uint32 iterations = 10;
+  const char *outputPath = nullptr;
+};
+
+/* A measured primitive at one size. */
+struct BenchResult {
+  const char *primitive;
+  const char *type;
+  const char *engine;
+  uint64 elements;
+  float64 ms;
+  uint64 bytes;
+  uint64 mismatches;
+};
+
+static void
+printUsage(const char *program)
+{
+  fprintf(stderr,
+          "usage: %s [--min-elements N] [--max-elements N] "
+          "[--iterations N] [--output FILE]\n", program);
+}
+
+static BenchOptions
+parseOptions(int argc, char **argv)
+{
+  BenchOptions options = {};
+
+  for (int i = 1; i < argc; ++i)
+  {
+    bool hasValue = i + 1 < argc;
+
+    if (!strcmp(argv[i], "--min-elements") && hasValue)
+    {
+      options.minElements = strtoull(argv[++i], nullptr, 0);
+    }
+    else if (!strcmp(argv[i], "--max-elements") && hasValue)
+    {
+      options.maxElements = strtoull(argv[++i], nullptr, 0);
+    }
+    else if (!strcmp(argv[i], "--iterations") && hasValue)
+    {
+      options.iterations = (uint32)strtoul(argv[++i], nullptr, 0);
+    }
+    else if (!strcmp(argv[i], "--output") && hasValue)
+    {
+      options.outputPath = argv[++i];
+    }
+    else
+    {
+      printUsage(argv[0]);
+      exit(1);
+    }
+  }
+
+  options.minElements = std::max<uint64>(options.minElements, 1);
+  options.iterations = std::max<uint32>(options.iterations, 1);
+
+  return options;
+}
+
+static float64
+median(std::vector<float64> values)
+{
+  std::sort(values.begin(), values.end());
+  return values[values.size() / 2];
+}
+
+/* Median time of the CPU running fn. */
+static float64
+timeCPU(uint32 iterations, const std::function<void()> &fn)
+{
+  std::vector<float64> times;
+
+  for (uint32 i = 0; i < iterations; ++i)
+  {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+
+    times.push_back(
+      std::chrono::duration<float64, std::milli>(end - start).count());
+  }
+
+  return median(times);
+}
+
+/* Median time of the GPU running the commands record adds. With the
+ * profiler, every iteration goes into the same command buffer and the time
+ * comes from the timestamps of the scope named name (which record has to
+ * open). Without it, every iteration is submitted on its own and includes
+ * the submission. */
+static float64
+timeGPU(const GPUDevice &gpu, uint32 iterations, const char *name,
+        const std::function<void(VkCommandBuffer)> &record)
+{
+  VkCommandBuffer cmdbuf = gpu.makeCommandBuffer();
+  std::vector<float64> times;
+
+  /* Keeps iterations from overlapping, since they write the same memory,
+   * and makes the results visible to the host (for imported memory). */
+  VkMemoryBarrier barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT |
+                     VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_SHADER_READ_BIT |
+                     VK_ACCESS_HOST_READ_BIT
+  };
+
+  VkPipelineStageFlags srcStages = VK_PIPELINE_STAGE_TRANSFER_BIT |
+                                   VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+  VkPipelineStageFlags dstStages = srcStages | VK_PIPELINE_STAGE_HOST_BIT;
+
+  if (gpu.profiler)
+  {
+    gpu.profiler->events.clear();
+
+    gpu.beginSingleUseCommandBuffer(cmdbuf);
+    for (uint32 i = 0; i < iterations; ++i)
+    {
+      record(cmdbuf);
+      vkCmdPipelineBarrier(cmdbuf, srcStages, dstStages, 0, 1, &barrier,
+                           0, nullptr, 0, nullptr);
+    }
+    gpu.endCommandBuffer(cmdbuf);
+
+    gpu.submitCommandBuffer(cmdbuf, VK_NULL_HANDLE, VK_NULL_HANDLE, 0,
+                            VK_NULL_HANDLE);
+    gpu.waitIdle();
+    gpu.profiler->collect();
+
+    for (const ProfileEvent &event : gpu.profiler->events)
+    {
+      if (event.name == name)
+        times.push_back(event.durationMs);
+    }
+  }
+  else
+  {
+    for (uint32 i = 0; i < iterations; ++i)
+    {
+      gpu.beginSingleUseCommandBuffer(cmdbuf);
+      record(cmdbuf);
+      vkCmdPipelineBarrier(cmdbuf, srcStages, dstStages, 0, 1, &barrier,
+                           0, nullptr, 0, nullptr);
+      gpu.endCommandBuffer(cmdbuf);
+
+      auto start = std::chrono::steady_clock::now();
+      gpu.submitCommandBuffer(cmdbuf, VK_NULL_HANDLE, VK_NULL_HANDLE, 0,
+                              VK_NULL_HANDLE);
+      gpu.waitIdle();
+      auto end = std::chrono::steady_clock::now();
+
+      times.push_back(
+        std::chrono::duration<float64, std::milli>(end - start).count());
+    }
+  }
+
+  gpu.freeCommandBuffer(cmdbuf);
+
+  if (times.empty())
+  {
+    fprintf(stderr, "No timings for %s\n", name);
+    PANIC_AND_EXIT("Missing GPU timings");
+  }
+
+  return median(times);
+}
+
+static void
+copyBuffer(const GPUDevice &gpu, VkBuffer src, VkBuffer dst, uint64 size,
+           uint64 srcOffset = 0)
+{
+  VkCommandBuffer cmdbuf = gpu.makeCommandBuffer();
+  gpu.beginSingleUseCommandBuffer(cmdbuf);
+
+  VkBufferCopy region = { srcOffset, 0, size };
+  vkCmdCopyBuffer(cmdbuf, src, dst, 1, &region);
+
+  gpu.endCommandBuffer(cmdbuf);
+  gpu.submitCommandBuffer(cmdbuf, VK_NULL_HANDLE, VK_NULL_HANDLE, 0,
+                          VK_NULL_HANDLE);
+  gpu.waitIdle();
+  gpu.freeCommandBuffer(cmdbuf);
+}
+
+static void
+destroyBuffer(const GPUDevice &gpu, const DeviceBuffer &buffer)
+{
+  vkDestroyBuffer(gpu.dev, buffer.hdl, nullptr);
+  gpu.freeMemory(buffer.mem);
+}
+
+static uint64
+countMismatches(const uint32 *expected, const uint32 *values, uint64 count)
+{
+  uint64 mismatches = 0;
+  for (uint64 i = 0; i < count; ++i)
+    mismatches += (expected[i] != values[i]);
+
+  return mismatches;
+}
+
+/* The largest sweep size: both buffers have to fit in half of device local
+ * memory (leaving room for everything else), scans count elements with 32
+ * bits, and without device addresses a buffer has to fit in a storage
+ * buffer descriptor. */
+static uint64
+maxSweepElements(const GPUDevice &gpu, const BenchOptions &options)
+{
+  uint64 elements = options.maxElements;
+
+  elements = std::min(elements,
+                      gpu.getDeviceLocalMemorySize() / 2 / (2 * sizeof(uint32)));
+  elements = std::min<uint64>(elements, UINT32_MAX);
+
+  if (!gpu.features.bufferDeviceAddress)
+    elements = std::min(elements, gpu.getMaxStorageBufferRange() / sizeof(uint32));
+
+  return elements;
+}
+
+struct BenchWriter {
+  FILE *file;
+  std::string device;
+
+  /* Copy bandwidth per engine and the CPU reference time of each primitive,
+   * for the size being measured. */
+  float64 gpuCopyGBps;
+  float64 cpuCopyGBps;
+  std::vector<BenchResult> references;
+
+  void writeHeader()
+  {
+    fprintf(file, "device,primitive,type,engine,elements,ms,"
+                  "gelements_per_s,gb_per_s,pct_copy_bw,speedup_vs_cpu,"
+                  "mismatches\n");
+  }
+
+  void write(const BenchResult &result)
+  {
+    float64 seconds = result.ms * 1e-3;
+    float64 gigabytesPerSecond = (float64)result.bytes / seconds * 1e-9;
+    float64 copyGBps = strcmp(result.engine, "gpu") ? cpuCopyGBps : gpuCopyGBps;
+
+    float64 speedup = 0.0;
+    for (const BenchResult &reference : references)
+    {
+      if (!strcmp(reference.primitive, result.primitive) &&
+          !strcmp(reference.type, result.type))
+        speedup = reference.ms / result.ms;
+    }
+
+    fprintf(file, "\"%s\",%s,%s,%s,%llu,%.6f,%.4f,%.3f,%.1f,%.3f,%llu\n",
+            device.c_str(), result.primitive, result.type, result.engine,
+            (unsigned long long)result.elements, result.ms,
+            (float64)result.elements / seconds * 1e-9,
+            gigabytesPerSecond,
+            copyGBps > 0.0 ? 100.0 * gigabytesPerSecond / copyGBps : 0.0,
+            speedup,
+            (unsigned long long)result.mismatches);
+    fflush(file);
+  }
+};
+
+/* numParts + 1 offsets which split count elements into parts whose
+ * lengths follow a power law (Pareto with alpha 1.2, like the degrees of a
+ * web or social graph). */
+static std::vector<uint32>
+makePowerLawOffsets(std::mt19937 &random, uint64 count, uint32 numParts)
+{
+  std::uniform_real_distribution<float64> uniform(0.0, 1.0);
+
+  std::vector<uint32> offsets;
+  offsets.push_back(0);
+
+  for (uint32 part = 0; part < numParts; ++part)
+  {
+    uint64 length = (uint64)(2.0 / pow(1.0 - uniform(random), 1.0 / 1.2));
+    uint64 remaining = count - offsets.back();
+
+    /* The last part takes whatever is left. */
+    if (part == numParts - 1 || length > remaining)
+      length = remaining;
+
+    offsets.push_back(offsets.back() + (uint32)length);
+  }
+
+  return offsets;
+}
+
+/* A CSR matrix with rows whose lengths follow a power law (see
+ * makePowerLawOffsets). */
+struct PowerLawMatrix {
+  uint32 numRows;
+  std::vector<uint32> rowOffsets;
+  std::vector<uint32> columns;
+  std::vector<float64> values;
+  std::vector<float64> x;
+};
+
+static PowerLawMatrix
+makePowerLawMatrix(uint64 numNonzeros)
+{
+  PowerLawMatrix ret = {};
+
+  std::mt19937 random(1234);
+  std::uniform_real_distribution<float64> uniform(0.0, 1.0);
+
+  /* Rows hold 8 nonzeros on average, most far fewer. */
+  ret.numRows = (uint32)std::max<uint64>(numNonzeros / 8, 1);
+  ret.rowOffsets = makePowerLawOffsets(random, numNonzeros, ret.numRows);
+
+  std::uniform_int_distribution<uint32> column(0, ret.numRows - 1);
+  for (uint64 i = 0; i < numNonzeros; ++i)
+  {
+    ret.columns.push_back(column(random));
+    ret.values.push_back(uniform(random) - 0.5);
+  }
+
+  for (uint32 i = 0; i < ret.numRows; ++i)
+    ret.x.push_back(uniform(random));
+
+  return ret;
+}
+
+/* Uploads count values, as floats or doubles, through the staging
+ * buffer. */
+static void
+uploadValues(const GPUDevice &gpu, const StagingBuffer &staging,
+             const DeviceBuffer &buffer, const float64 *values, uint64 count,
+             bool isDouble)
+{
+  if (isDouble)
+  {
+    memcpy(staging.ptr, values, count * sizeof(float64));
+  }
+  else
+  {
+    for (uint64 i = 0; i < count; ++i)
+      ((float32 *)staging.ptr)[i] = (float32)values[i];
+  }
+
+  copyBuffer(gpu, staging.hdl, buffer.hdl,
+             count * (isDouble ? sizeof(float64) : sizeof(float32)));
+}
+
+/* Bandwidth of a copy from src to dst which reads and writes
+ * trafficBytes in total. */
+static float64
+measureCopyGBps(const GPUDevice &gpu, const BenchOptions &options,
+                const DeviceBuffer &src, const DeviceBuffer &dst,
+                uint64 trafficBytes)
+{
+  float64 ms = timeGPU(gpu, options.iterations, "copy",
+    [&](VkCommandBuffer cmdbuf)
+    {
+      ProfileScope profile(gpu, cmdbuf, "copy", trafficBytes);
+
+      VkBufferCopy region = { 0, 0, trafficBytes / 2 };
+      vkCmdCopyBuffer(cmdbuf, src.hdl, dst.hdl, 1, &region);
+    });
+
+  return trafficBytes / (ms * 1e-3) * 1e-9;
+}
+
+/* Measures both SpMV kernels on a power-law matrix of numNonzeros
+ * nonzeros, in floats and (if the device has them) doubles, with the
+ * DeviceSpmv of each type. Staging has to hold numNonzeros doubles, and
+ * copySrc and copyDst half of what an SpMV reads and writes. */
+static void
+benchSpmv(const GPUDevice &gpu, BenchWriter &writer,
+          const BenchOptions &options, const StagingBuffer &staging,
+          const vub::DeviceSpmv *spmvs, const DeviceBuffer &copySrc,
+          const DeviceBuffer &copyDst, uint64 numNonzeros)
+{
+  /* Restored for the rows after these. */
+  float64 gpuCopyGBps = writer.gpuCopyGBps;
+
+  PowerLawMatrix matrix = makePowerLawMatrix(numNonzeros);
+
+  std::vector<float64> expected(matrix.numRows, 0.0);
+  for (uint32 row = 0; row < matrix.numRows; ++row)
+  {
+    for (uint32 i = matrix.rowOffsets[row]; i < matrix.rowOffsets[row + 1];
+         ++i)
+      expected[row] += matrix.values[i] * matrix.x[matrix.columns[i]];
+  }
+
+  uint64 bytes = numNonzeros * sizeof(float64);
+  DeviceBuffer rowOffsets = gpu.makeDeviceBuffer(
+    ((uint64)matrix.numRows + 1) * sizeof(uint32));
+  DeviceBuffer columns = gpu.makeDeviceBuffer(
+    std::max<uint64>(numNonzeros, 1) * sizeof(uint32));
+  DeviceBuffer values = gpu.makeDeviceBuffer(std::max<uint64>(bytes, 8));
+  DeviceBuffer x = gpu.makeDeviceBuffer(matrix.numRows * sizeof(float64));
+  DeviceBuffer y = gpu.makeDeviceBuffer(matrix.numRows * sizeof(float64));
+
+  memcpy(staging.ptr, matrix.rowOffsets.data(),
+         matrix.rowOffsets.size() * sizeof(uint32));
+  copyBuffer(gpu, staging.hdl, rowOffsets.hdl,
+             matrix.rowOffsets.size() * sizeof(uint32));
+
+  if (numNonzeros)
+  {
+    memcpy(staging.ptr, matrix.columns.data(), numNonzeros * sizeof(uint32));
+    copyBuffer(gpu, staging.hdl, columns.hdl, numNonzeros * sizeof(uint32));
+  }
+
+  for (bool isDouble : { false, true })
+  {
+    if (isDouble && !gpu.features.float64)
+      continue;
+
+    const vub::DeviceSpmv &spmv = spmvs[isDouble];
+
+    uploadValues(gpu, staging, values, matrix.values.data(), numNonzeros,
+                 isDouble);
+    uploadValues(gpu, staging, x, matrix.x.data(), matrix.numRows,
+                 isDouble);
+
+    uint64 valueSize = isDouble ? sizeof(float64) : sizeof(float32);
+    uint64 trafficBytes = numNonzeros * (sizeof(uint32) + 2 * valueSize) +
+                          (uint64)matrix.numRows * (sizeof(uint32) + valueSize);
+
+    /* Copies get faster with their size, so the rows are put next to a
+     * copy as large as they are rather than the one of size elements. */
+    writer.gpuCopyGBps = measureCopyGBps(gpu, options, copySrc, copyDst,
+                                         trafficBytes);
+
+    for (vub::SpmvAlgorithm algorithm : { vub::SpmvAlgorithm::Merge,
+                                          vub::SpmvAlgorithm::RowPerSubgroup })
+    {
+      const char *primitive = algorithm == vub::SpmvAlgorithm::Merge ?
+        "spmv-merge" : "spmv-rows";
+
+      BenchResult result = { primitive, isDouble ? "f64" : "f32", "gpu",
+                             numNonzeros, 0.0, trafficBytes, 0 };
+      result.ms = timeGPU(gpu, options.iterations, "DeviceSpmv",
+        [&](VkCommandBuffer cmdbuf)
+        {
+          spmv.record(cmdbuf, rowOffsets, columns, values, x, y,
+                      matrix.numRows, (uint32)numNonzeros, algorithm);
+        });
+
+      copyBuffer(gpu, y.hdl, staging.hdl, matrix.numRows * valueSize);
+
+      /* Sums come out in another order than on the CPU. */
+      float64 tolerance = isDouble ? 1e-9 : 1e-3;
+      for (uint32 row = 0; row < matrix.numRows; ++row)
+      {
+        float64 value = isDouble ? ((float64 *)staging.ptr)[row] :
+                                   ((float32 *)staging.ptr)[row];
+        float64 scale = std::max(1.0, fabs(expected[row]));
+        result.mismatches += fabs(value - expected[row]) > tolerance * scale;
+      }
+
+      if (result.mismatches)
+        fprintf(stderr, "%s %s of %llu nonzeros: %llu mismatches\n",
+                result.type, primitive, (unsigned long long)numNonzeros,
+                (unsigned long long)result.mismatches);
+
+      writer.write(result);
+    }
+  }
+
+  writer.gpuCopyGBps = gpuCopyGBps;
+
+  for (const DeviceBuffer *buffer : { &rowOffsets, &columns, &values, &x, &y })
+    destroyBuffer(gpu, *buffer);
+}
+
+/* The sorts and selections, made once for the largest size benchSorts is
+ * given. */
+struct SortPrimitives {
+  vub::DeviceRadixSort radix;
+  vub::DeviceMergeSort merge;
+  vub::DeviceMergeSort mergeFloat;
+  vub::DeviceSegmentedSort segmented;
+  vub::DeviceSelectNth selectNth;
+  vub::DeviceTopK topK;
+};
+
+/* Logs the mismatches of a result and writes it. */
+static void
+writeChecked(BenchWriter &writer, const BenchResult &result)
+{
+  if (result.mismatches)
+    fprintf(stderr, "%s %s of %llu elements: %llu mismatches\n",
+            result.engine, result.primitive,
+            (unsigned long long)result.elements,
+            (unsigned long long)result.mismatches);
+
+  writer.write(result);
+}
+
+/* Measures the sorts and selections on size random keys. Staging has to
+ * hold size + 1 elements. */
+static void
+benchSorts(const GPUDevice &gpu, BenchWriter &writer,
+           const BenchOptions &options, const StagingBuffer &staging,
+           const SortPrimitives &sorts, vub::CPUBackend &cpu,
+           const char *cpuEngine, uint64 size)
+{
+  uint64 bytes = size * sizeof(uint32);
+  uint64 trafficBytes = 2 * bytes;
+
+  std::mt19937 random(5678);
+  std::vector<uint32> keys(size);
+  for (uint32 &key : keys)
+    key = random();
+
+  std::vector<uint32> sorted(size);
+  std::vector<uint32> backendKeys(size);
+
+  DeviceBuffer keysIn = gpu.makeDeviceBuffer(bytes);
+  DeviceBuffer keysOut = gpu.makeDeviceBuffer(bytes);
+  DeviceBuffer keysAlt = gpu.makeDeviceBuffer(bytes);
+
+  memcpy(staging.ptr, keys.data(), bytes);
+  copyBuffer(gpu, staging.hdl, keysIn.hdl, bytes);
+
+  /* Copies the keys in before the sorts which sort in place. */
+  auto copyKeys = [&](VkCommandBuffer cmdbuf)
+  {
+    VkBufferCopy region = { 0, 0, bytes };
+    vkCmdCopyBuffer(cmdbuf, keysIn.hdl, keysOut.hdl, 1, &region);
+    vub::recordIndirectBarrier(cmdbuf);
+  };
+
+  /* CPU reference, which the GPU results are also checked against. */
+  BenchResult cpuSort = { "sort", "u32", "cpu-std", size, 0.0,
+                          trafficBytes, 0 };
+  cpuSort.ms = timeCPU(options.iterations,
+    [&]()
+    {
+      std::copy(keys.begin(), keys.end(), sorted.begin());
+      std::sort(std::execution::par, sorted.begin(), sorted.end());
+    });
+
+  writer.references.push_back(cpuSort);
+
+  BenchResult cpuMergeSort = cpuSort;
+  cpuMergeSort.primitive = "sort-merge";
+  writer.references.push_back(cpuMergeSort);
+
+  BenchResult backendSort = { "sort", "u32", cpuEngine, size, 0.0,
+                              trafficBytes, 0 };
+  backendSort.ms = timeCPU(options.iterations,
+    [&]()
+    {
+      std::copy(keys.begin(), keys.end(), backendKeys.begin());
+      cpu.sort(backendKeys.data(), size);
+    });
+
+  backendSort.mismatches = countMismatches(sorted.data(),
+                                           backendKeys.data(), size);
+
+  BenchResult radixSort = { "sort", "u32", "gpu", size, 0.0,
+                            trafficBytes, 0 };
+  radixSort.ms = timeGPU(gpu, options.iterations, "DeviceRadixSort",
+    [&](VkCommandBuffer cmdbuf)
+    {
+      copyKeys(cmdbuf);
+      sorts.radix.record(cmdbuf, keysOut.range(0, bytes),
+                         keysAlt.range(0, bytes), {}, {}, (uint32)size);
+    });
+
+  copyBuffer(gpu, keysOut.hdl, staging.hdl, bytes);
+  radixSort.mismatches = countMismatches(sorted.data(),
+                                         (uint32 *)staging.ptr, size);
+
+  BenchResult mergeSort = { "sort-merge", "u32", "gpu", size, 0.0,
+                            trafficBytes, 0 };
+  mergeSort.ms = timeGPU(gpu, options.iterations, "DeviceMergeSort",
+    [&](VkCommandBuffer cmdbuf)
+    {
+      copyKeys(cmdbuf);
+      sorts.merge.sortKeys(cmdbuf, keysOut.range(0, bytes),
+                           keysAlt.range(0, bytes), (uint32)size);
+    });
+
+  copyBuffer(gpu, keysOut.hdl, staging.hdl, bytes);
+  mergeSort.mismatches = countMismatches(sorted.data(),
+                                         (uint32 *)staging.ptr, size);
+
+  writeChecked(writer, radixSort);
+  writeChecked(writer, mergeSort);
+  writeChecked(writer, backendSort);
+  writer.write(cpuSort);
+
+  /* Segments hold 8 keys on average, like the rows of the SpMV
+   * matrices. */
+  uint32 numSegments = (uint32)std::max<uint64>(size / 8, 1);
+  std::vector<uint32> offsets = makePowerLawOffsets(random, size,
+                                                    numSegments);
+  uint64 offsetBytes = offsets.size() * sizeof(uint32);
+
+  DeviceBuffer offsetsBuffer = gpu.makeDeviceBuffer(offsetBytes);
+  memcpy(staging.ptr, offsets.data(), offsetBytes);
+  copyBuffer(gpu, staging.hdl, offsetsBuffer.hdl, offsetBytes);
+
+  std::vector<uint32> segments(numSegments);
+  std::iota(segments.begin(), segments.end(), 0);
+
+  BenchResult cpuSegmented = { "sort-segmented", "u32", "cpu-std", size,
+                               0.0, trafficBytes, 0 };
+  cpuSegmented.ms = timeCPU(options.iterations,
+    [&]()
+    {
+      std::copy(keys.begin(), keys.end(), sorted.begin());
+      std::for_each(std::execution::par, segments.begin(), segments.end(),
+        [&](uint32 segment)
+        {
+          std::sort(sorted.begin() + offsets[segment],
+                    sorted.begin() + offsets[segment + 1]);
+        });
+    });
+
+  writer.references.push_back(cpuSegmented);
+
+  BenchResult segmentedSort = { "sort-segmented", "u32", "gpu", size, 0.0,
+                                trafficBytes, 0 };
+  segmentedSort.ms = timeGPU(gpu, options.iterations, "DeviceSegmentedSort",
+    [&](VkCommandBuffer cmdbuf)
+    {
+      sorts.segmented.sortKeys(cmdbuf, keysIn.range(0, bytes),
+                               keysOut.range(0, bytes),
+                               keysAlt.range(0, bytes), offsetsBuffer,
+                               numSegments);
+    });
+
+  copyBuffer(gpu, keysOut.hdl, staging.hdl, bytes);
+  segmentedSort.mismatches = countMismatches(sorted.data(),
+                                             (uint32 *)staging.ptr, size);
+
+  writeChecked(writer, segmentedSort);
+  writer.write(cpuSegmented);
+
+  /* The selections read the keys once. */
+  uint32 n = (uint32)(size / 2);
+
+  BenchResult cpuSelect = { "select-nth", "u32", "cpu-std", size, 0.0,
+                            bytes, 0 };
+  cpuSelect.ms = timeCPU(options.iterations,
+    [&]()
+    {
+      std::copy(keys.begin(), keys.end(), sorted.begin());
+      std::nth_element(std::execution::par, sorted.begin(),
+                       sorted.begin() + n, sorted.end());
+    });
+
+  writer.references.push_back(cpuSelect);
+
+  uint32 nth = sorted[n];
+
+  BenchResult selectNth = { "select-nth", "u32", "gpu", size, 0.0,
+                            bytes, 0 };
+  selectNth.ms = timeGPU(gpu, options.iterations, "DeviceSelectNth",
+    [&](VkCommandBuffer cmdbuf)
+    {
+      sorts.selectNth.record(cmdbuf, keysIn.range(0, bytes), (uint32)size,
+                             n, keysOut.range(0, 2 * sizeof(uint32)));
+    });
+
+  copyBuffer(gpu, keysOut.hdl, staging.hdl, 2 * sizeof(uint32));
+  selectNth.mismatches = ((uint32 *)staging.ptr)[0] != nth;
+
+  writeChecked(writer, selectNth);
+  writer.write(cpuSelect);
+
+  uint32 k = (uint32)std::min<uint64>(size, 1024);
+
+  BenchResult cpuTopK = { "top-k", "u32", "cpu-std", size, 0.0, bytes, 0 };
+  cpuTopK.ms = timeCPU(options.iterations,
+    [&]()
+    {
+      std::copy(keys.begin(), keys.end(), sorted.begin());
+      std::nth_element(std::execution::par, sorted.begin(),
+                       sorted.begin() + (k - 1), sorted.end());
+    });
+
+  writer.references.push_back(cpuTopK);
+
+  BenchResult topK = { "top-k", "u32", "gpu", size, 0.0, bytes, 0 };
+  topK.ms = timeGPU(gpu, options.iterations, "DeviceTopK",
+    [&](VkCommandBuffer cmdbuf)
+    {
+      sorts.topK.record(cmdbuf, keysIn.range(0, bytes), (uint32)size, k,
+                        keysOut.range(0, k * sizeof(uint32)),
+                        keysAlt.range(0, k * sizeof(uint32)));
+    });
+
+  /* The k keys come out in no particular order. */
+  copyBuffer(gpu, keysOut.hdl, staging.hdl, k * sizeof(uint32));
+  std::sort(sorted.begin(), sorted.begin() + k);
+  std::sort((uint32 *)staging.ptr, (uint32 *)staging.ptr + k);
+  topK.mismatches = countMismatches(sorted.data(), (uint32 *)staging.ptr, k);
+
+  writeChecked(writer, topK);
+  writer.write(cpuTopK);
+
+  for (const DeviceBuffer *buffer : { &keysIn, &keysOut, &keysAlt,
+                                      &offsetsBuffer })
+    destroyBuffer(gpu, *buffer);
+}
+
+/* Measures the sorts and selections which take float keys on size random
+ * keys of both signs. Staging has to hold size elements. */
+static void
+benchFloatSorts(const GPUDevice &gpu, BenchWriter &writer,
+                const BenchOptions &options, const StagingBuffer &staging,
+                const SortPrimitives &sorts, uint64 size)
+{
+  uint64 bytes = size * sizeof(float32);
+  uint64 trafficBytes = 2 * bytes;
+
+  std::mt19937 random(5678);
+  std::uniform_real_distribution<float32> uniform(-1.0f, 1.0f);
+  std::vector<float32> keys(size);
+  for (float32 &key : keys)
+    key = uniform(random);
+
+  std::vector<float32> sorted(size);
+
+  DeviceBuffer keysIn = gpu.makeDeviceBuffer(bytes);
+  DeviceBuffer keysOut = gpu.makeDeviceBuffer(bytes);
+  DeviceBuffer keysAlt = gpu.makeDeviceBuffer(bytes);
+
+  memcpy(staging.ptr, keys.data(), bytes);
+  copyBuffer(gpu, staging.hdl, keysIn.hdl, bytes);
+
+  /* There are no NaNs or negative zeros, so sorted floats are equal
+   * wherever their bits are. */
+  BenchResult cpuSort = { "sort-merge", "f32", "cpu-std", size, 0.0,
+                          trafficBytes, 0 };
+  cpuSort.ms = timeCPU(options.iterations,
+    [&]()
+    {
+      std::copy(keys.begin(), keys.end(), sorted.begin());
+      std::sort(std::execution::par, sorted.begin(), sorted.end());
+    });
+
+  writer.references.push_back(cpuSort);
+
+  BenchResult mergeSort = { "sort-merge", "f32", "gpu", size, 0.0,
+                            trafficBytes, 0 };
+  mergeSort.ms = timeGPU(gpu, options.iterations, "DeviceMergeSort",
+    [&](VkCommandBuffer cmdbuf)
+    {
+      VkBufferCopy region = { 0, 0, bytes };
+      vkCmdCopyBuffer(cmdbuf, keysIn.hdl, keysOut.hdl, 1, &region);
+      vub::recordIndirectBarrier(cmdbuf);
+
+      sorts.mergeFloat.sortKeys(cmdbuf, keysOut.range(0, bytes),
+                                keysAlt.range(0, bytes), (uint32)size);
+    });
+
+  copyBuffer(gpu, keysOut.hdl, staging.hdl, bytes);
+  mergeSort.mismatches = countMismatches((uint32 *)sorted.data(),
+                                         (uint32 *)staging.ptr, size);
+
+  writeChecked(writer, mergeSort);
+  writer.write(cpuSort);
+
+  uint32 n = (uint32)(size / 2);
+
+  BenchResult cpuSelect = { "select-nth", "f32", "cpu-std", size, 0.0,
+                            bytes, 0 };
+  cpuSelect.ms = timeCPU(options.iterations,
+    [&]()
+    {
+      std::copy(keys.begin(), keys.end(), sorted.begin());
+      std::nth_element(std::execution::par, sorted.begin(),
+                       sorted.begin() + n, sorted.end());
+    });
+
+  writer.references.push_back(cpuSelect);
+
+  float32 nth = sorted[n];
+
+  BenchResult selectNth = { "select-nth", "f32", "gpu", size, 0.0,
+                            bytes, 0 };
+  selectNth.ms = timeGPU(gpu, options.iterations, "DeviceSelectNth",
+    [&](VkCommandBuffer cmdbuf)
+    {
+      sorts.selectNth.record(cmdbuf, keysIn.range(0, bytes), (uint32)size,
+                             n, keysOut.range(0, 2 * sizeof(uint32)),
+                             vub::SelectOrder::Smallest,
+                             vub::SelectKey::Float);
+    });
+
+  copyBuffer(gpu, keysOut.hdl, staging.hdl, 2 * sizeof(uint32));
+  selectNth.mismatches = ((float32 *)staging.ptr)[0] != nth;
+
+  writeChecked(writer, selectNth);
+  writer.write(cpuSelect);
+
+  uint32 k = (uint32)std::min<uint64>(size, 1024);
+
+  BenchResult cpuTopK = { "top-k", "f32", "cpu-std", size, 0.0, bytes, 0 };
+  cpuTopK.ms = timeCPU(options.iterations,
+    [&]()
+    {
+      std::copy(keys.begin(), keys.end(), sorted.begin());
+      std::nth_element(std::execution::par, sorted.begin(),
+                       sorted.begin() + (k - 1), sorted.end());
+    });
+
+  writer.references.push_back(cpuTopK);
+
+  BenchResult topK = { "top-k", "f32", "gpu", size, 0.0, bytes, 0 };
+  topK.ms = timeGPU(gpu, options.iterations, "DeviceTopK",
+    [&](VkCommandBuffer cmdbuf)
+    {
+      sorts.topK.record(cmdbuf, keysIn.range(0, bytes), (uint32)size, k,
+                        keysOut.range(0, k * sizeof(float32)),
+                        keysAlt.range(0, k * sizeof(uint32)),
+                        vub::SelectOrder::Smallest, vub::SelectKey::Float);
+    });
+
+  /* The k keys come out in no particular order. */
+  copyBuffer(gpu, keysOut.hdl, staging.hdl, k * sizeof(float32));
+  std::sort(sorted.begin(), sorted.begin() + k);
+  std::sort((float32 *)staging.ptr, (float32 *)staging.ptr + k);
+  topK.mismatches = countMismatches((uint32 *)sorted.data(),
+                                    (uint32 *)staging.ptr, k);
+
+  writeChecked(writer, topK);
+  writer.write(cpuTopK);
+
+  for (const DeviceBuffer *buffer : { &keysIn, &keysOut, &keysAlt })
+    destroyBuffer(gpu, *buffer);
+}
+
+/* An exclusive scan of inputs of another type than uint32, into uint32
+ * offsets or float sums (see ScanType). */
+struct TypedScan {
+  const char *type;
+  vub::ScanType input;
+  vub::ScanType output;
+  vub::DeviceScan scan;
+};
+
+/* The half float of an integer below 2048, which it holds exactly. */
+static uint16
+toHalf(uint32 value)
+{
+  if (!value)
+    return 0;
+
+  uint32 exponent = 31 - __builtin_clz(value);
+  return (uint16)(((exponent + 15) << 10) |
+                  ((value << (10 - exponent)) & 0x3FF));
+}
+
+/* Measures the typed scans on the first size inputs, which are small
+ * integers and so the same in every type. The scans write to output. */
+static void
+benchTypedScans(const GPUDevice &gpu, BenchWriter &writer,
+                const BenchOptions &options, const StagingBuffer &staging,
+                const std::vector<TypedScan> &scans,
+                const std::vector<uint32> &inputs,
+                const DeviceBuffer &output, uint64 size)
+{
+  /* In doubles, which hold the float sums exactly. */
+  std::vector<float64> expected(size);
+  float64 sum = 0.0;
+  for (uint64 i = 0; i < size; ++i)
+  {
+    expected[i] = sum;
+    sum += inputs[i];
+  }
+
+  DeviceBuffer input = gpu.makeDeviceBuffer(size * sizeof(uint32));
+
+  for (const TypedScan &typed : scans)
+  {
+    uint64 inputBytes = size * vub::getScanTypeSize(typed.input);
+    uint64 outputBytes = size * sizeof(uint32);
+
+    for (uint64 i = 0; i < size; ++i)
+    {
+      switch (typed.input)
+      {
+      case vub::ScanType::Uint8:
+        ((uint8 *)staging.ptr)[i] = (uint8)inputs[i];
+        break;
+      case vub::ScanType::Uint16:
+        ((uint16 *)staging.ptr)[i] = (uint16)inputs[i];
+        break;
+      case vub::ScanType::Float32:
+        ((float32 *)staging.ptr)[i] = (float32)inputs[i];
+        break;
+      case vub::ScanType::Float16:
+        ((uint16 *)staging.ptr)[i] = toHalf(inputs[i]);
+        break;
+      default:
+        ((uint32 *)staging.ptr)[i] = inputs[i];
+        break;
+      }
+    }
+
+    copyBuffer(gpu, staging.hdl, input.hdl, inputBytes);
+
+    BenchResult result = { "scan-exclusive", typed.type, "gpu", size, 0.0,
+                           inputBytes + outputBytes, 0 };
+    result.ms = timeGPU(gpu, options.iterations, "DeviceScan",
+      [&](VkCommandBuffer cmdbuf)
+      {
+        typed.scan.record(cmdbuf, input.range(0, inputBytes),
+                          output.range(0, outputBytes), (uint32)size);
+      });
+
+    copyBuffer(gpu, output.hdl, staging.hdl, outputBytes);
+
+    /* Float sums come out in another order than on the CPU, uint ones
+     * wrap around like the uint32 scans. */
+    for (uint64 i = 0; i < size; ++i)
+    {
+      if (vub::isFloatScanType(typed.output))
+      {
+        float64 value = ((float32 *)staging.ptr)[i];
+        float64 scale = std::max(1.0, expected[i]);
+        result.mismatches += fabs(value - expected[i]) > 1e-3 * scale;
+      }
+      else
+      {
+        result.mismatches += ((uint32 *)staging.ptr)[i] !=
+                             (uint32)(uint64)expected[i];
+      }
+    }
+
+    writeChecked(writer, result);
+  }
+
+  destroyBuffer(gpu, input);
+}
+
+int main(int argc, char **argv)
+{
+  BenchOptions options = parseOptions(argc, argv);
+
+  /* Validation would be measured along with everything else. */
+  GPUDevice gpu = GPUDevice::make(nullptr, false);
+  gpu.enableProfiling(false, std::max<uint32>(options.iterations, 1024));
+
+  uint64 maxElements = maxSweepElements(gpu, options);
+  uint64 maxBytes = maxElements * sizeof(uint32);
+
+  fprintf(stderr, "%s: up to %llu elements, %s\n", gpu.getDeviceName(),
+          (unsigned long long)maxElements,
+          gpu.profiler ? "timestamps" : "wall clock");
+
+  if (maxElements < options.minElements)
+    PANIC_AND_EXIT("Not enough device memory for the smallest size");
+
+  StagingBuffer staging = gpu.makeStagingBuffer(
+    maxBytes, VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+  DeviceBuffer input = gpu.makeDeviceBuffer(maxBytes);
+  DeviceBuffer output = gpu.makeDeviceBuffer(maxBytes);
+
+  std::vector<uint32> inputs(maxElements);
+  std::vector<uint32> outputs(maxElements);
+  std::vector<uint32> expected(maxElements);
+
+  for (uint64 i = 0; i < maxElements; ++i)
+    inputs[i] = (uint32)((i * 2654435761ull) >> 7) & 0xF;
+
+  memcpy(staging.ptr, inputs.data(), maxBytes);
+  copyBuffer(gpu, staging.hdl, input.hdl, maxBytes);
+
+  vub::DeviceScan scan = vub::DeviceScan::make(gpu, (uint32)maxElements);
+  /* Scans which read and write host memory in place (engine "gpu-host"),
+   * if it can be imported. */
+  HostBuffer hostInput = gpu.importHostBuffer(inputs.data(), maxBytes);
+  HostBuffer hostOutput = gpu.importHostBuffer(outputs.data(), maxBytes);
+  bool hostImported = hostInput.imported && hostOutput.imported;
+
+  if (!hostImported)
+    fprintf(stderr, "Host memory can't be imported, no gpu-host rows\n");
+
+  /* Made once for the largest matrix benchSpmv is given, a float and (if
+   * the device has them) a double one. */
+  uint64 maxNonzeros = maxBytes / (3 * sizeof(float64));
+  uint32 maxRows = (uint32)std::max<uint64>(maxNonzeros / 8, 1);
+
+  vub::DeviceSpmv spmvs[2] = {};
+  spmvs[0] = vub::DeviceSpmv::make(gpu, maxRows, (uint32)maxNonzeros,
+                                   vub::SpmvType::Float);
+  if (gpu.features.float64)
+    spmvs[1] = vub::DeviceSpmv::make(gpu, maxRows, (uint32)maxNonzeros,
+                                     vub::SpmvType::Double);
+
+  /* benchSorts makes four buffers of the keys. */
+  uint64 maxSortElements = std::max<uint64>(maxElements / 4, 1);
+
+  SortPrimitives sorts = {};
+  sorts.radix = vub::DeviceRadixSort::make(gpu, (uint32)maxSortElements);
+  sorts.merge = vub::DeviceMergeSort::make(gpu);
+  sorts.mergeFloat = vub::DeviceMergeSort::make(gpu,
+                                                vub::Comparator::floats());
+  sorts.segmented = vub::DeviceSegmentedSort::make(
+    gpu, (uint32)std::max<uint64>(maxSortElements / 8, 1));
+  sorts.selectNth = vub::DeviceSelectNth::make(gpu);
+  sorts.topK = vub::DeviceTopK::make(gpu);
+
+  /* The variants of these the build compiled, but for the types the
+   * device can't store. */
+  std::vector<TypedScan> typedScans;
+  typedScans.push_back({ "u8", vub::ScanType::Uint8, vub::ScanType::Uint32 });
+  typedScans.push_back({ "u16", vub::ScanType::Uint16,
+                         vub::ScanType::Uint32 });
+  typedScans.push_back({ "f32", vub::ScanType::Float32,
+                         vub::ScanType::Float32 });
+  typedScans.push_back({ "f16", vub::ScanType::Float16,
+                         vub::ScanType::Float32 });
+
+  for (auto typed = typedScans.begin(); typed != typedScans.end();)
+  {
+    uint32 typeSize = vub::getScanTypeSize(typed->input);
+    if ((typeSize == 1 && !gpu.features.storage8Bit) ||
+        (typeSize == 2 && !gpu.features.storage16Bit))
+    {
+      fprintf(stderr, "No %u-bit storage buffers, no %s scan rows\n",
+              typeSize * 8, typed->type);
+      typed = typedScans.erase(typed);
+      continue;
+    }
+
+    vub::ScanFusion fusion = { vub::typedInput(typed->input),
+                               vub::typedOutput(typed->output) };
+    typed->scan = vub::DeviceScan::make(gpu, (uint32)maxElements,
+                                        vub::BindingMode::Auto, true, fusion);
+    ++typed;
+  }
+
+  vub::CPUBackend cpu = vub::CPUBackend::make();
+
+  char cpuEngine[32];
+  snprintf(cpuEngine, sizeof(cpuEngine), "cpu-%s",
+           vub::simdLevelName(cpu.simd));
+
+  BenchWriter writer = {};
+  writer.file = stdout;
+  writer.device = gpu.getDeviceName();
+
+  if (options.outputPath)
+  {
+    writer.file = fopen(options.outputPath, "w");
+    if (!writer.file)
+      PANIC_AND_EXIT("Failed to open the output file");
+  }
+
+  writer.writeHeader();
+
+  std::vector<uint64> sizes;
+  for (uint64 size = options.minElements; size <= maxElements; size *= 4)
+    sizes.push_back(size);
+
+  if (sizes.back() != maxElements)
+    sizes.push_back(maxElements);
+
+  for (uint64 size : sizes)
+  {
+    uint64 bytes = size * sizeof(uint32);
+
+    /* Everything below reads and writes size elements once. */
+    uint64 trafficBytes = 2 * bytes;
+
+    /* Copy bandwidth first, since everything else is relative to it. */
+    BenchResult gpuCopy = { "copy", "u32", "gpu", size, 0.0, trafficBytes, 0 };
+    gpuCopy.ms = timeGPU(gpu, options.iterations, "copy",
+      [&](VkCommandBuffer cmdbuf)
+      {
+        ProfileScope profile(gpu, cmdbuf, "copy", trafficBytes);
+
+        VkBufferCopy region = { 0, 0, bytes };
+        vkCmdCopyBuffer(cmdbuf, input.hdl, output.hdl, 1, &region);
+      });
+
+    BenchResult cpuCopy = { "copy", "u32", "cpu-std", size, 0.0, trafficBytes, 0 };
+    cpuCopy.ms = timeCPU(options.iterations,
+      [&]()
+      {
+        std::copy(std::execution::par, inputs.begin(), inputs.begin() + size,
+                  outputs.begin());
+      });
+
+    writer.gpuCopyGBps = trafficBytes / (gpuCopy.ms * 1e-3) * 1e-9;
+    writer.cpuCopyGBps = trafficBytes / (cpuCopy.ms * 1e-3) * 1e-9;
+    writer.references.clear();
+    writer.references.push_back(cpuCopy);
+
+    writer.write(gpuCopy);
+    writer.write(cpuCopy);
+
+    for (bool inclusive : { false, true })
+    {
+      const char *primitive = inclusive ? "scan-inclusive" : "scan-exclusive";
+
+      /* CPU reference, which the GPU results are also checked against. */
+      BenchResult cpuScan = { primitive, "u32", "cpu-std", size, 0.0,
+                              trafficBytes, 0 };
+      cpuScan.ms = timeCPU(options.iterations,
+        [&]()
+        {
+          if (inclusive)
+            std::inclusive_scan(std::execution::par,
+                                inputs.begin(), inputs.begin() + size,
+                                expected.begin());
+          else
+            std::exclusive_scan(std::execution::par,
+                                inputs.begin(), inputs.begin() + size,
+                                expected.begin(), 0u);
+        });
+
+      writer.references.push_back(cpuScan);
+
+      BenchResult backendScan = { primitive, "u32", cpuEngine, size, 0.0,
+                                  trafficBytes, 0 };
+      backendScan.ms = timeCPU(options.iterations,
+        [&]()
+        {
+          cpu.scan(inputs.data(), outputs.data(), size, inclusive);
+        });
+
+      backendScan.mismatches = countMismatches(expected.data(),
+                                               outputs.data(), size);
+
+      BenchResult gpuScan = { primitive, "u32", "gpu", size, 0.0,
+                              trafficBytes, 0 };
+      gpuScan.ms = timeGPU(gpu, options.iterations, "DeviceScan",
+        [&](VkCommandBuffer cmdbuf)
+        {
+          scan.record(cmdbuf, input.range(0, bytes), output.range(0, bytes),
+                      (uint32)size, inclusive);
+        });
+
+      copyBuffer(gpu, output.hdl, staging.hdl, bytes);
+      gpuScan.mismatches = countMismatches(expected.data(),
+                                           (uint32 *)staging.ptr, size);
+
+      BenchResult hostScan = { primitive, "u32", "gpu-host", size, 0.0,
+                               trafficBytes, 0 };
+      if (hostImported)
+      {
+        /* outputs still holds the CPU backend's scan, which would pass the
+         * check if the GPU wrote nothing. */
+        std::fill(outputs.begin(), outputs.begin() + size, 0xFFFFFFFFu);
+
+        hostScan.ms = timeGPU(gpu, options.iterations, "DeviceScan",
+          [&](VkCommandBuffer cmdbuf)
+          {
+            scan.record(cmdbuf, hostInput.range(0, bytes),
+                        hostOutput.range(0, bytes), (uint32)size, inclusive);
+          });
+
+        hostScan.mismatches = countMismatches(expected.data(),
+                                              outputs.data(), size);
+      }
+
+      for (const BenchResult *result : { &gpuScan, &hostScan, &backendScan })
+      {
+        if (result->mismatches)
+          fprintf(stderr, "%s %s of %llu elements: %llu mismatches\n",
+                  result->engine, primitive, (unsigned long long)size,
+                  (unsigned long long)result->mismatches);
+      }
+
+      writer.write(gpuScan);
+      if (hostImported)
+        writer.write(hostScan);
+      writer.write(backendScan);
+      writer.write(cpuScan);
+    }
+
+    /* Reads size elements once. */
+    BenchResult cpuReduce = { "reduce", "u32", "cpu-std", size, 0.0, bytes,
+                              0 };
+    uint32 sum = 0;
+    cpuReduce.ms = timeCPU(options.iterations,
+      [&]()
+      {
+        sum = std::reduce(std::execution::par,
+                          inputs.begin(), inputs.begin() + size, 0u);
+      });
+
+    writer.references.push_back(cpuReduce);
+
+    BenchResult backendReduce = { "reduce", "u32", cpuEngine, size, 0.0,
+                                  bytes, 0 };
+    uint32 backendSum = 0;
+    backendReduce.ms = timeCPU(options.iterations,
+      [&]()
+      {
+        backendSum = cpu.reduce(inputs.data(), size);
+      });
+
+    backendReduce.mismatches = backendSum != sum;
+
+    BenchResult gpuReduce = { "reduce", "u32", "gpu", size, 0.0, bytes, 0 };
+    gpuReduce.ms = timeGPU(gpu, options.iterations, "DeviceScan",
+      [&](VkCommandBuffer cmdbuf)
+      {
+        scan.record(cmdbuf, input.range(0, bytes), output.range(0, bytes),
+                    (uint32)size, true, vub::ScanCarry::Start);
+      });
+
+    BufferRange total = scan.carryOut();
+    copyBuffer(gpu, total.hdl, staging.hdl, sizeof(uint32), total.offset);
+
+    gpuReduce.mismatches = *(uint32 *)staging.ptr != sum;
+
+    writeChecked(writer, gpuReduce);
+    writeChecked(writer, backendReduce);
+    writer.write(cpuReduce);
+
+    /* Makes another buffer of size elements, like benchSorts' four of a
+     * quarter of them. */
+    if (!typedScans.empty())
+      benchTypedScans(gpu, writer, options, staging, typedScans, inputs,
+                      output, size);
+
+    if (size <= maxSortElements)
+    {
+      benchSorts(gpu, writer, options, staging, sorts, cpu, cpuEngine, size);
+      benchFloatSorts(gpu, writer, options, staging, sorts, size);
+    }
+
+    /* The matrix takes about three times as much memory as its values,
+     * which are doubles. Its copy reference goes from input to output,
+     * which are large enough. */
+    if (size <= maxNonzeros)
+      benchSpmv(gpu, writer, options, staging, spmvs, input, output, size);
+  }
+
+  if (writer.file != stdout)
+    fclose(writer.file);
+
+  return 0;
+}
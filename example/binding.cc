@@ -0,0 +1,252 @@
+#include "binding.h"
+
+#include <string.h>
+#include <cassert>
+#include "helper.h"
+
+namespace vub {
+
+BindingMode
+resolveBindingMode(const GPUDevice &gpu, BindingMode requested)
+{
+  if (requested == BindingMode::Addresses && gpu.features.bufferDeviceAddress)
+    return BindingMode::Addresses;
+  if (requested == BindingMode::PushDescriptors && gpu.features.pushDescriptor)
+    return BindingMode::PushDescriptors;
+  if (requested == BindingMode::CachedSets)
+    return BindingMode::CachedSets;
+
+  if (gpu.features.bufferDeviceAddress)
+    return BindingMode::Addresses;
+  else if (gpu.features.pushDescriptor)
+    return BindingMode::PushDescriptors;
+  else
+    return BindingMode::CachedSets;
+}
+
+const char *
+bindingModeName(BindingMode mode)
+{
+  switch (mode)
+  {
+  case BindingMode::Auto: return "auto";
+  case BindingMode::Addresses: return "addresses";
+  case BindingMode::PushDescriptors: return "push-descriptors";
+  case BindingMode::CachedSets: return "cached-sets";
+  default: return "unknown";
+  }
+}
+
+bool
+DescriptorCache::Key::operator==(const Key &other) const
+{
+  if (layout != other.layout || count != other.count)
+    return false;
+
+  for (uint32 i = 0; i < count; ++i)
+  {
+    if (infos[i].buffer != other.infos[i].buffer ||
+        infos[i].offset != other.infos[i].offset ||
+        infos[i].range != other.infos[i].range)
+      return false;
+  }
+
+  return true;
+}
+
+/* FNV-1a over the handles, offsets and ranges. */
+static uint64
+hashCombine(uint64 hash, uint64 value)
+{
+  for (uint32 i = 0; i < 8; ++i)
+  {
+    hash ^= (value >> (i * 8)) & 0xFF;
+    hash *= 0x100000001B3ull;
+  }
+
+  return hash;
+}
+
+size_t
+DescriptorCache::KeyHash::operator()(const Key &key) const
+{
+  uint64 hash = 0xCBF29CE484222325ull;
+  hash = hashCombine(hash, (uint64)key.layout);
+  hash = hashCombine(hash, key.count);
+
+  for (uint32 i = 0; i < key.count; ++i)
+  {
+    hash = hashCombine(hash, (uint64)key.infos[i].buffer);
+    hash = hashCombine(hash, key.infos[i].offset);
+    hash = hashCombine(hash, key.infos[i].range);
+  }
+
+  return (size_t)hash;
+}
+
+DescriptorCache
+DescriptorCache::make(const GPUDevice &gpu, uint32 capacity)
+{
+  DescriptorCache ret = {};
+  ret.capacity = capacity;
+  ret.hits = 0;
+  ret.misses = 0;
+  ret.mNextPoolSize = 64;
+  ret.mDev = &gpu;
+  return ret;
+}
+
+void
+DescriptorCache::addPool()
+{
+  VkDescriptorPoolSize size = {
+    .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+    .descriptorCount = mNextPoolSize * MAX_BINDINGS
+  };
+
+  /* Sets are never freed one by one, only rewritten. */
+  VkDescriptorPoolCreateFlags flags = 0;
+  if (mDev->features.updateAfterBind)
+    flags |= VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
+
+  VkDescriptorPoolCreateInfo poolInfo = {
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+    .flags = flags,
+    .maxSets = mNextPoolSize,
+    .poolSizeCount = 1,
+    .pPoolSizes = &size
+  };
+
+  VkDescriptorPool pool;
+  VK_CHECK(vkCreateDescriptorPool(mDev->dev, &poolInfo, nullptr, &pool));
+
+  mPools.push_back(pool);
+  mNextPoolSize *= 2;
+}
+
+VkDescriptorSet
+DescriptorCache::allocate(VkDescriptorSetLayout layout)
+{
+  if (mPools.empty())
+    addPool();
+
+  for (;;)
+  {
+    VkDescriptorSetAllocateInfo info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+      .descriptorPool = mPools.back(),
+      .descriptorSetCount = 1,
+      .pSetLayouts = &layout
+    };
+
+    VkDescriptorSet set;
+    VkResult result = vkAllocateDescriptorSets(mDev->dev, &info, &set);
+
+    if (result == VK_SUCCESS)
+      return set;
+
+    if (result != VK_ERROR_OUT_OF_POOL_MEMORY &&
+        result != VK_ERROR_FRAGMENTED_POOL)
+      PANIC_AND_EXIT("Failed to allocate descriptor set");
+
+    addPool();
+  }
+}
+
+VkDescriptorSet
+DescriptorCache::get(VkDescriptorSetLayout layout,
+                     const VkDescriptorBufferInfo *infos,
+                     uint32 count)
+{
+  assert(count <= MAX_BINDINGS);
+
+  Key key = {};
+  key.layout = layout;
+  key.count = count;
+  memcpy(key.infos, infos, count * sizeof(VkDescriptorBufferInfo));
+
+  auto found = mLookup.find(key);
+  if (found != mLookup.end())
+  {
+    /* Move to the front. */
+    mEntries.splice(mEntries.begin(), mEntries, found->second);
+    found->second->value = mDev->submittedValue() + 1;
+    ++hits;
+    return found->second->set;
+  }
+
+  ++misses;
+
+  /* The least recently used sets have the lowest values, and recorded or
+   * in-flight command buffers may still bind the ones the queue hasn't
+   * gone past. */
+  uint64 completed = mDev->completedValue();
+  while (mEntries.size() >= capacity && mEntries.back().value <= completed)
+  {
+    Entry &lru = mEntries.back();
+    mFree[lru.key.layout].push_back(lru.set);
+    mLookup.erase(lru.key);
+    mEntries.pop_back();
+  }
+
+  VkDescriptorSet set;
+  std::vector<VkDescriptorSet> &freeSets = mFree[layout];
+  if (freeSets.empty())
+  {
+    set = allocate(layout);
+  }
+  else
+  {
+    set = freeSets.back();
+    freeSets.pop_back();
+  }
+
+  mDev->writeStorageBufferDescriptors(set, infos, count);
+
+  mEntries.push_front({ key, set, mDev->submittedValue() + 1 });
+  mLookup[key] = mEntries.begin();
+
+  return set;
+}
+
+void
+DescriptorCache::destroy()
+{
+  for (VkDescriptorPool pool : mPools)
+    vkDestroyDescriptorPool(mDev->dev, pool, nullptr);
+
+  mPools.clear();
+  mEntries.clear();
+  mLookup.clear();
+  mFree.clear();
+}
+
+DescriptorCache &
+DescriptorCache::operator=(DescriptorCache &&other)
+{
+  if (this != &other)
+  {
+    destroy();
+
+    capacity = other.capacity;
+    hits = other.hits;
+    misses = other.misses;
+    mEntries = std::move(other.mEntries);
+    mLookup = std::move(other.mLookup);
+    mFree = std::move(other.mFree);
+    mPools = std::move(other.mPools);
+    mNextPoolSize = other.mNextPoolSize;
+    mDev = other.mDev;
+
+    other.mPools.clear();
+  }
+
+  return *this;
+}
+
+DescriptorCache::~DescriptorCache()
+{
+  destroy();
+}
+
+} /* namespace vub */
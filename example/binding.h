@@ -0,0 +1,95 @@
+#pragma once
+
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include "gpu-device.h"
+
+namespace vub {
+
+/* How a primitive hands its buffers to its kernel outside of recordings. */
+enum class BindingMode {
+  /* The first of the modes below which the device supports. */
+  Auto,
+
+  /* Device addresses in push constants (features.bufferDeviceAddress). */
+  Addresses,
+
+  /* vkCmdPushDescriptorSetKHR (features.pushDescriptor). */
+  PushDescriptors,
+
+  /* Descriptor sets from a DescriptorCache. Always supported. */
+  CachedSets
+};
+
+/* Turns Auto, or a mode the device doesn't support, into one it does. */
+BindingMode resolveBindingMode(const GPUDevice &gpu, BindingMode requested);
+const char *bindingModeName(BindingMode mode);
+
+/* Descriptor sets of storage buffers, keyed by the layout and the buffer
+ * ranges that were written to them. Asking again for the same bindings
+ * returns the same set without calling into Vulkan.
+ *
+ * Once capacity sets are cached, the least recently used one gets rewritten
+ * for new bindings, but only once the queue timeline has reached the submit
+ * after its last use (see GPUDevice::submittedValue), as with
+ * ScratchAllocator. Until then, new sets are allocated and the cache grows
+ * past capacity. Pools are added, each twice as large as the last,
+ * whenever allocating from the current one fails. */
+struct DescriptorCache {
+  static constexpr uint32 MAX_BINDINGS = 8;
+
+  uint32 capacity;
+
+  /* For benchmarks. */
+  uint64 hits;
+  uint64 misses;
+
+  static DescriptorCache make(const GPUDevice &gpu, uint32 capacity = 1024);
+
+  VkDescriptorSet get(VkDescriptorSetLayout layout,
+                      const VkDescriptorBufferInfo *infos,
+                      uint32 count);
+
+  DescriptorCache() = default;
+  DescriptorCache(DescriptorCache &&other) = default;
+  DescriptorCache &operator=(DescriptorCache &&other);
+  ~DescriptorCache();
+
+private:
+  struct Key {
+    VkDescriptorSetLayout layout;
+    uint32 count;
+    VkDescriptorBufferInfo infos[MAX_BINDINGS];
+
+    bool operator==(const Key &other) const;
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key &key) const;
+  };
+
+  struct Entry {
+    Key key;
+    VkDescriptorSet set;
+    /* Timeline value after which the GPU is done with the set. */
+    uint64 value;
+  };
+
+  VkDescriptorSet allocate(VkDescriptorSetLayout layout);
+  void addPool();
+  void destroy();
+
+  /* Most recently used first. */
+  std::list<Entry> mEntries;
+  std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> mLookup;
+
+  /* Evicted sets, ready to be rewritten. */
+  std::unordered_map<VkDescriptorSetLayout, std::vector<VkDescriptorSet>> mFree;
+
+  std::vector<VkDescriptorPool> mPools;
+  uint32 mNextPoolSize = 0;
+  const GPUDevice *mDev = nullptr;
+};
+
+} /* namespace vub */
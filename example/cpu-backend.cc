@@ -0,0 +1,220 @@
+#include "cpu-backend.h"
+
+#include <string.h>
+#include <algorithm>
+
+namespace vub {
+
+/* 128 KiB of 32-bit elements: half of the smallest L2 caches around, so a
+ * tile read by the first pass is still there for the second. */
+static const uint64 TILE_ELEMENTS = 32 * 1024;
+
+/* Radix sort tiles are larger, since every one of them costs a histogram
+ * per pass. */
+static const uint64 SORT_TILE_ELEMENTS = 256 * 1024;
+static const uint32 RADIX_BITS = 8;
+static const uint32 RADIX_DIGITS = 1 << RADIX_BITS;
+
+static uint64
+tileCount(uint64 count, uint64 tileElements)
+{
+  return (count + tileElements - 1) / tileElements;
+}
+
+CPUBackend
+CPUBackend::make(uint32 workerCount, SimdLevel simd)
+{
+  CPUBackend ret = {};
+  ret.simd = std::min(simd, detectSimdLevel());
+  ret.pool = ThreadPool::make(workerCount);
+
+  return ret;
+}
+
+void
+CPUBackend::scan(const uint32 *in, uint32 *out, uint64 count, bool inclusive)
+{
+  uint64 tiles = tileCount(count, TILE_ELEMENTS);
+  if (tiles <= 1)
+  {
+    scanSpan(simd, in, out, count, 0, inclusive);
+    return;
+  }
+
+  mTileSums.resize(tiles);
+
+  pool.parallelFor(tiles, 1,
+    [&](uint64 first, uint64 last, uint32 worker)
+    {
+      for (uint64 tile = first; tile < last; ++tile)
+      {
+        uint64 begin = tile * TILE_ELEMENTS;
+        uint64 size = std::min(TILE_ELEMENTS, count - begin);
+        mTileSums[tile] = reduceSpan(simd, in + begin, size);
+      }
+    });
+
+  /* There are few enough tiles for this to not matter. */
+  scanSpan(SimdLevel::Scalar, mTileSums.data(), mTileSums.data(), tiles,
+           0, false);
+
+  pool.parallelFor(tiles, 1,
+    [&](uint64 first, uint64 last, uint32 worker)
+    {
+      for (uint64 tile = first; tile < last; ++tile)
+      {
+        uint64 begin = tile * TILE_ELEMENTS;
+        uint64 size = std::min(TILE_ELEMENTS, count - begin);
+        scanSpan(simd, in + begin, out + begin, size, mTileSums[tile],
+                 inclusive);
+      }
+    });
+}
+
+uint32
+CPUBackend::reduce(const uint32 *in, uint64 count)
+{
+  uint64 tiles = tileCount(count, TILE_ELEMENTS);
+  if (tiles <= 1)
+    return reduceSpan(simd, in, count);
+
+  mTileSums.resize(tiles);
+
+  pool.parallelFor(tiles, 1,
+    [&](uint64 first, uint64 last, uint32 worker)
+    {
+      for (uint64 tile = first; tile < last; ++tile)
+      {
+        uint64 begin = tile * TILE_ELEMENTS;
+        uint64 size = std::min(TILE_ELEMENTS, count - begin);
+        mTileSums[tile] = reduceSpan(simd, in + begin, size);
+      }
+    });
+
+  return reduceSpan(SimdLevel::Scalar, mTileSums.data(), tiles);
+}
+
+uint64
+CPUBackend::select(const uint32 *in, const uint8 *flags, uint32 *out,
+                   uint64 count)
+{
+  uint64 tiles = tileCount(count, TILE_ELEMENTS);
+  if (tiles <= 1)
+    return selectSpan(simd, in, flags, out, count);
+
+  mTileOffsets.resize(tiles + 1);
+
+  pool.parallelFor(tiles, 1,
+    [&](uint64 first, uint64 last, uint32 worker)
+    {
+      for (uint64 tile = first; tile < last; ++tile)
+      {
+        uint64 begin = tile * TILE_ELEMENTS;
+        uint64 end = std::min(begin + TILE_ELEMENTS, count);
+
+        uint64 selected = 0;
+        for (uint64 i = begin; i < end; ++i)
+          selected += (flags[i] != 0);
+
+        mTileOffsets[tile] = selected;
+      }
+    });
+
+  uint64 offset = 0;
+  for (uint64 tile = 0; tile < tiles; ++tile)
+  {
+    uint64 selected = mTileOffsets[tile];
+    mTileOffsets[tile] = offset;
+    offset += selected;
+  }
+
+  mTileOffsets[tiles] = offset;
+
+  pool.parallelFor(tiles, 1,
+    [&](uint64 first, uint64 last, uint32 worker)
+    {
+      for (uint64 tile = first; tile < last; ++tile)
+      {
+        uint64 begin = tile * TILE_ELEMENTS;
+        uint64 size = std::min(TILE_ELEMENTS, count - begin);
+        selectSpan(simd, in + begin, flags + begin,
+                   out + mTileOffsets[tile], size);
+      }
+    });
+
+  return mTileOffsets[tiles];
+}
+
+void
+CPUBackend::sort(uint32 *keys, uint64 count)
+{
+  if (count <= 1)
+    return;
+
+  uint64 tiles = tileCount(count, SORT_TILE_ELEMENTS);
+
+  mSortScratch.resize(count);
+  mTileOffsets.resize(tiles * RADIX_DIGITS);
+
+  uint32 *src = keys;
+  uint32 *dst = mSortScratch.data();
+
+  for (uint32 shift = 0; shift < 32; shift += RADIX_BITS)
+  {
+    /* Histogram of every tile. */
+    pool.parallelFor(tiles, 1,
+      [&](uint64 first, uint64 last, uint32 worker)
+      {
+        for (uint64 tile = first; tile < last; ++tile)
+        {
+          uint64 *histogram = &mTileOffsets[tile * RADIX_DIGITS];
+          memset(histogram, 0, RADIX_DIGITS * sizeof(uint64));
+
+          uint64 begin = tile * SORT_TILE_ELEMENTS;
+          uint64 end = std::min(begin + SORT_TILE_ELEMENTS, count);
+
+          for (uint64 i = begin; i < end; ++i)
+            ++histogram[(src[i] >> shift) & (RADIX_DIGITS - 1)];
+        }
+      });
+
+    /* Scanned digit by digit, then tile by tile, which keeps equal digits
+     * in the order of the tiles (and so the sort stable). */
+    uint64 offset = 0;
+    for (uint32 digit = 0; digit < RADIX_DIGITS; ++digit)
+    {
+      for (uint64 tile = 0; tile < tiles; ++tile)
+      {
+        uint64 &entry = mTileOffsets[tile * RADIX_DIGITS + digit];
+        uint64 digitCount = entry;
+        entry = offset;
+        offset += digitCount;
+      }
+    }
+
+    pool.parallelFor(tiles, 1,
+      [&](uint64 first, uint64 last, uint32 worker)
+      {
+        for (uint64 tile = first; tile < last; ++tile)
+        {
+          uint64 *offsets = &mTileOffsets[tile * RADIX_DIGITS];
+
+          uint64 begin = tile * SORT_TILE_ELEMENTS;
+          uint64 end = std::min(begin + SORT_TILE_ELEMENTS, count);
+
+          for (uint64 i = begin; i < end; ++i)
+          {
+            uint32 key = src[i];
+            dst[offsets[(key >> shift) & (RADIX_DIGITS - 1)]++] = key;
+          }
+        }
+      });
+
+    std::swap(src, dst);
+  }
+
+  /* An even number of passes leaves the keys where they started. */
+  static_assert((32 / RADIX_BITS) % 2 == 0);
+}
+
+} /* namespace vub */
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+#include "cpu-simd.h"
+#include "thread-pool.h"
+
+namespace vub {
+
+/* The primitives over host memory, for machines without a usable Vulkan
+ * device. Inputs are cut into tiles which stay in the L2 cache while a
+ * worker of the pool runs a SIMD kernel over them.
+ *
+ * Scans are two passes over the tiles: the first sums every tile, the sums
+ * are scanned, and the second scans every tile starting from its sum. The
+ * other primitives follow the same pattern. Calls mustn't overlap. */
+struct CPUBackend {
+  SimdLevel simd;
+  ThreadPool pool;
+
+  /* 0 workers means one per hardware thread. simd is clamped to what the
+   * CPU supports. */
+  static CPUBackend make(uint32 workerCount = 0,
+                         SimdLevel simd = SimdLevel::AVX512);
+
+  /* in and out may be the same. */
+  void scan(const uint32 *in, uint32 *out, uint64 count,
+            bool inclusive = false);
+  uint32 reduce(const uint32 *in, uint64 count);
+
+  /* Writes the elements whose flag isn't 0 to out, in order, and returns how
+   * many there were. out can't overlap in. */
+  uint64 select(const uint32 *in, const uint8 *flags, uint32 *out,
+                uint64 count);
+
+  /* Stable LSD radix sort, 8 bits per pass. */
+  void sort(uint32 *keys, uint64 count);
+
+private:
+  /* One per tile. */
+  std::vector<uint32> mTileSums;
+  std::vector<uint64> mTileOffsets;
+
+  std::vector<uint32> mSortScratch;
+};
+
+} /* namespace vub */
@@ -0,0 +1,278 @@
+#include "cpu-simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VUB_X86 1
+#include <immintrin.h>
+#endif
+
+namespace vub {
+
+SimdLevel
+detectSimdLevel()
+{
+#ifdef VUB_X86
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512f"))
+    return SimdLevel::AVX512;
+
+  if (__builtin_cpu_supports("avx2"))
+    return SimdLevel::AVX2;
+#endif
+
+  return SimdLevel::Scalar;
+}
+
+const char *
+simdLevelName(SimdLevel level)
+{
+  switch (level)
+  {
+  case SimdLevel::Scalar: return "scalar";
+  case SimdLevel::AVX2: return "avx2";
+  case SimdLevel::AVX512: return "avx512";
+  default: return "unknown";
+  }
+}
+
+static uint32
+scanScalar(const uint32 *in, uint32 *out, uint64 count,
+           uint32 carry, bool inclusive)
+{
+  for (uint64 i = 0; i < count; ++i)
+  {
+    uint32 value = in[i];
+    out[i] = inclusive ? carry + value : carry;
+    carry += value;
+  }
+
+  return carry;
+}
+
+static uint32
+reduceScalar(const uint32 *in, uint64 count)
+{
+  uint32 sum = 0;
+  for (uint64 i = 0; i < count; ++i)
+    sum += in[i];
+
+  return sum;
+}
+
+static uint64
+selectScalar(const uint32 *in, const uint8 *flags, uint32 *out, uint64 count)
+{
+  uint64 selected = 0;
+  for (uint64 i = 0; i < count; ++i)
+  {
+    if (flags[i])
+      out[selected++] = in[i];
+  }
+
+  return selected;
+}
+
+#ifdef VUB_X86
+
+/* GCC warns about the undefined registers some intrinsics start from when
+ * they are inlined into target() functions. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+/* Every lane gets the sum of itself and the lanes below it: log2(8) shifted
+ * adds inside of each 128-bit half, then the low half's total is added to
+ * the high half. */
+__attribute__((target("avx2"))) static inline __m256i
+prefixSum8(__m256i x)
+{
+  x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+  x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+
+  __m256i lowTotal = _mm256_shuffle_epi32(x, 0xFF);
+  lowTotal = _mm256_permute2x128_si256(lowTotal, lowTotal, 0x08);
+
+  return _mm256_add_epi32(x, lowTotal);
+}
+
+__attribute__((target("avx2"))) static uint32
+scanAVX2(const uint32 *in, uint32 *out, uint64 count,
+         uint32 carry, bool inclusive)
+{
+  __m256i carries = _mm256_set1_epi32(carry);
+  __m256i last = _mm256_set1_epi32(7);
+
+  uint64 i = 0;
+  for (; i + 8 <= count; i += 8)
+  {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(in + i));
+    __m256i sums = _mm256_add_epi32(prefixSum8(x), carries);
+
+    __m256i result = inclusive ? sums : _mm256_sub_epi32(sums, x);
+    _mm256_storeu_si256((__m256i *)(out + i), result);
+
+    carries = _mm256_permutevar8x32_epi32(sums, last);
+  }
+
+  carry = (uint32)_mm256_cvtsi256_si32(carries);
+  return scanScalar(in + i, out + i, count - i, carry, inclusive);
+}
+
+__attribute__((target("avx2"))) static uint32
+reduceAVX2(const uint32 *in, uint64 count)
+{
+  /* Several accumulators to hide the latency of the adds. */
+  __m256i sums[4] = {
+    _mm256_setzero_si256(), _mm256_setzero_si256(),
+    _mm256_setzero_si256(), _mm256_setzero_si256()
+  };
+
+  uint64 i = 0;
+  for (; i + 32 <= count; i += 32)
+  {
+    for (uint32 j = 0; j < 4; ++j)
+    {
+      __m256i x = _mm256_loadu_si256((const __m256i *)(in + i + j * 8));
+      sums[j] = _mm256_add_epi32(sums[j], x);
+    }
+  }
+
+  __m256i sum = _mm256_add_epi32(_mm256_add_epi32(sums[0], sums[1]),
+                                 _mm256_add_epi32(sums[2], sums[3]));
+
+  __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum),
+                               _mm256_extracti128_si256(sum, 1));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4E));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xB1));
+
+  return (uint32)_mm_cvtsi128_si32(half) + reduceScalar(in + i, count - i);
+}
+
+/* Same as prefixSum8 over 16 lanes. alignr with zeros shifts whole lanes
+ * across the register. */
+__attribute__((target("avx512f"))) static inline __m512i
+prefixSum16(__m512i x)
+{
+  __m512i zero = _mm512_setzero_si512();
+
+  x = _mm512_add_epi32(x, _mm512_alignr_epi32(x, zero, 15));
+  x = _mm512_add_epi32(x, _mm512_alignr_epi32(x, zero, 14));
+  x = _mm512_add_epi32(x, _mm512_alignr_epi32(x, zero, 12));
+  x = _mm512_add_epi32(x, _mm512_alignr_epi32(x, zero, 8));
+
+  return x;
+}
+
+__attribute__((target("avx512f"))) static uint32
+scanAVX512(const uint32 *in, uint32 *out, uint64 count,
+           uint32 carry, bool inclusive)
+{
+  __m512i carries = _mm512_set1_epi32(carry);
+  __m512i last = _mm512_set1_epi32(15);
+
+  uint64 i = 0;
+  for (; i + 16 <= count; i += 16)
+  {
+    __m512i x = _mm512_loadu_si512(in + i);
+    __m512i sums = _mm512_add_epi32(prefixSum16(x), carries);
+
+    __m512i result = inclusive ? sums : _mm512_sub_epi32(sums, x);
+    _mm512_storeu_si512(out + i, result);
+
+    carries = _mm512_permutexvar_epi32(last, sums);
+  }
+
+  carry = (uint32)_mm_cvtsi128_si32(_mm512_castsi512_si128(carries));
+  return scanScalar(in + i, out + i, count - i, carry, inclusive);
+}
+
+__attribute__((target("avx512f"))) static uint32
+reduceAVX512(const uint32 *in, uint64 count)
+{
+  __m512i sums[4] = {
+    _mm512_setzero_si512(), _mm512_setzero_si512(),
+    _mm512_setzero_si512(), _mm512_setzero_si512()
+  };
+
+  uint64 i = 0;
+  for (; i + 64 <= count; i += 64)
+  {
+    for (uint32 j = 0; j < 4; ++j)
+      sums[j] = _mm512_add_epi32(sums[j], _mm512_loadu_si512(in + i + j * 16));
+  }
+
+  __m512i sum = _mm512_add_epi32(_mm512_add_epi32(sums[0], sums[1]),
+                                 _mm512_add_epi32(sums[2], sums[3]));
+
+  return (uint32)_mm512_reduce_add_epi32(sum) +
+         reduceScalar(in + i, count - i);
+}
+
+__attribute__((target("avx512f"))) static uint64
+selectAVX512(const uint32 *in, const uint8 *flags, uint32 *out, uint64 count)
+{
+  uint64 selected = 0;
+
+  uint64 i = 0;
+  for (; i + 16 <= count; i += 16)
+  {
+    __m512i x = _mm512_loadu_si512(in + i);
+    __m512i f = _mm512_cvtepu8_epi32(
+      _mm_loadu_si128((const __m128i *)(flags + i)));
+
+    __mmask16 mask = _mm512_test_epi32_mask(f, f);
+    _mm512_mask_compressstoreu_epi32(out + selected, mask, x);
+
+    selected += __builtin_popcount(mask);
+  }
+
+  return selected + selectScalar(in + i, flags + i, out + selected, count - i);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+uint32
+scanSpan(SimdLevel level, const uint32 *in, uint32 *out, uint64 count,
+         uint32 carry, bool inclusive)
+{
+#ifdef VUB_X86
+  if (level == SimdLevel::AVX512)
+    return scanAVX512(in, out, count, carry, inclusive);
+
+  if (level == SimdLevel::AVX2)
+    return scanAVX2(in, out, count, carry, inclusive);
+#endif
+
+  return scanScalar(in, out, count, carry, inclusive);
+}
+
+uint32
+reduceSpan(SimdLevel level, const uint32 *in, uint64 count)
+{
+#ifdef VUB_X86
+  if (level == SimdLevel::AVX512)
+    return reduceAVX512(in, count);
+
+  if (level == SimdLevel::AVX2)
+    return reduceAVX2(in, count);
+#endif
+
+  return reduceScalar(in, count);
+}
+
+uint64
+selectSpan(SimdLevel level, const uint32 *in, const uint8 *flags,
+           uint32 *out, uint64 count)
+{
+#ifdef VUB_X86
+  /* AVX2 has no compress instruction. */
+  if (level == SimdLevel::AVX512)
+    return selectAVX512(in, flags, out, count);
+#endif
+
+  return selectScalar(in, flags, out, count);
+}
+
+} /* namespace vub */
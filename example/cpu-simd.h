@@ -0,0 +1,32 @@
+#pragma once
+
+#include "types.h"
+
+namespace vub {
+
+/* Widest vector instructions the CPU backend uses on this machine. */
+enum class SimdLevel {
+  Scalar,
+  AVX2,
+  AVX512
+};
+
+SimdLevel detectSimdLevel();
+const char *simdLevelName(SimdLevel level);
+
+/* Sequential kernels which the CPU backend runs on one tile at a time. in
+ * and out may be the same. */
+
+/* Scans count elements starting from carry and returns carry plus their
+ * sum. */
+uint32 scanSpan(SimdLevel level, const uint32 *in, uint32 *out, uint64 count,
+                uint32 carry, bool inclusive);
+
+uint32 reduceSpan(SimdLevel level, const uint32 *in, uint64 count);
+
+/* Writes the elements whose flag isn't 0 to out, in order, and returns how
+ * many there were. */
+uint64 selectSpan(SimdLevel level, const uint32 *in, const uint8 *flags,
+                  uint32 *out, uint64 count);
+
+} /* namespace vub */
@@ -0,0 +1,281 @@
+#include "daemon-client.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "helper.h"
+
+namespace vub {
+
+SharedMemory
+SharedMemory::make(uint64 size)
+{
+  SharedMemory ret = {};
+  ret.fd = memfd_create("vub-shared", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+  /* The daemon only maps memory which can't shrink under it. */
+  if (ret.fd < 0 || ftruncate(ret.fd, size) != 0 ||
+      fcntl(ret.fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) != 0)
+    PANIC_AND_EXIT("Can't make shared memory");
+
+  ret.ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 ret.fd, 0);
+  if (ret.ptr == MAP_FAILED)
+    PANIC_AND_EXIT("Can't map shared memory");
+
+  ret.size = size;
+  return ret;
+}
+
+SharedMemory::SharedMemory(SharedMemory &&other)
+  : fd(other.fd), ptr(other.ptr), size(other.size)
+{
+  other.fd = -1;
+  other.ptr = nullptr;
+}
+
+SharedMemory &
+SharedMemory::operator=(SharedMemory &&other)
+{
+  if (this != &other)
+  {
+    if (ptr)
+      munmap(ptr, size);
+
+    if (fd >= 0)
+      close(fd);
+
+    fd = other.fd;
+    ptr = other.ptr;
+    size = other.size;
+
+    other.fd = -1;
+    other.ptr = nullptr;
+  }
+
+  return *this;
+}
+
+SharedMemory::~SharedMemory()
+{
+  if (ptr)
+    munmap(ptr, size);
+
+  if (fd >= 0)
+    close(fd);
+}
+
+bool
+DaemonClient::connect(const std::string &socketPath)
+{
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+
+  if (socketPath.size() >= sizeof(address.sun_path))
+    return false;
+
+  memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+  int socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (socket < 0)
+    return false;
+
+  if (::connect(socket, (const sockaddr *)&address, sizeof(address)) != 0 ||
+      !receiveMessage(socket, &hello, sizeof(hello)) ||
+      hello.version != DAEMON_PROTOCOL_VERSION)
+  {
+    close(socket);
+    return false;
+  }
+
+  if (mSocket >= 0)
+    close(mSocket);
+
+  mSocket = socket;
+  return true;
+}
+
+bool
+DaemonClient::isConnected() const
+{
+  return mSocket >= 0;
+}
+
+DaemonReply
+DaemonClient::send(DaemonRequest &request, const int *fds, uint32 fdCount)
+{
+  DaemonReply reply = { DaemonStatus::Disconnected, 0, 0 };
+
+  if (mSocket < 0)
+    return reply;
+
+  request.version = DAEMON_PROTOCOL_VERSION;
+
+  if (!sendMessage(mSocket, &request, sizeof(request), fds, fdCount) ||
+      !receiveMessage(mSocket, &reply, sizeof(reply)))
+  {
+    close(mSocket);
+    mSocket = -1;
+
+    reply.status = DaemonStatus::Disconnected;
+  }
+
+  return reply;
+}
+
+DaemonReply
+DaemonClient::send(DaemonRequest &request, int waitFd, int signalFd)
+{
+  int fds[2];
+  uint32 fdCount = 0;
+
+  /* In the order the daemon takes them. */
+  if (waitFd >= 0)
+  {
+    fds[fdCount++] = waitFd;
+    request.flags |= DAEMON_FLAG_WAIT_SEMAPHORE;
+  }
+
+  if (signalFd >= 0)
+  {
+    fds[fdCount++] = signalFd;
+    request.flags |= DAEMON_FLAG_SIGNAL_SEMAPHORE;
+  }
+
+  return send(request, fds, fdCount);
+}
+
+uint64
+DaemonClient::registerHost(const SharedMemory &memory)
+{
+  DaemonRequest request = {};
+  request.op = DaemonOp::RegisterHost;
+  request.count = memory.size;
+
+  DaemonReply reply = send(request, &memory.fd, 1);
+  return reply.status == DaemonStatus::Ok ? reply.value : 0;
+}
+
+uint64
+DaemonClient::registerDevice(const GPUDevice &gpu,
+                             const DeviceBuffer &buffer)
+{
+  /* Opaque descriptors only make sense to the same device. */
+  uint8 uuid[VK_UUID_SIZE];
+  gpu.getDeviceUUID(uuid);
+
+  if (memcmp(uuid, hello.deviceUUID, VK_UUID_SIZE))
+    return 0;
+
+  int fd = gpu.getMemoryHandle(VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT_KHR,
+                               buffer.mem);
+  if (fd < 0)
+    return 0;
+
+  DaemonRequest request = {};
+  request.op = DaemonOp::RegisterDevice;
+  request.count = buffer.size;
+
+  DaemonReply reply = send(request, &fd, 1);
+  close(fd);
+
+  return reply.status == DaemonStatus::Ok ? reply.value : 0;
+}
+
+void
+DaemonClient::release(uint64 handle)
+{
+  DaemonRequest request = {};
+  request.op = DaemonOp::Release;
+  request.count = handle;
+
+  send(request, nullptr, 0);
+}
+
+DaemonStatus
+DaemonClient::scan(const DaemonBuffer &input,
+                   const DaemonBuffer &output,
+                   uint64 count,
+                   bool inclusive,
+                   int waitFd,
+                   int signalFd)
+{
+  DaemonRequest request = {};
+  request.op = DaemonOp::Scan;
+  request.flags = inclusive ? DAEMON_FLAG_INCLUSIVE : 0;
+  request.bufferCount = 2;
+  request.count = count;
+  request.buffers[0] = input;
+  request.buffers[1] = output;
+
+  return send(request, waitFd, signalFd).status;
+}
+
+DaemonStatus
+DaemonClient::reduce(const DaemonBuffer &input,
+                     uint64 count,
+                     uint32 &sum,
+                     int waitFd,
+                     int signalFd)
+{
+  DaemonRequest request = {};
+  request.op = DaemonOp::Reduce;
+  request.bufferCount = 1;
+  request.count = count;
+  request.buffers[0] = input;
+
+  DaemonReply reply = send(request, waitFd, signalFd);
+  sum = (uint32)reply.value;
+
+  return reply.status;
+}
+
+DaemonStatus
+DaemonClient::sort(const DaemonBuffer &keys,
+                   const DaemonBuffer &values,
+                   uint64 count,
+                   int waitFd,
+                   int signalFd)
+{
+  DaemonRequest request = {};
+  request.op = DaemonOp::Sort;
+  request.bufferCount = values.size > 0 ? 2 : 1;
+  request.count = count;
+  request.buffers[0] = keys;
+  request.buffers[1] = values;
+
+  return send(request, waitFd, signalFd).status;
+}
+
+DaemonClient::DaemonClient(DaemonClient &&other)
+  : hello(other.hello), mSocket(other.mSocket)
+{
+  other.mSocket = -1;
+}
+
+DaemonClient &
+DaemonClient::operator=(DaemonClient &&other)
+{
+  if (this != &other)
+  {
+    if (mSocket >= 0)
+      close(mSocket);
+
+    hello = other.hello;
+    mSocket = other.mSocket;
+    other.mSocket = -1;
+  }
+
+  return *this;
+}
+
+DaemonClient::~DaemonClient()
+{
+  if (mSocket >= 0)
+    close(mSocket);
+}
+
+} /* namespace vub */
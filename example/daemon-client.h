@@ -0,0 +1,84 @@
+#pragma once
+
+#include <string>
+#include "gpu-device.h"
+#include "daemon-protocol.h"
+
+namespace vub {
+
+/* Memory a process shares with the daemon without a Vulkan device of its
+ * own: a memfd, mapped here and by the daemon, and sealed so that it can't
+ * be made smaller. */
+struct SharedMemory {
+  int fd = -1;
+  void *ptr = nullptr;
+  uint64 size = 0;
+
+  /* Panics if the memory can't be made. */
+  static SharedMemory make(uint64 size);
+
+  SharedMemory() = default;
+  SharedMemory(SharedMemory &&other);
+  SharedMemory &operator=(SharedMemory &&other);
+  ~SharedMemory();
+};
+
+/* Connection to a vub daemon (see Daemon), which runs primitives on its
+ * device for this process. Every call sends a request and waits for the
+ * reply, so the daemon is done with the buffers when it returns.
+ *
+ * Buffers are registered once and referred to by handle afterwards, with
+ * offsets which are multiples of DAEMON_BUFFER_ALIGNMENT. Semaphores are
+ * descriptors from getSemaphoreHandle, which stay the caller's. */
+struct DaemonClient {
+  /* What the daemon sent when connecting. */
+  DaemonHello hello;
+
+  /* Returns false if no daemon of this protocol version is listening at
+   * socketPath. */
+  bool connect(const std::string &socketPath =
+                 getDefaultDaemonSocketPath());
+  bool isConnected() const;
+
+  /* The handle of the memory, or 0 if the daemon couldn't import it. The
+   * memory has to stay around until it is released. */
+  uint64 registerHost(const SharedMemory &memory);
+  uint64 registerDevice(const GPUDevice &gpu, const DeviceBuffer &buffer);
+  void release(uint64 handle);
+
+  /* See DaemonOp. waitFd and signalFd are -1 if there are no semaphores. */
+  DaemonStatus scan(const DaemonBuffer &input,
+                    const DaemonBuffer &output,
+                    uint64 count,
+                    bool inclusive = false,
+                    int waitFd = -1,
+                    int signalFd = -1);
+  DaemonStatus reduce(const DaemonBuffer &input,
+                      uint64 count,
+                      uint32 &sum,
+                      int waitFd = -1,
+                      int signalFd = -1);
+  /* No values with a values.size of 0. */
+  DaemonStatus sort(const DaemonBuffer &keys,
+                    const DaemonBuffer &values,
+                    uint64 count,
+                    int waitFd = -1,
+                    int signalFd = -1);
+
+  DaemonClient() = default;
+  DaemonClient(DaemonClient &&other);
+  DaemonClient &operator=(DaemonClient &&other);
+  ~DaemonClient();
+
+private:
+  /* Sends the request with fds and waits for the reply. Disconnects if
+   * the daemon went away. */
+  DaemonReply send(DaemonRequest &request, const int *fds, uint32 fdCount);
+
+  /* Same with the semaphores which are set. */
+  DaemonReply send(DaemonRequest &request, int waitFd, int signalFd);
+
+  int mSocket = -1;
+};
+
+} /* namespace vub */
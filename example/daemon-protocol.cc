@@ -0,0 +1,186 @@
+#include "daemon-protocol.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+namespace vub {
+
+std::string
+getDefaultDaemonSocketPath()
+{
+  if (const char *path = getenv("VUB_DAEMON_SOCKET"))
+    return path;
+
+  if (const char *dir = getenv("XDG_RUNTIME_DIR"))
+    return std::string(dir) + "/vub.sock";
+
+  return "/tmp/vub-" + std::to_string(getuid()) + ".sock";
+}
+
+bool
+sendMessage(int socket, const void *message, uint64 size,
+            const int *fds, uint32 fdCount)
+{
+  if (fdCount > DAEMON_MAX_FDS)
+    return false;
+
+  const uint8 *bytes = (const uint8 *)message;
+
+  /* The descriptors go with the first byte. */
+  union {
+    char buffer[CMSG_SPACE(DAEMON_MAX_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control = {};
+
+  while (size > 0)
+  {
+    iovec io = { (void *)bytes, size };
+
+    msghdr header = {};
+    header.msg_iov = &io;
+    header.msg_iovlen = 1;
+
+    if (fdCount > 0)
+    {
+      header.msg_control = control.buffer;
+      header.msg_controllen = CMSG_SPACE(fdCount * sizeof(int));
+
+      cmsghdr *fdHeader = CMSG_FIRSTHDR(&header);
+      fdHeader->cmsg_level = SOL_SOCKET;
+      fdHeader->cmsg_type = SCM_RIGHTS;
+      fdHeader->cmsg_len = CMSG_LEN(fdCount * sizeof(int));
+      memcpy(CMSG_DATA(fdHeader), fds, fdCount * sizeof(int));
+    }
+
+    ssize_t sent = sendmsg(socket, &header, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+
+    if (sent <= 0)
+      return false;
+
+    bytes += sent;
+    size -= sent;
+    fdCount = 0;
+  }
+
+  return true;
+}
+
+/* One recvmsg into bytes, which takes the descriptors which came with it
+ * into fds past *fdCount. */
+static ssize_t
+receiveOnce(int socket, uint8 *bytes, uint64 size, int *fds,
+            uint32 maxFds, uint32 *fdCount, int flags)
+{
+  union {
+    char buffer[CMSG_SPACE(DAEMON_MAX_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+
+  ssize_t read;
+  msghdr header;
+
+  do
+  {
+    iovec io = { bytes, size };
+
+    header = {};
+    header.msg_iov = &io;
+    header.msg_iovlen = 1;
+    header.msg_control = control.buffer;
+    header.msg_controllen = sizeof(control.buffer);
+
+    read = recvmsg(socket, &header, flags | MSG_CMSG_CLOEXEC);
+  } while (read < 0 && errno == EINTR);
+
+  /* Nothing was filled in on errors. */
+  if (read < 0)
+    return read;
+
+  for (cmsghdr *fdHeader = CMSG_FIRSTHDR(&header); fdHeader;
+       fdHeader = CMSG_NXTHDR(&header, fdHeader))
+  {
+    if (fdHeader->cmsg_level != SOL_SOCKET ||
+        fdHeader->cmsg_type != SCM_RIGHTS)
+      continue;
+
+    uint32 count = (fdHeader->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int *data = (int *)CMSG_DATA(fdHeader);
+
+    /* Whatever the caller didn't ask for would leak otherwise. */
+    for (uint32 i = 0; i < count; ++i)
+    {
+      if (*fdCount < maxFds)
+        fds[(*fdCount)++] = data[i];
+      else
+        close(data[i]);
+    }
+  }
+
+  return read;
+}
+
+static void
+closeAll(int *fds, uint32 *fdCount)
+{
+  for (uint32 i = 0; i < *fdCount; ++i)
+    close(fds[i]);
+
+  *fdCount = 0;
+}
+
+bool
+receiveMessage(int socket, void *message, uint64 size,
+               int *fds, uint32 maxFds, uint32 *fdCount)
+{
+  uint8 *bytes = (uint8 *)message;
+  uint32 received = 0;
+
+  while (size > 0)
+  {
+    ssize_t read = receiveOnce(socket, bytes, size, fds, maxFds,
+                               &received, 0);
+    if (read <= 0)
+    {
+      closeAll(fds, &received);
+      return false;
+    }
+
+    bytes += read;
+    size -= read;
+  }
+
+  if (fdCount)
+    *fdCount = received;
+
+  return true;
+}
+
+bool
+receiveMessagePart(int socket, void *message, uint64 size,
+                   uint64 *received, int *fds, uint32 maxFds,
+                   uint32 *fdCount)
+{
+  ssize_t read = receiveOnce(socket, (uint8 *)message + *received,
+                             size - *received, fds, maxFds, fdCount,
+                             MSG_DONTWAIT);
+
+  /* Nothing more has come in yet. */
+  if (read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return true;
+
+  if (read <= 0)
+  {
+    closeAll(fds, fdCount);
+    return false;
+  }
+
+  *received += read;
+  return true;
+}
+
+} /* namespace vub */
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <string>
+#include "types.h"
+
+namespace vub {
+
+/* What vub-daemon and its clients (DaemonClient) send each other over a
+ * Unix domain socket. Both run on the same machine, so everything goes as
+ * it is laid out in memory. File descriptors of memory and semaphores go
+ * along with messages as SCM_RIGHTS.
+ *
+ * The daemon sends a DaemonHello when a client connects. From then on the
+ * client sends a DaemonRequest, with the descriptors it takes, and waits
+ * for its DaemonReply. */
+
+static constexpr uint32 DAEMON_PROTOCOL_VERSION = 1;
+
+/* Most buffers a request refers to, and most descriptors a message can
+ * carry. */
+static constexpr uint32 DAEMON_MAX_BUFFERS = 2;
+static constexpr uint32 DAEMON_MAX_FDS = 4;
+
+/* Offsets into registered buffers are multiples of this, since they get
+ * bound through descriptors. */
+static constexpr uint64 DAEMON_BUFFER_ALIGNMENT = 256;
+
+enum class DaemonOp : uint32 {
+  /* Maps the shared memory of the descriptor and imports it with
+   * importHostBuffer. Replies with the handle of the buffer. The memory has
+   * to be a memfd sealed with F_SEAL_SHRINK (see SharedMemory). */
+  RegisterHost,
+  /* Imports the memory of a makeDeviceBuffer(size, true) of a client on a
+   * device of the same UUID (see DaemonHello) with importDeviceBuffer.
+   * Replies with the handle of the buffer. */
+  RegisterDevice,
+  /* Frees the buffer of handle. */
+  Release,
+
+  /* Scans count uint32 of buffers[0] into buffers[1]. Both may be the
+   * same. */
+  Scan,
+  /* Replies with the sum of count uint32 of buffers[0]. */
+  Reduce,
+  /* Sorts count uint32 keys of buffers[0] in place, along with as many
+   * uint32 values of buffers[1] if bufferCount is 2. */
+  Sort
+};
+
+enum class DaemonStatus : uint32 {
+  Ok,
+  /* Malformed, of another version, or referring to unknown handles. */
+  BadRequest,
+  /* More elements than the daemon was made for (DaemonHello). */
+  TooLarge,
+  /* A descriptor the device couldn't import. */
+  ImportFailed,
+  /* The work didn't finish in time, most likely because a wait semaphore
+   * was never signaled. The daemon's queue stays blocked behind it, so
+   * every request gets this until it does finish. */
+  TimedOut,
+  /* The daemon went away. Only ever made by DaemonClient. */
+  Disconnected
+};
+
+/* Inclusive scan, for DaemonOp::Scan. */
+#define DAEMON_FLAG_INCLUSIVE 0x1
+/* A binary semaphore of makeExportSemaphore comes with the request, which
+ * the work waits on before it starts. */
+#define DAEMON_FLAG_WAIT_SEMAPHORE 0x2
+/* Same, signaled once the work is done. The reply still comes after. */
+#define DAEMON_FLAG_SIGNAL_SEMAPHORE 0x4
+
+struct DaemonHello {
+  uint32 version;
+  /* Largest count of a request. */
+  uint32 maxElements;
+  /* Whether RegisterHost imports the memory in place (features.
+   * externalMemoryHost). If not, the daemon copies it in and out around
+   * every request. */
+  uint32 externalMemoryHost;
+  uint32 pad;
+  /* See GPUDevice::getDeviceUUID. */
+  uint8 deviceUUID[16];
+};
+
+/* bytes of a registered buffer, starting offset bytes into it. */
+struct DaemonBuffer {
+  uint64 handle;
+  uint64 offset;
+  uint64 size;
+};
+
+struct DaemonRequest {
+  uint32 version;
+  DaemonOp op;
+  uint32 flags;
+  uint32 bufferCount;
+
+  /* Elements for the primitives, bytes of the memory to register, and the
+   * handle to release. */
+  uint64 count;
+
+  DaemonBuffer buffers[DAEMON_MAX_BUFFERS];
+};
+
+struct DaemonReply {
+  DaemonStatus status;
+  uint32 pad;
+  /* The handle of a registered buffer, or the result of a reduce. */
+  uint64 value;
+};
+
+/* VUB_DAEMON_SOCKET of the environment if set, $XDG_RUNTIME_DIR/vub.sock
+ * or /tmp/vub-<uid>.sock if not. */
+std::string getDefaultDaemonSocketPath();
+
+/* Send and receive a whole message of size bytes with fdCount descriptors
+ * (at most DAEMON_MAX_FDS). Receiving stores how many came in fdCount and
+ * closes any beyond maxFds. Both return false if the other end went away
+ * or the message was cut short. */
+bool sendMessage(int socket, const void *message, uint64 size,
+                 const int *fds = nullptr, uint32 fdCount = 0);
+bool receiveMessage(int socket, void *message, uint64 size,
+                    int *fds = nullptr, uint32 maxFds = 0,
+                    uint32 *fdCount = nullptr);
+
+/* Same without waiting: reads whatever has come in of the message into it
+ * past *received, and adds the descriptors to fds past *fdCount. The
+ * message is whole once *received is size. Returns false, having closed
+ * the descriptors, if the other end went away. */
+bool receiveMessagePart(int socket, void *message, uint64 size,
+                        uint64 *received, int *fds, uint32 maxFds,
+                        uint32 *fdCount);
+
+} /* namespace vub */
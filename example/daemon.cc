@@ -0,0 +1,666 @@
+#include "daemon.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "helper.h"
+#include "kernel.h"
+#include "memory-tracker.h"
+
+namespace vub {
+
+/* Makes a transfer visible to the shaders after it. */
+static void
+recordTransferBarrier(VkCommandBuffer cmdbuf)
+{
+  VkMemoryBarrier barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT
+  };
+
+  vkCmdPipelineBarrier(cmdbuf,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+/* Makes everything the work wrote visible to the host, which is where
+ * registered host memory is read. */
+static void
+recordHostBarrier(VkCommandBuffer cmdbuf)
+{
+  VkMemoryBarrier barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_HOST_READ_BIT
+  };
+
+  vkCmdPipelineBarrier(cmdbuf,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                       VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_HOST_BIT,
+                       0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+static bool
+makeSocketAddress(const std::string &path, sockaddr_un &address)
+{
+  address = {};
+  address.sun_family = AF_UNIX;
+
+  if (path.size() >= sizeof(address.sun_path))
+    return false;
+
+  memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  return true;
+}
+
+/* Whether a daemon is still serving the socket at address. */
+static bool
+isServed(const sockaddr_un &address)
+{
+  int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  bool served = connect(probe, (const sockaddr *)&address,
+                        sizeof(address)) == 0;
+  close(probe);
+
+  return served;
+}
+
+static int
+listenOn(const std::string &path)
+{
+  sockaddr_un address;
+  if (!makeSocketAddress(path, address))
+  {
+    printf("Daemon socket path is too long: %s\n", path.c_str());
+    PANIC_AND_EXIT("Can't listen");
+  }
+
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0)
+    PANIC_AND_EXIT("Can't make the daemon socket");
+
+  int result = bind(listener, (const sockaddr *)&address, sizeof(address));
+
+  /* Left behind by a daemon which didn't get to remove it. */
+  if (result != 0 && errno == EADDRINUSE && !isServed(address))
+  {
+    unlink(path.c_str());
+    result = bind(listener, (const sockaddr *)&address, sizeof(address));
+  }
+
+  if (result != 0 || listen(listener, SOMAXCONN) != 0)
+  {
+    printf("Can't listen on %s: %s\n", path.c_str(), strerror(errno));
+    PANIC_AND_EXIT("Can't listen");
+  }
+
+  return listener;
+}
+
+Daemon
+Daemon::make(const std::string &socketPath, uint32 maxElements,
+             uint32 timeoutMs)
+{
+  Daemon ret = {};
+
+  /* GPUDevice can't be moved, but it can be made in place. */
+  ret.gpu.reset(new GPUDevice(GPUDevice::make(nullptr, false)));
+  ret.socketPath = socketPath;
+  ret.maxElements = maxElements;
+  ret.timeoutMs = timeoutMs;
+
+  MemoryScope memoryScope(*ret.gpu, "Daemon");
+
+  uint64 bytes = (uint64)maxElements * sizeof(uint32);
+
+  ret.mScan = DeviceScan::make(*ret.gpu, maxElements);
+  ret.mSort = DeviceRadixSort::make(*ret.gpu, maxElements);
+  ret.mScratch = ret.gpu->makeDeviceBuffer(bytes);
+  ret.mScratchAlt = ret.gpu->makeDeviceBuffer(bytes);
+  ret.mTotal = ret.gpu->makeStagingBuffer(sizeof(uint32),
+                                          VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+
+  /* Every kernel a client can ask for is made by now. */
+  ret.gpu->savePipelineCache();
+
+  ret.mListener = listenOn(socketPath);
+
+  return ret;
+}
+
+void
+Daemon::run()
+{
+  while (!mStopping)
+  {
+    std::vector<pollfd> fds(mClients.size() + 1);
+
+    fds[0] = { mListener, POLLIN, 0 };
+    for (uint32 i = 0; i < mClients.size(); ++i)
+      fds[i + 1] = { mClients[i]->socket, POLLIN, 0 };
+
+    /* Signals (see stop) interrupt the wait. Stalled work is looked at
+     * every so often, in case it finished. */
+    int timeout = mStalled.empty() ? -1 : 100;
+
+    if (poll(fds.data(), fds.size(), timeout) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      PANIC_AND_EXIT("Daemon failed to wait for clients");
+    }
+
+    retireStalled();
+
+    /* Clients which went away, newest first so that erasing them doesn't
+     * move the others. */
+    for (uint32 i = (uint32)mClients.size(); i > 0; --i)
+    {
+      if (fds[i].revents == 0)
+        continue;
+
+      if (!receive(*mClients[i - 1]))
+      {
+        disconnect(*mClients[i - 1]);
+        mClients.erase(mClients.begin() + (i - 1));
+      }
+    }
+
+    if (fds[0].revents & POLLIN)
+    {
+      int socket = accept4(mListener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (socket < 0)
+        continue;
+
+      /* Replies are tiny, but a client which never reads them mustn't
+       * block the daemon once the socket is full. */
+      timeval sendTimeout = { 1, 0 };
+      setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout,
+                 sizeof(sendTimeout));
+
+      DaemonHello hello = {
+        .version = DAEMON_PROTOCOL_VERSION,
+        .maxElements = maxElements,
+        .externalMemoryHost = gpu->features.externalMemoryHost,
+        .pad = 0
+      };
+
+      gpu->getDeviceUUID(hello.deviceUUID);
+
+      if (!sendMessage(socket, &hello, sizeof(hello)))
+      {
+        close(socket);
+        continue;
+      }
+
+      auto client = std::make_unique<Client>();
+      client->socket = socket;
+      client->nextHandle = 1;
+      client->received = 0;
+      client->fdCount = 0;
+
+      mClients.push_back(std::move(client));
+    }
+  }
+}
+
+void
+Daemon::stop()
+{
+  mStopping = 1;
+}
+
+void
+Daemon::shutdown()
+{
+  for (std::unique_ptr<Client> &client : mClients)
+    disconnect(*client);
+
+  mClients.clear();
+
+  if (mListener >= 0)
+  {
+    close(mListener);
+    unlink(socketPath.c_str());
+    mListener = -1;
+  }
+
+  /* Kernels made since make (runtime variants) are in it too. */
+  gpu->savePipelineCache();
+}
+
+bool
+Daemon::receive(Client &client)
+{
+  if (!receiveMessagePart(client.socket, &client.request,
+                          sizeof(client.request), &client.received,
+                          client.fds, DAEMON_MAX_FDS, &client.fdCount))
+    return false;
+
+  if (client.received < sizeof(client.request))
+    return true;
+
+  bool served = serve(client);
+
+  client.received = 0;
+  client.fdCount = 0;
+
+  return served;
+}
+
+bool
+Daemon::serve(Client &client)
+{
+  DaemonRequest &request = client.request;
+  int *fds = client.fds;
+  uint32 fdCount = client.fdCount;
+
+  DaemonReply reply = { DaemonStatus::BadRequest, 0, 0 };
+
+  /* Anything else gets a BadRequest. */
+  if (request.version != DAEMON_PROTOCOL_VERSION ||
+      request.bufferCount > DAEMON_MAX_BUFFERS)
+    request.op = (DaemonOp)~0u;
+
+  uint32 semaphoreCount =
+    (request.flags & DAEMON_FLAG_WAIT_SEMAPHORE ? 1 : 0) +
+    (request.flags & DAEMON_FLAG_SIGNAL_SEMAPHORE ? 1 : 0);
+
+  switch (request.op)
+  {
+  case DaemonOp::RegisterHost:
+  case DaemonOp::RegisterDevice:
+  {
+    if (fdCount == 1)
+    {
+      reply = registerBuffer(client, request, fds[0]);
+      fdCount = 0;
+    }
+  } break;
+
+  case DaemonOp::Release:
+  {
+    reply = release(client, request);
+  } break;
+
+  case DaemonOp::Scan:
+  case DaemonOp::Reduce:
+  case DaemonOp::Sort:
+  {
+    if (fdCount != semaphoreCount)
+      break;
+
+    VkSemaphore semaphores[2] = { VK_NULL_HANDLE, VK_NULL_HANDLE };
+    bool imported = true;
+
+    for (uint32 i = 0; i < semaphoreCount; ++i)
+    {
+      semaphores[i] = gpu->importSemaphore(fds[i]);
+
+      /* The device owns the descriptor if the import worked. */
+      if (semaphores[i] != VK_NULL_HANDLE)
+        fds[i] = -1;
+      else
+        imported = false;
+    }
+
+    uint32 next = 0;
+    VkSemaphore wait = request.flags & DAEMON_FLAG_WAIT_SEMAPHORE ?
+      semaphores[next++] : VK_NULL_HANDLE;
+    VkSemaphore signal = request.flags & DAEMON_FLAG_SIGNAL_SEMAPHORE ?
+      semaphores[next++] : VK_NULL_HANDLE;
+
+    if (imported)
+      reply = runPrimitive(client, request, wait, signal);
+    else
+      reply.status = DaemonStatus::ImportFailed;
+
+    /* Unless stalled work still uses them. */
+    for (VkSemaphore semaphore : { wait, signal })
+    {
+      if (semaphore != VK_NULL_HANDLE)
+        vkDestroySemaphore(gpu->dev, semaphore, nullptr);
+    }
+  } break;
+
+  default:
+    break;
+  }
+
+  /* Descriptors which are still ours. */
+  for (uint32 i = 0; i < fdCount; ++i)
+  {
+    if (fds[i] >= 0)
+      close(fds[i]);
+  }
+
+  return sendMessage(client.socket, &reply, sizeof(reply));
+}
+
+DaemonReply
+Daemon::registerBuffer(Client &client, const DaemonRequest &request, int fd)
+{
+  DaemonReply reply = { DaemonStatus::BadRequest, 0, 0 };
+
+  uint64 size = request.count;
+  if (size == 0)
+  {
+    close(fd);
+    return reply;
+  }
+
+  Buffer buffer = {};
+  buffer.isHost = request.op == DaemonOp::RegisterHost;
+
+  if (buffer.isHost)
+  {
+    /* Touching a mapping past the end of the memory would kill the
+     * daemon, so the memory mustn't be able to shrink after the check. */
+    int seals = fcntl(fd, F_GET_SEALS);
+
+    struct stat status;
+    if (seals < 0 || !(seals & F_SEAL_SHRINK) ||
+        fstat(fd, &status) != 0 || (uint64)status.st_size < size)
+    {
+      close(fd);
+      return reply;
+    }
+
+    void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd, 0);
+
+    /* The mapping keeps the memory around. */
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+    {
+      reply.status = DaemonStatus::ImportFailed;
+      return reply;
+    }
+
+    buffer.mapping = mapping;
+    buffer.mappingSize = size;
+    buffer.host = gpu->importHostBuffer(mapping, size);
+  }
+  else
+  {
+    buffer.device = gpu->importDeviceBuffer(fd, size);
+
+    if (buffer.device.hdl == VK_NULL_HANDLE)
+    {
+      close(fd);
+      reply.status = DaemonStatus::ImportFailed;
+      return reply;
+    }
+  }
+
+  uint64 handle = client.nextHandle++;
+  client.buffers.emplace(handle, std::move(buffer));
+
+  reply.status = DaemonStatus::Ok;
+  reply.value = handle;
+  return reply;
+}
+
+DaemonReply
+Daemon::release(Client &client, const DaemonRequest &request)
+{
+  auto buffer = client.buffers.find(request.count);
+  if (buffer == client.buffers.end())
+    return { DaemonStatus::BadRequest, 0, 0 };
+
+  /* Nothing runs once a reply is sent, so nothing uses it anymore. */
+  freeBuffer(buffer->second);
+  client.buffers.erase(buffer);
+
+  return { DaemonStatus::Ok, 0, 0 };
+}
+
+Daemon::Buffer *
+Daemon::findBuffer(Client &client, const DaemonBuffer &buffer) const
+{
+  auto found = client.buffers.find(buffer.handle);
+  if (found == client.buffers.end())
+    return nullptr;
+
+  uint64 size = found->second.isHost ?
+    found->second.host.size : found->second.device.size;
+
+  if (buffer.offset % DAEMON_BUFFER_ALIGNMENT != 0 ||
+      buffer.offset > size || buffer.size > size - buffer.offset)
+    return nullptr;
+
+  return &found->second;
+}
+
+BufferRange
+Daemon::rangeOf(Client &client, const DaemonBuffer &buffer) const
+{
+  Buffer *found = findBuffer(client, buffer);
+
+  return found->isHost ?
+    found->host.range(buffer.offset, buffer.size) :
+    found->device.range(buffer.offset, buffer.size);
+}
+
+DaemonReply
+Daemon::runPrimitive(Client &client, const DaemonRequest &request,
+                     VkSemaphore &wait, VkSemaphore &signal)
+{
+  DaemonReply reply = { DaemonStatus::BadRequest, 0, 0 };
+
+  uint64 count = request.count;
+  uint64 bytes = count * sizeof(uint32);
+
+  /* Scans take an output, sorts may take values. */
+  uint32 minBuffers = request.op == DaemonOp::Scan ? 2 : 1;
+  uint32 maxBuffers = request.op == DaemonOp::Reduce ? 1 : 2;
+
+  if (count == 0 || request.bufferCount < minBuffers ||
+      request.bufferCount > maxBuffers)
+    return reply;
+
+  if (count > maxElements)
+  {
+    reply.status = DaemonStatus::TooLarge;
+    return reply;
+  }
+
+  Buffer *buffers[DAEMON_MAX_BUFFERS] = {};
+  for (uint32 i = 0; i < request.bufferCount; ++i)
+  {
+    buffers[i] = findBuffer(client, request.buffers[i]);
+
+    if (!buffers[i] || request.buffers[i].size < bytes)
+      return reply;
+  }
+
+  /* Anything submitted now would only queue up behind it. */
+  if (!mStalled.empty())
+  {
+    reply.status = DaemonStatus::TimedOut;
+    return reply;
+  }
+
+  /* The client may have written host memory which is a copy since. */
+  for (uint32 i = 0; i < request.bufferCount; ++i)
+  {
+    if (buffers[i]->isHost)
+      buffers[i]->host.upload();
+  }
+
+  BufferRange first = rangeOf(client, request.buffers[0]).range(0, bytes);
+  BufferRange second = request.bufferCount > 1 ?
+    rangeOf(client, request.buffers[1]).range(0, bytes) : BufferRange{};
+
+  VkCommandBuffer cmdbuf = gpu->makeCommandBuffer();
+  gpu->beginSingleUseCommandBuffer(cmdbuf);
+
+  switch (request.op)
+  {
+  case DaemonOp::Scan:
+  {
+    /* The kernel can't scan in place, so overlapping inputs get scanned
+     * out of a copy. */
+    bool overlaps = first.hdl == second.hdl &&
+                    first.offset < second.offset + bytes &&
+                    second.offset < first.offset + bytes;
+
+    if (overlaps)
+    {
+      VkBufferCopy region = { first.offset, 0, bytes };
+      vkCmdCopyBuffer(cmdbuf, first.hdl, mScratch.hdl, 1, &region);
+      recordTransferBarrier(cmdbuf);
+
+      first = mScratch.range(0, bytes);
+    }
+
+    mScan.record(cmdbuf, first, second, (uint32)count,
+                 request.flags & DAEMON_FLAG_INCLUSIVE);
+  } break;
+
+  case DaemonOp::Reduce:
+  {
+    mScan.record(cmdbuf, first, mScratch.range(0, bytes), (uint32)count,
+                 true, ScanCarry::Start);
+    recordComputeBarrier(cmdbuf);
+
+    BufferRange total = mScan.carryOut();
+    VkBufferCopy region = { total.offset, 0, sizeof(uint32) };
+    vkCmdCopyBuffer(cmdbuf, total.hdl, mTotal.hdl, 1, &region);
+  } break;
+
+  case DaemonOp::Sort:
+  {
+    BufferRange valuesAlt = second.size > 0 ?
+      mScratchAlt.range(0, bytes) : BufferRange{};
+
+    mSort.record(cmdbuf, first, mScratch.range(0, bytes),
+                 second, valuesAlt, (uint32)count);
+  } break;
+
+  default:
+    break;
+  }
+
+  recordHostBarrier(cmdbuf);
+
+  VkFenceCreateInfo fenceInfo = {
+    .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO
+  };
+
+  VkFence fence;
+  VK_CHECK(vkCreateFence(gpu->dev, &fenceInfo, nullptr, &fence));
+
+  gpu->endCommandBuffer(cmdbuf);
+  gpu->submitCommandBuffer(cmdbuf, wait, signal,
+                           VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, fence);
+
+  VkResult result = gpu->waitForFence(fence, (uint64)timeoutMs * 1000000);
+
+  if (result == VK_TIMEOUT)
+  {
+    /* Nothing the work uses can go until it is done. */
+    mStalled.push_back({ cmdbuf, fence, wait, signal });
+    wait = VK_NULL_HANDLE;
+    signal = VK_NULL_HANDLE;
+
+    reply.status = DaemonStatus::TimedOut;
+    return reply;
+  }
+
+  VK_CHECK(result);
+
+  vkDestroyFence(gpu->dev, fence, nullptr);
+  gpu->freeCommandBuffer(cmdbuf);
+
+  /* Scans write their second buffer, sorts both. */
+  for (uint32 i = request.op == DaemonOp::Scan ? 1 : 0;
+       i < request.bufferCount; ++i)
+  {
+    if (buffers[i]->isHost)
+      buffers[i]->host.download();
+  }
+
+  reply.status = DaemonStatus::Ok;
+
+  if (request.op == DaemonOp::Reduce)
+    reply.value = *(const uint32 *)mTotal.ptr;
+
+  return reply;
+}
+
+void
+Daemon::retireStalled()
+{
+  /* The queue finishes work in order. */
+  uint32 finished = 0;
+  while (finished < mStalled.size() &&
+         gpu->waitForFence(mStalled[finished].fence, 0) == VK_SUCCESS)
+  {
+    Stalled &stalled = mStalled[finished++];
+
+    vkDestroyFence(gpu->dev, stalled.fence, nullptr);
+    gpu->freeCommandBuffer(stalled.cmdbuf);
+
+    for (VkSemaphore semaphore : { stalled.wait, stalled.signal })
+    {
+      if (semaphore != VK_NULL_HANDLE)
+        vkDestroySemaphore(gpu->dev, semaphore, nullptr);
+    }
+  }
+
+  mStalled.erase(mStalled.begin(), mStalled.begin() + finished);
+
+  if (mStalled.empty())
+  {
+    for (Buffer &buffer : mOrphans)
+      freeBuffer(buffer);
+
+    mOrphans.clear();
+  }
+}
+
+void
+Daemon::freeBuffer(Buffer &buffer)
+{
+  if (!mStalled.empty())
+  {
+    mOrphans.push_back(std::move(buffer));
+    return;
+  }
+
+  if (buffer.isHost)
+  {
+    /* The import goes before the memory it imported. */
+    buffer.host = HostBuffer();
+    munmap(buffer.mapping, buffer.mappingSize);
+  }
+  else
+  {
+    vkDestroyBuffer(gpu->dev, buffer.device.hdl, nullptr);
+    gpu->freeMemory(buffer.device.mem);
+  }
+}
+
+void
+Daemon::disconnect(Client &client)
+{
+  for (auto &buffer : client.buffers)
+    freeBuffer(buffer.second);
+
+  client.buffers.clear();
+  close(client.socket);
+}
+
+} /* namespace vub */
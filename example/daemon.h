@@ -0,0 +1,128 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <signal.h>
+#include <unordered_map>
+#include "gpu-device.h"
+#include "device-scan.h"
+#include "device-radix-sort.h"
+#include "daemon-protocol.h"
+
+namespace vub {
+
+/* Runs vub primitives for other processes (see DaemonClient), so that
+ * short-lived ones don't each pay for making an instance, a device and
+ * their pipelines. The device and the kernels are made once, when the
+ * daemon starts, and the pipeline cache is saved right after, so even a
+ * restarted daemon comes up warm.
+ *
+ * Clients register memory once and refer to it by handle afterwards:
+ * shared memory (a memfd), which needs no Vulkan in the client at all, or
+ * exported device memory of a client with a device of its own, which may
+ * then also chain its work to the daemon's with semaphores. Requests are
+ * served one at a time, in the order they come in, on one queue.
+ *
+ * No client can hold up the others for long: messages are read as they
+ * come in, and work which doesn't finish within timeoutMs is answered with
+ * DaemonStatus::TimedOut (as is everything after it, until it does). */
+struct Daemon {
+  std::unique_ptr<GPUDevice> gpu;
+  std::string socketPath;
+  uint32 maxElements;
+  uint32 timeoutMs;
+
+  /* Panics if socketPath can't be listened on. A socket left behind by a
+   * daemon which didn't exit cleanly is replaced, one which is still
+   * served isn't. */
+  static Daemon make(const std::string &socketPath, uint32 maxElements,
+                     uint32 timeoutMs = 10000);
+
+  /* Serves clients until stop is called. */
+  void run();
+
+  /* May be called from a signal handler, which run then returns after. */
+  void stop();
+
+  /* Saves the pipeline cache and removes the socket. */
+  void shutdown();
+
+private:
+  /* Memory a client registered. */
+  struct Buffer {
+    /* RegisterHost: the client's mapping, imported or copied. */
+    void *mapping;
+    uint64 mappingSize;
+    HostBuffer host;
+
+    /* RegisterDevice. */
+    DeviceBuffer device;
+
+    bool isHost;
+  };
+
+  struct Client {
+    int socket;
+    uint64 nextHandle;
+    std::unordered_map<uint64, Buffer> buffers;
+
+    /* What has come in of the next request. */
+    DaemonRequest request;
+    uint64 received;
+    int fds[DAEMON_MAX_FDS];
+    uint32 fdCount;
+  };
+
+  /* Work which timed out, and what it uses. */
+  struct Stalled {
+    VkCommandBuffer cmdbuf;
+    VkFence fence;
+    VkSemaphore wait;
+    VkSemaphore signal;
+  };
+
+  /* Reads what came in and serves the request once it is whole. Returns
+   * false once the client is gone. */
+  bool receive(Client &client);
+  bool serve(Client &client);
+
+  DaemonReply registerBuffer(Client &client, const DaemonRequest &request,
+                             int fd);
+  DaemonReply release(Client &client, const DaemonRequest &request);
+
+  /* Scan, Reduce and Sort. If the work times out, it keeps the semaphores
+   * (which the work still uses) and sets them to VK_NULL_HANDLE. */
+  DaemonReply runPrimitive(Client &client, const DaemonRequest &request,
+                           VkSemaphore &wait, VkSemaphore &signal);
+
+  /* Frees what the stalled work which has finished since used. */
+  void retireStalled();
+
+  /* Null if request doesn't refer to a buffer of the client, or to more
+   * than it holds. */
+  Buffer *findBuffer(Client &client, const DaemonBuffer &buffer) const;
+  BufferRange rangeOf(Client &client, const DaemonBuffer &buffer) const;
+
+  /* Only once no stalled work may use it. */
+  void freeBuffer(Buffer &buffer);
+  void disconnect(Client &client);
+
+  DeviceScan mScan;
+  DeviceRadixSort mSort;
+
+  /* Where in-place scans and reduces write, and the scratch of sorts. */
+  DeviceBuffer mScratch;
+  DeviceBuffer mScratchAlt;
+  StagingBuffer mTotal;
+
+  int mListener = -1;
+  volatile sig_atomic_t mStopping = 0;
+  std::vector<std::unique_ptr<Client>> mClients;
+
+  /* In the order submitted, and buffers released while there was any. */
+  std::vector<Stalled> mStalled;
+  std::vector<Buffer> mOrphans;
+};
+
+} /* namespace vub */
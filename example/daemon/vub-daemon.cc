@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <string>
+#include "helper.h"
+#include "daemon.h"
+
+/* Serves vub primitives to other processes on this machine (see
+ * vub::Daemon and vub::DaemonClient), on a device which is made once and
+ * stays warm. Clients using Primitives pick it up on their own when it
+ * listens at the default socket:
+ *   vub-daemon &
+ *   VUB_DAEMON_SOCKET=/run/vub.sock vub-daemon --max-elements 67108864
+ *
+ * SIGINT and SIGTERM stop it, after which it saves the pipeline cache and
+ * removes the socket. */
+
+struct DaemonOptions {
+  std::string socketPath = vub::getDefaultDaemonSocketPath();
+  uint32 maxElements = 1 << 24;
+  uint32 timeoutMs = 10000;
+};
+
+static vub::Daemon *gDaemon = nullptr;
+
+static void
+printUsage(const char *program)
+{
+  fprintf(stderr, "usage: %s [--socket PATH] [--max-elements N] "
+                  "[--timeout-ms N]\n", program);
+}
+
+static DaemonOptions
+parseOptions(int argc, char **argv)
+{
+  DaemonOptions options;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    bool hasValue = i + 1 < argc;
+
+    if (!strcmp(argv[i], "--socket") && hasValue)
+    {
+      options.socketPath = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--max-elements") && hasValue)
+    {
+      options.maxElements = (uint32)strtoul(argv[++i], nullptr, 0);
+    }
+    else if (!strcmp(argv[i], "--timeout-ms") && hasValue)
+    {
+      options.timeoutMs = (uint32)strtoul(argv[++i], nullptr, 0);
+    }
+    else
+    {
+      printUsage(argv[0]);
+      exit(1);
+    }
+  }
+
+  return options;
+}
+
+static void
+handleStopSignal(int signal)
+{
+  (void)signal;
+
+  if (gDaemon)
+    gDaemon->stop();
+}
+
+int main(int argc, char **argv)
+{
+  DaemonOptions options = parseOptions(argc, argv);
+
+  vub::Daemon daemon = vub::Daemon::make(options.socketPath,
+                                         options.maxElements,
+                                         options.timeoutMs);
+  gDaemon = &daemon;
+
+  /* Without SA_RESTART, so that the daemon's wait for clients returns. */
+  struct sigaction action = {};
+  action.sa_handler = handleStopSignal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  fprintf(stderr, "%s: serving up to %u elements at %s\n",
+          daemon.gpu->getDeviceName(), options.maxElements,
+          options.socketPath.c_str());
+
+  daemon.run();
+  daemon.shutdown();
+
+  return 0;
+}
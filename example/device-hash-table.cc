@@ -0,0 +1,331 @@
+#include "device-hash-table.h"
+
+#include <cassert>
+#include <cstddef>
+#include <algorithm>
+#include "helper.h"
+#include "memory-tracker.h"
+#include "profiler.h"
+#include "prefix-sum.h"
+#include "hash-table.h"
+
+using namespace HashTable;
+using namespace PrefixSum;
+
+namespace vub {
+
+/* Workgroups of the extract loop over the slots, so there is no need for
+ * more of them than the device can keep busy. */
+static const uint32 MAX_EXTRACT_GROUPS = 2048;
+
+/* Makes a transfer visible to the shaders after it. */
+static void
+recordTransferBarrier(VkCommandBuffer cmdbuf)
+{
+  VkMemoryBarrier barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT
+  };
+
+  recordPipelineBarrier(cmdbuf,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                        &barrier);
+}
+
+DeviceHashTable
+DeviceHashTable::make(const GPUDevice &gpu,
+                      uint32 maxKeys,
+                      HashKey keyType,
+                      float loadFactor)
+{
+  MemoryScope memoryScope(gpu, "DeviceHashTable");
+
+  assert(loadFactor > 0.0f && loadFactor < 1.0f);
+
+  uint64 minCapacity = (uint64)((double)std::max(maxKeys, 1u) / loadFactor);
+
+  uint64 capacity = 1;
+  while (capacity < minCapacity)
+    capacity *= 2;
+
+  if (capacity > (1ull << 31))
+  {
+    printf("Hash table of %u keys needs too many slots\n", maxKeys);
+    PANIC_AND_EXIT("Hash table capacity is too large");
+  }
+
+  bool key64 = keyType == HashKey::Uint64;
+
+  DeviceHashTable ret = {};
+
+  /* Header, slot keys and slot values, then keys, values, output and
+   * parameters. */
+  ret.access = Kernel::make(gpu, key64 ? "hash-table-64" : "hash-table", 7,
+                            sizeof(HashTablePushConstant));
+
+  /* Header, slot keys and slot values, then keys and values out. */
+  ret.extractEntries = Kernel::make(
+    gpu, key64 ? "hash-table-extract-64" : "hash-table-extract", 5,
+    sizeof(HashTablePushConstant));
+
+  ret.keyType = keyType;
+  ret.capacity = (uint32)capacity;
+  ret.indirect = IndirectDispatch::make(gpu);
+  ret.indirectParams = gpu.makeDeviceBuffer(SCAN_PARAMS_STRIDE);
+  ret.mDev = &gpu;
+
+  ret.storage = gpu.makeDeviceBuffer(
+    HASH_REGION_ALIGNMENT +
+    roundUp<uint64>(ret.keyBytes(), HASH_REGION_ALIGNMENT) +
+    capacity * sizeof(uint32));
+
+  return ret;
+}
+
+uint64
+DeviceHashTable::keyBytes() const
+{
+  uint32 words = keyType == HashKey::Uint64 ?
+    HASH_KEY64_WORDS : HASH_KEY32_WORDS;
+  return (uint64)capacity * words * sizeof(uint32);
+}
+
+BufferRange
+DeviceHashTable::header() const
+{
+  return storage.range(0, sizeof(HashTableHeader));
+}
+
+BufferRange
+DeviceHashTable::slotKeys() const
+{
+  return storage.range(HASH_REGION_ALIGNMENT, keyBytes());
+}
+
+BufferRange
+DeviceHashTable::slotValues() const
+{
+  return storage.range(
+    HASH_REGION_ALIGNMENT +
+    roundUp<uint64>(keyBytes(), HASH_REGION_ALIGNMENT),
+    (uint64)capacity * sizeof(uint32));
+}
+
+IndirectCount
+DeviceHashTable::entryCount() const
+{
+  return { header() };
+}
+
+uint32
+DeviceHashTable::identity(HashAggregate op)
+{
+  return op == HashAggregate::Min ? 0xFFFFFFFF : 0;
+}
+
+uint32
+DeviceHashTable::hashOp(HashAggregate op)
+{
+  uint32 ops[] = { HASH_OP_SUM, HASH_OP_MIN, HASH_OP_MAX, HASH_OP_COUNT };
+  return ops[(int)op];
+}
+
+void
+DeviceHashTable::clear(VkCommandBuffer cmdbuf, uint32 initialValue) const
+{
+  /* Previous calls may still be using the table. */
+  recordEntryBarrier(cmdbuf);
+
+  BufferRange keys = slotKeys();
+  BufferRange values = slotValues();
+
+  vkCmdFillBuffer(cmdbuf, storage.hdl, 0, sizeof(HashTableHeader), 0);
+  vkCmdFillBuffer(cmdbuf, keys.hdl, keys.offset, keys.size, HASH_EMPTY);
+  vkCmdFillBuffer(cmdbuf, values.hdl, values.offset, values.size,
+                  initialValue);
+
+  recordExitBarrier(cmdbuf);
+}
+
+void
+DeviceHashTable::record(VkCommandBuffer cmdbuf,
+                        const BufferRange &keys,
+                        const BufferRange &values,
+                        const BufferRange &output,
+                        uint32 numElements,
+                        uint32 op) const
+{
+  HashTablePushConstant pushConstant = {
+    .numElements = numElements,
+    .capacityMask = capacity - 1,
+    .op = op,
+    .flags = 0
+  };
+
+  BufferRange params = indirectParams.range(0, SCAN_PARAMS_STRIDE);
+
+  BufferRange buffers[] = {
+    header(), slotKeys(), slotValues(), keys, values, output, params
+  };
+
+  /* The keys may have just been written, and previous calls may still be
+   * using the table. */
+  recordEntryBarrier(cmdbuf);
+
+  if (numElements == SCAN_INDIRECT_COUNT)
+  {
+    access.dispatchIndirect(cmdbuf, buffers, &pushConstant, params);
+  }
+  else
+  {
+    access.dispatch(cmdbuf, buffers, &pushConstant,
+                    (numElements + HASH_THREADS_PER_BLOCK - 1) /
+                    HASH_THREADS_PER_BLOCK);
+  }
+
+  recordExitBarrier(cmdbuf);
+}
+
+void
+DeviceHashTable::recordParams(VkCommandBuffer cmdbuf,
+                              const BufferRange &keys,
+                              const IndirectCount &count) const
+{
+  uint64 keySize = keyType == HashKey::Uint64 ? 8 : 4;
+  uint32 maxKeys = (uint32)std::min<uint64>(keys.size / keySize,
+                                            SCAN_INDIRECT_COUNT - 1);
+
+  indirect.record(cmdbuf, count, indirectParams.range(0, SCAN_PARAMS_STRIDE),
+                  HASH_THREADS_PER_BLOCK, maxKeys);
+}
+
+void
+DeviceHashTable::build(VkCommandBuffer cmdbuf,
+                       const BufferRange &keys,
+                       const BufferRange &values,
+                       uint32 numElements) const
+{
+  if (numElements == 0)
+    return;
+
+  ProfileScope profile(*mDev, cmdbuf, "DeviceHashTable::build");
+
+  /* Nothing is written to the output; it just needs a binding. */
+  record(cmdbuf, keys, values, slotValues(), numElements, HASH_OP_INSERT);
+}
+
+void
+DeviceHashTable::build(VkCommandBuffer cmdbuf,
+                       const BufferRange &keys,
+                       const BufferRange &values,
+                       const IndirectCount &count) const
+{
+  ProfileScope profile(*mDev, cmdbuf, "DeviceHashTable::build (indirect)");
+
+  recordParams(cmdbuf, keys, count);
+  record(cmdbuf, keys, values, slotValues(), SCAN_INDIRECT_COUNT,
+         HASH_OP_INSERT);
+}
+
+void
+DeviceHashTable::probe(VkCommandBuffer cmdbuf,
+                       const BufferRange &keys,
+                       uint32 numElements,
+                       const BufferRange &valuesOut) const
+{
+  if (numElements == 0)
+    return;
+
+  ProfileScope profile(*mDev, cmdbuf, "DeviceHashTable::probe");
+
+  /* Values are unused, but still need a binding. */
+  record(cmdbuf, keys, slotValues(), valuesOut, numElements, HASH_OP_PROBE);
+}
+
+void
+DeviceHashTable::probe(VkCommandBuffer cmdbuf,
+                       const BufferRange &keys,
+                       const IndirectCount &count,
+                       const BufferRange &valuesOut) const
+{
+  ProfileScope profile(*mDev, cmdbuf, "DeviceHashTable::probe (indirect)");
+
+  recordParams(cmdbuf, keys, count);
+  record(cmdbuf, keys, slotValues(), valuesOut, SCAN_INDIRECT_COUNT,
+         HASH_OP_PROBE);
+}
+
+void
+DeviceHashTable::aggregate(VkCommandBuffer cmdbuf,
+                           const BufferRange &keys,
+                           const BufferRange &values,
+                           uint32 numElements,
+                           HashAggregate op) const
+{
+  if (numElements == 0)
+    return;
+
+  ProfileScope profile(*mDev, cmdbuf, "DeviceHashTable::aggregate");
+
+  BufferRange valueRange = op == HashAggregate::Count ? slotValues() : values;
+  record(cmdbuf, keys, valueRange, slotValues(), numElements, hashOp(op));
+}
+
+void
+DeviceHashTable::aggregate(VkCommandBuffer cmdbuf,
+                           const BufferRange &keys,
+                           const BufferRange &values,
+                           const IndirectCount &count,
+                           HashAggregate op) const
+{
+  ProfileScope profile(*mDev, cmdbuf,
+                       "DeviceHashTable::aggregate (indirect)");
+
+  recordParams(cmdbuf, keys, count);
+
+  BufferRange valueRange = op == HashAggregate::Count ? slotValues() : values;
+  record(cmdbuf, keys, valueRange, slotValues(), SCAN_INDIRECT_COUNT,
+         hashOp(op));
+}
+
+void
+DeviceHashTable::extract(VkCommandBuffer cmdbuf,
+                         const BufferRange &keysOut,
+                         const BufferRange &valuesOut) const
+{
+  ProfileScope profile(*mDev, cmdbuf, "DeviceHashTable::extract",
+                       keyBytes() + (uint64)capacity * sizeof(uint32));
+
+  recordEntryBarrier(cmdbuf);
+
+  vkCmdFillBuffer(cmdbuf, storage.hdl, offsetof(HashTableHeader, count),
+                  sizeof(uint32), 0);
+  recordTransferBarrier(cmdbuf);
+
+  HashTablePushConstant pushConstant = {
+    .numElements = capacity,
+    .capacityMask = capacity - 1,
+    .op = 0,
+    .flags = 0
+  };
+
+  BufferRange buffers[] = {
+    header(), slotKeys(), slotValues(), keysOut, valuesOut
+  };
+
+  extractEntries.dispatch(cmdbuf, buffers, &pushConstant,
+                          std::min(MAX_EXTRACT_GROUPS,
+                                   (capacity + HASH_THREADS_PER_BLOCK - 1) /
+                                   HASH_THREADS_PER_BLOCK));
+
+  /* Fills in the dispatch in front of the count. */
+  indirect.record(cmdbuf, entryCount(), header(),
+                  HASH_THREADS_PER_BLOCK, capacity);
+
+  /* The header may be copied back too. */
+  recordExitBarrier(cmdbuf);
+}
+
+} /* namespace vub */
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "kernel.h"
+#include "gpu-device.h"
+#include "indirect-dispatch.h"
+
+namespace vub {
+
+enum class HashKey {
+  /* Any key but 0xFFFFFFFF. */
+  Uint32,
+  /* Pairs of uint32, low half first. */
+  Uint64
+};
+
+/* How values of the same key combine in DeviceHashTable::aggregate. */
+enum class HashAggregate {
+  Sum,
+  Min,
+  Max,
+  Count
+};
+
+/* Open-addressing hash table with linear probing, living in one
+ * DeviceBuffer: a header, the keys of the slots and a uint32 value per
+ * slot. The capacity is the power of two which keeps maxKeys keys under
+ * the load factor.
+ *
+ * Group-bys aggregate their keys into it and extract the groups; hash
+ * joins build it out of one side (with row IDs as values) and probe it
+ * with the other. Every call handles a batch of keys with one dispatch and
+ * nothing goes back to the host, so whether a batch overflowed the table
+ * is only known from the header. Batches whose size is only known on the
+ * device (see IndirectCount) are dispatched indirectly. */
+struct DeviceHashTable {
+  Kernel access;
+  Kernel extractEntries;
+
+  DeviceBuffer storage;
+  HashKey keyType;
+  uint32 capacity;
+
+  /* Writes the parameter block of the calls over an IndirectCount, which
+   * therefore run one after the other. */
+  IndirectDispatch indirect;
+  DeviceBuffer indirectParams;
+
+  static DeviceHashTable make(const GPUDevice &gpu,
+                              uint32 maxKeys,
+                              HashKey keyType = HashKey::Uint32,
+                              float loadFactor = 0.5f);
+
+  /* Empties the table and sets every value to initialValue, which for
+   * aggregates has to be identity(op). */
+  void clear(VkCommandBuffer cmdbuf, uint32 initialValue = 0) const;
+
+  static uint32 identity(HashAggregate op);
+
+  /* Inserts numElements keys with their values. A key which is already in
+   * the table keeps the value it has. */
+  void build(VkCommandBuffer cmdbuf,
+             const BufferRange &keys,
+             const BufferRange &values,
+             uint32 numElements) const;
+
+  /* Same with as many keys as count holds, at most as many as fit in
+   * keys. The same goes for the other calls over an IndirectCount. */
+  void build(VkCommandBuffer cmdbuf,
+             const BufferRange &keys,
+             const BufferRange &values,
+             const IndirectCount &count) const;
+
+  /* Writes the value of every key, or HASH_NOT_FOUND (0xFFFFFFFF) for keys
+   * not in the table, to valuesOut. */
+  void probe(VkCommandBuffer cmdbuf,
+             const BufferRange &keys,
+             uint32 numElements,
+             const BufferRange &valuesOut) const;
+  void probe(VkCommandBuffer cmdbuf,
+             const BufferRange &keys,
+             const IndirectCount &count,
+             const BufferRange &valuesOut) const;
+
+  /* Inserts the keys which aren't in the table yet and combines the values
+   * into theirs. With HashAggregate::Count, values is unused (and may be
+   * empty). */
+  void aggregate(VkCommandBuffer cmdbuf,
+                 const BufferRange &keys,
+                 const BufferRange &values,
+                 uint32 numElements,
+                 HashAggregate op) const;
+  void aggregate(VkCommandBuffer cmdbuf,
+                 const BufferRange &keys,
+                 const BufferRange &values,
+                 const IndirectCount &count,
+                 HashAggregate op) const;
+
+  /* Writes every key in the table and its value to keysOut and valuesOut,
+   * which hold up to capacity entries, in no particular order. The number
+   * of entries goes to the header, along with a dispatch of one thread
+   * (HASH_THREADS_PER_BLOCK per workgroup) per entry. */
+  void extract(VkCommandBuffer cmdbuf,
+               const BufferRange &keysOut,
+               const BufferRange &valuesOut) const;
+
+  /* HashTableHeader: the entry count of the last extract and whether any
+   * insert found the table full. */
+  BufferRange header() const;
+
+  /* The entry count of the last extract, for primitives which work on the
+   * extracted entries. */
+  IndirectCount entryCount() const;
+
+private:
+  /* numElements is SCAN_INDIRECT_COUNT for the calls over an
+   * IndirectCount, which then have their parameter block written
+   * already. */
+  void record(VkCommandBuffer cmdbuf,
+              const BufferRange &keys,
+              const BufferRange &values,
+              const BufferRange &output,
+              uint32 numElements,
+              uint32 op) const;
+
+  /* Writes the parameter block of a call over count keys. */
+  void recordParams(VkCommandBuffer cmdbuf,
+                    const BufferRange &keys,
+                    const IndirectCount &count) const;
+
+  static uint32 hashOp(HashAggregate op);
+
+  uint64 keyBytes() const;
+
+  BufferRange slotKeys() const;
+  BufferRange slotValues() const;
+
+  const GPUDevice *mDev = nullptr;
+};
+
+} /* namespace vub */
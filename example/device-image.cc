@@ -0,0 +1,407 @@
+#include "device-image.h"
+
+#include <algorithm>
+#include <cassert>
+#include "helper.h"
+#include "memory-tracker.h"
+#include "profiler.h"
+#include "scratch-allocator.h"
+#include "image-scan.h"
+#include "image-reduce.h"
+
+using namespace ImageScan;
+using namespace ImageReduce;
+
+namespace vub {
+
+/* Parts of the temp storage start on multiples of this, since they get
+ * bound through descriptors. */
+static const uint64 TEMP_STORAGE_ALIGNMENT = 256;
+
+static uint32
+tileCount(uint32 size, uint32 tile)
+{
+  return (size + tile - 1) / tile;
+}
+
+static uint64
+imageBytes(uint32 width, uint32 height)
+{
+  return roundUp<uint64>((uint64)width * height * sizeof(uint32),
+                         TEMP_STORAGE_ALIGNMENT);
+}
+
+/* Makes a transfer visible to the shaders after it. */
+static void
+recordTransferBarrier(VkCommandBuffer cmdbuf)
+{
+  VkMemoryBarrier barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT
+  };
+
+  recordPipelineBarrier(cmdbuf,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                        &barrier);
+}
+
+void
+recordImageCopy(VkCommandBuffer cmdbuf,
+                const DeviceImage &image,
+                VkImageLayout layout,
+                const BufferRange &dst)
+{
+  assert(dst.size >= (uint64)image.extent.width * image.extent.height *
+                     sizeof(uint32));
+
+  /* The image may have just been rendered to or written by a shader, and
+   * a previous call may still be reading dst. */
+  VkMemoryBarrier barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT
+  };
+
+  recordPipelineBarrier(cmdbuf,
+                        VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        &barrier);
+
+  VkBufferImageCopy region = {
+    .bufferOffset = dst.offset,
+    .bufferRowLength = 0,
+    .bufferImageHeight = 0,
+    .imageSubresource = {
+      .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .mipLevel = 0,
+      .baseArrayLayer = 0,
+      .layerCount = 1
+    },
+    .imageOffset = { 0, 0, 0 },
+    .imageExtent = { image.extent.width, image.extent.height, 1 }
+  };
+
+  vkCmdCopyImageToBuffer(cmdbuf, image.image, layout, dst.hdl, 1, &region);
+  recordTransferBarrier(cmdbuf);
+}
+
+/* Where the parts of the temp storage of a table of width x height
+ * elements go: the transposed scan of the rows, the sums of the tiles of
+ * both passes and the copy of the image, if it is made from one. */
+struct TempStorageLayout {
+  uint64 transposed;
+  uint64 tileSums;
+  uint64 image;
+  uint64 size;
+};
+
+static TempStorageLayout
+tempStorageLayout(uint32 width, uint32 height, bool fromImage)
+{
+  uint64 sumCount = std::max(
+    (uint64)height * tileCount(width, IMAGE_SCAN_TILE),
+    (uint64)width * tileCount(height, IMAGE_SCAN_TILE));
+
+  TempStorageLayout ret = {};
+  ret.transposed = 0;
+  ret.tileSums = imageBytes(width, height);
+  ret.image = ret.tileSums + roundUp<uint64>(sumCount * sizeof(uint32),
+                                             TEMP_STORAGE_ALIGNMENT);
+  ret.size = ret.image + (fromImage ? imageBytes(width, height) : 0);
+  return ret;
+}
+
+DeviceImageScan
+DeviceImageScan::make(const GPUDevice &gpu,
+                      uint32 maxWidth,
+                      uint32 maxHeight,
+                      ImageElementType type)
+{
+  MemoryScope memoryScope(gpu, "DeviceImageScan");
+
+  DeviceImageScan ret = {};
+
+  /* Input, output and tile sums. */
+  ret.scan = Kernel::make(gpu,
+                          type == ImageElementType::Float32 ?
+                            "image-scan-float" : "image-scan",
+                          3, sizeof(ImageScanPushConstant));
+
+  ret.type = type;
+  ret.maxWidth = maxWidth;
+  ret.maxHeight = maxHeight;
+  ret.mDev = &gpu;
+
+  return ret;
+}
+
+uint64
+DeviceImageScan::tempStorageBytes(uint32 width, uint32 height,
+                                  bool fromImage)
+{
+  return tempStorageLayout(width, height, fromImage).size;
+}
+
+void
+DeviceImageScan::record(VkCommandBuffer cmdbuf,
+                        const BufferRange &input,
+                        uint32 inPitch,
+                        const BufferRange &output,
+                        uint32 outPitch,
+                        uint32 width,
+                        uint32 height,
+                        const BufferRange &tempStorage) const
+{
+  assert(width <= maxWidth && height <= maxHeight);
+  assert(inPitch >= width && outPitch >= width);
+
+  if (width == 0 || height == 0)
+    return;
+
+  /* Three reads and a write per pass. */
+  ProfileScope profile(*mDev, cmdbuf, "DeviceImageScan",
+                       8 * (uint64)width * height * sizeof(uint32));
+
+  TempStorageLayout layout = tempStorageLayout(width, height, false);
+  ScratchScope temp(*mDev, tempStorage, layout.size);
+
+  BufferRange transposed = temp.range.range(
+    layout.transposed, (uint64)width * height * sizeof(uint32));
+  BufferRange tileSums = temp.range.range(
+    layout.tileSums, layout.image - layout.tileSums);
+
+  /* The input may have just been written. */
+  recordEntryBarrier(cmdbuf);
+
+  /* The rows, into width rows of height elements... */
+  recordPass(cmdbuf, input, inPitch, transposed, height,
+             width, height, tileSums);
+
+  /* ...and those, which were the columns, back. */
+  recordPass(cmdbuf, transposed, height, output, outPitch,
+             height, width, tileSums);
+}
+
+void
+DeviceImageScan::record(VkCommandBuffer cmdbuf,
+                        const DeviceImage &image,
+                        VkImageLayout layout,
+                        const BufferRange &output,
+                        uint32 outPitch,
+                        const BufferRange &tempStorage) const
+{
+  uint32 width = image.extent.width;
+  uint32 height = image.extent.height;
+
+  /* The copy goes at the end, where record won't look for its own temp
+   * storage. */
+  TempStorageLayout tempLayout = tempStorageLayout(width, height, true);
+  ScratchScope temp(*mDev, tempStorage, tempLayout.size);
+
+  BufferRange copy = temp.range.range(tempLayout.image,
+                                      imageBytes(width, height));
+
+  recordImageCopy(cmdbuf, image, layout, copy);
+  record(cmdbuf, copy, width, output, outPitch, width, height,
+         temp.range.range(0, tempLayout.image));
+}
+
+void
+DeviceImageScan::recordPass(VkCommandBuffer cmdbuf,
+                            const BufferRange &input,
+                            uint32 inPitch,
+                            const BufferRange &output,
+                            uint32 outPitch,
+                            uint32 width,
+                            uint32 height,
+                            const BufferRange &tileSums) const
+{
+  uint32 tiles = tileCount(width, IMAGE_SCAN_TILE) *
+                 tileCount(height, IMAGE_SCAN_TILE);
+
+  ImageScanPushConstant pushConstant = {
+    .width = width,
+    .height = height,
+    .inPitch = inPitch,
+    .outPitch = outPitch,
+    .pass = IMAGE_SCAN_PASS_REDUCE
+  };
+
+  BufferRange buffers[] = { input, output, tileSums };
+
+  scan.dispatch(cmdbuf, buffers, &pushConstant, tiles);
+  recordComputeBarrier(cmdbuf);
+
+  pushConstant.pass = IMAGE_SCAN_PASS_CARRY;
+  scan.dispatch(cmdbuf, buffers, &pushConstant,
+                tileCount(height, IMAGE_SCAN_THREADS_PER_BLOCK));
+  recordComputeBarrier(cmdbuf);
+
+  pushConstant.pass = IMAGE_SCAN_PASS_DOWNSWEEP;
+  scan.dispatch(cmdbuf, buffers, &pushConstant, tiles);
+  recordComputeBarrier(cmdbuf);
+}
+
+static uint32
+levelSize(uint32 size, uint32 level)
+{
+  return (uint32)(((uint64)size + (1ull << level) - 1) >> level);
+}
+
+/* Texels of levels 1 to level-1 of the pyramid, which is where level
+ * starts in it. */
+static uint64
+levelOffset(uint32 width, uint32 height, uint32 level)
+{
+  uint64 offset = 0;
+  for (uint32 below = 1; below < level; ++below)
+    offset += (uint64)levelSize(width, below) * levelSize(height, below);
+
+  return offset;
+}
+
+DeviceImageReduce
+DeviceImageReduce::make(const GPUDevice &gpu,
+                        uint32 maxWidth,
+                        uint32 maxHeight,
+                        ImageElementType type)
+{
+  MemoryScope memoryScope(gpu, "DeviceImageReduce");
+
+  uint32 levelCount = getLevelCount(maxWidth, maxHeight);
+
+  DeviceImageReduce ret = {};
+
+  /* Input, pyramid, result and histogram. */
+  ret.reduce = Kernel::make(gpu, "image-reduce", 4,
+                            sizeof(ImageReducePushConstant));
+
+  ret.pyramid = gpu.makeDeviceBuffer(
+    levelOffset(maxWidth, maxHeight, levelCount + 1) * sizeof(ImageStats));
+  ret.result = gpu.makeDeviceBuffer(sizeof(ImageReduceResult));
+  ret.histogram = gpu.makeDeviceBuffer(IMAGE_REDUCE_MAX_BINS *
+                                       sizeof(uint32));
+
+  ret.type = type;
+  ret.maxWidth = maxWidth;
+  ret.maxHeight = maxHeight;
+  ret.mDev = &gpu;
+
+  return ret;
+}
+
+uint32
+DeviceImageReduce::getLevelCount(uint32 width, uint32 height)
+{
+  uint32 level = IMAGE_REDUCE_TILE_LEVELS;
+  while (levelSize(width, level) > 1 || levelSize(height, level) > 1)
+    ++level;
+
+  return level;
+}
+
+uint64
+DeviceImageReduce::tempStorageBytes(uint32 width, uint32 height)
+{
+  return imageBytes(width, height);
+}
+
+void
+DeviceImageReduce::record(VkCommandBuffer cmdbuf,
+                          const BufferRange &input,
+                          uint32 pitch,
+                          uint32 width,
+                          uint32 height,
+                          const ImageHistogram &bins) const
+{
+  assert(width <= maxWidth && height <= maxHeight && pitch >= width);
+  assert(bins.binCount <= IMAGE_REDUCE_MAX_BINS);
+
+  if (width == 0 || height == 0)
+    return;
+
+  /* Every value would be a NaN bin position. */
+  if (bins.binCount > 0 && !(bins.high > bins.low))
+  {
+    printf("Histogram range [%f, %f] is empty\n", bins.low, bins.high);
+    PANIC_AND_EXIT("Invalid ImageHistogram");
+  }
+
+  ProfileScope profile(*mDev, cmdbuf, "DeviceImageReduce",
+                       (uint64)width * height * sizeof(uint32));
+
+  /* A previous call may still be using the results, and the input may
+   * have just been written. */
+  recordEntryBarrier(cmdbuf);
+
+  vkCmdFillBuffer(cmdbuf, result.hdl, 0, sizeof(ImageReduceResult), 0);
+  vkCmdFillBuffer(cmdbuf, histogram.hdl, 0, histogram.size, 0);
+  recordTransferBarrier(cmdbuf);
+
+  uint32 flags = type == ImageElementType::Uint32 ?
+    (uint32)IMAGE_REDUCE_FLAG_UINT : 0u;
+  if (bins.log2)
+    flags |= IMAGE_REDUCE_FLAG_LOG2_HISTOGRAM;
+
+  ImageReducePushConstant pushConstant = {
+    .width = width,
+    .height = height,
+    .pitch = pitch,
+    .flags = flags,
+    .binCount = bins.binCount,
+    .histogramMin = bins.low,
+    .histogramMax = bins.high
+  };
+
+  BufferRange buffers[] = {
+    input, pyramid.range(), result.range(), histogram.range()
+  };
+
+  reduce.dispatch(cmdbuf, buffers, &pushConstant,
+                  tileCount(width, IMAGE_REDUCE_TILE) *
+                  tileCount(height, IMAGE_REDUCE_TILE));
+  recordExitBarrier(cmdbuf);
+}
+
+void
+DeviceImageReduce::record(VkCommandBuffer cmdbuf,
+                          const DeviceImage &image,
+                          VkImageLayout layout,
+                          const ImageHistogram &bins,
+                          const BufferRange &tempStorage) const
+{
+  uint32 width = image.extent.width;
+  uint32 height = image.extent.height;
+
+  ScratchScope temp(*mDev, tempStorage, tempStorageBytes(width, height));
+
+  recordImageCopy(cmdbuf, image, layout, temp.range);
+  record(cmdbuf, temp.range, width, width, height, bins);
+}
+
+BufferRange
+DeviceImageReduce::stats() const
+{
+  return result.range(0, sizeof(ImageReduceResult));
+}
+
+BufferRange
+DeviceImageReduce::histogramBins() const
+{
+  return histogram.range();
+}
+
+BufferRange
+DeviceImageReduce::level(uint32 width, uint32 height, uint32 level) const
+{
+  assert(level >= 1 && level <= getLevelCount(width, height));
+
+  uint64 texels = (uint64)levelSize(width, level) * levelSize(height, level);
+
+  return pyramid.range(levelOffset(width, height, level) * sizeof(ImageStats),
+                       texels * sizeof(ImageStats));
+}
+
+} /* namespace vub */
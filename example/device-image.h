@@ -0,0 +1,159 @@
+#pragma once
+
+#include "kernel.h"
+#include "gpu-device.h"
+
+namespace vub {
+
+/* What the elements of a 2D array or image are. Images have to be of a
+ * single 32-bit channel: VK_FORMAT_R32_UINT or VK_FORMAT_R32_SFLOAT. */
+enum class ImageElementType {
+  Uint32,
+  Float32
+};
+
+/* Copies the width x height texels of an image in layout (which has to
+ * allow transfer reads, like TRANSFER_SRC_OPTIMAL or GENERAL) to dst, a
+ * row after the other, and makes them visible to the shaders after it.
+ * This is how the image primitives read images, since vub kernels only
+ * bind buffers. */
+void recordImageCopy(VkCommandBuffer cmdbuf,
+                     const DeviceImage &image,
+                     VkImageLayout layout,
+                     const BufferRange &dst);
+
+/* Summed-area tables: every element of the output is the sum of the
+ * elements of the input above and to the left of it, itself included, so
+ * the sum over any rectangle (a box filter) takes four reads.
+ *
+ * A pass of image-scan.comp scans the rows of the input and writes them
+ * transposed through shared memory, and a second one does the same with
+ * what the first wrote, which scans the columns and puts the table back
+ * in the layout of the input. Each goes through the input three times: to
+ * sum the rows of every tile, to scan those sums and to scan the tiles.
+ *
+ * Float tables lose precision as the sums grow, a box filter over a large
+ * float image is better off subtracting the mean first. The transposed
+ * array and the tile sums live in temp storage. */
+struct DeviceImageScan {
+  Kernel scan;
+  ImageElementType type;
+  uint32 maxWidth;
+  uint32 maxHeight;
+
+  static DeviceImageScan make(const GPUDevice &gpu,
+                              uint32 maxWidth,
+                              uint32 maxHeight,
+                              ImageElementType type =
+                                ImageElementType::Uint32);
+
+  /* Bytes of tempStorage a table of width x height elements needs, also
+   * for a copy of the image if it is made from one. */
+  static uint64 tempStorageBytes(uint32 width, uint32 height,
+                                 bool fromImage = false);
+
+  /* Pitches are in elements from the start of one row to the next. The
+   * output can't be the input. */
+  void record(VkCommandBuffer cmdbuf,
+              const BufferRange &input,
+              uint32 inPitch,
+              const BufferRange &output,
+              uint32 outPitch,
+              uint32 width,
+              uint32 height,
+              const BufferRange &tempStorage = {}) const;
+
+  /* Same over the whole image, in layout (see recordImageCopy). */
+  void record(VkCommandBuffer cmdbuf,
+              const DeviceImage &image,
+              VkImageLayout layout,
+              const BufferRange &output,
+              uint32 outPitch,
+              const BufferRange &tempStorage = {}) const;
+
+private:
+  /* One scan of the rows of input into the columns of output. */
+  void recordPass(VkCommandBuffer cmdbuf,
+                  const BufferRange &input,
+                  uint32 inPitch,
+                  const BufferRange &output,
+                  uint32 outPitch,
+                  uint32 width,
+                  uint32 height,
+                  const BufferRange &tileSums) const;
+
+  const GPUDevice *mDev = nullptr;
+};
+
+/* Bins of the histogram of a DeviceImageReduce, binCount of them (at most
+ * IMAGE_REDUCE_MAX_BINS) spread evenly over [low, high], with high above
+ * low. NaNs go to the first bin. With log2, values are binned by their log2
+ * and low and high are log2s too, which is what auto exposure wants out of
+ * luminances. */
+struct ImageHistogram {
+  uint32 binCount = 0;
+  float low = 0.0f;
+  float high = 1.0f;
+  bool log2 = false;
+};
+
+/* Minimum, maximum, sum and mean of a 2D array or image, along with a
+ * histogram and a pyramid of the same statistics over every 2x2, 4x4, ...
+ * block, all in one dispatch (see image-reduce.comp).
+ *
+ * Level k of the pyramid is ceil(width / 2^k) x ceil(height / 2^k)
+ * ImageReduce::ImageStats. The results stay in the buffers of the reduce
+ * until the next call, which therefore run one after the other. */
+struct DeviceImageReduce {
+  Kernel reduce;
+
+  /* Levels 1 and up, packed. */
+  DeviceBuffer pyramid;
+  /* An ImageReduce::ImageReduceResult. */
+  DeviceBuffer result;
+  /* IMAGE_REDUCE_MAX_BINS uint32 counts. */
+  DeviceBuffer histogram;
+
+  ImageElementType type;
+  uint32 maxWidth;
+  uint32 maxHeight;
+
+  static DeviceImageReduce make(const GPUDevice &gpu,
+                                uint32 maxWidth,
+                                uint32 maxHeight,
+                                ImageElementType type =
+                                  ImageElementType::Float32);
+
+  /* Levels of the pyramid of a width x height array, which has at least
+   * the 5 a workgroup reduces a tile through, and ends at 1x1. */
+  static uint32 getLevelCount(uint32 width, uint32 height);
+
+  /* Bytes of tempStorage a reduce of an image of that extent needs. */
+  static uint64 tempStorageBytes(uint32 width, uint32 height);
+
+  void record(VkCommandBuffer cmdbuf,
+              const BufferRange &input,
+              uint32 pitch,
+              uint32 width,
+              uint32 height,
+              const ImageHistogram &bins = {}) const;
+
+  /* Same over the whole image, in layout (see recordImageCopy). */
+  void record(VkCommandBuffer cmdbuf,
+              const DeviceImage &image,
+              VkImageLayout layout,
+              const ImageHistogram &bins = {},
+              const BufferRange &tempStorage = {}) const;
+
+  BufferRange stats() const;
+  BufferRange histogramBins() const;
+
+  /* Level 1 and up of the pyramid of the last reduce, which was of a
+   * width x height array. */
+  BufferRange level(uint32 width, uint32 height, uint32 level) const;
+
+private:
+  const GPUDevice *mDev = nullptr;
+};
+
+} /* namespace vub */
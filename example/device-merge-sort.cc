@@ -0,0 +1,210 @@
+#include "device-merge-sort.h"
+
+#include <utility>
+#include <algorithm>
+#include "helper.h"
+#include "profiler.h"
+#include "merge-path.h"
+#include "prefix-sum.h"
+#include "shader-compiler.h"
+
+using namespace MergePath;
+
+namespace vub {
+
+DeviceMergeSort
+DeviceMergeSort::make(const GPUDevice &gpu, Comparator comparator)
+{
+  DeviceMergeSort ret = {};
+  ret.comparator = comparator;
+
+  /* Keys in and out, values in and out and parameters. */
+  ret.blockSort = comparator.makeKernel(
+    gpu, "merge-sort-block", "merge-sort-block.comp", {},
+    5, sizeof(MergeSortPushConstant));
+
+  /* Same bindings as DeviceMerge, with the same buffer for a and b, then
+   * the parameters. */
+  ret.mergePass = comparator.makeKernel(
+    gpu, "merge-sort-pass", "merge-path.comp",
+    { { "MERGE_SORT_PASS", "" } }, 7, sizeof(MergeSortPushConstant));
+
+  ret.indirect = IndirectDispatch::make(gpu);
+  ret.indirectParams = gpu.makeDeviceBuffer(SCAN_PARAMS_STRIDE);
+  ret.mDev = &gpu;
+
+  return ret;
+}
+
+void
+DeviceMergeSort::record(VkCommandBuffer cmdbuf,
+                        const BufferRange &keys,
+                        const BufferRange &keysAlt,
+                        const BufferRange *values,
+                        const BufferRange *valuesAlt,
+                        uint32 numElements,
+                        const IndirectCount *count,
+                        bool stable) const
+{
+  /* Sorts over an IndirectCount take as many passes as the most elements
+   * there may be. The passes past the actual count merge a single run,
+   * which copies it, so the result ends up in the same buffer. */
+  bool isIndirect = count != nullptr;
+  uint32 maxElements = isIndirect ?
+    (uint32)std::min<uint64>(keys.size / comparator.keySize,
+                             SCAN_INDIRECT_COUNT - 1) :
+    numElements;
+
+  if (maxElements == 0)
+    return;
+
+  bool hasValues = values != nullptr;
+  uint32 tileCount = (maxElements + MERGE_VALUES_PER_BLOCK - 1) /
+                     MERGE_VALUES_PER_BLOCK;
+
+  uint32 passCount = 0;
+  for (uint64 width = MERGE_VALUES_PER_BLOCK; width < maxElements;
+       width *= 2)
+    ++passCount;
+
+  uint64 elementSize =
+    comparator.keySize + (hasValues ? sizeof(uint32) : 0);
+
+  ProfileScope profile(*mDev, cmdbuf,
+                       isIndirect ? "DeviceMergeSort (indirect)" :
+                                    "DeviceMergeSort",
+                       isIndirect ? 0 :
+                       2 * (uint64)(passCount + 1) * numElements * elementSize);
+
+  /* Unused without SCAN_INDIRECT_COUNT, but still needs a binding. */
+  BufferRange params = indirectParams.range(0, SCAN_PARAMS_STRIDE);
+
+  uint32 flags = 0;
+  if (hasValues)
+    flags |= MERGE_FLAG_VALUES;
+  if (stable)
+    flags |= MERGE_FLAG_STABLE;
+
+  /* Unused by the kernels without values, but they still need a binding. */
+  BufferRange keysIn = keys, keysOut = keysAlt;
+  BufferRange valuesIn = hasValues ? *values : keys;
+  BufferRange valuesOut = hasValues ? *valuesAlt : keysAlt;
+
+  /* The input may have just been written. The parameter block comes with
+   * its own barrier. */
+  if (isIndirect)
+    indirect.record(cmdbuf, *count, params, MERGE_VALUES_PER_BLOCK,
+                    maxElements);
+  else
+    recordEntryBarrier(cmdbuf);
+
+  MergeSortPushConstant pushConstant = {
+    .numElements = isIndirect ? SCAN_INDIRECT_COUNT : numElements,
+    .width = MERGE_VALUES_PER_BLOCK,
+    .flags = flags
+  };
+
+  /* Every pass has the same tiles as the block sort. */
+  auto dispatch = [&] (const Kernel &kernel, const BufferRange *buffers) {
+    if (isIndirect)
+      kernel.dispatchIndirect(cmdbuf, buffers, &pushConstant, params);
+    else
+      kernel.dispatch(cmdbuf, buffers, &pushConstant, tileCount);
+  };
+
+  BufferRange blockBuffers[] = {
+    keysIn, keysOut, valuesIn, valuesOut, params
+  };
+  dispatch(blockSort, blockBuffers);
+
+  std::swap(keysIn, keysOut);
+  std::swap(valuesIn, valuesOut);
+
+  for (uint32 pass = 0; pass < passCount; ++pass)
+  {
+    recordComputeBarrier(cmdbuf);
+
+    BufferRange passBuffers[] = {
+      keysIn, keysIn, keysOut, valuesIn, valuesIn, valuesOut, params
+    };
+
+    dispatch(mergePass, passBuffers);
+    pushConstant.width *= 2;
+
+    std::swap(keysIn, keysOut);
+    std::swap(valuesIn, valuesOut);
+  }
+
+  /* The block sort plus an even number of passes leaves the result in the
+   * scratch. */
+  if (passCount % 2 == 0)
+  {
+    recordComputeBarrier(cmdbuf);
+
+    VkBufferCopy keyRegion = {
+      keysAlt.offset, keys.offset, (uint64)maxElements * comparator.keySize
+    };
+    vkCmdCopyBuffer(cmdbuf, keysAlt.hdl, keys.hdl, 1, &keyRegion);
+
+    if (hasValues)
+    {
+      VkBufferCopy valueRegion = {
+        valuesAlt->offset, values->offset,
+        (uint64)maxElements * sizeof(uint32)
+      };
+      vkCmdCopyBuffer(cmdbuf, valuesAlt->hdl, values->hdl, 1, &valueRegion);
+    }
+  }
+
+  recordExitBarrier(cmdbuf);
+}
+
+void
+DeviceMergeSort::sortKeys(VkCommandBuffer cmdbuf,
+                          const BufferRange &keys,
+                          const BufferRange &keysAlt,
+                          uint32 numElements,
+                          bool stable) const
+{
+  record(cmdbuf, keys, keysAlt, nullptr, nullptr, numElements, nullptr,
+         stable);
+}
+
+void
+DeviceMergeSort::sortKeys(VkCommandBuffer cmdbuf,
+                          const BufferRange &keys,
+                          const BufferRange &keysAlt,
+                          const IndirectCount &count,
+                          bool stable) const
+{
+  record(cmdbuf, keys, keysAlt, nullptr, nullptr, SCAN_INDIRECT_COUNT,
+         &count, stable);
+}
+
+void
+DeviceMergeSort::sortPairs(VkCommandBuffer cmdbuf,
+                           const BufferRange &keys,
+                           const BufferRange &keysAlt,
+                           const BufferRange &values,
+                           const BufferRange &valuesAlt,
+                           uint32 numElements,
+                           bool stable) const
+{
+  record(cmdbuf, keys, keysAlt, &values, &valuesAlt, numElements, nullptr,
+         stable);
+}
+
+void
+DeviceMergeSort::sortPairs(VkCommandBuffer cmdbuf,
+                           const BufferRange &keys,
+                           const BufferRange &keysAlt,
+                           const BufferRange &values,
+                           const BufferRange &valuesAlt,
+                           const IndirectCount &count,
+                           bool stable) const
+{
+  record(cmdbuf, keys, keysAlt, &values, &valuesAlt, SCAN_INDIRECT_COUNT,
+         &count, stable);
+}
+
+} /* namespace vub */
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "kernel.h"
+#include "gpu-device.h"
+#include "device-merge.h"
+#include "indirect-dispatch.h"
+
+namespace vub {
+
+/* Comparison sort for keys radix sort can't handle: composite keys, floats
+ * or any other order a Comparator was compiled for.
+ *
+ * Every tile is first sorted in shared memory (merge-sort-block.comp), then
+ * passes of merge path merges double the length of the sorted runs until
+ * there is one. Merge path splits every pass into tiles of equal work, so
+ * skewed keys take as long as any others. */
+struct DeviceMergeSort {
+  Kernel blockSort;
+  Kernel mergePass;
+  Comparator comparator;
+
+  /* Writes the parameter block of sorts over an IndirectCount, which
+   * therefore run one after the other. */
+  IndirectDispatch indirect;
+  DeviceBuffer indirectParams;
+
+  static DeviceMergeSort make(const GPUDevice &gpu,
+                              Comparator comparator = Comparator::ascending());
+
+  /* Sorts numElements keys. keysAlt is scratch of the same size and the
+   * result ends up in keys. Without stable, keys that compare equal may
+   * come out in any order, which lets tiles be sorted with a bitonic
+   * network. */
+  void sortKeys(VkCommandBuffer cmdbuf,
+                const BufferRange &keys,
+                const BufferRange &keysAlt,
+                uint32 numElements,
+                bool stable = true) const;
+
+  /* Same, moving 32-bit values along with the keys. */
+  void sortPairs(VkCommandBuffer cmdbuf,
+                 const BufferRange &keys,
+                 const BufferRange &keysAlt,
+                 const BufferRange &values,
+                 const BufferRange &valuesAlt,
+                 uint32 numElements,
+                 bool stable = true) const;
+
+  /* Same over as many elements as count holds, at most as many as fit in
+   * keys. Takes as many passes as the most elements there may be, and the
+   * rest of keys (and values) may be overwritten with that of the scratch. */
+  void sortKeys(VkCommandBuffer cmdbuf,
+                const BufferRange &keys,
+                const BufferRange &keysAlt,
+                const IndirectCount &count,
+                bool stable = true) const;
+
+  void sortPairs(VkCommandBuffer cmdbuf,
+                 const BufferRange &keys,
+                 const BufferRange &keysAlt,
+                 const BufferRange &values,
+                 const BufferRange &valuesAlt,
+                 const IndirectCount &count,
+                 bool stable = true) const;
+
+private:
+  /* numElements is SCAN_INDIRECT_COUNT for sorts over count. */
+  void record(VkCommandBuffer cmdbuf,
+              const BufferRange &keys,
+              const BufferRange &keysAlt,
+              const BufferRange *values,
+              const BufferRange *valuesAlt,
+              uint32 numElements,
+              const IndirectCount *count,
+              bool stable) const;
+
+  const GPUDevice *mDev = nullptr;
+};
+
+} /* namespace vub */
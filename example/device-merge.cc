@@ -0,0 +1,94 @@
+#include "device-merge.h"
+
+#include <cassert>
+#include "helper.h"
+#include "profiler.h"
+#include "merge-path.h"
+#include "shader-compiler.h"
+
+using namespace MergePath;
+
+namespace vub {
+
+std::string
+Comparator::shaderName(const char *kernel) const
+{
+  return name ? std::string(kernel) + "-" + name : std::string(kernel);
+}
+
+Kernel
+Comparator::makeKernel(const GPUDevice &gpu, const char *kernel,
+                       const char *sourceName,
+                       std::vector<ShaderDefine> defines,
+                       uint32 bindingCount, uint32 pushConstantSize) const
+{
+  if (!isCustom())
+  {
+    return Kernel::make(gpu, shaderName(kernel).c_str(), bindingCount,
+                        pushConstantSize);
+  }
+
+  /* See merge-comparators.h. */
+  defines.push_back({ "MERGE_COMPARATOR_CUSTOM", "" });
+  defines.push_back({ "MERGE_KEY", key });
+  defines.push_back({ "MERGE_LESS(a, b)", "(" + less + ")" });
+
+  return Kernel::makeVariant(gpu, sourceName, defines, bindingCount,
+                             pushConstantSize);
+}
+
+DeviceMerge
+DeviceMerge::make(const GPUDevice &gpu, Comparator comparator)
+{
+  DeviceMerge ret = {};
+  ret.comparator = comparator;
+
+  /* Keys of a, b and out, then values of a, b and out. */
+  ret.kernel = comparator.makeKernel(gpu, "merge-path", "merge-path.comp", {},
+                                     6, sizeof(MergePushConstant));
+  ret.mDev = &gpu;
+
+  return ret;
+}
+
+void
+DeviceMerge::record(VkCommandBuffer cmdbuf,
+                    const SortedSequence &a,
+                    const SortedSequence &b,
+                    const SortedSequence &out) const
+{
+  bool hasValues = out.values.size > 0;
+  assert(hasValues == (a.values.size > 0) && hasValues == (b.values.size > 0));
+
+  uint32 total = a.count + b.count;
+  if (total == 0)
+    return;
+
+  ProfileScope profile(*mDev, cmdbuf, "DeviceMerge",
+                       2 * (uint64)total *
+                       (comparator.keySize + (hasValues ? sizeof(uint32) : 0)));
+
+  MergePushConstant pushConstant = {
+    .aOffset = a.offset,
+    .aCount = a.count,
+    .bOffset = b.offset,
+    .bCount = b.count,
+    .outOffset = out.offset,
+    .flags = hasValues ? (uint32)MERGE_FLAG_VALUES : 0u
+  };
+
+  /* Unused without values, but they still need a binding. */
+  BufferRange buffers[] = {
+    a.keys, b.keys, out.keys,
+    hasValues ? a.values : a.keys,
+    hasValues ? b.values : b.keys,
+    hasValues ? out.values : out.keys
+  };
+
+  uint32 groupCount = (total + MERGE_VALUES_PER_BLOCK - 1) /
+                      MERGE_VALUES_PER_BLOCK;
+
+  kernel.dispatch(cmdbuf, buffers, &pushConstant, groupCount);
+}
+
+} /* namespace vub */
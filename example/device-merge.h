@@ -0,0 +1,83 @@
+#pragma once
+
+#include <string>
+#include "kernel.h"
+#include "gpu-device.h"
+
+namespace vub {
+
+/* Picks the variant of the merge kernels which was compiled with one of
+ * the comparators of merge-comparators.h, or has the ShaderCompiler build
+ * them with one given in GLSL (see custom). */
+struct Comparator {
+  /* Suffix of the variant's shader names, null for the default. */
+  const char *name;
+  /* Bytes per key. */
+  uint32 keySize;
+  /* GLSL key type and strict weak ordering on keys a and b, empty for the
+   * built in comparators. */
+  std::string key;
+  std::string less;
+
+  /* uint keys, smallest first. The default. */
+  static Comparator ascending() { return { nullptr, 4 }; }
+  /* uint keys, largest first. */
+  static Comparator descending() { return { "descending", 4 }; }
+  /* uvec2 keys, by x and then by y. */
+  static Comparator uvec2() { return { "uvec2", 8 }; }
+  /* float keys, smallest first. */
+  static Comparator floats() { return { "float", 4 }; }
+  /* keySize byte keys of GLSL type key, ordered by the expression less of
+   * a and b, e.g. custom("int", "abs(a) < abs(b)", 4). The kernels are
+   * compiled when a primitive is made with it, unless they are cached on
+   * disk, which needs ShaderCompiler::isAvailable. */
+  static Comparator custom(std::string key, std::string less, uint32 keySize)
+  {
+    return { nullptr, keySize, std::move(key), std::move(less) };
+  }
+
+  bool isCustom() const { return !less.empty(); }
+
+  /* The name of kernel compiled with this comparator. */
+  std::string shaderName(const char *kernel) const;
+
+  /* kernel compiled with this comparator from sourceName, with defines
+   * on top of the comparator's (a built in one ignores both). */
+  Kernel makeKernel(const GPUDevice &gpu, const char *kernel,
+                    const char *sourceName,
+                    std::vector<ShaderDefine> defines,
+                    uint32 bindingCount, uint32 pushConstantSize) const;
+};
+
+/* A sorted sequence of keys, and of values if values.size isn't 0. Offsets
+ * and counts are in elements, so sequences can share buffers without
+ * having to be aligned for descriptors. */
+struct SortedSequence {
+  BufferRange keys;
+  BufferRange values;
+  uint32 offset;
+  uint32 count;
+};
+
+/* Merges two sorted sequences with merge path partitioning (see
+ * merge-path.comp). Keys that compare equal are taken from a first, so
+ * merges are always stable. */
+struct DeviceMerge {
+  Kernel kernel;
+  Comparator comparator;
+
+  static DeviceMerge make(const GPUDevice &gpu,
+                          Comparator comparator = Comparator::ascending());
+
+  /* Writes a.count + b.count elements to out, starting at out.offset. out
+   * mustn't overlap a or b. Either all three have values or none do. */
+  void record(VkCommandBuffer cmdbuf,
+              const SortedSequence &a,
+              const SortedSequence &b,
+              const SortedSequence &out) const;
+
+private:
+  const GPUDevice *mDev = nullptr;
+};
+
+} /* namespace vub */
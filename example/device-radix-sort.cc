@@ -0,0 +1,264 @@
+#include "device-radix-sort.h"
+
+#include <algorithm>
+#include <cassert>
+#include <utility>
+#include "helper.h"
+#include "memory-tracker.h"
+#include "profiler.h"
+#include "scratch-allocator.h"
+#include "prefix-sum.h"
+#include "radix-sort.h"
+
+using namespace RadixSort;
+using namespace PrefixSum;
+
+namespace vub {
+
+/* Parts of the temp storage start on multiples of this, since they get
+ * bound through descriptors. */
+static const uint64 TEMP_STORAGE_ALIGNMENT = 256;
+
+static uint32
+tileCount(uint32 numElements)
+{
+  return (uint32)(((uint64)numElements + RADIX_VALUES_PER_BLOCK - 1) /
+                  RADIX_VALUES_PER_BLOCK);
+}
+
+/* Where the parts of the temp storage of a sort of numElements elements
+ * go: the counts of every tile, their scan, the parameter blocks of an
+ * indirect sort (the sort's own and the one of the scan of the counts) and
+ * the scratch of the scan. */
+struct TempStorageLayout {
+  uint64 counts;
+  uint64 offsets;
+  uint64 params;
+  uint64 scan;
+  uint64 size;
+  uint32 numCounts;
+};
+
+static TempStorageLayout
+tempStorageLayout(uint32 numElements)
+{
+  uint32 numCounts = RADIX_DIGITS * tileCount(numElements);
+  uint64 countBytes = roundUp<uint64>((uint64)numCounts * sizeof(uint32),
+                                      TEMP_STORAGE_ALIGNMENT);
+
+  TempStorageLayout ret = {};
+  ret.counts = 0;
+  ret.offsets = countBytes;
+  ret.params = 2 * countBytes;
+  ret.scan = ret.params + 2 * SCAN_PARAMS_STRIDE;
+  ret.size = ret.scan + DeviceScan::tempStorageBytes(numCounts);
+  ret.numCounts = numCounts;
+  return ret;
+}
+
+DeviceRadixSort
+DeviceRadixSort::make(const GPUDevice &gpu, uint32 maxElements)
+{
+  MemoryScope memoryScope(gpu, "DeviceRadixSort");
+
+  uint32 maxCounts = RADIX_DIGITS * tileCount(maxElements);
+
+  DeviceRadixSort ret = {};
+
+  /* Keys, counts and parameters. */
+  ret.histogram = Kernel::make(gpu, "radix-sort-histogram", 3,
+                               sizeof(RadixSortPushConstant));
+
+  /* Keys in and out, values in and out, offsets and parameters. */
+  ret.scatter = Kernel::make(gpu, "radix-sort-scatter", 6,
+                             sizeof(RadixSortPushConstant));
+
+  ret.scan = DeviceScan::make(gpu, maxCounts, BindingMode::Auto, false);
+  ret.maxElements = maxElements;
+  ret.indirect = IndirectDispatch::make(gpu);
+  ret.mDev = &gpu;
+
+  return ret;
+}
+
+uint64
+DeviceRadixSort::tempStorageBytes(uint32 numElements)
+{
+  return tempStorageLayout(numElements).size;
+}
+
+void
+DeviceRadixSort::record(VkCommandBuffer cmdbuf,
+                        const BufferRange &keys,
+                        const BufferRange &keysAlt,
+                        const BufferRange &values,
+                        const BufferRange &valuesAlt,
+                        uint32 numElements,
+                        uint32 beginBit,
+                        uint32 endBit,
+                        const BufferRange &tempStorage) const
+{
+  assert(numElements <= maxElements);
+
+  if (numElements == 0 || beginBit >= endBit)
+    return;
+
+  bool hasValues = values.size > 0;
+  uint32 passCount = (endBit - beginBit + RADIX_BITS - 1) / RADIX_BITS;
+
+  ProfileScope profile(*mDev, cmdbuf, "DeviceRadixSort",
+                       2 * (uint64)passCount * numElements * sizeof(uint32) *
+                       (hasValues ? 2 : 1));
+
+  ScratchScope temp(*mDev, tempStorage, tempStorageBytes(numElements));
+
+  recordPasses(cmdbuf, keys, keysAlt, values, valuesAlt,
+               numElements, beginBit, endBit, temp.range);
+}
+
+void
+DeviceRadixSort::record(VkCommandBuffer cmdbuf,
+                        const BufferRange &keys,
+                        const BufferRange &keysAlt,
+                        const BufferRange &values,
+                        const BufferRange &valuesAlt,
+                        const IndirectCount &count,
+                        uint32 beginBit,
+                        uint32 endBit,
+                        const BufferRange &tempStorage) const
+{
+  if (beginBit >= endBit)
+    return;
+
+  ProfileScope profile(*mDev, cmdbuf, "DeviceRadixSort (indirect)");
+
+  TempStorageLayout layout = tempStorageLayout(maxElements);
+  ScratchScope temp(*mDev, tempStorage, layout.size);
+
+  BufferRange sortParams = temp.range.range(layout.params,
+                                            SCAN_PARAMS_STRIDE);
+  BufferRange countParams = temp.range.range(layout.params +
+                                             SCAN_PARAMS_STRIDE,
+                                             SCAN_PARAMS_STRIDE);
+
+  /* One workgroup per tile, and a count per digit of every tile. Only the
+   * count of the second block is used, by the scan, which derives its own
+   * dispatch from it. */
+  indirect.record(cmdbuf, count, sortParams,
+                  RADIX_VALUES_PER_BLOCK, maxElements);
+  indirect.record(cmdbuf, count, countParams,
+                  1, maxElements, RADIX_VALUES_PER_BLOCK, RADIX_DIGITS);
+
+  recordPasses(cmdbuf, keys, keysAlt, values, valuesAlt,
+               SCAN_INDIRECT_COUNT, beginBit, endBit, temp.range);
+}
+
+void
+DeviceRadixSort::recordPasses(VkCommandBuffer cmdbuf,
+                              const BufferRange &keys,
+                              const BufferRange &keysAlt,
+                              const BufferRange &values,
+                              const BufferRange &valuesAlt,
+                              uint32 numElements,
+                              uint32 beginBit,
+                              uint32 endBit,
+                              const BufferRange &temp) const
+{
+  bool isIndirect = numElements == SCAN_INDIRECT_COUNT;
+  bool hasValues = values.size > 0;
+  uint32 passCount = (endBit - beginBit + RADIX_BITS - 1) / RADIX_BITS;
+
+  /* Without the count on the host, the kernels work out the number of
+   * tiles themselves and the scan covers as many counts as the sort
+   * params say. */
+  uint32 numTiles = isIndirect ? 0 : tileCount(numElements);
+
+  TempStorageLayout layout =
+    tempStorageLayout(isIndirect ? maxElements : numElements);
+  uint64 countBytes = (uint64)layout.numCounts * sizeof(uint32);
+
+  BufferRange sortParams = temp.range(layout.params, SCAN_PARAMS_STRIDE);
+  IndirectCount countParams = {
+    temp.range(layout.params + SCAN_PARAMS_STRIDE, SCAN_PARAMS_STRIDE)
+  };
+
+  BufferRange countRange = temp.range(layout.counts, countBytes);
+  BufferRange offsetRange = temp.range(layout.offsets, countBytes);
+  BufferRange scanTemp = temp.range(layout.scan,
+                                    layout.size - layout.scan);
+
+  BufferRange keysIn = keys, keysOut = keysAlt;
+
+  /* Unused by the kernels without values, but they still need a binding. */
+  BufferRange valuesIn = hasValues ? values : keys;
+  BufferRange valuesOut = hasValues ? valuesAlt : keysAlt;
+
+  for (uint32 pass = 0; pass < passCount; ++pass)
+  {
+    RadixSortPushConstant pushConstant = {
+      .numElements = numElements,
+      .numTiles = numTiles,
+      .shift = beginBit + pass * RADIX_BITS,
+      .endBit = endBit,
+      .flags = hasValues ? (uint32)RADIX_FLAG_VALUES : 0u
+    };
+
+    /* The previous pass wrote keysIn (or a previous call is still reading
+     * the counts). */
+    if (pass == 0)
+      recordEntryBarrier(cmdbuf);
+    else
+      recordComputeBarrier(cmdbuf);
+
+    BufferRange histogramBuffers[] = { keysIn, countRange, sortParams };
+    BufferRange scatterBuffers[] = {
+      keysIn, keysOut, valuesIn, valuesOut, offsetRange, sortParams
+    };
+
+    if (isIndirect)
+    {
+      histogram.dispatchIndirect(cmdbuf, histogramBuffers, &pushConstant,
+                                 sortParams);
+      scan.record(cmdbuf, countRange, offsetRange, countParams, false,
+                  ScanCarry::None, scanTemp);
+      recordComputeBarrier(cmdbuf);
+      scatter.dispatchIndirect(cmdbuf, scatterBuffers, &pushConstant,
+                               sortParams);
+    }
+    else
+    {
+      histogram.dispatch(cmdbuf, histogramBuffers, &pushConstant, numTiles);
+      scan.record(cmdbuf, countRange, offsetRange, layout.numCounts, false,
+                  ScanCarry::None, scanTemp);
+      recordComputeBarrier(cmdbuf);
+      scatter.dispatch(cmdbuf, scatterBuffers, &pushConstant, numTiles);
+    }
+
+    std::swap(keysIn, keysOut);
+    std::swap(valuesIn, valuesOut);
+  }
+
+  /* An odd number of passes leaves the result in the scratch. */
+  if (passCount % 2 == 1)
+  {
+    recordComputeBarrier(cmdbuf);
+
+    /* An indirect sort copies all it may have written. */
+    uint64 bytes = isIndirect ?
+      std::min(keys.size, (uint64)maxElements * sizeof(uint32)) :
+      (uint64)numElements * sizeof(uint32);
+
+    VkBufferCopy keyRegion = { keysAlt.offset, keys.offset, bytes };
+    vkCmdCopyBuffer(cmdbuf, keysAlt.hdl, keys.hdl, 1, &keyRegion);
+
+    if (hasValues)
+    {
+      VkBufferCopy valueRegion = { valuesAlt.offset, values.offset, bytes };
+      vkCmdCopyBuffer(cmdbuf, valuesAlt.hdl, values.hdl, 1, &valueRegion);
+    }
+  }
+
+  recordExitBarrier(cmdbuf);
+}
+
+} /* namespace vub */
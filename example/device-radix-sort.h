@@ -0,0 +1,74 @@
+#pragma once
+
+#include "kernel.h"
+#include "gpu-device.h"
+#include "device-scan.h"
+
+namespace vub {
+
+/* LSD radix sort of 32-bit keys, optionally with 32-bit values, RADIX_BITS
+ * bits per pass. A pass counts the digits of every tile, scans the counts
+ * with DeviceScan and scatters the tiles (see radix-sort-scatter.comp). The
+ * sort is stable.
+ *
+ * The counts, their scan and the parameter blocks of indirect sorts live in
+ * temp storage, which comes from GPUDevice::scratchAllocator unless the
+ * caller passes some. It has to start at a multiple of 256 bytes. */
+struct DeviceRadixSort {
+  Kernel histogram;
+  Kernel scatter;
+
+  /* Runs on the temp storage. */
+  DeviceScan scan;
+  uint32 maxElements;
+
+  IndirectDispatch indirect;
+
+  static DeviceRadixSort make(const GPUDevice &gpu, uint32 maxElements);
+
+  /* Bytes of tempStorage a sort of numElements elements needs. */
+  static uint64 tempStorageBytes(uint32 numElements);
+
+  /* Sorts numElements keys (and values, unless values.size is 0) by bits
+   * [beginBit, endBit) of the keys. keysAlt and valuesAlt are scratch of
+   * the same size. The result ends up in keys and values. */
+  void record(VkCommandBuffer cmdbuf,
+              const BufferRange &keys,
+              const BufferRange &keysAlt,
+              const BufferRange &values,
+              const BufferRange &valuesAlt,
+              uint32 numElements,
+              uint32 beginBit = 0,
+              uint32 endBit = 32,
+              const BufferRange &tempStorage = {}) const;
+
+  /* Same over as many elements as count holds (at most maxElements). The
+   * scratch has to be as large as keys and values, and tempStorage has to
+   * be enough for maxElements. */
+  void record(VkCommandBuffer cmdbuf,
+              const BufferRange &keys,
+              const BufferRange &keysAlt,
+              const BufferRange &values,
+              const BufferRange &valuesAlt,
+              const IndirectCount &count,
+              uint32 beginBit = 0,
+              uint32 endBit = 32,
+              const BufferRange &tempStorage = {}) const;
+
+private:
+  /* numElements is SCAN_INDIRECT_COUNT for the indirect sorts, which then
+   * have their parameter blocks written to temp already. */
+  void recordPasses(VkCommandBuffer cmdbuf,
+                    const BufferRange &keys,
+                    const BufferRange &keysAlt,
+                    const BufferRange &values,
+                    const BufferRange &valuesAlt,
+                    uint32 numElements,
+                    uint32 beginBit,
+                    uint32 endBit,
+                    const BufferRange &temp) const;
+
+  const GPUDevice *mDev = nullptr;
+};
+
+} /* namespace vub */
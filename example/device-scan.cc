@@ -0,0 +1,550 @@
+#include "device-scan.h"
+
+#include <cassert>
+#include <cstddef>
+#include "helper.h"
+#include "memory-tracker.h"
+#include "profiler.h"
+#include "prefix-sum.h"
+#include "shader-compiler.h"
+
+using namespace PrefixSum;
+
+namespace vub {
+
+/* Mirrors the push constant block of prefix-sum.comp. */
+struct ScanPushConstant {
+  uint32 numElements;
+  uint32 flags;
+  uint32 inputValue;
+};
+
+/* Push constant block of prefix-sum.comp with VUB_BUFFER_REFERENCES. */
+struct ScanAddressPushConstant {
+  VkDeviceAddress input;
+  VkDeviceAddress output;
+  VkDeviceAddress status;
+  VkDeviceAddress params;
+  uint32 numElements;
+  uint32 flags;
+  uint32 inputValue;
+};
+
+static const uint32 NUM_VALUES_PER_BLOCK =
+  NUM_VALUES_PER_THREAD * NUM_THREADS_PER_BLOCK;
+
+static uint32
+tileCount(uint32 numElements)
+{
+  return (uint32)(((uint64)numElements + NUM_VALUES_PER_BLOCK - 1) /
+                  NUM_VALUES_PER_BLOCK);
+}
+
+static uint64
+statusBufferSize(uint32 numElements)
+{
+  return sizeof(StatusHeader) +
+         (uint64)tileCount(numElements) * sizeof(ProcessorDescriptor);
+}
+
+uint32
+getScanTypeSize(ScanType type)
+{
+  switch (type)
+  {
+  case ScanType::Uint8: return 1;
+  case ScanType::Uint16: case ScanType::Float16: return 2;
+  default: return 4;
+  }
+}
+
+bool
+isFloatScanType(ScanType type)
+{
+  return type == ScanType::Float32 || type == ScanType::Float16;
+}
+
+/* Suffix of the SCAN_INPUT_ and SCAN_OUTPUT_ defines of a type. */
+static const char *
+getScanTypeDefine(ScanType type)
+{
+  switch (type)
+  {
+  case ScanType::Uint8: return "UINT8";
+  case ScanType::Uint16: return "UINT16";
+  case ScanType::Float32: return "FLOAT32";
+  case ScanType::Float16: return "FLOAT16";
+  default: return nullptr;
+  }
+}
+
+static void
+checkScanType(const GPUDevice &gpu, ScanType type)
+{
+  uint32 size = getScanTypeSize(type);
+
+  if ((size == 1 && !gpu.features.storage8Bit) ||
+      (size == 2 && !gpu.features.storage16Bit))
+  {
+    printf("Scans of %s elements need %u-bit storage buffers\n",
+           getScanTypeDefine(type), size * 8);
+    PANIC_AND_EXIT("Device can't scan this type");
+  }
+}
+
+/* Snippets go in as function-like macros of the load and store stages. */
+static std::vector<ShaderDefine>
+fusionDefines(const ScanFusion &fusion)
+{
+  std::vector<ShaderDefine> defines;
+
+  /* The scan itself runs in ELEMT, which 32-bit outputs are. */
+  if (isFloatScanType(fusion.output.type))
+    defines.push_back({ "ELEMT", "float" });
+
+  if (getScanTypeSize(fusion.output.type) < 4)
+  {
+    defines.push_back({ std::string("SCAN_OUTPUT_") +
+                        getScanTypeDefine(fusion.output.type), "" });
+  }
+
+  if (fusion.input.kind == ScanInputKind::Buffer &&
+      fusion.input.type != ScanType::Uint32)
+  {
+    defines.push_back({ std::string("SCAN_INPUT_") +
+                        getScanTypeDefine(fusion.input.type), "" });
+  }
+
+  if (fusion.input.kind == ScanInputKind::Counting)
+    defines.push_back({ "SCAN_INPUT_COUNTING", "" });
+  else if (fusion.input.kind == ScanInputKind::Constant)
+    defines.push_back({ "SCAN_INPUT_CONSTANT", "" });
+
+  /* Predicates are bools, which become 0 or 1. */
+  if (!fusion.input.transform.empty())
+    defines.push_back({ "SCAN_INPUT_TRANSFORM(x, i)",
+                        "ELEMT(" + fusion.input.transform + ")" });
+
+  if (!fusion.output.transform.empty())
+    defines.push_back({ "SCAN_OUTPUT_TRANSFORM(x, i)",
+                        "ELEMT(" + fusion.output.transform + ")" });
+
+  return defines;
+}
+
+/* The kernel the build compiled, or a variant with the fusion. */
+static ComputePipeline
+makeScanPipeline(const GPUDevice &gpu, const ScanFusion &fusion,
+                 bool addresses, uint32 pushConstantSize,
+                 uint32 setLayoutCount, VkDescriptorSetLayout *layouts)
+{
+  if (fusion.isIdentity())
+  {
+    return gpu.makeComputePipeline(
+      addresses ? "prefix-sum-bda" : "prefix-sum", pushConstantSize,
+      setLayoutCount, layouts);
+  }
+
+  std::vector<ShaderDefine> defines = fusionDefines(fusion);
+  if (addresses)
+    defines.push_back({ "VUB_BUFFER_REFERENCES", "" });
+
+  return gpu.makeComputePipelineVariant("prefix-sum.comp", defines,
+                                        pushConstantSize,
+                                        setLayoutCount, layouts);
+}
+
+DeviceScan
+DeviceScan::make(const GPUDevice &gpu, uint32 maxElements, BindingMode binding,
+                 bool ownScratch, const ScanFusion &fusion)
+{
+  MemoryScope memoryScope(gpu, "DeviceScan");
+
+  if (fusion.input.kind == ScanInputKind::Buffer)
+    checkScanType(gpu, fusion.input.type);
+  checkScanType(gpu, fusion.output.type);
+
+  DeviceScan ret = {};
+  ret.binding = resolveBindingMode(gpu, binding);
+  ret.fusion = fusion;
+
+  if (gpu.features.bufferDeviceAddress)
+  {
+    ret.addressPipeline = makeScanPipeline(
+      gpu, fusion, true, sizeof(ScanAddressPushConstant), 0, nullptr);
+  }
+
+  if (ret.binding == BindingMode::CachedSets ||
+      !gpu.features.bufferDeviceAddress)
+  {
+    /* Input, output, status and parameters. */
+    ret.layout = gpu.makeRebindableDescriptorSetLayout(
+      BindingDesc{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1},
+      BindingDesc{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1},
+      BindingDesc{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1},
+      BindingDesc{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1}
+    );
+
+    ret.pipeline = makeScanPipeline(gpu, fusion, false,
+                                    sizeof(ScanPushConstant),
+                                    1, &ret.layout);
+  }
+
+  if (ret.binding == BindingMode::PushDescriptors)
+  {
+    ret.pushLayout = gpu.makePushDescriptorSetLayout(
+      BindingDesc{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1},
+      BindingDesc{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1},
+      BindingDesc{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1},
+      BindingDesc{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1}
+    );
+
+    ret.pushPipeline = makeScanPipeline(gpu, fusion, false,
+                                        sizeof(ScanPushConstant),
+                                        1, &ret.pushLayout);
+  }
+
+  if (ret.binding == BindingMode::CachedSets)
+    ret.mDescriptorCache = DescriptorCache::make(gpu);
+
+  if (ownScratch)
+    ret.status = gpu.makeDeviceBuffer(statusBufferSize(maxElements));
+
+  ret.defaultParams = gpu.makeDeviceBuffer(sizeof(ScanParams));
+  ret.indirect = IndirectDispatch::make(gpu);
+  ret.indirectParams = gpu.makeDeviceBuffer(SCAN_PARAMS_STRIDE);
+  ret.maxElements = maxElements;
+  ret.mDev = &gpu;
+
+  return ret;
+}
+
+uint64
+DeviceScan::tempStorageBytes(uint32 numElements)
+{
+  return statusBufferSize(numElements);
+}
+
+BufferRange
+DeviceScan::scratchFor(const BufferRange &tempStorage, uint64 size,
+                       ScanCarry carry) const
+{
+  if (tempStorage.size == 0)
+  {
+    assert(status.hdl != VK_NULL_HANDLE);
+    return status.range();
+  }
+
+  /* The total to carry is only kept in status. */
+  assert(carry == ScanCarry::None);
+  assert(tempStorage.size >= size);
+
+  return tempStorage;
+}
+
+void
+DeviceScan::recordPrologue(VkCommandBuffer cmdbuf, const BufferRange &scratch,
+                           uint64 statusSize, ScanCarry carry) const
+{
+  /* A previous scan may still be using the scratch, or may have written the
+   * input (or the carry) of this one. */
+  recordEntryBarrier(cmdbuf);
+
+  if (carry == ScanCarry::Continue)
+  {
+    /* Everything but the carries, then the last total becomes carryIn. */
+    vkCmdFillBuffer(cmdbuf, scratch.hdl, scratch.offset, sizeof(uint32), 0);
+    vkCmdFillBuffer(cmdbuf, scratch.hdl, scratch.offset + sizeof(StatusHeader),
+                    statusSize - sizeof(StatusHeader), 0);
+
+    VkBufferCopy region = {
+      scratch.offset + offsetof(StatusHeader, carryOut),
+      scratch.offset + offsetof(StatusHeader, carryIn),
+      sizeof(ELEMT)
+    };
+
+    vkCmdCopyBuffer(cmdbuf, scratch.hdl, scratch.hdl, 1, &region);
+  }
+  else
+  {
+    vkCmdFillBuffer(cmdbuf, scratch.hdl, scratch.offset, statusSize, 0);
+  }
+
+  VkBufferMemoryBarrier statusBarrier = GPUDevice::makeBarrier(
+    scratch.hdl, scratch.offset, statusSize,
+    VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+  recordPipelineBarrier(cmdbuf,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                        nullptr, &statusBarrier);
+}
+
+BufferRange
+DeviceScan::inputFor(const BufferRange &input,
+                     const BufferRange &output) const
+{
+  /* The binding still has to be valid when the kernel doesn't read it. */
+  if (fusion.input.kind != ScanInputKind::Buffer && input.size == 0)
+    return output;
+
+  return input;
+}
+
+void
+DeviceScan::bind(VkCommandBuffer cmdbuf,
+                 const BufferRange &unresolvedInput,
+                 const BufferRange &output,
+                 const BufferRange &scratch,
+                 const BufferRange &params,
+                 uint32 numElements,
+                 uint32 flags) const
+{
+  BufferRange input = inputFor(unresolvedInput, output);
+
+  if (binding == BindingMode::Addresses)
+  {
+    ScanAddressPushConstant pushConstant = {
+      .input = input.addr,
+      .output = output.addr,
+      .status = scratch.addr,
+      .params = params.addr,
+      .numElements = numElements,
+      .flags = flags,
+      .inputValue = fusion.input.value
+    };
+
+    vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      addressPipeline.hdl);
+    vkCmdPushConstants(cmdbuf, addressPipeline.layout, VK_SHADER_STAGE_ALL,
+                       0, sizeof(pushConstant), &pushConstant);
+  }
+  else
+  {
+    VkDescriptorBufferInfo infos[] = {
+      { input.hdl, input.offset, input.size },
+      { output.hdl, output.offset, output.size },
+      { scratch.hdl, scratch.offset, scratch.size },
+      { params.hdl, params.offset, params.size }
+    };
+
+    ScanPushConstant pushConstant = {
+      .numElements = numElements,
+      .flags = flags,
+      .inputValue = fusion.input.value
+    };
+
+    const ComputePipeline &used =
+      binding == BindingMode::PushDescriptors ? pushPipeline : pipeline;
+
+    vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, used.hdl);
+
+    if (binding == BindingMode::PushDescriptors)
+    {
+      mDev->pushStorageBufferDescriptors(cmdbuf, used.layout, infos, 4);
+    }
+    else
+    {
+      VkDescriptorSet set = mDescriptorCache.get(layout, infos, 4);
+      vkCmdBindDescriptorSets(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE,
+                              used.layout, 0, 1, &set, 0, nullptr);
+    }
+
+    vkCmdPushConstants(cmdbuf, used.layout, VK_SHADER_STAGE_ALL,
+                       0, sizeof(pushConstant), &pushConstant);
+  }
+}
+
+void
+DeviceScan::record(VkCommandBuffer cmdbuf,
+                   const BufferRange &input,
+                   const BufferRange &output,
+                   uint32 numElements,
+                   bool inclusive,
+                   ScanCarry carry,
+                   const BufferRange &tempStorage) const
+{
+  assert(numElements <= maxElements);
+
+  uint32 flags = inclusive ? (uint32)SCAN_FLAG_INCLUSIVE : 0u;
+  if (carry != ScanCarry::None)
+    flags |= SCAN_FLAG_CARRY;
+
+  /* Inputs which aren't buffers aren't read. */
+  uint64 elementBytes = getScanTypeSize(fusion.output.type);
+  if (fusion.input.kind == ScanInputKind::Buffer)
+    elementBytes += getScanTypeSize(fusion.input.type);
+
+  ProfileScope profile(*mDev, cmdbuf, "DeviceScan",
+                       elementBytes * numElements);
+
+  uint64 statusSize = statusBufferSize(numElements);
+  BufferRange scratch = scratchFor(tempStorage, statusSize, carry);
+
+  recordPrologue(cmdbuf, scratch, statusSize, carry);
+
+  /* The parameter block isn't read, but still needs a binding. */
+  bind(cmdbuf, input, output, scratch,
+       defaultParams.range(0, sizeof(ScanParams)), numElements, flags);
+
+  uint32 groupCountX, groupCountY;
+  splitGroupCount(tileCount(numElements), groupCountX, groupCountY);
+
+  vkCmdDispatch(cmdbuf, groupCountX, groupCountY, 1);
+}
+
+void
+DeviceScan::record(VkCommandBuffer cmdbuf,
+                   const BufferRange &input,
+                   const BufferRange &output,
+                   const IndirectCount &count,
+                   bool inclusive,
+                   ScanCarry carry,
+                   const BufferRange &tempStorage) const
+{
+  uint32 flags = inclusive ? (uint32)SCAN_FLAG_INCLUSIVE : 0u;
+  if (carry != ScanCarry::None)
+    flags |= SCAN_FLAG_CARRY;
+
+  /* The element count is only known on the device. */
+  ProfileScope profile(*mDev, cmdbuf, "DeviceScan (indirect)");
+
+  BufferRange params = indirectParams.range(0, SCAN_PARAMS_STRIDE);
+  BufferRange scratch = scratchFor(tempStorage,
+                                   statusBufferSize(maxElements), carry);
+
+  indirect.record(cmdbuf, count, params, NUM_VALUES_PER_BLOCK, maxElements);
+
+  /* With SCAN_INDIRECT_COUNT, the kernel takes the addresses from behind
+   * the parameter block too (see ParamsRef). */
+  if (binding == BindingMode::Addresses)
+  {
+    VkDeviceAddress addresses[] = {
+      inputFor(input, output).addr, output.addr, scratch.addr
+    };
+
+    /* An earlier indirect scan may still be reading the addresses. */
+    recordUpdateBarrier(cmdbuf);
+    vkCmdUpdateBuffer(cmdbuf, indirectParams.hdl, sizeof(ScanParams),
+                      sizeof(addresses), addresses);
+    recordIndirectBarrier(cmdbuf);
+  }
+
+  /* Neither is the amount of scratch used, so clear all of it. */
+  recordPrologue(cmdbuf, scratch, scratch.size, carry);
+
+  bind(cmdbuf, input, output, scratch, params, SCAN_INDIRECT_COUNT, flags);
+
+  vkCmdDispatchIndirect(cmdbuf, params.hdl, params.offset);
+}
+
+BufferRange
+DeviceScan::carryOut() const
+{
+  return status.range(offsetof(StatusHeader, carryOut), sizeof(ELEMT));
+}
+
+RecordedCall
+DeviceScan::record(Recording &recording,
+                   const BufferRange &input,
+                   const BufferRange &output,
+                   bool inclusive) const
+{
+  assert(status.hdl != VK_NULL_HANDLE);
+
+  bool usesAddresses = mDev->features.bufferDeviceAddress;
+
+  VkDescriptorSet set = usesAddresses ?
+    VK_NULL_HANDLE : mDev->makeDescriptorSet(layout);
+
+  RecordedCall call = recording.reserveCall(NUM_VALUES_PER_BLOCK,
+                                            maxElements, set);
+  rebind(recording, call, input, output);
+
+  uint32 flags = inclusive ? (uint32)SCAN_FLAG_INCLUSIVE : 0u;
+
+  /* Everything but the parameter block comes from the block itself. */
+  ScanAddressPushConstant addressPushConstant = {
+    .params = recording.paramsAddress(call),
+    .numElements = SCAN_INDIRECT_COUNT,
+    .flags = flags,
+    .inputValue = fusion.input.value
+  };
+
+  ScanPushConstant pushConstant = {
+    .numElements = SCAN_INDIRECT_COUNT,
+    .flags = flags,
+    .inputValue = fusion.input.value
+  };
+
+  VkBuffer paramsBuffer = recording.params.hdl;
+  VkDeviceSize paramsOffset = recording.paramsOffset(call);
+
+  recording.recordCall(call,
+    [this, usesAddresses, addressPushConstant, pushConstant,
+     paramsBuffer, paramsOffset, set](VkCommandBuffer cmdbuf)
+    {
+      /* The element count isn't known when recording, so neither is the
+       * amount of memory touched. */
+      ProfileScope profile(*mDev, cmdbuf, "DeviceScan (recorded)");
+
+      /* For the same reason, clear all of the scratch. */
+      recordPrologue(cmdbuf, status, status.size);
+
+      if (usesAddresses)
+      {
+        vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          addressPipeline.hdl);
+        vkCmdPushConstants(cmdbuf, addressPipeline.layout,
+                           VK_SHADER_STAGE_ALL, 0,
+                           sizeof(addressPushConstant), &addressPushConstant);
+      }
+      else
+      {
+        vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          pipeline.hdl);
+        vkCmdBindDescriptorSets(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                pipeline.layout, 0, 1, &set, 0, nullptr);
+        vkCmdPushConstants(cmdbuf, pipeline.layout, VK_SHADER_STAGE_ALL, 0,
+                           sizeof(pushConstant), &pushConstant);
+      }
+
+      vkCmdDispatchIndirect(cmdbuf, paramsBuffer, paramsOffset);
+    });
+
+  return call;
+}
+
+void
+DeviceScan::rebind(Recording &recording,
+                   const RecordedCall &call,
+                   const BufferRange &unresolvedInput,
+                   const BufferRange &output) const
+{
+  BufferRange input = inputFor(unresolvedInput, output);
+
+  if (mDev->features.bufferDeviceAddress)
+  {
+    /* Same order as in ParamsRef. */
+    VkDeviceAddress addresses[] = {
+      input.addr,
+      output.addr,
+      status.addr
+    };
+
+    recording.setAddresses(call, addresses, 3);
+  }
+  else
+  {
+    VkDescriptorBufferInfo infos[] = {
+      { input.hdl, input.offset, input.size },
+      { output.hdl, output.offset, output.size },
+      { status.hdl, 0, VK_WHOLE_SIZE },
+      recording.paramsInfo(call)
+    };
+
+    recording.setBuffers(call, infos, 4);
+  }
+}
+
+} /* namespace vub */
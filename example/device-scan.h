@@ -0,0 +1,250 @@
+#pragma once
+
+#include <string>
+#include "binding.h"
+#include "gpu-device.h"
+#include "recording.h"
+#include "indirect-dispatch.h"
+
+namespace vub {
+
+/* How a scan continues from the one recorded before it. */
+enum class ScanCarry {
+  /* Starts from 0. */
+  None,
+  /* Starts from 0 and keeps the total for a Continue. */
+  Start,
+  /* Starts from the total of the previous Start or Continue, which lets
+   * inputs be scanned in windows without going back to the host. */
+  Continue
+};
+
+/* Where a fused scan takes its elements from. */
+enum class ScanInputKind {
+  /* The input buffer, as without fusion. */
+  Buffer,
+  /* Element i is value + i. The input buffer isn't read. */
+  Counting,
+  /* Every element is value. The input buffer isn't read. */
+  Constant
+};
+
+/* Element types of the buffers of a fused scan. Narrow ones are widened
+ * to 32 bits when loaded and narrowed when stored, in registers, so only
+ * their bytes go through memory: scanning uint8 flags into uint32 offsets
+ * reads a quarter of what it does with uint32 flags. Uint8 needs
+ * features.storage8Bit and the 16-bit types features.storage16Bit.
+ *
+ * The scan adds uints, or floats if the output is of a float type. Inputs
+ * are converted to that like GLSL constructors do (floats truncate). */
+enum class ScanType {
+  Uint32,
+  Uint8,
+  Uint16,
+  Float32,
+  Float16
+};
+
+uint32 getScanTypeSize(ScanType type);
+bool isFloatScanType(ScanType type);
+
+/* Fancy iterators: what the load stage of the scan yields for element i.
+ * transform is a GLSL expression of the element x (in the type the scan
+ * adds) and of i (a uint), like "x * x" or "(x & 1u) == 0u", which the
+ * scan is applied to instead of x. Predicates give 0 or 1, so scanning one
+ * counts the elements it holds for. type is that of the input buffer. */
+struct ScanInputIterator {
+  ScanInputKind kind = ScanInputKind::Buffer;
+  uint32 value = 0;
+  std::string transform;
+  ScanType type = ScanType::Uint32;
+};
+
+/* What the store stage writes: transform is applied to the scanned value x
+ * of element i the same way, and the result converted to type. */
+struct ScanOutputIterator {
+  std::string transform;
+  ScanType type = ScanType::Uint32;
+};
+
+inline ScanInputIterator
+transformInput(std::string transform)
+{
+  return { ScanInputKind::Buffer, 0, std::move(transform) };
+}
+
+inline ScanInputIterator
+countingInput(uint32 first, std::string transform = "")
+{
+  return { ScanInputKind::Counting, first, std::move(transform) };
+}
+
+inline ScanInputIterator
+constantInput(uint32 value, std::string transform = "")
+{
+  return { ScanInputKind::Constant, value, std::move(transform) };
+}
+
+inline ScanOutputIterator
+transformOutput(std::string transform)
+{
+  return { std::move(transform) };
+}
+
+/* Buffers of other types than uint32, like uint8 flags in and uint32
+ * offsets out. */
+inline ScanInputIterator
+typedInput(ScanType type, std::string transform = "")
+{
+  return { ScanInputKind::Buffer, 0, std::move(transform), type };
+}
+
+inline ScanOutputIterator
+typedOutput(ScanType type, std::string transform = "")
+{
+  return { std::move(transform), type };
+}
+
+/* Work fused into the load and store stages of prefix-sum.comp, which
+ * saves the map kernel and the intermediate buffer (a write and a read of
+ * every element) of a map before or after the scan.
+ *
+ * A fused DeviceScan gets its own variants of the kernel from the
+ * ShaderCompiler when it is made, so scans with the same transforms and
+ * kinds of iterators share them. Unless the build compiled them (it does
+ * for scans of each ScanType without transforms, see add_vub_scan_types)
+ * or they are cached on disk, that compiles them, which needs
+ * ShaderCompiler::isAvailable. The value of the input isn't compiled into
+ * the kernel. */
+struct ScanFusion {
+  ScanInputIterator input;
+  ScanOutputIterator output;
+
+  /* Whether the kernel the build compiled does this. */
+  bool isIdentity() const
+  {
+    return input.kind == ScanInputKind::Buffer && input.transform.empty() &&
+           input.type == ScanType::Uint32 && output.transform.empty() &&
+           output.type == ScanType::Uint32;
+  }
+};
+
+/* Single-pass prefix scan (decoupled look-back) of 32-bit elements, or of
+ * others with a ScanFusion (see ScanType).
+ *
+ * How buffers reach the kernel outside of recordings depends on binding
+ * (see BindingMode), and every mode has its own pipeline. Recordings use
+ * device addresses if the device has them and descriptor sets made from
+ * layout if not. */
+struct DeviceScan {
+  BindingMode binding;
+
+  /* Buffers in descriptor sets made from layout. */
+  ComputePipeline pipeline;
+  VkDescriptorSetLayout layout;
+
+  /* Buffers as device addresses in push constants. */
+  ComputePipeline addressPipeline;
+
+  /* Buffers in pushed descriptors. */
+  ComputePipeline pushPipeline;
+  VkDescriptorSetLayout pushLayout;
+
+  /* Look-back scratch shared by every call made through this object which
+   * isn't given tempStorage, which is why these calls execute one after the
+   * other. It also keeps the total between ScanCarry calls. Not made
+   * without ownScratch. */
+  DeviceBuffer status;
+  DeviceBuffer defaultParams;
+  uint32 maxElements;
+
+  /* Writes the parameter block of scans over an IndirectCount, followed by
+   * the buffer addresses with BindingMode::Addresses. */
+  IndirectDispatch indirect;
+  DeviceBuffer indirectParams;
+
+  /* input.value may be changed between calls, and is taken when they are
+   * recorded. */
+  ScanFusion fusion;
+
+  /* Without ownScratch, every call has to be given tempStorage, and
+   * neither carries nor recordings can be used. With an input which isn't
+   * a buffer, calls may pass an empty input range. */
+  static DeviceScan make(const GPUDevice &gpu, uint32 maxElements,
+                         BindingMode binding = BindingMode::Auto,
+                         bool ownScratch = true,
+                         const ScanFusion &fusion = {});
+
+  /* Bytes of tempStorage a scan of numElements elements needs. */
+  static uint64 tempStorageBytes(uint32 numElements);
+
+  /* Records a scan of numElements elements from input to output. With
+   * tempStorage, the scan uses it instead of status (and so may run next to
+   * other calls); it can't carry then. */
+  void record(VkCommandBuffer cmdbuf,
+              const BufferRange &input,
+              const BufferRange &output,
+              uint32 numElements,
+              bool inclusive = false,
+              ScanCarry carry = ScanCarry::None,
+              const BufferRange &tempStorage = {}) const;
+
+  /* Same over as many elements as count holds (at most maxElements), which
+   * never has to go through the host. tempStorage has to be enough for
+   * maxElements. */
+  void record(VkCommandBuffer cmdbuf,
+              const BufferRange &input,
+              const BufferRange &output,
+              const IndirectCount &count,
+              bool inclusive = false,
+              ScanCarry carry = ScanCarry::None,
+              const BufferRange &tempStorage = {}) const;
+
+  /* Where a Start or Continue scan leaves the total of everything scanned
+   * so far (one uint or float, see ScanType, written by the compute shader
+   * stage). Reductions of narrow inputs scan them with a Start, into an
+   * output as narrow as they are, and read this. */
+  BufferRange carryOut() const;
+
+  /* Records a scan into a recording. The element count is set with
+   * Recording::setNumElements and the buffers with rebind. */
+  RecordedCall record(Recording &recording,
+                      const BufferRange &input,
+                      const BufferRange &output,
+                      bool inclusive = false) const;
+  void rebind(Recording &recording,
+              const RecordedCall &call,
+              const BufferRange &input,
+              const BufferRange &output) const;
+
+private:
+  /* Binds the pipeline of the binding mode with its buffers and push
+   * constants. */
+  void bind(VkCommandBuffer cmdbuf,
+            const BufferRange &input,
+            const BufferRange &output,
+            const BufferRange &scratch,
+            const BufferRange &params,
+            uint32 numElements,
+            uint32 flags) const;
+
+  /* Clears statusSize bytes of scratch. */
+  void recordPrologue(VkCommandBuffer cmdbuf, const BufferRange &scratch,
+                      uint64 statusSize,
+                      ScanCarry carry = ScanCarry::None) const;
+
+  /* output for the input binding of iterators which aren't buffers and
+   * weren't given one. */
+  BufferRange inputFor(const BufferRange &input,
+                       const BufferRange &output) const;
+
+  /* tempStorage if there is any, status if not. */
+  BufferRange scratchFor(const BufferRange &tempStorage, uint64 size,
+                         ScanCarry carry) const;
+
+  /* Used with BindingMode::CachedSets. */
+  mutable DescriptorCache mDescriptorCache;
+  const GPUDevice *mDev = nullptr;
+};
+
+} /* namespace vub */
@@ -0,0 +1,227 @@
+#include "device-segmented-sort.h"
+
+#include <cassert>
+#include <algorithm>
+#include "helper.h"
+#include "memory-tracker.h"
+#include "profiler.h"
+#include "scratch-allocator.h"
+#include "prefix-sum.h"
+#include "merge-path.h"
+#include "segmented-sort.h"
+
+using namespace MergePath;
+using namespace SegmentedSort;
+
+namespace vub {
+
+static_assert(SEGMENTED_MEDIUM_MAX == MERGE_VALUES_PER_BLOCK,
+              "Medium segments have to fit a block sort tile");
+
+/* Workgroups of the sorting kernels loop over their bins, so there is no
+ * need for more of them than the device can keep busy. */
+static const uint32 MAX_SORT_GROUPS = 4096;
+
+DeviceSegmentedSort
+DeviceSegmentedSort::make(const GPUDevice &gpu, uint32 maxSegments)
+{
+  MemoryScope memoryScope(gpu, "DeviceSegmentedSort");
+
+  DeviceSegmentedSort ret = {};
+
+  /* Offsets, bins and parameters. */
+  ret.bin = Kernel::make(gpu, "segmented-sort-bin", 3,
+                         sizeof(SegmentedSortPushConstant));
+
+  /* Keys in and out, values in and out, offsets and bins. */
+  ret.sortSmall = Kernel::make(gpu, "segmented-sort-small", 6,
+                               sizeof(SegmentedSortPushConstant));
+  ret.sortMedium = Kernel::make(gpu, "merge-sort-block-segmented", 6,
+                                sizeof(SegmentedSortPushConstant));
+
+  /* Keys in, out and scratch, the same for values, offsets and bins. */
+  ret.sortLarge = Kernel::make(gpu, "segmented-sort-large", 8,
+                               sizeof(SegmentedSortPushConstant));
+
+  ret.maxSegments = maxSegments;
+  ret.indirect = IndirectDispatch::make(gpu);
+  ret.indirectParams = gpu.makeDeviceBuffer(SCAN_PARAMS_STRIDE);
+  ret.mDev = &gpu;
+
+  return ret;
+}
+
+uint64
+DeviceSegmentedSort::tempStorageBytes(uint32 numSegments)
+{
+  return (SEGMENTED_BIN_HEADER + SEGMENTED_BIN_COUNT * (uint64)numSegments) *
+         sizeof(uint32);
+}
+
+void
+DeviceSegmentedSort::record(VkCommandBuffer cmdbuf,
+                            const BufferRange *keys,
+                            const BufferRange *values,
+                            const BufferRange &offsets,
+                            uint32 numSegments,
+                            const IndirectCount *count,
+                            const BufferRange &tempStorage) const
+{
+  /* Sorts over an IndirectCount are dispatched for as many segments as
+   * there may be. */
+  bool isIndirect = count != nullptr;
+  uint64 offsetCount = offsets.size / sizeof(uint32);
+  uint32 dispatchSegments = isIndirect ?
+    (uint32)std::min<uint64>(maxSegments,
+                             offsetCount > 0 ? offsetCount - 1 : 0) :
+    numSegments;
+
+  assert(isIndirect || numSegments <= maxSegments);
+
+  if (dispatchSegments == 0)
+    return;
+
+  bool hasValues = values != nullptr;
+
+  /* The element count is only known on the device. */
+  ProfileScope profile(*mDev, cmdbuf,
+                       isIndirect ? "DeviceSegmentedSort (indirect)" :
+                                    "DeviceSegmentedSort");
+
+  ScratchScope temp(*mDev, tempStorage, tempStorageBytes(dispatchSegments));
+  BufferRange bins = temp.range;
+
+  /* Unused without SCAN_INDIRECT_COUNT, but still needs a binding. */
+  BufferRange params = indirectParams.range(0, SCAN_PARAMS_STRIDE);
+
+  if (isIndirect)
+    indirect.record(cmdbuf, *count, params, SEGMENTED_THREADS_PER_BLOCK,
+                    dispatchSegments);
+
+  /* The bins are laid out for as many segments as there may be. */
+  SegmentedSortPushConstant pushConstant = {
+    .numSegments = numSegments,
+    .maxSegments = dispatchSegments,
+    .flags = (uint32)(MERGE_FLAG_STABLE | (hasValues ? MERGE_FLAG_VALUES : 0))
+  };
+
+  /* A previous call may still be reading the bins, and the input may have
+   * just been written. */
+  recordEntryBarrier(cmdbuf);
+
+  vkCmdFillBuffer(cmdbuf, bins.hdl, bins.offset,
+                  SEGMENTED_BIN_HEADER * sizeof(uint32), 0);
+
+  VkBufferMemoryBarrier binBarrier = GPUDevice::makeBarrier(
+    bins.hdl, bins.offset, SEGMENTED_BIN_HEADER * sizeof(uint32),
+    VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+  recordPipelineBarrier(cmdbuf,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                        nullptr, &binBarrier);
+
+  BufferRange binBuffers[] = { offsets, bins, params };
+  if (isIndirect)
+    bin.dispatchIndirect(cmdbuf, binBuffers, &pushConstant, params);
+  else
+    bin.dispatch(cmdbuf, binBuffers, &pushConstant,
+                 (numSegments + SEGMENTED_THREADS_PER_BLOCK - 1) /
+                 SEGMENTED_THREADS_PER_BLOCK);
+
+  recordComputeBarrier(cmdbuf);
+
+  /* Unused by the kernels without values, but they still need a binding. */
+  const BufferRange *valueBuffers = hasValues ? values : keys;
+
+  BufferRange buffers[] = {
+    keys[0], keys[1], valueBuffers[0], valueBuffers[1], offsets, bins
+  };
+
+  /* The bins don't overlap, so the sorts can run at the same time. They
+   * loop over the counts the binning left, so they need no more than the
+   * most segments there may be. */
+  sortSmall.dispatch(cmdbuf, buffers, &pushConstant,
+                     std::min(MAX_SORT_GROUPS,
+                              (dispatchSegments +
+                               SEGMENTED_THREADS_PER_BLOCK - 1) /
+                              SEGMENTED_THREADS_PER_BLOCK));
+
+  sortMedium.dispatch(cmdbuf, buffers, &pushConstant,
+                      std::min(MAX_SORT_GROUPS, dispatchSegments));
+
+  BufferRange largeBuffers[] = {
+    keys[0], keys[1], keys[2],
+    valueBuffers[0], valueBuffers[1], valueBuffers[2],
+    offsets, bins
+  };
+
+  sortLarge.dispatch(cmdbuf, largeBuffers, &pushConstant,
+                     std::min(MAX_SORT_GROUPS, dispatchSegments));
+
+  recordExitBarrier(cmdbuf);
+}
+
+void
+DeviceSegmentedSort::sortKeys(VkCommandBuffer cmdbuf,
+                              const BufferRange &keysIn,
+                              const BufferRange &keysOut,
+                              const BufferRange &keysAlt,
+                              const BufferRange &offsets,
+                              uint32 numSegments,
+                              const BufferRange &tempStorage) const
+{
+  BufferRange keys[] = { keysIn, keysOut, keysAlt };
+  record(cmdbuf, keys, nullptr, offsets, numSegments, nullptr, tempStorage);
+}
+
+void
+DeviceSegmentedSort::sortKeys(VkCommandBuffer cmdbuf,
+                              const BufferRange &keysIn,
+                              const BufferRange &keysOut,
+                              const BufferRange &keysAlt,
+                              const BufferRange &offsets,
+                              const IndirectCount &numSegments,
+                              const BufferRange &tempStorage) const
+{
+  BufferRange keys[] = { keysIn, keysOut, keysAlt };
+  record(cmdbuf, keys, nullptr, offsets, SCAN_INDIRECT_COUNT, &numSegments,
+         tempStorage);
+}
+
+void
+DeviceSegmentedSort::sortPairs(VkCommandBuffer cmdbuf,
+                               const BufferRange &keysIn,
+                               const BufferRange &keysOut,
+                               const BufferRange &keysAlt,
+                               const BufferRange &valuesIn,
+                               const BufferRange &valuesOut,
+                               const BufferRange &valuesAlt,
+                               const BufferRange &offsets,
+                               uint32 numSegments,
+                               const BufferRange &tempStorage) const
+{
+  BufferRange keys[] = { keysIn, keysOut, keysAlt };
+  BufferRange values[] = { valuesIn, valuesOut, valuesAlt };
+  record(cmdbuf, keys, values, offsets, numSegments, nullptr, tempStorage);
+}
+
+void
+DeviceSegmentedSort::sortPairs(VkCommandBuffer cmdbuf,
+                               const BufferRange &keysIn,
+                               const BufferRange &keysOut,
+                               const BufferRange &keysAlt,
+                               const BufferRange &valuesIn,
+                               const BufferRange &valuesOut,
+                               const BufferRange &valuesAlt,
+                               const BufferRange &offsets,
+                               const IndirectCount &numSegments,
+                               const BufferRange &tempStorage) const
+{
+  BufferRange keys[] = { keysIn, keysOut, keysAlt };
+  BufferRange values[] = { valuesIn, valuesOut, valuesAlt };
+  record(cmdbuf, keys, values, offsets, SCAN_INDIRECT_COUNT, &numSegments,
+         tempStorage);
+}
+
+} /* namespace vub */
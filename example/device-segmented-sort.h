@@ -0,0 +1,100 @@
+#pragma once
+
+#include "kernel.h"
+#include "gpu-device.h"
+#include "indirect-dispatch.h"
+
+namespace vub {
+
+/* Sorts many independent segments of 32-bit keys (optionally with 32-bit
+ * values) at once, in four dispatches however many segments there are.
+ *
+ * Segment i is [offsets[i], offsets[i+1]) of the keys. Segments are first
+ * binned by size; small ones are then sorted by one thread each in
+ * registers, medium ones by a workgroup each in shared memory (the block
+ * sort of DeviceMergeSort) and large ones by a workgroup each with a radix
+ * sort through global memory. The sort is stable.
+ *
+ * A workgroup per large segment is right for segments of up to a few
+ * hundred thousand elements. Inputs of a few huge segments are better off
+ * with one DeviceRadixSort per segment.
+ *
+ * The lists of the segments in each bin live in temp storage:
+ * GPUDevice::scratchAllocator's unless the caller passes some. */
+struct DeviceSegmentedSort {
+  Kernel bin;
+  Kernel sortSmall;
+  Kernel sortMedium;
+  Kernel sortLarge;
+
+  uint32 maxSegments;
+
+  /* Writes the parameter block of sorts over an IndirectCount, which
+   * therefore run one after the other. */
+  IndirectDispatch indirect;
+  DeviceBuffer indirectParams;
+
+  static DeviceSegmentedSort make(const GPUDevice &gpu, uint32 maxSegments);
+
+  /* Bytes of tempStorage sorting this many segments needs. */
+  static uint64 tempStorageBytes(uint32 numSegments);
+
+  /* Sorts the segments of keysIn into keysOut. offsets holds numSegments +
+   * 1 elements. keysAlt is scratch the size of the keys, which only large
+   * segments use. */
+  void sortKeys(VkCommandBuffer cmdbuf,
+                const BufferRange &keysIn,
+                const BufferRange &keysOut,
+                const BufferRange &keysAlt,
+                const BufferRange &offsets,
+                uint32 numSegments,
+                const BufferRange &tempStorage = {}) const;
+
+  /* Same, moving values along with the keys. */
+  void sortPairs(VkCommandBuffer cmdbuf,
+                 const BufferRange &keysIn,
+                 const BufferRange &keysOut,
+                 const BufferRange &keysAlt,
+                 const BufferRange &valuesIn,
+                 const BufferRange &valuesOut,
+                 const BufferRange &valuesAlt,
+                 const BufferRange &offsets,
+                 uint32 numSegments,
+                 const BufferRange &tempStorage = {}) const;
+
+  /* Same over as many segments as numSegments holds, at most maxSegments
+   * and as many as offsets has room for. tempStorage is then sized for
+   * maxSegments. */
+  void sortKeys(VkCommandBuffer cmdbuf,
+                const BufferRange &keysIn,
+                const BufferRange &keysOut,
+                const BufferRange &keysAlt,
+                const BufferRange &offsets,
+                const IndirectCount &numSegments,
+                const BufferRange &tempStorage = {}) const;
+
+  void sortPairs(VkCommandBuffer cmdbuf,
+                 const BufferRange &keysIn,
+                 const BufferRange &keysOut,
+                 const BufferRange &keysAlt,
+                 const BufferRange &valuesIn,
+                 const BufferRange &valuesOut,
+                 const BufferRange &valuesAlt,
+                 const BufferRange &offsets,
+                 const IndirectCount &numSegments,
+                 const BufferRange &tempStorage = {}) const;
+
+private:
+  /* count is null unless numSegments is SCAN_INDIRECT_COUNT. */
+  void record(VkCommandBuffer cmdbuf,
+              const BufferRange *keys,
+              const BufferRange *values,
+              const BufferRange &offsets,
+              uint32 numSegments,
+              const IndirectCount *count,
+              const BufferRange &tempStorage) const;
+
+  const GPUDevice *mDev = nullptr;
+};
+
+} /* namespace vub */
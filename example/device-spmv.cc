@@ -0,0 +1,188 @@
+#include "device-spmv.h"
+
+#include <cassert>
+#include <algorithm>
+#include "helper.h"
+#include "profiler.h"
+#include "scratch-allocator.h"
+#include "prefix-sum.h"
+#include "spmv.h"
+
+using namespace Spmv;
+
+namespace vub {
+
+/* Workgroups of the row-based kernel loop over rows. */
+static const uint32 MAX_ROW_GROUPS = 16384;
+
+static uint32
+tileCount(uint32 numRows, uint32 numNonzeros)
+{
+  return (uint32)(((uint64)numRows + numNonzeros + SPMV_ITEMS_PER_BLOCK - 1) /
+                  SPMV_ITEMS_PER_BLOCK);
+}
+
+DeviceSpmv
+DeviceSpmv::make(const GPUDevice &gpu,
+                 uint32 maxRows,
+                 uint32 maxNonzeros,
+                 SpmvType type)
+{
+  bool isDouble = type == SpmvType::Double;
+
+  if (isDouble && !gpu.features.float64)
+    PANIC_AND_EXIT("Device can't run SpMV on doubles (no shaderFloat64)");
+
+  if ((uint64)maxRows + maxNonzeros > UINT32_MAX)
+    PANIC_AND_EXIT("SpMV matrix has too many rows and nonzeros");
+
+  DeviceSpmv ret = {};
+
+  /* Row offsets, columns, values, x, y, look-back status and
+   * parameters. */
+  ret.merge = Kernel::make(gpu, isDouble ? "spmv-double" : "spmv", 7,
+                           sizeof(SpmvPushConstant));
+
+  /* Same without the status. */
+  ret.rows = Kernel::make(gpu, isDouble ? "spmv-rows-double" : "spmv-rows",
+                          6, sizeof(SpmvPushConstant));
+
+  ret.type = type;
+  ret.maxRows = maxRows;
+  ret.maxNonzeros = maxNonzeros;
+  ret.indirect = IndirectDispatch::make(gpu);
+  ret.indirectParams = gpu.makeDeviceBuffer(SCAN_PARAMS_STRIDE);
+  ret.mDev = &gpu;
+
+  return ret;
+}
+
+uint64
+DeviceSpmv::tempStorageBytes(uint32 numRows, uint32 numNonzeros)
+{
+  return SPMV_STATUS_HEADER_SIZE +
+         (uint64)tileCount(numRows, numNonzeros) * SPMV_STATUS_DESCRIPTOR_SIZE;
+}
+
+void
+DeviceSpmv::record(VkCommandBuffer cmdbuf,
+                   const BufferRange &rowOffsets,
+                   const BufferRange &columns,
+                   const BufferRange &values,
+                   const BufferRange &x,
+                   const BufferRange &y,
+                   uint32 numRows,
+                   uint32 numNonzeros,
+                   SpmvAlgorithm algorithm,
+                   const BufferRange &tempStorage) const
+{
+  assert(numRows <= maxRows && numNonzeros <= maxNonzeros);
+
+  if (numRows == 0)
+    return;
+
+  uint64 valueSize = type == SpmvType::Double ? 8 : 4;
+
+  /* Every nonzero reads its column, its value and an element of x, and
+   * every row its offset and an element of y. */
+  ProfileScope profile(*mDev, cmdbuf, "DeviceSpmv",
+                       (uint64)numNonzeros * (4 + 2 * valueSize) +
+                       (uint64)numRows * (4 + valueSize));
+
+  recordProduct(cmdbuf, rowOffsets, columns, values, x, y, numRows,
+                numNonzeros, algorithm, tempStorage);
+}
+
+void
+DeviceSpmv::record(VkCommandBuffer cmdbuf,
+                   const BufferRange &rowOffsets,
+                   const BufferRange &columns,
+                   const BufferRange &values,
+                   const BufferRange &x,
+                   const BufferRange &y,
+                   const IndirectCount &numRows,
+                   SpmvAlgorithm algorithm,
+                   const BufferRange &tempStorage) const
+{
+  ProfileScope profile(*mDev, cmdbuf, "DeviceSpmv (indirect)");
+
+  /* Only the count is used, the kernels aren't dispatched over it. */
+  indirect.record(cmdbuf, numRows,
+                  indirectParams.range(0, SCAN_PARAMS_STRIDE), 1, maxRows);
+
+  recordProduct(cmdbuf, rowOffsets, columns, values, x, y,
+                SCAN_INDIRECT_COUNT, maxNonzeros, algorithm, tempStorage);
+}
+
+void
+DeviceSpmv::recordProduct(VkCommandBuffer cmdbuf,
+                          const BufferRange &rowOffsets,
+                          const BufferRange &columns,
+                          const BufferRange &values,
+                          const BufferRange &x,
+                          const BufferRange &y,
+                          uint32 numRows,
+                          uint32 numNonzeros,
+                          SpmvAlgorithm algorithm,
+                          const BufferRange &tempStorage) const
+{
+  /* Products over an IndirectCount are dispatched for the largest matrix,
+   * and their kernels find out how large it actually is. */
+  bool isIndirect = numRows == SCAN_INDIRECT_COUNT;
+  uint32 dispatchRows = isIndirect ? maxRows : numRows;
+
+  BufferRange params = indirectParams.range(0, SCAN_PARAMS_STRIDE);
+
+  SpmvPushConstant pushConstant = {
+    .numRows = numRows,
+    .numNonzeros = numNonzeros,
+    .flags = 0,
+    .pad = 0
+  };
+
+  /* The inputs may have just been written, or a previous call may still be
+   * using the temp storage. */
+  recordEntryBarrier(cmdbuf);
+
+  if (algorithm == SpmvAlgorithm::RowPerSubgroup)
+  {
+    BufferRange buffers[] = { rowOffsets, columns, values, x, y, params };
+
+    /* Workgroups loop over the rows, so this only has to be about right
+     * for subgroups of 32. */
+    uint32 rowsPerGroup = SPMV_THREADS_PER_BLOCK / 32;
+    rows.dispatch(cmdbuf, buffers, &pushConstant,
+                  std::min(MAX_ROW_GROUPS,
+                           (dispatchRows + rowsPerGroup - 1) / rowsPerGroup));
+
+    recordExitBarrier(cmdbuf);
+    return;
+  }
+
+  uint32 numTiles = tileCount(dispatchRows, numNonzeros);
+  uint64 statusSize = tempStorageBytes(dispatchRows, numNonzeros);
+
+  ScratchScope temp(*mDev, tempStorage, statusSize);
+  BufferRange status = temp.range.range(0, statusSize);
+
+  vkCmdFillBuffer(cmdbuf, status.hdl, status.offset, statusSize, 0);
+
+  VkBufferMemoryBarrier statusBarrier = GPUDevice::makeBarrier(
+    status.hdl, status.offset, statusSize,
+    VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+  recordPipelineBarrier(cmdbuf,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                        nullptr, &statusBarrier);
+
+  BufferRange buffers[] = {
+    rowOffsets, columns, values, x, y, status, params
+  };
+
+  merge.dispatch(cmdbuf, buffers, &pushConstant, numTiles);
+
+  recordExitBarrier(cmdbuf);
+}
+
+} /* namespace vub */
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "kernel.h"
+#include "gpu-device.h"
+#include "indirect-dispatch.h"
+
+namespace vub {
+
+/* Element type of the matrix and of the vectors. */
+enum class SpmvType {
+  Float,
+  /* Needs features.float64. */
+  Double
+};
+
+enum class SpmvAlgorithm {
+  /* Balanced over rows and nonzeros together (see spmv.comp). */
+  Merge,
+  /* A subgroup per row (see spmv-rows.comp). Only there to be compared
+   * against. */
+  RowPerSubgroup
+};
+
+/* Sparse matrix-vector multiply, y = A * x, with A in CSR: numRows + 1 row
+ * offsets, and the column and value of every nonzero.
+ *
+ * The merge-based kernel gives every workgroup the same number of row ends
+ * and nonzeros, so power-law matrices (a few rows holding most nonzeros)
+ * run as fast as regular ones. Rows which span workgroups are summed up
+ * with the decoupled look-back of DeviceScan, whose status lives in temp
+ * storage: GPUDevice::scratchAllocator's unless the caller passes some. */
+struct DeviceSpmv {
+  Kernel merge;
+  Kernel rows;
+
+  SpmvType type;
+  uint32 maxRows;
+  uint32 maxNonzeros;
+
+  /* Writes the parameter block of products over an IndirectCount, which
+   * therefore run one after the other. */
+  IndirectDispatch indirect;
+  DeviceBuffer indirectParams;
+
+  static DeviceSpmv make(const GPUDevice &gpu,
+                         uint32 maxRows,
+                         uint32 maxNonzeros,
+                         SpmvType type = SpmvType::Float);
+
+  /* Bytes of tempStorage a product with this many rows and nonzeros needs
+   * (none with SpmvAlgorithm::RowPerSubgroup). */
+  static uint64 tempStorageBytes(uint32 numRows, uint32 numNonzeros);
+
+  void record(VkCommandBuffer cmdbuf,
+              const BufferRange &rowOffsets,
+              const BufferRange &columns,
+              const BufferRange &values,
+              const BufferRange &x,
+              const BufferRange &y,
+              uint32 numRows,
+              uint32 numNonzeros,
+              SpmvAlgorithm algorithm = SpmvAlgorithm::Merge,
+              const BufferRange &tempStorage = {}) const;
+
+  /* Same with as many rows as numRows holds (at most maxRows), like the
+   * groups of a hash table extract, and rowOffsets[numRows] nonzeros (at
+   * most maxNonzeros). Every tile of a matrix of maxRows and maxNonzeros
+   * is dispatched, and tempStorage has to be enough for that. */
+  void record(VkCommandBuffer cmdbuf,
+              const BufferRange &rowOffsets,
+              const BufferRange &columns,
+              const BufferRange &values,
+              const BufferRange &x,
+              const BufferRange &y,
+              const IndirectCount &numRows,
+              SpmvAlgorithm algorithm = SpmvAlgorithm::Merge,
+              const BufferRange &tempStorage = {}) const;
+
+private:
+  /* numRows is SCAN_INDIRECT_COUNT for the products over an IndirectCount,
+   * which then have their parameter block written already. */
+  void recordProduct(VkCommandBuffer cmdbuf,
+                     const BufferRange &rowOffsets,
+                     const BufferRange &columns,
+                     const BufferRange &values,
+                     const BufferRange &x,
+                     const BufferRange &y,
+                     uint32 numRows,
+                     uint32 numNonzeros,
+                     SpmvAlgorithm algorithm,
+                     const BufferRange &tempStorage) const;
+
+  const GPUDevice *mDev = nullptr;
+};
+
+} /* namespace vub */
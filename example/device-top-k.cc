@@ -0,0 +1,311 @@
+#include "device-top-k.h"
+
+#include <cassert>
+#include <algorithm>
+#include "helper.h"
+#include "memory-tracker.h"
+#include "profiler.h"
+#include "prefix-sum.h"
+#include "radix-select.h"
+#include "scratch-allocator.h"
+
+using namespace RadixSelect;
+
+namespace vub {
+
+/* Workgroups of the kernels reading every key loop over tiles, so there is
+ * no need for more of them than the device can keep busy. This also bounds
+ * the number of atomics on the histogram. */
+static const uint32 MAX_SELECT_GROUPS = 2048;
+
+/* Selections over an IndirectCount are dispatched for as many keys as
+ * fit in keys. */
+static uint32
+selectGroupCount(const BufferRange &keys, uint32 numElements)
+{
+  if (numElements == SCAN_INDIRECT_COUNT)
+    numElements = (uint32)std::min<uint64>(keys.size / sizeof(uint32),
+                                           SCAN_INDIRECT_COUNT - 1);
+
+  uint32 numTiles = (uint32)(((uint64)numElements +
+                              RADIX_SELECT_VALUES_PER_BLOCK - 1) /
+                             RADIX_SELECT_VALUES_PER_BLOCK);
+  return std::min(MAX_SELECT_GROUPS, numTiles);
+}
+
+static uint32
+selectFlags(SelectOrder order, SelectKey key)
+{
+  uint32 flags = 0;
+  if (order == SelectOrder::Largest)
+    flags |= RADIX_SELECT_FLAG_LARGEST;
+  if (key == SelectKey::Float)
+    flags |= RADIX_SELECT_FLAG_FLOAT;
+  return flags;
+}
+
+/* Makes a transfer visible to the shaders after it. */
+static void
+recordTransferBarrier(VkCommandBuffer cmdbuf)
+{
+  VkMemoryBarrier barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT
+  };
+
+  recordPipelineBarrier(cmdbuf,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                        &barrier);
+}
+
+RadixSelect
+RadixSelect::make(const GPUDevice &gpu)
+{
+  MemoryScope memoryScope(gpu, "RadixSelect");
+
+  RadixSelect ret = {};
+
+  /* Keys, state and parameters. */
+  ret.histogram = Kernel::make(gpu, "radix-select-histogram", 3,
+                               sizeof(RadixSelectPushConstant));
+
+  /* State and parameters. */
+  ret.digit = Kernel::make(gpu, "radix-select-digit", 2,
+                           sizeof(RadixSelectPushConstant));
+
+  ret.mDev = &gpu;
+
+  return ret;
+}
+
+uint64
+RadixSelect::stateBytes()
+{
+  return sizeof(RadixSelectState);
+}
+
+void
+RadixSelect::record(VkCommandBuffer cmdbuf,
+                    const BufferRange &keys,
+                    uint32 numElements,
+                    uint32 rank,
+                    uint32 flags,
+                    const BufferRange &state,
+                    const BufferRange &params) const
+{
+  assert(rank < numElements && state.size >= stateBytes());
+
+  /* A previous call may still be using the state, and the keys may have
+   * just been written. */
+  recordEntryBarrier(cmdbuf);
+
+  vkCmdFillBuffer(cmdbuf, state.hdl, state.offset, stateBytes(), 0);
+  recordTransferBarrier(cmdbuf);
+
+  /* Unused without SCAN_INDIRECT_COUNT, but still needs a binding. */
+  BufferRange paramsRange = params.size > 0 ? params : state;
+
+  BufferRange histogramBuffers[] = { keys, state, paramsRange };
+  BufferRange digitBuffers[] = { state, paramsRange };
+
+  for (int shift = 32 - RADIX_SELECT_BITS; shift >= 0;
+       shift -= RADIX_SELECT_BITS)
+  {
+    RadixSelectPushConstant pushConstant = {
+      .numElements = numElements,
+      .rank = rank,
+      .shift = (uint32)shift,
+      .flags = flags
+    };
+
+    histogram.dispatch(cmdbuf, histogramBuffers, &pushConstant,
+                       selectGroupCount(keys, numElements));
+    recordComputeBarrier(cmdbuf);
+
+    digit.dispatch(cmdbuf, digitBuffers, &pushConstant, 1);
+    recordComputeBarrier(cmdbuf);
+  }
+}
+
+DeviceSelectNth
+DeviceSelectNth::make(const GPUDevice &gpu)
+{
+  MemoryScope memoryScope(gpu, "DeviceSelectNth");
+
+  DeviceSelectNth ret = {};
+
+  ret.select = RadixSelect::make(gpu);
+
+  /* Keys, state and output. */
+  ret.nth = Kernel::make(gpu, "radix-select-nth", 3,
+                         sizeof(RadixSelectPushConstant));
+  ret.mDev = &gpu;
+
+  return ret;
+}
+
+uint64
+DeviceSelectNth::tempStorageBytes(uint32 numElements)
+{
+  (void)numElements;
+  return RadixSelect::stateBytes();
+}
+
+void
+DeviceSelectNth::record(VkCommandBuffer cmdbuf,
+                        const BufferRange &keys,
+                        uint32 numElements,
+                        uint32 n,
+                        const BufferRange &out,
+                        SelectOrder order,
+                        SelectKey key,
+                        const BufferRange &tempStorage) const
+{
+  assert(n < numElements && out.size >= 2 * sizeof(uint32));
+
+  uint32 flags = selectFlags(order, key);
+
+  /* Four passes over the keys and, at most, one more. */
+  ProfileScope profile(*mDev, cmdbuf, "DeviceSelectNth",
+                       5 * (uint64)numElements * sizeof(uint32));
+
+  ScratchScope temp(*mDev, tempStorage, tempStorageBytes(numElements));
+  BufferRange state = temp.range.range(0, RadixSelect::stateBytes());
+
+  select.record(cmdbuf, keys, numElements, n, flags, state);
+
+  vkCmdFillBuffer(cmdbuf, out.hdl, out.offset + sizeof(uint32),
+                  sizeof(uint32), 0xFFFFFFFF);
+  recordTransferBarrier(cmdbuf);
+
+  RadixSelectPushConstant pushConstant = {
+    .numElements = numElements,
+    .rank = n,
+    .shift = 0,
+    .flags = flags
+  };
+
+  BufferRange buffers[] = { keys, state, out };
+
+  nth.dispatch(cmdbuf, buffers, &pushConstant,
+               selectGroupCount(keys, numElements));
+  recordExitBarrier(cmdbuf);
+}
+
+DeviceTopK
+DeviceTopK::make(const GPUDevice &gpu)
+{
+  MemoryScope memoryScope(gpu, "DeviceTopK");
+
+  DeviceTopK ret = {};
+
+  ret.select = RadixSelect::make(gpu);
+
+  /* Keys, state, keys out, indices out and parameters. */
+  ret.compact = Kernel::make(gpu, "radix-select-compact", 5,
+                             sizeof(RadixSelectPushConstant));
+  ret.indirect = IndirectDispatch::make(gpu);
+  ret.indirectParams = gpu.makeDeviceBuffer(SCAN_PARAMS_STRIDE);
+  ret.mDev = &gpu;
+
+  return ret;
+}
+
+uint64
+DeviceTopK::tempStorageBytes(uint32 numElements)
+{
+  (void)numElements;
+  return RadixSelect::stateBytes();
+}
+
+void
+DeviceTopK::record(VkCommandBuffer cmdbuf,
+                   const BufferRange &keys,
+                   uint32 numElements,
+                   uint32 k,
+                   const BufferRange &keysOut,
+                   const BufferRange &indicesOut,
+                   SelectOrder order,
+                   SelectKey key,
+                   const BufferRange &tempStorage) const
+{
+  assert(k <= numElements);
+
+  if (k == 0)
+    return;
+
+  uint32 flags = selectFlags(order, key);
+
+  /* Five passes over the keys. */
+  ProfileScope profile(*mDev, cmdbuf, "DeviceTopK",
+                       5 * (uint64)numElements * sizeof(uint32));
+
+  ScratchScope temp(*mDev, tempStorage, tempStorageBytes(numElements));
+  BufferRange state = temp.range.range(0, RadixSelect::stateBytes());
+
+  recordTopK(cmdbuf, keys, numElements, k, keysOut, indicesOut, flags,
+             state);
+}
+
+void
+DeviceTopK::record(VkCommandBuffer cmdbuf,
+                   const BufferRange &keys,
+                   const IndirectCount &count,
+                   uint32 k,
+                   const BufferRange &keysOut,
+                   const BufferRange &indicesOut,
+                   SelectOrder order,
+                   SelectKey key,
+                   const BufferRange &tempStorage) const
+{
+  if (k == 0)
+    return;
+
+  uint32 maxKeys = (uint32)std::min<uint64>(keys.size / sizeof(uint32),
+                                            SCAN_INDIRECT_COUNT - 1);
+
+  ProfileScope profile(*mDev, cmdbuf, "DeviceTopK (indirect)");
+
+  ScratchScope temp(*mDev, tempStorage, tempStorageBytes(maxKeys));
+  BufferRange state = temp.range.range(0, RadixSelect::stateBytes());
+
+  /* Only the count is used: the kernels loop over the tiles of all the
+   * keys there may be. */
+  indirect.record(cmdbuf, count, indirectParams.range(0, SCAN_PARAMS_STRIDE),
+                  1, maxKeys);
+
+  recordTopK(cmdbuf, keys, SCAN_INDIRECT_COUNT, k, keysOut, indicesOut,
+             selectFlags(order, key), state);
+}
+
+void
+DeviceTopK::recordTopK(VkCommandBuffer cmdbuf,
+                       const BufferRange &keys,
+                       uint32 numElements,
+                       uint32 k,
+                       const BufferRange &keysOut,
+                       const BufferRange &indicesOut,
+                       uint32 flags,
+                       const BufferRange &state) const
+{
+  BufferRange params = indirectParams.range(0, SCAN_PARAMS_STRIDE);
+
+  select.record(cmdbuf, keys, numElements, k - 1, flags, state, params);
+
+  RadixSelectPushConstant pushConstant = {
+    .numElements = numElements,
+    .rank = k - 1,
+    .shift = 0,
+    .flags = flags
+  };
+
+  BufferRange buffers[] = { keys, state, keysOut, indicesOut, params };
+
+  compact.dispatch(cmdbuf, buffers, &pushConstant,
+                   selectGroupCount(keys, numElements));
+  recordExitBarrier(cmdbuf);
+}
+
+} /* namespace vub */
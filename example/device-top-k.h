@@ -0,0 +1,141 @@
+#pragma once
+
+#include "kernel.h"
+#include "gpu-device.h"
+#include "indirect-dispatch.h"
+
+namespace vub {
+
+/* What the 32-bit keys of a selection are and which end they are ranked
+ * from. */
+enum class SelectKey {
+  Uint,
+  Float
+};
+
+enum class SelectOrder {
+  Smallest,
+  Largest
+};
+
+/* Finds the key of a given rank with a radix select: every pass counts the
+ * next 8-bit digit of the keys which still match the digits found so far
+ * and keeps the digit the rank falls in. Four passes over the keys find
+ * any rank, with nothing going back to the host.
+ *
+ * Used by DeviceSelectNth and DeviceTopK, whose temp storage holds the
+ * RadixSelectState: GPUDevice::scratchAllocator's unless the caller passes
+ * some. */
+struct RadixSelect {
+  Kernel histogram;
+  Kernel digit;
+
+  static RadixSelect make(const GPUDevice &gpu);
+
+  /* Bytes of state a select needs. */
+  static uint64 stateBytes();
+
+  /* Leaves the key of the given rank among numElements keys in state.
+   * rank has to be less than numElements. With SCAN_INDIRECT_COUNT, the
+   * count is in params instead, and may be at most as many keys as fit in
+   * keys. */
+  void record(VkCommandBuffer cmdbuf,
+              const BufferRange &keys,
+              uint32 numElements,
+              uint32 rank,
+              uint32 flags,
+              const BufferRange &state,
+              const BufferRange &params = {}) const;
+
+private:
+  const GPUDevice *mDev = nullptr;
+};
+
+/* Finds the n-th key (0 being the first) in the order asked for, without
+ * sorting. Percentiles and medians are select-nths. */
+struct DeviceSelectNth {
+  RadixSelect select;
+  Kernel nth;
+
+  static DeviceSelectNth make(const GPUDevice &gpu);
+
+  /* Bytes of tempStorage a select among numElements keys needs. */
+  static uint64 tempStorageBytes(uint32 numElements);
+
+  /* Writes the key and the lowest index it is at to out, as two uint32. */
+  void record(VkCommandBuffer cmdbuf,
+              const BufferRange &keys,
+              uint32 numElements,
+              uint32 n,
+              const BufferRange &out,
+              SelectOrder order = SelectOrder::Smallest,
+              SelectKey key = SelectKey::Uint,
+              const BufferRange &tempStorage = {}) const;
+
+private:
+  const GPUDevice *mDev = nullptr;
+};
+
+/* Finds the k smallest (or largest) keys and their indices, without
+ * sorting: a radix select finds the k-th key and a compaction writes out
+ * every key before it and as many keys equal to it as are needed.
+ *
+ * The keys come out in no particular order and, when several keys are
+ * equal to the k-th, which of them make it isn't specified. Sort the k
+ * keys afterwards (with DeviceMergeSort) if the order matters. */
+struct DeviceTopK {
+  RadixSelect select;
+  Kernel compact;
+
+  /* Writes the parameter block of top-ks over an IndirectCount, which
+   * therefore run one after the other. */
+  IndirectDispatch indirect;
+  DeviceBuffer indirectParams;
+
+  static DeviceTopK make(const GPUDevice &gpu);
+
+  /* Bytes of tempStorage a top-k of numElements keys needs. */
+  static uint64 tempStorageBytes(uint32 numElements);
+
+  /* keysOut and indicesOut hold k elements. k has to be at most
+   * numElements. */
+  void record(VkCommandBuffer cmdbuf,
+              const BufferRange &keys,
+              uint32 numElements,
+              uint32 k,
+              const BufferRange &keysOut,
+              const BufferRange &indicesOut,
+              SelectOrder order = SelectOrder::Smallest,
+              SelectKey key = SelectKey::Uint,
+              const BufferRange &tempStorage = {}) const;
+
+  /* Same among as many keys as count holds, at most as many as fit in
+   * keys. If that is fewer than k, all of them are written and the rest of
+   * keysOut and indicesOut is left as it is. */
+  void record(VkCommandBuffer cmdbuf,
+              const BufferRange &keys,
+              const IndirectCount &count,
+              uint32 k,
+              const BufferRange &keysOut,
+              const BufferRange &indicesOut,
+              SelectOrder order = SelectOrder::Smallest,
+              SelectKey key = SelectKey::Uint,
+              const BufferRange &tempStorage = {}) const;
+
+private:
+  /* numElements is SCAN_INDIRECT_COUNT for the top-ks over an
+   * IndirectCount, which then have their parameter block written
+   * already. */
+  void recordTopK(VkCommandBuffer cmdbuf,
+                  const BufferRange &keys,
+                  uint32 numElements,
+                  uint32 k,
+                  const BufferRange &keysOut,
+                  const BufferRange &indicesOut,
+                  uint32 flags,
+                  const BufferRange &state) const;
+
+  const GPUDevice *mDev = nullptr;
+};
+
+} /* namespace vub */
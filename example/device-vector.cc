@@ -0,0 +1,267 @@
+#include "device-vector.h"
+
+#include <cassert>
+#include <algorithm>
+#include "kernel.h"
+#include "helper.h"
+#include "memory-tracker.h"
+#include "vector-append.h"
+
+using namespace VectorAppend;
+
+namespace vub {
+
+/* Smallest chunk bound to a sparse vector at once, so that vectors which
+ * grow a few elements at a time don't take a bind for each. */
+static const uint64 MIN_SPARSE_CHUNK = 2 * 1024 * 1024;
+
+DeviceVectorStorage
+DeviceVectorStorage::make(const GPUDevice &gpu,
+                          uint64 elementSize,
+                          uint64 maxCount,
+                          uint64 capacity)
+{
+  MemoryScope memoryScope(gpu, "DeviceVector");
+
+  assert(elementSize > 0);
+  assert(maxCount > 0 && maxCount <= UINT32_MAX);
+  assert(capacity <= maxCount);
+
+  DeviceVectorStorage ret = {};
+  ret.elementSize = elementSize;
+  ret.size = 0;
+  ret.capacity = 0;
+  ret.maxCount = maxCount;
+  ret.sparse = gpu.features.sparseBuffer;
+  ret.mCommittedBytes = 0;
+  ret.mDev = &gpu;
+
+  if (ret.sparse)
+    ret.buffer = gpu.makeSparseDeviceBuffer(maxCount * elementSize);
+
+  ret.header = gpu.makeDeviceBuffer(sizeof(VectorHeader));
+  ret.mReadback = gpu.makeStagingBuffer(sizeof(VectorHeader),
+                                        VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+
+  if (capacity > 0)
+    ret.reserve(capacity);
+
+  return ret;
+}
+
+void
+DeviceVectorStorage::reserve(uint64 count)
+{
+  if (count <= capacity)
+    return;
+
+  if (count > maxCount)
+  {
+    printf("Device vector of at most %llu elements can't hold %llu\n",
+           (unsigned long long)maxCount, (unsigned long long)count);
+    PANIC_AND_EXIT("Device vector is full");
+  }
+
+  MemoryScope memoryScope(*mDev, "DeviceVector");
+
+  if (sparse)
+    growSparse(count * elementSize);
+  else
+    growByCopy(count);
+}
+
+/* Binds a chunk after the memory there is, which is the only part of the
+ * buffer which changes. */
+void
+DeviceVectorStorage::growSparse(uint64 bytes)
+{
+  uint64 blockSize = mDev->getSparseBlockSize(buffer);
+
+  uint64 chunk = std::max({ bytes - mCommittedBytes,
+                            mCommittedBytes / 2,
+                            MIN_SPARSE_CHUNK });
+  /* The last chunk may end with the buffer instead of on a block. */
+  chunk = std::min(roundUp(chunk, blockSize), buffer.size - mCommittedBytes);
+
+  mChunks.push_back(mDev->bindSparseMemory(buffer, mCommittedBytes, chunk));
+  mCommittedBytes += chunk;
+
+  capacity = std::min(mCommittedBytes / elementSize, maxCount);
+}
+
+static void
+recordCopyBarrier(VkCommandBuffer cmdbuf)
+{
+  VkMemoryBarrier barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT |
+                     VK_ACCESS_TRANSFER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT
+  };
+
+  vkCmdPipelineBarrier(cmdbuf,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                       VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void
+DeviceVectorStorage::growByCopy(uint64 count)
+{
+  uint64 newCapacity = std::min(std::max(count, capacity * 2), maxCount);
+  DeviceBuffer newBuffer = mDev->makeDeviceBuffer(newCapacity * elementSize);
+
+  /* Nothing to copy or free the first time. */
+  if (buffer.hdl != VK_NULL_HANDLE)
+  {
+    VkCommandBuffer cmdbuf = mDev->makeCommandBuffer();
+    mDev->beginSingleUseCommandBuffer(cmdbuf);
+
+    if (size > 0)
+    {
+      /* Against whatever wrote the elements in earlier submits. */
+      recordCopyBarrier(cmdbuf);
+
+      VkBufferCopy region = {
+        .srcOffset = 0,
+        .dstOffset = 0,
+        .size = size * elementSize
+      };
+
+      vkCmdCopyBuffer(cmdbuf, buffer.hdl, newBuffer.hdl, 1, &region);
+    }
+
+    mDev->endCommandBuffer(cmdbuf);
+
+    VkFenceCreateInfo fenceInfo = {
+      .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO
+    };
+
+    /* The fence also covers the submits before this one, which may still
+     * use the old buffer. */
+    VkFence fence;
+    VK_CHECK(vkCreateFence(mDev->dev, &fenceInfo, nullptr, &fence));
+    mDev->submitCommandBuffer(cmdbuf, VK_NULL_HANDLE, VK_NULL_HANDLE,
+                              0, fence);
+    VK_CHECK(mDev->waitForFence(fence));
+
+    vkDestroyFence(mDev->dev, fence, nullptr);
+    mDev->freeCommandBuffer(cmdbuf);
+
+    vkDestroyBuffer(mDev->dev, buffer.hdl, nullptr);
+    mDev->freeMemory(buffer.mem);
+  }
+
+  buffer = newBuffer;
+  capacity = newCapacity;
+}
+
+void
+DeviceVectorStorage::recordAppendBegin(VkCommandBuffer cmdbuf) const
+{
+  VectorHeader start = {};
+  start.count = (uint32)size;
+  start.capacity = (uint32)capacity;
+
+  /* The appends or readback copy of a previous call may still be using the
+   * header. */
+  recordUpdateBarrier(cmdbuf);
+
+  vkCmdUpdateBuffer(cmdbuf, header.hdl, 0, sizeof(start), &start);
+
+  /* Appending kernels, or an IndirectDispatch on the count, come next. */
+  recordIndirectBarrier(cmdbuf);
+}
+
+void
+DeviceVectorStorage::recordAppendEnd(VkCommandBuffer cmdbuf) const
+{
+  recordComputeBarrier(cmdbuf);
+
+  VkBufferCopy region = {
+    .srcOffset = 0,
+    .dstOffset = 0,
+    .size = sizeof(VectorHeader)
+  };
+
+  vkCmdCopyBuffer(cmdbuf, header.hdl, mReadback.hdl, 1, &region);
+}
+
+uint64
+DeviceVectorStorage::finishAppend()
+{
+  const VectorHeader *end = (const VectorHeader *)mReadback.ptr;
+
+  /* Dropped appends leave holes, so none of it is kept. */
+  if (!end->overflow)
+    size = end->count;
+
+  return end->count;
+}
+
+void
+DeviceVectorStorage::release()
+{
+  if (!mDev)
+    return;
+
+  if (buffer.hdl != VK_NULL_HANDLE)
+    vkDestroyBuffer(mDev->dev, buffer.hdl, nullptr);
+
+  /* Sparse buffers have their memory in mChunks instead. */
+  if (buffer.mem != VK_NULL_HANDLE)
+    mDev->freeMemory(buffer.mem);
+
+  for (VkDeviceMemory chunk : mChunks)
+    mDev->freeMemory(chunk);
+
+  vkDestroyBuffer(mDev->dev, header.hdl, nullptr);
+  mDev->freeMemory(header.mem);
+
+  mChunks.clear();
+  mDev = nullptr;
+}
+
+DeviceVectorStorage::DeviceVectorStorage(DeviceVectorStorage &&other)
+  : buffer(other.buffer), header(other.header),
+    elementSize(other.elementSize), size(other.size),
+    capacity(other.capacity), maxCount(other.maxCount),
+    sparse(other.sparse), mChunks(std::move(other.mChunks)),
+    mCommittedBytes(other.mCommittedBytes),
+    mReadback(std::move(other.mReadback)), mDev(other.mDev)
+{
+  other.mDev = nullptr;
+}
+
+DeviceVectorStorage &
+DeviceVectorStorage::operator=(DeviceVectorStorage &&other)
+{
+  if (this != &other)
+  {
+    release();
+
+    buffer = other.buffer;
+    header = other.header;
+    elementSize = other.elementSize;
+    size = other.size;
+    capacity = other.capacity;
+    maxCount = other.maxCount;
+    sparse = other.sparse;
+    mChunks = std::move(other.mChunks);
+    mCommittedBytes = other.mCommittedBytes;
+    mReadback = std::move(other.mReadback);
+    mDev = other.mDev;
+
+    other.mDev = nullptr;
+  }
+
+  return *this;
+}
+
+DeviceVectorStorage::~DeviceVectorStorage()
+{
+  release();
+}
+
+} /* namespace vub */
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <vector>
+#include <cassert>
+#include "gpu-device.h"
+#include "indirect-dispatch.h"
+
+namespace vub {
+
+/* Untyped part of DeviceVector, which sizes are in elements of
+ * elementSize bytes. */
+struct DeviceVectorStorage {
+  /* The elements. Sparse vectors reserve address space for maxCount
+   * elements up front, of which only the first capacity have memory. */
+  DeviceBuffer buffer;
+
+  /* VectorHeader, for appends from kernels. */
+  DeviceBuffer header;
+
+  uint64 elementSize;
+  uint64 size;
+  uint64 capacity;
+  uint64 maxCount;
+  bool sparse;
+
+  static DeviceVectorStorage make(const GPUDevice &gpu,
+                                  uint64 elementSize,
+                                  uint64 maxCount,
+                                  uint64 capacity);
+
+  void reserve(uint64 count);
+
+  void recordAppendBegin(VkCommandBuffer cmdbuf) const;
+  void recordAppendEnd(VkCommandBuffer cmdbuf) const;
+  uint64 finishAppend();
+
+  DeviceVectorStorage() = default;
+  DeviceVectorStorage(DeviceVectorStorage &&other);
+  DeviceVectorStorage &operator=(DeviceVectorStorage &&other);
+  ~DeviceVectorStorage();
+
+private:
+  void growSparse(uint64 bytes);
+  void growByCopy(uint64 count);
+  void release();
+
+  /* Memory bound to a sparse buffer, in the order of the ranges it backs. */
+  std::vector<VkDeviceMemory> mChunks;
+  uint64 mCommittedBytes;
+
+  /* Where recordAppendEnd copies the header for finishAppend. */
+  StagingBuffer mReadback;
+
+  const GPUDevice *mDev = nullptr;
+};
+
+/* Array of T in device memory which can grow, from the host and from
+ * kernels.
+ *
+ * With features.sparseBuffer, the buffer is sparse: growing binds more
+ * memory after what is there, without copying anything and without moving
+ * the buffer, so ranges and recorded command buffers stay valid and work
+ * in flight goes on. Memory is bound in chunks of at least half of what
+ * the vector already has, so a vector which keeps growing only takes a
+ * logarithmic number of binds.
+ *
+ * Without it, growing allocates a buffer of twice the capacity (or of what
+ * was asked for, if that is more), copies the elements over on the queue
+ * and waits for the copy before freeing the old buffer. Ranges of the
+ * vector are invalid after that.
+ *
+ * Kernels append with DEFINE_VECTOR_APPEND (vector-append.glsl) on
+ * header(): recordAppendBegin before them, recordAppendEnd after them,
+ * and once the submit has finished, finishAppend. */
+template <typename T>
+struct DeviceVector {
+  DeviceVectorStorage storage;
+
+  /* capacity elements get memory right away. The vector never grows past
+   * maxCount, which may be at most UINT32_MAX. */
+  static DeviceVector make(const GPUDevice &gpu,
+                           uint64 maxCount,
+                           uint64 capacity = 0)
+  {
+    DeviceVector ret = {};
+    ret.storage = DeviceVectorStorage::make(gpu, sizeof(T), maxCount,
+                                            capacity);
+    return ret;
+  }
+
+  uint64 size() const { return storage.size; }
+  uint64 capacity() const { return storage.capacity; }
+  uint64 maxCount() const { return storage.maxCount; }
+  bool isSparse() const { return storage.sparse; }
+
+  /* Makes room for count elements, never shrinks. Only the copy of a
+   * vector which isn't sparse waits for the queue. */
+  void reserve(uint64 count) { storage.reserve(count); }
+
+  /* New elements are undefined. */
+  void resize(uint64 count)
+  {
+    storage.reserve(count);
+    storage.size = count;
+  }
+
+  void clear() { storage.size = 0; }
+
+  /* count defaults to the rest of the elements. */
+  BufferRange range(uint64 first = 0, uint64 count = VK_WHOLE_SIZE) const
+  {
+    assert(first <= storage.size);
+
+    if (count == VK_WHOLE_SIZE)
+      count = storage.size - first;
+
+    assert(first + count <= storage.size);
+
+    return storage.buffer.range(first * sizeof(T), count * sizeof(T));
+  }
+
+  /* Every element there is memory for, which is what appending kernels
+   * write to. */
+  BufferRange capacityRange() const
+  {
+    return storage.buffer.range(0, storage.capacity * sizeof(T));
+  }
+
+  BufferRange header() const { return storage.header; }
+
+  /* The count of the header, for primitives working on what was appended.
+   * It may exceed capacity(), so give capacity() as their maximum. */
+  IndirectCount appendCount() const { return { storage.header }; }
+
+  /* Points the header at the end of the vector. Kernels appending to it
+   * may follow right away. */
+  void recordAppendBegin(VkCommandBuffer cmdbuf) const
+  {
+    storage.recordAppendBegin(cmdbuf);
+  }
+
+  /* Copies the header for finishAppend, after a barrier against the
+   * appending kernels. */
+  void recordAppendEnd(VkCommandBuffer cmdbuf) const
+  {
+    storage.recordAppendEnd(cmdbuf);
+  }
+
+  /* Call once the submit with recordAppendEnd has finished. Takes the
+   * appended elements into the vector and returns its size with all of
+   * them. If that is more than capacity(), some appends were dropped and
+   * the size stays what it was: reserve the returned size and append
+   * again. */
+  uint64 finishAppend() { return storage.finishAppend(); }
+};
+
+} /* namespace vub */
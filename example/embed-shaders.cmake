@@ -0,0 +1,49 @@
+# Writes OUTPUT, the gEmbeddedShaders of shader-compiler.h, from MANIFEST.
+# Every line of it is the name of a shader of SHADER_DIR and its variant
+# key, separated by a tab (see add_vub_shader). The SPIR-V is only put in
+# with EMBED.
+
+file(STRINGS ${MANIFEST} LINES)
+
+set(ARRAYS "")
+set(TABLE "")
+set(INDEX 0)
+
+foreach(LINE IN LISTS LINES)
+  string(FIND "${LINE}" "\t" TAB)
+  string(SUBSTRING "${LINE}" 0 ${TAB} NAME)
+  math(EXPR KEY_START "${TAB} + 1")
+  string(SUBSTRING "${LINE}" ${KEY_START} -1 KEY)
+
+  string(REPLACE "\\" "\\\\" KEY "${KEY}")
+  string(REPLACE "\"" "\\\"" KEY "${KEY}")
+
+  if (NOT EMBED)
+    string(APPEND TABLE "  { \"${NAME}\", \"${KEY}\", nullptr, 0 },\n")
+    continue()
+  endif()
+
+  # SPIR-V is made of little endian words, four to a line.
+  file(READ ${SHADER_DIR}/${NAME}.spv CODE HEX)
+  string(REGEX REPLACE "(..)(..)(..)(..)" "0x\\4\\3\\2\\1, " CODE "${CODE}")
+  string(REGEX REPLACE "(0x[0-9a-f]+, 0x[0-9a-f]+, 0x[0-9a-f]+, 0x[0-9a-f]+, )"
+         "\\1\n  " CODE "${CODE}")
+
+  string(APPEND ARRAYS
+         "/* ${NAME} */\nstatic const uint32 gCode${INDEX}[] = {\n  ${CODE}\n};\n\n")
+  string(APPEND TABLE
+         "  { \"${NAME}\", \"${KEY}\", gCode${INDEX}, sizeof(gCode${INDEX}) },\n")
+
+  math(EXPR INDEX "${INDEX} + 1")
+endforeach()
+
+string(REPLACE ", \n" ",\n" ARRAYS "${ARRAYS}")
+
+file(WRITE ${OUTPUT}
+     "/* Generated by embed-shaders.cmake. */\n\n"
+     "#include \"shader-compiler.h\"\n\n"
+     "${ARRAYS}"
+     "const EmbeddedShader gEmbeddedShaders[] = {\n"
+     "${TABLE}"
+     "  { nullptr, nullptr, nullptr, 0 }\n"
+     "};\n")
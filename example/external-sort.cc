@@ -0,0 +1,562 @@
+#include "external-sort.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include "helper.h"
+#include "memory-tracker.h"
+
+namespace vub {
+
+/* Read ahead and drop behind mappings, if the memory is mapped. */
+static void
+willNeed(const MappedFile *file, const void *ptr, uint64 bytes)
+{
+  if (file && bytes > 0)
+    file->willNeed((const uint8 *)ptr - (const uint8 *)file->ptr, bytes);
+}
+
+static void
+release(const MappedFile *file, const void *ptr, uint64 bytes)
+{
+  if (file && bytes > 0)
+    file->release((const uint8 *)ptr - (const uint8 *)file->ptr, bytes);
+}
+
+ExternalSort
+ExternalSort::make(const GPUDevice &gpu, uint32 runElements,
+                   SpillTarget spill, const char *spillDirectory)
+{
+  MemoryScope memoryScope(gpu, "ExternalSort");
+
+  if (runElements == 0)
+  {
+    /* Keys, values and their scratch take four words per element. Only
+     * half of what is left in the budget, for the staging, the sort's
+     * scratch and whatever gets allocated after. */
+    uint64 byMemory =
+      gpu.getDeviceLocalMemoryBudget().available / 2 / (4 * sizeof(uint32));
+    uint64 byRange = gpu.getMaxStorageBufferRange() / sizeof(uint32);
+
+    runElements = (uint32)std::min<uint64>({byMemory, byRange, 1u << 28});
+  }
+
+  uint64 bytes = (uint64)runElements * sizeof(uint32);
+
+  ExternalSort ret = {};
+  ret.spill = spill;
+  ret.runElements = runElements;
+  ret.mDev = &gpu;
+  ret.mSort = DeviceRadixSort::make(gpu, runElements);
+  ret.mMerge = DeviceMerge::make(gpu);
+  ret.mSpillDirectory = spillDirectory;
+
+  for (uint32 i = 0; i < 2; ++i)
+  {
+    ret.mKeys[i] = gpu.makeDeviceBuffer(bytes);
+    ret.mValues[i] = gpu.makeDeviceBuffer(bytes);
+    ret.mStaging[i] = gpu.makeStagingBuffer(
+      2 * bytes,
+      VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+  }
+
+  return ret;
+}
+
+MappedFile
+ExternalSort::makeSpillFile(uint64 size) const
+{
+  std::string path = mSpillDirectory + "/vub-sort-XXXXXX";
+
+  int fd = mkstemp(path.data());
+  if (fd < 0)
+  {
+    printf("Failed to create a spill file in %s\n", mSpillDirectory.c_str());
+    PANIC_AND_EXIT("Failed to create spill file");
+  }
+  close(fd);
+
+  /* The mapping keeps the file around until it gets unmapped. */
+  MappedFile ret = MappedFile::create(path.c_str(), size);
+  unlink(path.c_str());
+
+  return ret;
+}
+
+void
+ExternalSort::stream(
+  const std::function<bool(uint32)> &fill,
+  const std::function<void(VkCommandBuffer, uint32)> &record,
+  const std::function<void(uint32)> &drain)
+{
+  VkCommandBuffer cmdbufs[2];
+  VkFence fences[2];
+  bool busy[2] = {};
+
+  for (uint32 i = 0; i < 2; ++i)
+  {
+    cmdbufs[i] = mDev->makeCommandBuffer();
+
+    VkFenceCreateInfo fenceInfo = {
+      .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO
+    };
+
+    VK_CHECK(vkCreateFence(mDev->dev, &fenceInfo, nullptr, &fences[i]));
+  }
+
+  auto finish = [&] (uint32 slot) {
+    if (!busy[slot])
+      return;
+
+    VK_CHECK(mDev->waitForFence(fences[slot]));
+    VK_CHECK(vkResetFences(mDev->dev, 1, &fences[slot]));
+
+    drain(slot);
+    busy[slot] = false;
+  };
+
+  uint32 slot = 0;
+  for (;; slot ^= 1)
+  {
+    finish(slot);
+
+    if (!fill(slot))
+      break;
+
+    VkCommandBuffer cmdbuf = cmdbufs[slot];
+    mDev->beginSingleUseCommandBuffer(cmdbuf);
+
+    /* The other slot's commands may still be using the device buffers. */
+    VkMemoryBarrier barrier = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT |
+                       VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT |
+                       VK_ACCESS_TRANSFER_READ_BIT |
+                       VK_ACCESS_SHADER_READ_BIT |
+                       VK_ACCESS_SHADER_WRITE_BIT
+    };
+
+    vkCmdPipelineBarrier(cmdbuf,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT |
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    record(cmdbuf, slot);
+
+    /* Makes the downloads available to the host. */
+    VkMemoryBarrier hostBarrier = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_HOST_READ_BIT
+    };
+
+    vkCmdPipelineBarrier(cmdbuf,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT,
+                         0, 1, &hostBarrier, 0, nullptr, 0, nullptr);
+
+    mDev->endCommandBuffer(cmdbuf);
+    mDev->submitCommandBuffer(cmdbuf, VK_NULL_HANDLE, VK_NULL_HANDLE, 0,
+                              fences[slot]);
+    busy[slot] = true;
+  }
+
+  /* slot was drained before fill ran out, the other one is the last. */
+  finish(slot ^ 1);
+
+  for (uint32 i = 0; i < 2; ++i)
+  {
+    vkDestroyFence(mDev->dev, fences[i], nullptr);
+    mDev->freeCommandBuffer(cmdbufs[i]);
+  }
+}
+
+void
+ExternalSort::recordUpload(VkCommandBuffer cmdbuf, uint32 slot,
+                           uint32 buffer, uint32 count, bool hasValues) const
+{
+  uint64 bytes = (uint64)count * sizeof(uint32);
+  uint64 valueOffset = (uint64)runElements * sizeof(uint32);
+
+  VkBufferCopy keyRegion = { 0, 0, bytes };
+  vkCmdCopyBuffer(cmdbuf, mStaging[slot].hdl, mKeys[buffer].hdl,
+                  1, &keyRegion);
+
+  if (hasValues)
+  {
+    VkBufferCopy valueRegion = { valueOffset, 0, bytes };
+    vkCmdCopyBuffer(cmdbuf, mStaging[slot].hdl, mValues[buffer].hdl,
+                    1, &valueRegion);
+  }
+
+  VkMemoryBarrier barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT
+  };
+
+  vkCmdPipelineBarrier(cmdbuf,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void
+ExternalSort::recordDownload(VkCommandBuffer cmdbuf, uint32 slot,
+                             uint32 buffer, uint32 count,
+                             bool hasValues) const
+{
+  uint64 bytes = (uint64)count * sizeof(uint32);
+  uint64 valueOffset = (uint64)runElements * sizeof(uint32);
+
+  recordComputeBarrier(cmdbuf);
+
+  VkBufferCopy keyRegion = { 0, 0, bytes };
+  vkCmdCopyBuffer(cmdbuf, mKeys[buffer].hdl, mStaging[slot].hdl,
+                  1, &keyRegion);
+
+  if (hasValues)
+  {
+    VkBufferCopy valueRegion = { 0, valueOffset, bytes };
+    vkCmdCopyBuffer(cmdbuf, mValues[buffer].hdl, mStaging[slot].hdl,
+                    1, &valueRegion);
+  }
+}
+
+uint32
+ExternalSort::recordMerge(VkCommandBuffer cmdbuf, const Step &step,
+                          bool hasValues) const
+{
+  std::vector<Segment> segments = step.segments;
+  uint32 src = 0;
+
+  /* Pairs of neighbours are merged until one segment is left. A segment
+   * without a neighbour is merged with nothing, which copies it over. */
+  while (segments.size() > 1)
+  {
+    std::vector<Segment> merged;
+
+    auto sequence = [&] (uint32 buffer, const Segment &segment) {
+      return SortedSequence {
+        .keys = mKeys[buffer],
+        .values = hasValues ? mValues[buffer].range() : BufferRange{},
+        .offset = segment.offset,
+        .count = segment.count
+      };
+    };
+
+    for (size_t i = 0; i < segments.size(); i += 2)
+    {
+      Segment a = segments[i];
+      Segment b = i + 1 < segments.size() ?
+        segments[i + 1] : Segment{ a.offset + a.count, 0 };
+      Segment out = { a.offset, a.count + b.count };
+
+      mMerge.record(cmdbuf, sequence(src, a), sequence(src, b),
+                    sequence(src ^ 1, out));
+      merged.push_back(out);
+    }
+
+    recordComputeBarrier(cmdbuf);
+
+    segments = std::move(merged);
+    src ^= 1;
+  }
+
+  return src;
+}
+
+void
+ExternalSort::sortImpl(const uint32 *keys, const uint32 *values,
+                       uint64 count, uint32 *outKeys, uint32 *outValues,
+                       const Mappings &mappings)
+{
+  if (count == 0)
+    return;
+
+  bool hasValues = values != nullptr;
+  uint64 runCount = (count + runElements - 1) / runElements;
+  uint64 valueOffset = (uint64)runElements * sizeof(uint32);
+
+  /* A merge step takes at least one element of every run and has to fit
+   * into the staging buffers. */
+  if (runCount > runElements)
+  {
+    printf("Can't sort %llu elements in runs of %u\n",
+           (unsigned long long)count, runElements);
+    PANIC_AND_EXIT("Too many runs to merge");
+  }
+
+  /* A single run is sorted straight into the output. */
+  uint32 *runKeys = outKeys;
+  uint32 *runValues = outValues;
+  const MappedFile *runKeysFile = mappings.outKeys;
+  const MappedFile *runValuesFile = mappings.outValues;
+
+  std::vector<uint32> hostKeys, hostValues;
+  MappedFile spillKeys, spillValues;
+
+  if (runCount > 1 && spill == SpillTarget::Host)
+  {
+    hostKeys.resize(count);
+    runKeys = hostKeys.data();
+    runKeysFile = nullptr;
+
+    if (hasValues)
+      hostValues.resize(count);
+    runValues = hostValues.data();
+    runValuesFile = nullptr;
+  }
+  else if (runCount > 1)
+  {
+    spillKeys = makeSpillFile(count * sizeof(uint32));
+    runKeys = (uint32 *)spillKeys.ptr;
+    runKeysFile = &spillKeys;
+
+    if (hasValues)
+      spillValues = makeSpillFile(count * sizeof(uint32));
+    runValues = (uint32 *)spillValues.ptr;
+    runValuesFile = &spillValues;
+  }
+
+  /* Sorts the runs into the spill. */
+  uint64 nextRun = 0;
+
+  stream(
+    [&] (uint32 slot) {
+      if (nextRun == runCount)
+        return false;
+
+      Step &step = mSteps[slot];
+      step.outBegin = nextRun * runElements;
+      step.count = (uint32)std::min<uint64>(runElements,
+                                            count - step.outBegin);
+      ++nextRun;
+
+      uint64 bytes = (uint64)step.count * sizeof(uint32);
+      uint64 next = step.outBegin + step.count;
+      uint64 nextBytes =
+        std::min<uint64>(runElements, count - next) * sizeof(uint32);
+
+      willNeed(mappings.keys, keys + next, nextBytes);
+      memcpy(mStaging[slot].ptr, keys + step.outBegin, bytes);
+      release(mappings.keys, keys + step.outBegin, bytes);
+
+      if (hasValues)
+      {
+        willNeed(mappings.values, values + next, nextBytes);
+        memcpy((uint8 *)mStaging[slot].ptr + valueOffset,
+               values + step.outBegin, bytes);
+        release(mappings.values, values + step.outBegin, bytes);
+      }
+
+      return true;
+    },
+    [&] (VkCommandBuffer cmdbuf, uint32 slot) {
+      const Step &step = mSteps[slot];
+      uint64 bytes = (uint64)step.count * sizeof(uint32);
+
+      recordUpload(cmdbuf, slot, 0, step.count, hasValues);
+
+      mSort.record(cmdbuf,
+                   mKeys[0].range(0, bytes),
+                   mKeys[1].range(0, bytes),
+                   hasValues ? mValues[0].range(0, bytes) : BufferRange{},
+                   hasValues ? mValues[1].range(0, bytes) : BufferRange{},
+                   step.count);
+
+      recordDownload(cmdbuf, slot, 0, step.count, hasValues);
+    },
+    [&] (uint32 slot) {
+      const Step &step = mSteps[slot];
+      uint64 bytes = (uint64)step.count * sizeof(uint32);
+
+      memcpy(runKeys + step.outBegin, mStaging[slot].ptr, bytes);
+      if (hasValues)
+        memcpy(runValues + step.outBegin,
+               (uint8 *)mStaging[slot].ptr + valueOffset, bytes);
+
+      /* The spill gets read again, the output doesn't. */
+      if (runCount == 1)
+      {
+        release(runKeysFile, runKeys + step.outBegin, bytes);
+        if (hasValues)
+          release(runValuesFile, runValues + step.outBegin, bytes);
+      }
+    });
+
+  if (runCount == 1)
+    return;
+
+  /* Merges the runs from the spill into the output. Each step takes up to
+   * partElements of every run, so that a step fits on the device. */
+  std::vector<uint64> consumed(runCount, 0);
+  uint64 outBegin = 0;
+  uint32 partElements = (uint32)(runElements / runCount);
+
+  auto runSize = [&] (uint64 run) {
+    return std::min<uint64>(runElements, count - run * runElements);
+  };
+
+  stream(
+    [&] (uint32 slot) {
+      if (outBegin == count)
+        return false;
+
+      Step &step = mSteps[slot];
+      step.outBegin = outBegin;
+      step.segments.clear();
+
+      /* Everything up to the smallest last key of the parts which don't
+       * end their run can go, nothing that comes later is smaller. */
+      bool bounded = false;
+      uint32 bound = 0;
+
+      for (uint64 run = 0; run < runCount; ++run)
+      {
+        uint64 available =
+          std::min<uint64>(partElements, runSize(run) - consumed[run]);
+
+        if (available > 0 && consumed[run] + available < runSize(run))
+        {
+          uint32 last =
+            runKeys[run * runElements + consumed[run] + available - 1];
+
+          if (!bounded || last < bound)
+            bound = last;
+          bounded = true;
+        }
+      }
+
+      uint32 offset = 0;
+
+      for (uint64 run = 0; run < runCount; ++run)
+      {
+        uint64 available =
+          std::min<uint64>(partElements, runSize(run) - consumed[run]);
+        if (available == 0)
+          continue;
+
+        uint64 begin = run * runElements + consumed[run];
+        const uint32 *first = runKeys + begin;
+
+        uint32 taken = bounded ?
+          (uint32)(std::upper_bound(first, first + available, bound) - first) :
+          (uint32)available;
+        if (taken == 0)
+          continue;
+
+        uint64 bytes = (uint64)taken * sizeof(uint32);
+
+        memcpy((uint8 *)mStaging[slot].ptr + offset * sizeof(uint32),
+               first, bytes);
+        release(runKeysFile, first, bytes);
+
+        if (hasValues)
+        {
+          memcpy((uint8 *)mStaging[slot].ptr + valueOffset +
+                 offset * sizeof(uint32),
+                 runValues + begin, bytes);
+          release(runValuesFile, runValues + begin, bytes);
+        }
+
+        step.segments.push_back({ offset, taken });
+        consumed[run] += taken;
+        offset += taken;
+
+        /* The next part of this run. */
+        uint64 nextBytes = std::min<uint64>(
+          partElements, runSize(run) - consumed[run]) * sizeof(uint32);
+
+        willNeed(runKeysFile, first + taken, nextBytes);
+        if (hasValues)
+          willNeed(runValuesFile, runValues + begin + taken, nextBytes);
+      }
+
+      step.count = offset;
+      outBegin += offset;
+
+      return true;
+    },
+    [&] (VkCommandBuffer cmdbuf, uint32 slot) {
+      const Step &step = mSteps[slot];
+
+      recordUpload(cmdbuf, slot, 0, step.count, hasValues);
+      uint32 result = recordMerge(cmdbuf, step, hasValues);
+      recordDownload(cmdbuf, slot, result, step.count, hasValues);
+    },
+    [&] (uint32 slot) {
+      const Step &step = mSteps[slot];
+      uint64 bytes = (uint64)step.count * sizeof(uint32);
+
+      memcpy(outKeys + step.outBegin, mStaging[slot].ptr, bytes);
+      release(mappings.outKeys, outKeys + step.outBegin, bytes);
+
+      if (hasValues)
+      {
+        memcpy(outValues + step.outBegin,
+               (uint8 *)mStaging[slot].ptr + valueOffset, bytes);
+        release(mappings.outValues, outValues + step.outBegin, bytes);
+      }
+    });
+}
+
+void
+ExternalSort::sort(const uint32 *keys, const uint32 *values, uint64 count,
+                   uint32 *outKeys, uint32 *outValues)
+{
+  sortImpl(keys, values, count, outKeys, outValues, Mappings{});
+}
+
+void
+ExternalSort::sortFile(const char *keysPath, const char *outKeysPath)
+{
+  MappedFile keys = MappedFile::open(keysPath);
+  if (keys.size % sizeof(uint32) != 0)
+    PANIC_AND_EXIT("File size isn't a multiple of the element size");
+
+  MappedFile outKeys = MappedFile::create(outKeysPath, keys.size);
+
+  sortImpl((const uint32 *)keys.ptr, nullptr, keys.size / sizeof(uint32),
+           (uint32 *)outKeys.ptr, nullptr,
+           Mappings{ &keys, nullptr, &outKeys, nullptr });
+
+  if (outKeys.ptr)
+    msync(outKeys.ptr, outKeys.size, MS_SYNC);
+}
+
+void
+ExternalSort::sortPairsFile(const char *keysPath, const char *valuesPath,
+                            const char *outKeysPath,
+                            const char *outValuesPath)
+{
+  MappedFile keys = MappedFile::open(keysPath);
+  MappedFile values = MappedFile::open(valuesPath);
+
+  if (keys.size % sizeof(uint32) != 0)
+    PANIC_AND_EXIT("File size isn't a multiple of the element size");
+  if (values.size != keys.size)
+    PANIC_AND_EXIT("Keys and values have different sizes");
+
+  MappedFile outKeys = MappedFile::create(outKeysPath, keys.size);
+  MappedFile outValues = MappedFile::create(outValuesPath, values.size);
+
+  sortImpl((const uint32 *)keys.ptr, (const uint32 *)values.ptr,
+           keys.size / sizeof(uint32),
+           (uint32 *)outKeys.ptr, (uint32 *)outValues.ptr,
+           Mappings{ &keys, &values, &outKeys, &outValues });
+
+  if (outKeys.ptr)
+  {
+    msync(outKeys.ptr, outKeys.size, MS_SYNC);
+    msync(outValues.ptr, outValues.size, MS_SYNC);
+  }
+}
+
+} /* namespace vub */
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include "gpu-device.h"
+#include "file-scan.h"
+#include "device-merge.h"
+#include "device-radix-sort.h"
+
+namespace vub {
+
+/* Where ExternalSort keeps sorted runs until they get merged. */
+enum class SpillTarget {
+  Host,
+  /* Unlinked temporary files, mapped into memory. */
+  Files
+};
+
+/* Sorts 32-bit keys (optionally with 32-bit values) which don't fit on the
+ * device.
+ *
+ * The input is cut into runs of runElements elements. Each run is sorted
+ * on the device with DeviceRadixSort and spilled. The runs are then merged
+ * in steps: every step takes the next part of each run, up to the smallest
+ * last key of the parts taken (so that everything after the step is larger
+ * than everything in it), and merges the parts on the device with rounds of
+ * DeviceMerge.
+ *
+ * Both phases keep two steps in flight, so that the host reads the input,
+ * fills the spill and writes the output while the device sorts and merges.
+ * Keys that compare equal may come out in any order. */
+struct ExternalSort {
+  SpillTarget spill;
+  uint32 runElements;
+
+  /* runElements of 0 sizes runs to the device's memory. */
+  static ExternalSort make(const GPUDevice &gpu,
+                           uint32 runElements = 0,
+                           SpillTarget spill = SpillTarget::Files,
+                           const char *spillDirectory = "/tmp");
+
+  /* values and outValues may be null for keys only. Output may be mapped
+   * regions, but mustn't overlap the input. Panics if count needs more runs
+   * than a run has elements (more than runElements squared). */
+  void sort(const uint32 *keys, const uint32 *values, uint64 count,
+            uint32 *outKeys, uint32 *outValues);
+
+  /* Same over files of uint32. Outputs are created with the size of the
+   * input. */
+  void sortFile(const char *keysPath, const char *outKeysPath);
+  void sortPairsFile(const char *keysPath, const char *valuesPath,
+                     const char *outKeysPath, const char *outValuesPath);
+
+private:
+  /* The mappings which the pointers passed to sortImpl point into (or
+   * null), to read ahead of and drop behind the streams. */
+  struct Mappings {
+    const MappedFile *keys;
+    const MappedFile *values;
+    const MappedFile *outKeys;
+    const MappedFile *outValues;
+  };
+
+  /* The part of a sorted run which a merge step took, where it sits in
+   * the device buffers. */
+  struct Segment {
+    uint32 offset;
+    uint32 count;
+  };
+
+  /* What a step in flight needs once the device is done with it. */
+  struct Step {
+    uint64 outBegin;
+    uint32 count;
+    std::vector<Segment> segments;
+  };
+
+  void sortImpl(const uint32 *keys, const uint32 *values, uint64 count,
+                uint32 *outKeys, uint32 *outValues,
+                const Mappings &mappings);
+
+  /* Calls fill(slot) until it returns false, submitting what record
+   * records into the slot's command buffer after each call. drain(slot) is
+   * called once the device is done with the slot, which happens while the
+   * host fills the other one. */
+  void stream(const std::function<bool(uint32)> &fill,
+              const std::function<void(VkCommandBuffer, uint32)> &record,
+              const std::function<void(uint32)> &drain);
+
+  /* Copies count keys (and values) between a slot's staging buffer and
+   * the device buffers of index buffer. */
+  void recordUpload(VkCommandBuffer cmdbuf, uint32 slot, uint32 buffer,
+                    uint32 count, bool hasValues) const;
+  void recordDownload(VkCommandBuffer cmdbuf, uint32 slot, uint32 buffer,
+                      uint32 count, bool hasValues) const;
+
+  /* Merges the segments of a step, which sit one after the other in the
+   * device buffers of index 0. Returns the index holding the result. */
+  uint32 recordMerge(VkCommandBuffer cmdbuf, const Step &step,
+                     bool hasValues) const;
+
+  MappedFile makeSpillFile(uint64 size) const;
+
+  const GPUDevice *mDev;
+
+  DeviceRadixSort mSort;
+  DeviceMerge mMerge;
+  DeviceBuffer mKeys[2];
+  DeviceBuffer mValues[2];
+
+  /* Keys followed by values. */
+  StagingBuffer mStaging[2];
+  Step mSteps[2];
+
+  std::string mSpillDirectory;
+};
+
+} /* namespace vub */
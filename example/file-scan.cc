@@ -0,0 +1,430 @@
+#include "file-scan.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "helper.h"
+#include "memory-tracker.h"
+
+namespace vub {
+
+static uint64
+pageSize()
+{
+  return (uint64)sysconf(_SC_PAGESIZE);
+}
+
+MappedFile
+MappedFile::open(const char *path)
+{
+  MappedFile ret = {};
+  ret.mFd = ::open(path, O_RDONLY);
+
+  struct stat info;
+  if (ret.mFd < 0 || fstat(ret.mFd, &info) != 0)
+  {
+    printf("Failed to open %s\n", path);
+    PANIC_AND_EXIT("Failed to open file");
+  }
+
+  ret.size = (uint64)info.st_size;
+  ret.ptr = nullptr;
+
+  if (ret.size > 0)
+  {
+    ret.ptr = mmap(nullptr, ret.size, PROT_READ, MAP_SHARED, ret.mFd, 0);
+    if (ret.ptr == MAP_FAILED)
+      PANIC_AND_EXIT("Failed to map file");
+
+    /* Reads further ahead and lets pages behind the reads go sooner. */
+    madvise(ret.ptr, ret.size, MADV_SEQUENTIAL);
+  }
+
+  return ret;
+}
+
+MappedFile
+MappedFile::create(const char *path, uint64 size)
+{
+  MappedFile ret = {};
+  ret.mFd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  ret.mWritable = true;
+
+  if (ret.mFd < 0 || ftruncate(ret.mFd, (off_t)size) != 0)
+  {
+    printf("Failed to create %s\n", path);
+    PANIC_AND_EXIT("Failed to create file");
+  }
+
+  ret.size = size;
+  ret.ptr = nullptr;
+
+  if (size > 0)
+  {
+    ret.ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   ret.mFd, 0);
+    if (ret.ptr == MAP_FAILED)
+      PANIC_AND_EXIT("Failed to map file");
+
+    madvise(ret.ptr, size, MADV_SEQUENTIAL);
+  }
+
+  return ret;
+}
+
+void
+MappedFile::willNeed(uint64 offset, uint64 bytes) const
+{
+  /* Rounded out to whole pages. Only a hint, so failing isn't an error. */
+  uint64 begin = offset & ~(pageSize() - 1);
+  madvise((uint8 *)ptr + begin, offset + bytes - begin, MADV_WILLNEED);
+}
+
+void
+MappedFile::release(uint64 offset, uint64 bytes) const
+{
+  /* Rounded in to whole pages, so that pages shared with the neighbouring
+   * ranges stay. */
+  uint64 page = pageSize();
+  uint64 begin = (offset + page - 1) & ~(page - 1);
+  uint64 end = (offset + bytes) & ~(page - 1);
+
+  if (end <= begin)
+    return;
+
+  /* Dropping dirty pages of a shared mapping doesn't lose them, but
+   * starting the writeback now keeps it from piling up at the end. */
+  if (mWritable)
+    msync((uint8 *)ptr + begin, end - begin, MS_ASYNC);
+
+  madvise((uint8 *)ptr + begin, end - begin, MADV_DONTNEED);
+}
+
+MappedFile::MappedFile(MappedFile &&other)
+  : ptr(other.ptr), size(other.size), mFd(other.mFd),
+    mWritable(other.mWritable)
+{
+  other.ptr = nullptr;
+  other.mFd = -1;
+}
+
+MappedFile &
+MappedFile::operator=(MappedFile &&other)
+{
+  if (this != &other)
+  {
+    if (ptr)
+      munmap(ptr, size);
+    if (mFd >= 0)
+      close(mFd);
+
+    ptr = other.ptr;
+    size = other.size;
+    mFd = other.mFd;
+    mWritable = other.mWritable;
+
+    other.ptr = nullptr;
+    other.mFd = -1;
+  }
+
+  return *this;
+}
+
+MappedFile::~MappedFile()
+{
+  if (ptr)
+    munmap(ptr, size);
+  if (mFd >= 0)
+    close(mFd);
+}
+
+FileScan
+FileScan::make(const GPUDevice &gpu, uint32 windowElements)
+{
+  MemoryScope memoryScope(gpu, "FileScan");
+
+  uint64 bytes = (uint64)windowElements * sizeof(uint32);
+
+  FileScan ret = {};
+  ret.mDev = &gpu;
+  ret.mWindowElements = windowElements;
+  ret.mScan = DeviceScan::make(gpu, windowElements);
+  ret.mInput = gpu.makeDeviceBuffer(bytes);
+  ret.mOutput = gpu.makeDeviceBuffer(bytes);
+
+  for (StagingBuffer &staging : ret.mStaging)
+    staging = gpu.makeStagingBuffer(
+      bytes,
+      VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+
+  ret.mTotal = gpu.makeStagingBuffer(sizeof(uint32),
+                                     VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+
+  return ret;
+}
+
+namespace {
+
+/* A window the GPU may be working on. */
+struct Window {
+  VkCommandBuffer cmdbuf;
+  VkFence fence;
+  bool busy;
+
+  uint64 begin;
+  uint32 count;
+
+  /* Only set when scanning imported memory. */
+  HostBuffer input;
+  HostBuffer output;
+};
+
+} /* namespace */
+
+uint32
+FileScan::scanImpl(const uint32 *in, uint32 *out, uint64 count,
+                   bool inclusive,
+                   const MappedFile *inFile, const MappedFile *outFile)
+{
+  if (count == 0)
+    return 0;
+
+  /* The kernel can't scan in place. Whether importing works is only known
+   * after trying it with the first window. */
+  bool import = mDev->features.externalMemoryHost && in != out;
+
+  Window windows[2] = {};
+  for (Window &window : windows)
+  {
+    window.cmdbuf = mDev->makeCommandBuffer();
+
+    VkFenceCreateInfo fenceInfo = {
+      .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO
+    };
+
+    VK_CHECK(vkCreateFence(mDev->dev, &fenceInfo, nullptr, &window.fence));
+  }
+
+  auto finish = [&] (Window &window, uint32 slot) {
+    if (!window.busy)
+      return;
+
+    VK_CHECK(mDev->waitForFence(window.fence));
+    VK_CHECK(vkResetFences(mDev->dev, 1, &window.fence));
+
+    uint64 bytes = (uint64)window.count * sizeof(uint32);
+
+    if (import)
+    {
+      if (out)
+        window.output.download();
+
+      window.input = HostBuffer();
+      window.output = HostBuffer();
+    }
+    else if (out)
+    {
+      memcpy(out + window.begin, mStaging[slot].ptr, bytes);
+    }
+
+    if (inFile)
+      inFile->release((uint8 *)(in + window.begin) - (uint8 *)inFile->ptr,
+                      bytes);
+    if (out && outFile)
+      outFile->release((uint8 *)(out + window.begin) - (uint8 *)outFile->ptr,
+                       bytes);
+
+    window.busy = false;
+  };
+
+  uint32 slot = 0;
+  for (uint64 begin = 0; begin < count; begin += mWindowElements, slot ^= 1)
+  {
+    Window &window = windows[slot];
+    finish(window, slot);
+
+    uint32 size = (uint32)std::min<uint64>(mWindowElements, count - begin);
+    uint64 bytes = (uint64)size * sizeof(uint32);
+    uint64 next = begin + size;
+
+    /* Gets the disk going on the window after this one while the GPU works
+     * through this one. */
+    if (inFile && next < count)
+      inFile->willNeed(
+        (uint8 *)(in + next) - (uint8 *)inFile->ptr,
+        std::min<uint64>(mWindowElements, count - next) * sizeof(uint32));
+
+    window.begin = begin;
+    window.count = size;
+
+    BufferRange input = mInput.range(0, bytes);
+    BufferRange output = mOutput.range(0, bytes);
+
+    if (import)
+    {
+      /* The GPU only reads the input, the const_cast is to import it. */
+      window.input = mDev->importHostBuffer((uint32 *)in + begin, bytes);
+      if (out)
+        window.output = mDev->importHostBuffer(out + begin, bytes);
+
+      if (begin == 0 &&
+          (!window.input.imported || (out && !window.output.imported)))
+      {
+        /* Copies would be slower than the staging ring. */
+        import = false;
+        window.input = HostBuffer();
+        window.output = HostBuffer();
+      }
+      else
+      {
+        /* Later imports can still fall back to copies. */
+        window.input.upload();
+        input = window.input;
+        if (out)
+          output = window.output;
+      }
+    }
+
+    if (!import)
+      memcpy(mStaging[slot].ptr, in + begin, bytes);
+
+    VkCommandBuffer cmdbuf = window.cmdbuf;
+    mDev->beginSingleUseCommandBuffer(cmdbuf);
+
+    /* The previous window may still be reading mInput or writing mOutput. */
+    VkMemoryBarrier barrier = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT |
+                       VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT |
+                       VK_ACCESS_TRANSFER_READ_BIT |
+                       VK_ACCESS_SHADER_READ_BIT |
+                       VK_ACCESS_SHADER_WRITE_BIT
+    };
+
+    vkCmdPipelineBarrier(cmdbuf,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT |
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    VkBufferCopy region = { 0, 0, bytes };
+
+    if (!import)
+    {
+      vkCmdCopyBuffer(cmdbuf, mStaging[slot].hdl, mInput.hdl, 1, &region);
+
+      VkBufferMemoryBarrier inputBarrier = GPUDevice::makeBarrier(
+        mInput.hdl, 0, bytes,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+      vkCmdPipelineBarrier(cmdbuf,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                           0, 0, nullptr, 1, &inputBarrier, 0, nullptr);
+    }
+
+    mScan.record(cmdbuf, input, output, size, inclusive,
+                 begin == 0 ? ScanCarry::Start : ScanCarry::Continue);
+
+    bool last = next >= count;
+
+    if ((!import && out) || last)
+    {
+      VkMemoryBarrier scanBarrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT
+      };
+
+      vkCmdPipelineBarrier(cmdbuf,
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           0, 1, &scanBarrier, 0, nullptr, 0, nullptr);
+    }
+
+    if (!import && out)
+      vkCmdCopyBuffer(cmdbuf, mOutput.hdl, mStaging[slot].hdl, 1, &region);
+
+    if (last)
+    {
+      BufferRange total = mScan.carryOut();
+      VkBufferCopy totalRegion = { total.offset, 0, sizeof(uint32) };
+      vkCmdCopyBuffer(cmdbuf, total.hdl, mTotal.hdl, 1, &totalRegion);
+    }
+
+    /* Makes the writes available to the host. */
+    VkMemoryBarrier hostBarrier = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT |
+                       VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_HOST_READ_BIT
+    };
+
+    vkCmdPipelineBarrier(cmdbuf,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT,
+                         0, 1, &hostBarrier, 0, nullptr, 0, nullptr);
+
+    mDev->endCommandBuffer(cmdbuf);
+    mDev->submitCommandBuffer(cmdbuf, VK_NULL_HANDLE, VK_NULL_HANDLE, 0,
+                              window.fence);
+    window.busy = true;
+  }
+
+  /* slot is now the older of the two. */
+  finish(windows[slot], slot);
+  finish(windows[slot ^ 1], slot ^ 1);
+
+  for (Window &window : windows)
+  {
+    vkDestroyFence(mDev->dev, window.fence, nullptr);
+    mDev->freeCommandBuffer(window.cmdbuf);
+  }
+
+  return *(const uint32 *)mTotal.ptr;
+}
+
+uint32
+FileScan::scan(const uint32 *in, uint32 *out, uint64 count, bool inclusive)
+{
+  return scanImpl(in, out, count, inclusive, nullptr, nullptr);
+}
+
+uint32
+FileScan::scanFile(const char *inPath, const char *outPath, bool inclusive)
+{
+  MappedFile input = MappedFile::open(inPath);
+  if (input.size % sizeof(uint32) != 0)
+    PANIC_AND_EXIT("File size isn't a multiple of the element size");
+
+  MappedFile output = MappedFile::create(outPath, input.size);
+
+  uint32 total = scanImpl((const uint32 *)input.ptr, (uint32 *)output.ptr,
+                          input.size / sizeof(uint32), inclusive,
+                          &input, &output);
+
+  if (output.ptr)
+    msync(output.ptr, output.size, MS_SYNC);
+
+  return total;
+}
+
+uint32
+FileScan::reduceFile(const char *inPath)
+{
+  MappedFile input = MappedFile::open(inPath);
+  if (input.size % sizeof(uint32) != 0)
+    PANIC_AND_EXIT("File size isn't a multiple of the element size");
+
+  return scanImpl((const uint32 *)input.ptr, nullptr,
+                  input.size / sizeof(uint32), true, &input, nullptr);
+}
+
+} /* namespace vub */
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "gpu-device.h"
+#include "device-scan.h"
+
+namespace vub {
+
+/* A file mapped into memory with mmap. */
+struct MappedFile {
+  void *ptr;
+  uint64 size;
+
+  /* Maps an existing file for reading. */
+  static MappedFile open(const char *path);
+  /* Creates (or truncates) a file of size bytes and maps it for writing. */
+  static MappedFile create(const char *path, uint64 size);
+
+  /* Starts reading a range of bytes of the file ahead of its use. */
+  void willNeed(uint64 offset, uint64 bytes) const;
+  /* Drops the pages of a range which won't be touched again. Writes to them
+   * are scheduled to go to the file first. */
+  void release(uint64 offset, uint64 bytes) const;
+
+  MappedFile() = default;
+  MappedFile(MappedFile &&other);
+  MappedFile &operator=(MappedFile &&other);
+  ~MappedFile();
+
+private:
+  int mFd = -1;
+  bool mWritable = false;
+};
+
+/* Scans and reduces inputs which don't fit on the device (or in memory) by
+ * streaming them through it in windows of windowElements elements.
+ *
+ * The running total stays on the device between windows (ScanCarry), so
+ * the only work the host does per window is moving data. Two windows are
+ * in flight: while the GPU works on one, the host fills (and empties) the
+ * other. If the device can import host memory, windows are scanned in place
+ * and the host only has to wait; otherwise they go through a pair of
+ * staging buffers. */
+struct FileScan {
+  static FileScan make(const GPUDevice &gpu, uint32 windowElements = 1 << 24);
+
+  /* Scans count elements of in to out, which may be a mapped region. out
+   * may be null to only get the total. Returns the sum of all of in. */
+  uint32 scan(const uint32 *in, uint32 *out, uint64 count,
+              bool inclusive = false);
+
+  /* Same over files of uint32. The output file is created with the size of
+   * the input. */
+  uint32 scanFile(const char *inPath, const char *outPath,
+                  bool inclusive = false);
+  uint32 reduceFile(const char *inPath);
+
+private:
+  /* inFile and outFile (either may be null) are the mappings in and out
+   * point into, in which case pages are read ahead and dropped behind the
+   * windows. */
+  uint32 scanImpl(const uint32 *in, uint32 *out, uint64 count,
+                  bool inclusive,
+                  const MappedFile *inFile, const MappedFile *outFile);
+
+  const GPUDevice *mDev;
+
+  DeviceScan mScan;
+  DeviceBuffer mInput;
+  DeviceBuffer mOutput;
+  StagingBuffer mStaging[2];
+  StagingBuffer mTotal;
+  uint32 mWindowElements;
+};
+
+} /* namespace vub */
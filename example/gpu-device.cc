@@ -1,12 +1,21 @@
 #include "gpu-device.h" 
 
 #include <vector>
+#include <string>
 #include <numeric>
+#include <string.h>
+#include <cassert>
 #include "types.h"
 #include "helper.h"
 #include <algorithm>
+#include <filesystem>
+#include <unistd.h>
 #include <vulkan/vulkan_core.h>
 #include "capped-array.h"
+#include "profiler.h"
+#include "scratch-allocator.h"
+#include "memory-tracker.h"
+#include "shader-compiler.h"
 
 struct GPUDevice::Impl {
   VkInstance instance;
@@ -22,26 +31,101 @@ struct GPUDevice::Impl {
   VkCommandPool commandPool;
   VkDescriptorPool defaultDescriptorPool;
   uint32 maxPushConstantSize;
+  VkPhysicalDeviceProperties properties;
+  uint8 deviceUUID[VK_UUID_SIZE];
+  uint64 minImportedHostPointerAlignment;
   uint32 swapchainImageCount;
   CappedArray<VkImage> swapchainImages;
   CappedArray<VkImageView> swapchainImageViews;
+
+  /* Queue timeline (VK_NULL_HANDLE without features.timelineSemaphore). */
+  VkSemaphore timeline;
+  uint64 submittedValue;
+  uint64 idleValue;
+
+  /* Without the timeline, the value of the last submit each fence was
+   * given to, see waitForFence. */
+  struct FenceValue {
+    VkFence fence;
+    uint64 value;
+  };
+
+  std::vector<FenceValue> fenceValues;
+
+  /* Every pipeline goes through it, see savePipelineCache. The path is
+   * empty if there is no cache directory. */
+  VkPipelineCache pipelineCache;
+  std::string pipelineCachePath;
+
+  /* Made on first use. */
+  std::unique_ptr<ScratchAllocator> scratch;
+  std::unique_ptr<ShaderCompiler> compiler;
+
+  VkPhysicalDeviceMemoryProperties memoryProperties;
+  std::unique_ptr<MemoryTracker> memory;
 };
 
+/* Drops the layers which aren't installed (like on CI machines) instead of
+ * failing to make the instance. */
 static void
-assertValidationSupport(const std::vector<const char *> &layers)
+removeMissingLayers(std::vector<const char *> &layers)
+{
+  uint32 layerCount = 0;
+  vkEnumerateInstanceLayerProperties(&layerCount, nullptr);
+
+  std::vector<VkLayerProperties> available(layerCount);
+  vkEnumerateInstanceLayerProperties(&layerCount, available.data());
+
+  for (auto layer = layers.begin(); layer != layers.end();)
+  {
+    bool found = std::any_of(available.begin(), available.end(),
+      [&](const VkLayerProperties &properties)
+      {
+        return !strcmp(properties.layerName, *layer);
+      });
+
+    if (found)
+    {
+      ++layer;
+    }
+    else
+    {
+      printf("Layer %s isn't available\n", *layer);
+      layer = layers.erase(layer);
+    }
+  }
+}
+
+static bool
+hasInstanceExtension(const char *name)
 {
-  /* TODO */
+  uint32 extensionCount = 0;
+  vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, nullptr);
+
+  std::vector<VkExtensionProperties> extensions(extensionCount);
+  vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount,
+                                         extensions.data());
+
+  for (const VkExtensionProperties &extension : extensions)
+  {
+    if (!strcmp(extension.extensionName, name))
+      return true;
+  }
+
+  return false;
 }
 
 static VkInstance
-makeInstance(bool enableValidation, std::vector<const char *> &layers)
+makeInstance(bool enableValidation, std::vector<const char *> &layers,
+             bool &debugUtils)
 {
-  layers.push_back("VK_LAYER_KHRONOS_validation");
-
   if (enableValidation)
-    assertValidationSupport(layers);
+  {
+    layers.push_back("VK_LAYER_KHRONOS_validation");
+    removeMissingLayers(layers);
+  }
 
-  std::vector<const char *> extensions = 
+  std::vector<const char *> wantedExtensions = 
   {
 #ifndef NDEBUG
     "VK_EXT_debug_utils",
@@ -64,8 +148,19 @@ makeInstance(bool enableValidation, std::vector<const char *> &layers)
     "VK_KHR_xcb_surface";
 #endif
 
-  extensions.push_back(ext);
-  extensions.push_back("VK_KHR_surface");
+  wantedExtensions.push_back(ext);
+  wantedExtensions.push_back("VK_KHR_surface");
+
+  /* Surfaces aren't needed for compute, and headless machines may not have
+   * them. */
+  std::vector<const char *> extensions;
+  for (const char *extension : wantedExtensions)
+  {
+    if (hasInstanceExtension(extension))
+      extensions.push_back(extension);
+  }
+
+  debugUtils = enableValidation && hasInstanceExtension("VK_EXT_debug_utils");
 
   VkApplicationInfo appInfo = {
     .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
@@ -166,33 +261,34 @@ findDepthFormat(VkPhysicalDevice gpu, VkFormat *formats, uint32_t formatCount,
   return VK_FORMAT_MAX_ENUM;
 }
 
+static bool
+hasDeviceExtension(VkPhysicalDevice gpu, const char *name)
+{
+  uint32 extensionCount = 0;
+  vkEnumerateDeviceExtensionProperties(gpu, nullptr, &extensionCount, nullptr);
+
+  std::vector<VkExtensionProperties> extensions(extensionCount);
+  vkEnumerateDeviceExtensionProperties(gpu, nullptr, &extensionCount,
+                                       extensions.data());
+
+  for (const VkExtensionProperties &extension : extensions)
+  {
+    if (!strcmp(extension.extensionName, name))
+      return true;
+  }
+
+  return false;
+}
+
 static VkDevice
 makeDevice(VkInstance instance, VkSurfaceKHR surface,
            const std::vector<const char *> &layers,
            VkPhysicalDevice &physicalDevice,
            int32 &graphicsFamily, int32 &presentFamily,
            VkQueue &graphicsQueue, VkQueue &presentQueue,
-           VkFormat &depthFormat)
+           VkFormat &depthFormat, DeviceFeatures &features,
+           uint8 *deviceUUID)
 {
-  std::vector<const char *> extensions = 
-  {
-    VK_KHR_DEPTH_STENCIL_RESOLVE_EXTENSION_NAME,
-    VK_KHR_CREATE_RENDERPASS_2_EXTENSION_NAME,
-    VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME,
-    VK_EXT_DEBUG_MARKER_EXTENSION_NAME,
-#if defined (__APPLE__)
-    "VK_KHR_portability_subset",
-    "VK_EXT_shader_viewport_index_layer",
-#endif
-    VK_KHR_SWAPCHAIN_EXTENSION_NAME,
-    VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME,
-    VK_KHR_EXTERNAL_SEMAPHORE_EXTENSION_NAME,
-    VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME,
-    VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME,
-  };
-
-  extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
-
   // Get physical devices
   std::vector<VkPhysicalDevice> devices;
   {
@@ -203,56 +299,81 @@ makeDevice(VkInstance instance, VkSurfaceKHR surface,
     vkEnumeratePhysicalDevices(instance, &deviceCount, devices.data());
   }
 
-  uint32 selectedPhysicalDevice = 0;
-  uint32 maxPushConstantSize = 0;
+  /* Prefer a discrete GPU, but take anything with a queue that can do
+   * compute (integrated GPUs, or lavapipe on machines without a GPU). */
+  int32 selectedPhysicalDevice = -1;
+  bool selectedDiscrete = false;
+  graphicsFamily = -1;
 
   for (uint32 i = 0; i < devices.size(); ++i) 
   {
     VkPhysicalDeviceProperties deviceProperties;
     vkGetPhysicalDeviceProperties(devices[i], &deviceProperties);
 
-    if (deviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU)
-    {
-      selectedPhysicalDevice = i;
+    bool discrete =
+      deviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU;
 
-      maxPushConstantSize = deviceProperties.limits.maxPushConstantsSize;
+    if (selectedPhysicalDevice >= 0 && (selectedDiscrete || !discrete))
+      continue;
 
-      // Get queue families
-      uint32 queueFamilyCount = 0;
-      vkGetPhysicalDeviceQueueFamilyProperties(devices[i], &queueFamilyCount, 
-                                               nullptr);
+    // Get queue families
+    uint32 queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(devices[i], &queueFamilyCount, 
+                                             nullptr);
 
-      std::vector<VkQueueFamilyProperties> queueProperties;
-      queueProperties.resize(queueFamilyCount);
+    std::vector<VkQueueFamilyProperties> queueProperties;
+    queueProperties.resize(queueFamilyCount);
 
-      vkGetPhysicalDeviceQueueFamilyProperties(devices[i], &queueFamilyCount, 
-                                               queueProperties.data());
+    vkGetPhysicalDeviceQueueFamilyProperties(devices[i], &queueFamilyCount, 
+                                             queueProperties.data());
 
-      for (uint32 f = 0; f < queueFamilyCount; ++f) 
+    for (uint32 f = 0; f < queueFamilyCount; ++f) 
+    {
+      if (queueProperties[f].queueFlags & VK_QUEUE_COMPUTE_BIT &&
+          queueProperties[f].queueCount > 0) 
       {
-        if (queueProperties[f].queueFlags & VK_QUEUE_GRAPHICS_BIT &&
-            queueProperties[f].queueCount > 0) 
-          graphicsFamily = f;
+        selectedPhysicalDevice = i;
+        selectedDiscrete = discrete;
+        graphicsFamily = f;
+        break;
+      }
+    }
+  }
 
-#if 0
-        VkBool32 presentSupport = 0;
+  if (selectedPhysicalDevice < 0)
+    PANIC_AND_EXIT("No Vulkan device with a compute queue");
+
+  physicalDevice = devices[selectedPhysicalDevice];
 
-        vkGetPhysicalDeviceSurfaceSupportKHR(devices[i], f, surface, &presentSupport);
+  /* Nothing gets presented. */
+  presentFamily = graphicsFamily;
 
-        if (queueProperties[f].queueCount > 0 && presentSupport) 
-          presentFamily = f;
+  /* Only enable what the device has. Extensions vub makes use of are
+   * checked for separately further down. */
+  const char *wantedExtensions[] = 
+  {
+    VK_KHR_DEPTH_STENCIL_RESOLVE_EXTENSION_NAME,
+    VK_KHR_CREATE_RENDERPASS_2_EXTENSION_NAME,
+    VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME,
+    VK_EXT_DEBUG_MARKER_EXTENSION_NAME,
+#if defined (__APPLE__)
+    "VK_KHR_portability_subset",
+    "VK_EXT_shader_viewport_index_layer",
 #endif
+    VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+    VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME,
+    VK_KHR_EXTERNAL_SEMAPHORE_EXTENSION_NAME,
+    VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME,
+    VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME,
+  };
 
-        VkBool32 presentSupport = 1;
-
-        if (presentFamily >= 0 && graphicsFamily >= 0) 
-          break;
-      }
-    }
+  std::vector<const char *> extensions;
+  for (const char *extension : wantedExtensions)
+  {
+    if (hasDeviceExtension(physicalDevice, extension))
+      extensions.push_back(extension);
   }
 
-  physicalDevice = devices[selectedPhysicalDevice];
-
   uint32 uniqueQueueFamilyFinder = 0;
   uniqueQueueFamilyFinder |= 1 << graphicsFamily;
   uniqueQueueFamilyFinder |= 1 << presentFamily;
@@ -286,15 +407,228 @@ makeDevice(VkInstance instance, VkSurfaceKHR surface,
     uniqueFamilyInfos[i] = queueInfo;
   }
 
+  /* Optional features get pushed to the front of this chain. */
+  void *featureChain = nullptr;
+
+  VkPhysicalDeviceDescriptorIndexingFeaturesEXT descriptorIndexingFeature = 
+  {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT
+  };
+
+  features.updateAfterBind = false;
+  if (hasDeviceExtension(physicalDevice,
+                         VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME))
+  {
+    VkPhysicalDeviceFeatures2 supported = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+      .pNext = &descriptorIndexingFeature
+    };
+
+    vkGetPhysicalDeviceFeatures2(physicalDevice, &supported);
+
+    features.updateAfterBind =
+      descriptorIndexingFeature.descriptorBindingStorageBufferUpdateAfterBind;
+
+    /* Only enable what we use. */
+    descriptorIndexingFeature = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT,
+      .pNext = featureChain
+    };
+    descriptorIndexingFeature.descriptorBindingStorageBufferUpdateAfterBind =
+      features.updateAfterBind;
+
+    featureChain = &descriptorIndexingFeature;
+    extensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+  }
+
+  VkPhysicalDeviceBufferDeviceAddressFeaturesKHR bufferDeviceAddressFeature =
+  {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES_KHR
+  };
+
+  features.bufferDeviceAddress = false;
+  if (hasDeviceExtension(physicalDevice,
+                         VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME))
+  {
+    VkPhysicalDeviceFeatures2 supported = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+      .pNext = &bufferDeviceAddressFeature
+    };
+
+    vkGetPhysicalDeviceFeatures2(physicalDevice, &supported);
+
+    features.bufferDeviceAddress =
+      bufferDeviceAddressFeature.bufferDeviceAddress;
+
+    if (features.bufferDeviceAddress)
+    {
+      bufferDeviceAddressFeature = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES_KHR,
+        .pNext = featureChain,
+        .bufferDeviceAddress = VK_TRUE
+      };
+
+      featureChain = &bufferDeviceAddressFeature;
+      extensions.push_back(VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME);
+    }
+  }
+
+  VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineSemaphoreFeature =
+  {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR
+  };
+
+  features.timelineSemaphore = false;
+  if (hasDeviceExtension(physicalDevice,
+                         VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME))
+  {
+    VkPhysicalDeviceFeatures2 supported = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+      .pNext = &timelineSemaphoreFeature
+    };
+
+    vkGetPhysicalDeviceFeatures2(physicalDevice, &supported);
+
+    features.timelineSemaphore = timelineSemaphoreFeature.timelineSemaphore;
+
+    if (features.timelineSemaphore)
+    {
+      timelineSemaphoreFeature = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR,
+        .pNext = featureChain,
+        .timelineSemaphore = VK_TRUE
+      };
+
+      featureChain = &timelineSemaphoreFeature;
+      extensions.push_back(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+    }
+  }
+
+  /* Core in Vulkan 1.1. */
+  VkPhysicalDevice16BitStorageFeatures storage16BitFeature =
+  {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_16BIT_STORAGE_FEATURES
+  };
+
+  {
+    VkPhysicalDeviceFeatures2 supported = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+      .pNext = &storage16BitFeature
+    };
+
+    vkGetPhysicalDeviceFeatures2(physicalDevice, &supported);
+
+    features.storage16Bit = storage16BitFeature.storageBuffer16BitAccess;
+
+    if (features.storage16Bit)
+    {
+      storage16BitFeature = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_16BIT_STORAGE_FEATURES,
+        .pNext = featureChain,
+        .storageBuffer16BitAccess = VK_TRUE
+      };
+
+      featureChain = &storage16BitFeature;
+    }
+  }
+
+  VkPhysicalDevice8BitStorageFeaturesKHR storage8BitFeature =
+  {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_8BIT_STORAGE_FEATURES_KHR
+  };
+
+  features.storage8Bit = false;
+  if (hasDeviceExtension(physicalDevice, VK_KHR_8BIT_STORAGE_EXTENSION_NAME))
+  {
+    VkPhysicalDeviceFeatures2 supported = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+      .pNext = &storage8BitFeature
+    };
+
+    vkGetPhysicalDeviceFeatures2(physicalDevice, &supported);
+
+    features.storage8Bit = storage8BitFeature.storageBuffer8BitAccess;
+
+    if (features.storage8Bit)
+    {
+      storage8BitFeature = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_8BIT_STORAGE_FEATURES_KHR,
+        .pNext = featureChain,
+        .storageBuffer8BitAccess = VK_TRUE
+      };
+
+      featureChain = &storage8BitFeature;
+      extensions.push_back(VK_KHR_8BIT_STORAGE_EXTENSION_NAME);
+    }
+  }
+
+  features.pushDescriptor = hasDeviceExtension(
+    physicalDevice, VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+  if (features.pushDescriptor)
+    extensions.push_back(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+
+  features.externalMemoryHost = hasDeviceExtension(
+    physicalDevice, VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+  if (features.externalMemoryHost)
+    extensions.push_back(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+
+  features.memoryBudget = hasDeviceExtension(
+    physicalDevice, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+  if (features.memoryBudget)
+    extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+
   VkPhysicalDeviceDynamicRenderingFeatures dynamicRenderingFeature = 
   {
     .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES,
+    .pNext = featureChain,
     .dynamicRendering = VK_TRUE,
   };
 
+  if (hasDeviceExtension(physicalDevice,
+                         VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME))
+    featureChain = &dynamicRenderingFeature;
+
+  /* Core features go through the chain too so that pEnabledFeatures can
+   * stay null. */
+  VkPhysicalDeviceFeatures2 supportedFeatures = {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2
+  };
+
+  vkGetPhysicalDeviceFeatures2(physicalDevice, &supportedFeatures);
+
+  features.pipelineStatistics =
+    supportedFeatures.features.pipelineStatisticsQuery;
+  features.float64 = supportedFeatures.features.shaderFloat64;
+
+  /* Binds go through the one queue vub submits to. */
+  uint32 queueFamilyCount = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount,
+                                           nullptr);
+
+  std::vector<VkQueueFamilyProperties> queueProperties(queueFamilyCount);
+  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount,
+                                           queueProperties.data());
+
+  features.sparseBuffer =
+    supportedFeatures.features.sparseBinding &&
+    supportedFeatures.features.sparseResidencyBuffer &&
+    (queueProperties[graphicsFamily].queueFlags &
+     VK_QUEUE_SPARSE_BINDING_BIT);
+
+  VkPhysicalDeviceFeatures2 enabledFeatures = {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+    .pNext = featureChain
+  };
+
+  enabledFeatures.features.pipelineStatisticsQuery =
+    features.pipelineStatistics;
+  enabledFeatures.features.shaderFloat64 = features.float64;
+  enabledFeatures.features.sparseBinding = features.sparseBuffer;
+  enabledFeatures.features.sparseResidencyBuffer = features.sparseBuffer;
+
   VkDeviceCreateInfo deviceInfo = {
     .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-    .pNext = &dynamicRenderingFeature,
+    .pNext = &enabledFeatures,
     .flags = 0,
     .queueCreateInfoCount = uniqueQueueFamilyCount,
     .pQueueCreateInfos = uniqueFamilyInfos.data(),
@@ -331,8 +665,23 @@ makeDevice(VkInstance instance, VkSurfaceKHR surface,
     (vkGetInstanceProcAddr(instance, "vkGetMemoryFdKHR"));
   vkGetSemaphoreFdKHRProc = (PFN_vkGetSemaphoreFdKHR)
     (vkGetDeviceProcAddr(dev, "vkGetSemaphoreFdKHR"));
+  vkImportSemaphoreFdKHRProc = (PFN_vkImportSemaphoreFdKHR)
+    (vkGetDeviceProcAddr(dev, "vkImportSemaphoreFdKHR"));
   vkGetPhysicalDeviceProperties2Proc = (PFN_vkGetPhysicalDeviceProperties2)
     (vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceProperties2"));
+  vkGetBufferDeviceAddressKHRProc = (PFN_vkGetBufferDeviceAddressKHR)
+    (vkGetDeviceProcAddr(dev, "vkGetBufferDeviceAddressKHR"));
+  vkCmdPushDescriptorSetKHRProc = (PFN_vkCmdPushDescriptorSetKHR)
+    (vkGetDeviceProcAddr(dev, "vkCmdPushDescriptorSetKHR"));
+  vkCmdBeginDebugUtilsLabelEXTProc = (PFN_vkCmdBeginDebugUtilsLabelEXT)
+    (vkGetInstanceProcAddr(instance, "vkCmdBeginDebugUtilsLabelEXT"));
+  vkCmdEndDebugUtilsLabelEXTProc = (PFN_vkCmdEndDebugUtilsLabelEXT)
+    (vkGetInstanceProcAddr(instance, "vkCmdEndDebugUtilsLabelEXT"));
+  vkGetMemoryHostPointerPropertiesEXTProc =
+    (PFN_vkGetMemoryHostPointerPropertiesEXT)
+    (vkGetDeviceProcAddr(dev, "vkGetMemoryHostPointerPropertiesEXT"));
+  vkGetSemaphoreCounterValueKHRProc = (PFN_vkGetSemaphoreCounterValueKHR)
+    (vkGetDeviceProcAddr(dev, "vkGetSemaphoreCounterValueKHR"));
 
   VkPhysicalDeviceIDProperties vkPhysicalDeviceIDProperties = {
     .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES,
@@ -347,6 +696,8 @@ makeDevice(VkInstance instance, VkSurfaceKHR surface,
   vkGetPhysicalDeviceProperties2Proc(physicalDevice,
                                      &vkPhysicalDeviceProperties2);
 
+  memcpy(deviceUUID, vkPhysicalDeviceIDProperties.deviceUUID, VK_UUID_SIZE);
+
   return dev;
 }
 
@@ -477,7 +828,7 @@ makeCommandPool(VkDevice dev, int32 graphicsFam)
 }
 
 static VkDescriptorPool
-makeDefaultDescriptorPool(VkDevice dev)
+makeDefaultDescriptorPool(VkDevice dev, bool updateAfterBind)
 {
   uint32 setCount = 100;
 
@@ -500,9 +851,14 @@ makeDefaultDescriptorPool(VkDevice dev)
 
   uint32 max_sets = setCount * sizeof(sizes)/sizeof(sizes[0]);
 
+  VkDescriptorPoolCreateFlags flags = 
+    VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
+  if (updateAfterBind)
+    flags |= VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
+
   VkDescriptorPoolCreateInfo descriptor_pool_info = {
     .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-    .flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT,
+    .flags = flags,
     .maxSets = max_sets,
     .poolSizeCount = sizeof(sizes)/sizeof(sizes[0]),
     .pPoolSizes = sizes
@@ -524,22 +880,171 @@ GPUDevice::~GPUDevice()
 {
 }
 
+/* Named after what makes caches compatible, so that devices (or drivers)
+ * don't keep replacing each other's. */
+static std::string
+getPipelineCachePath(const VkPhysicalDeviceProperties &properties)
+{
+  std::string dir = getDefaultCacheDir();
+  if (dir.empty())
+    return "";
+
+  char name[64];
+  snprintf(name, sizeof(name), "pipelines-%08x-%08x-%08x.bin",
+           properties.vendorID, properties.deviceID,
+           properties.driverVersion);
+
+  return dir + "/" + name;
+}
+
+/* Starts from what a previous process saved at path, unless it is missing
+ * or was written for another device. Drivers check the data themselves,
+ * but not all of them do so gracefully. */
+static VkPipelineCache
+makePipelineCache(VkDevice dev,
+                  const VkPhysicalDeviceProperties &properties,
+                  const std::string &path)
+{
+  std::vector<uint8> data;
+
+  if (FILE *file = path.empty() ? nullptr : fopen(path.c_str(), "rb"))
+  {
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    data.resize(size > 0 ? size : 0);
+    if (fread(data.data(), 1, data.size(), file) != data.size())
+      data.clear();
+
+    fclose(file);
+  }
+
+  VkPipelineCacheHeaderVersionOne header = {};
+  if (data.size() >= sizeof(header))
+    memcpy(&header, data.data(), sizeof(header));
+
+  if (header.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+      header.vendorID != properties.vendorID ||
+      header.deviceID != properties.deviceID ||
+      memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID,
+             VK_UUID_SIZE))
+    data.clear();
+
+  VkPipelineCacheCreateInfo cacheInfo = {
+    .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+    .initialDataSize = data.size(),
+    .pInitialData = data.data()
+  };
+
+  VkPipelineCache cache;
+  VK_CHECK(vkCreatePipelineCache(dev, &cacheInfo, nullptr, &cache));
+
+  return cache;
+}
+
+bool
+GPUDevice::isAvailable()
+{
+  VkApplicationInfo appInfo = {
+    .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+    .apiVersion = VK_API_VERSION_1_1
+  };
+
+  VkInstanceCreateInfo instanceInfo = {
+    .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+#if __APPLE__
+    .flags = VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHR,
+#endif
+    .pApplicationInfo = &appInfo
+  };
+
+  /* Fails without a loader or driver, which is one of the cases this is
+   * for. */
+  VkInstance instance;
+  if (vkCreateInstance(&instanceInfo, nullptr, &instance) != VK_SUCCESS)
+    return false;
+
+  uint32 deviceCount = 0;
+  vkEnumeratePhysicalDevices(instance, &deviceCount, nullptr);
+
+  std::vector<VkPhysicalDevice> devices(deviceCount);
+  vkEnumeratePhysicalDevices(instance, &deviceCount, devices.data());
+
+  /* Same as what makeDevice looks for. */
+  bool found = false;
+  for (VkPhysicalDevice device : devices)
+  {
+    uint32 queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount,
+                                             nullptr);
+
+    std::vector<VkQueueFamilyProperties> queueProperties(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount,
+                                             queueProperties.data());
+
+    for (const VkQueueFamilyProperties &properties : queueProperties)
+    {
+      if (properties.queueFlags & VK_QUEUE_COMPUTE_BIT &&
+          properties.queueCount > 0)
+        found = true;
+    }
+  }
+
+  vkDestroyInstance(instance, nullptr);
+
+  return found;
+}
+
 GPUDevice 
-GPUDevice::make(const Surface *surface)
+GPUDevice::make(const Surface *surface, bool enableValidation)
 {
   VkDevice dev = VK_NULL_HANDLE;
   auto impl = std::make_unique<GPUDevice::Impl>();
+  DeviceFeatures features = {};
 
   std::vector<const char *> layers;
+  bool debugUtils = false;
 
-  impl->instance = makeInstance(true, layers);
-  impl->messenger = makeDebugMessenger(impl->instance);
+  impl->instance = makeInstance(enableValidation, layers, debugUtils);
+  impl->messenger = debugUtils ?
+    makeDebugMessenger(impl->instance) : VK_NULL_HANDLE;
 
   dev = makeDevice(impl->instance, impl->surface,
                    layers, impl->physicalDevice, 
                    impl->graphicsFamily, impl->presentFamily,
                    impl->graphicsQueue, impl->presentQueue,
-                   impl->depthFormat);
+                   impl->depthFormat, features, impl->deviceUUID);
+
+  vkGetPhysicalDeviceProperties(impl->physicalDevice, &impl->properties);
+  vkGetPhysicalDeviceMemoryProperties(impl->physicalDevice,
+                                      &impl->memoryProperties);
+
+  impl->pipelineCachePath = getPipelineCachePath(impl->properties);
+  impl->pipelineCache = makePipelineCache(dev, impl->properties,
+                                          impl->pipelineCachePath);
+
+  impl->memory = std::make_unique<MemoryTracker>(
+    MemoryTracker::make(impl->memoryProperties.memoryHeapCount));
+
+  impl->minImportedHostPointerAlignment = 0;
+  if (features.externalMemoryHost)
+  {
+    VkPhysicalDeviceExternalMemoryHostPropertiesEXT hostProperties = {
+      .sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT
+    };
+
+    VkPhysicalDeviceProperties2 properties = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+      .pNext = &hostProperties
+    };
+
+    vkGetPhysicalDeviceProperties2Proc(impl->physicalDevice, &properties);
+
+    impl->minImportedHostPointerAlignment =
+      hostProperties.minImportedHostPointerAlignment;
+  }
 
 #if 0
   impl->swapchain = makeSwapchain(dev, impl->physicalDevice, 
@@ -554,9 +1059,31 @@ GPUDevice::make(const Surface *surface)
 
   impl->commandPool = makeCommandPool(dev, impl->graphicsFamily);
 
-  impl->defaultDescriptorPool = makeDefaultDescriptorPool(dev);
+  impl->defaultDescriptorPool = makeDefaultDescriptorPool(
+    dev, features.updateAfterBind);
+
+  impl->timeline = VK_NULL_HANDLE;
+  if (features.timelineSemaphore)
+  {
+    VkSemaphoreTypeCreateInfoKHR typeInfo = {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR,
+      .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR,
+      .initialValue = 0
+    };
+
+    VkSemaphoreCreateInfo semaphoreInfo = {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+      .pNext = &typeInfo
+    };
+
+    VK_CHECK(vkCreateSemaphore(dev, &semaphoreInfo, nullptr,
+                               &impl->timeline));
+  }
+
+  impl->submittedValue = 0;
+  impl->idleValue = 0;
 
-  return { dev, std::move(impl) };
+  return { dev, std::move(impl), features };
 }
 
 static VkAccessFlags 
@@ -585,6 +1112,12 @@ findAccessFlagsFor(VkPipelineStageFlags stage)
   case VK_PIPELINE_STAGE_TRANSFER_BIT:
     return VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT;
 
+  case VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT:
+    return VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT;
+
+  case VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT:
+    return VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+
   case VK_PIPELINE_STAGE_ALL_COMMANDS_BIT:
     return VK_ACCESS_MEMORY_WRITE_BIT | VK_ACCESS_MEMORY_READ_BIT;
 
@@ -659,8 +1192,8 @@ GPUDevice::makeBarrier(VkImage image, VkImageAspectFlags aspect,
 
 VkBufferMemoryBarrier 
 GPUDevice::makeBarrier(VkBuffer buffer,
-                       uint32 offset,
-                       uint32 size,
+                       uint64 offset,
+                       uint64 size,
                        VkPipelineStageFlags src,
                        VkPipelineStageFlags dst)
 {
@@ -680,17 +1213,87 @@ void
 GPUDevice::waitIdle() const
 {
   vkDeviceWaitIdle(dev);
+  impl->idleValue = impl->submittedValue;
+  impl->fenceValues.clear();
+}
+
+uint64
+GPUDevice::submittedValue() const
+{
+  return impl->submittedValue;
+}
+
+uint64
+GPUDevice::completedValue() const
+{
+  if (impl->timeline == VK_NULL_HANDLE)
+    return impl->idleValue;
+
+  uint64 value;
+  VK_CHECK(vkGetSemaphoreCounterValueKHRProc(dev, impl->timeline, &value));
+
+  return value;
+}
+
+VkResult
+GPUDevice::waitForFence(VkFence fence, uint64 timeout) const
+{
+  VkResult result = vkWaitForFences(dev, 1, &fence, VK_TRUE, timeout);
+
+  if (result != VK_SUCCESS || impl->timeline != VK_NULL_HANDLE)
+    return result;
+
+  auto &fenceValues = impl->fenceValues;
+  auto it = std::find_if(fenceValues.begin(), fenceValues.end(),
+                         [fence] (const auto &fenceValue) {
+                           return fenceValue.fence == fence;
+                         });
+
+  /* The queue finishes submits in order. */
+  if (it != fenceValues.end())
+    impl->idleValue = std::max(impl->idleValue, it->value);
+
+  /* Drops the fences of the submits which are known to be done, the ones
+   * which have been destroyed since among them. */
+  uint64 idleValue = impl->idleValue;
+  fenceValues.erase(
+    std::remove_if(fenceValues.begin(), fenceValues.end(),
+                   [idleValue] (const auto &fenceValue) {
+                     return fenceValue.value <= idleValue;
+                   }),
+    fenceValues.end());
+
+  return result;
+}
+
+ScratchAllocator &
+GPUDevice::scratchAllocator() const
+{
+  if (!impl->scratch)
+    impl->scratch = std::make_unique<ScratchAllocator>(
+      ScratchAllocator::make(*this));
+
+  return *impl->scratch;
+}
+
+ShaderCompiler &
+GPUDevice::shaderCompiler() const
+{
+  if (!impl->compiler)
+    impl->compiler = std::make_unique<ShaderCompiler>(ShaderCompiler::make());
+
+  return *impl->compiler;
 }
 
 VkCommandBuffer 
-GPUDevice::makeCommandBuffer() const
+GPUDevice::makeCommandBuffer(VkCommandBufferLevel level) const
 {
   VkCommandBuffer commandBuffer;
 
   VkCommandBufferAllocateInfo allocInfo = {
     .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
     .commandPool = impl->commandPool,
-    .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+    .level = level,
     .commandBufferCount = 1
   };
 
@@ -701,6 +1304,9 @@ GPUDevice::makeCommandBuffer() const
 void 
 GPUDevice::freeCommandBuffer(VkCommandBuffer cmdbuf) const
 {
+  if (profiler)
+    profiler->discardUnsubmitted(cmdbuf);
+
   vkFreeCommandBuffers(dev, impl->commandPool, 1, &cmdbuf);
 }
 
@@ -711,6 +1317,9 @@ GPUDevice::beginCommandBuffer(VkCommandBuffer cmdbuf) const
     .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO
   };
 
+  if (profiler)
+    profiler->discardUnsubmitted(cmdbuf);
+
   vkBeginCommandBuffer(cmdbuf, &beginInfo);
 }
 
@@ -722,6 +1331,9 @@ GPUDevice::beginSingleUseCommandBuffer(VkCommandBuffer cmdbuf) const
     .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
   };
 
+  if (profiler)
+    profiler->discardUnsubmitted(cmdbuf);
+
   vkBeginCommandBuffer(cmdbuf, &beginInfo);
 }
 
@@ -738,18 +1350,8 @@ GPUDevice::submitCommandBuffer(VkCommandBuffer cmdbuf,
                                VkPipelineStageFlags waitStage,
                                VkFence fence) const
 {
-  VkSubmitInfo submitInfo = {
-    .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-    .waitSemaphoreCount = (wait == VK_NULL_HANDLE) ? 0u : 1u,
-    .pWaitSemaphores = &wait,
-    .pWaitDstStageMask = &waitStage,
-    .commandBufferCount = 1,
-    .pCommandBuffers = &cmdbuf,
-    .signalSemaphoreCount = (signal == VK_NULL_HANDLE) ? 0u : 1u,
-    .pSignalSemaphores = &signal
-  };
-
-  VK_CHECK(vkQueueSubmit(impl->graphicsQueue, 1, &submitInfo, fence));
+  submitCommandBuffer(cmdbuf, (wait == VK_NULL_HANDLE) ? 0u : 1u,
+                      &wait, signal, &waitStage, fence);
 }
 
 void 
@@ -760,18 +1362,65 @@ GPUDevice::submitCommandBuffer(VkCommandBuffer cmdbuf,
                                VkPipelineStageFlags *waitStage,
                                VkFence signalFence) const
 {
+  uint64 value = ++impl->submittedValue;
+
+  /* The caller's semaphore (if any) and the queue timeline. */
+  VkSemaphore signals[2];
+  uint64 signalValues[2];
+  uint32 signalCount = 0;
+
+  if (signal != VK_NULL_HANDLE)
+  {
+    signals[signalCount] = signal;
+    signalValues[signalCount++] = 0;
+  }
+
+  if (impl->timeline != VK_NULL_HANDLE)
+  {
+    signals[signalCount] = impl->timeline;
+    signalValues[signalCount++] = value;
+  }
+
+  /* The waits are binary semaphores, which take no values. */
+  VkTimelineSemaphoreSubmitInfoKHR timelineInfo = {
+    .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR,
+    .waitSemaphoreValueCount = 0,
+    .pWaitSemaphoreValues = nullptr,
+    .signalSemaphoreValueCount = signalCount,
+    .pSignalSemaphoreValues = signalValues
+  };
+
   VkSubmitInfo submitInfo = {
     .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+    .pNext = impl->timeline != VK_NULL_HANDLE ? &timelineInfo : nullptr,
     .waitSemaphoreCount = waitCount,
     .pWaitSemaphores = wait,
     .pWaitDstStageMask = waitStage,
     .commandBufferCount = 1,
     .pCommandBuffers = &cmdbuf,
-    .signalSemaphoreCount = (signal == VK_NULL_HANDLE) ? 0u : 1u,
-    .pSignalSemaphores = &signal
+    .signalSemaphoreCount = signalCount,
+    .pSignalSemaphores = signals
   };
 
   VK_CHECK(vkQueueSubmit(impl->graphicsQueue, 1, &submitInfo, signalFence));
+
+  if (profiler)
+    profiler->submitted(cmdbuf);
+
+  if (impl->timeline == VK_NULL_HANDLE && signalFence != VK_NULL_HANDLE)
+  {
+    /* A fence is reset before it is submitted again. */
+    auto &fenceValues = impl->fenceValues;
+    auto it = std::find_if(fenceValues.begin(), fenceValues.end(),
+                           [signalFence] (const auto &fenceValue) {
+                             return fenceValue.fence == signalFence;
+                           });
+
+    if (it != fenceValues.end())
+      it->value = value;
+    else
+      fenceValues.push_back({ signalFence, value });
+  }
 }
 
 uint32 
@@ -817,6 +1466,133 @@ GPUDevice::getSwapchainExtent() const
   return impl->swapchainExtent;
 }
 
+const char *
+GPUDevice::getDeviceName() const
+{
+  return impl->properties.deviceName;
+}
+
+/* Index of the largest device local heap. */
+static uint32
+findDeviceLocalHeap(const VkPhysicalDeviceMemoryProperties &memProperties)
+{
+  uint32 largest = 0;
+  uint64 size = 0;
+  for (uint32 i = 0; i < memProperties.memoryHeapCount; ++i)
+  {
+    const VkMemoryHeap &heap = memProperties.memoryHeaps[i];
+    if (heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT && heap.size > size)
+    {
+      largest = i;
+      size = heap.size;
+    }
+  }
+
+  return largest;
+}
+
+uint64
+GPUDevice::getDeviceLocalMemorySize() const
+{
+  uint32 heap = findDeviceLocalHeap(impl->memoryProperties);
+  return impl->memoryProperties.memoryHeaps[heap].size;
+}
+
+MemoryBudget
+GPUDevice::getMemoryBudget(uint32 heap) const
+{
+  assert(heap < impl->memoryProperties.memoryHeapCount);
+
+  MemoryBudget ret = {};
+  ret.heap = heap;
+  ret.heapSize = impl->memoryProperties.memoryHeaps[heap].size;
+
+  if (features.memoryBudget)
+  {
+    /* Changes as the process and others allocate, so it is queried every
+     * time. */
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProperties = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT
+    };
+
+    VkPhysicalDeviceMemoryProperties2 properties = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2,
+      .pNext = &budgetProperties
+    };
+
+    vkGetPhysicalDeviceMemoryProperties2(impl->physicalDevice, &properties);
+
+    ret.budget = budgetProperties.heapBudget[heap];
+    ret.usage = budgetProperties.heapUsage[heap];
+  }
+  else
+  {
+    ret.budget = ret.heapSize;
+    ret.usage = impl->memory->heaps[heap].bytes;
+  }
+
+  ret.available = ret.budget > ret.usage ? ret.budget - ret.usage : 0;
+
+  return ret;
+}
+
+MemoryBudget
+GPUDevice::getDeviceLocalMemoryBudget() const
+{
+  return getMemoryBudget(findDeviceLocalHeap(impl->memoryProperties));
+}
+
+VkDeviceMemory
+GPUDevice::allocateMemory(const VkMemoryAllocateInfo &allocInfo,
+                          MemoryTag tag,
+                          bool mayFail) const
+{
+  uint32 heap =
+    impl->memoryProperties.memoryTypes[allocInfo.memoryTypeIndex].heapIndex;
+
+  VkDeviceMemory memory;
+  VkResult result = vkAllocateMemory(dev, &allocInfo, nullptr, &memory);
+
+  if (result != VK_SUCCESS)
+  {
+    if (mayFail)
+      return VK_NULL_HANDLE;
+
+    MemoryBudget budget = getMemoryBudget(heap);
+    printf("Failed to allocate %llu bytes (%s) from heap %u: "
+           "%llu of %llu bytes used, vub has %llu\n",
+           (unsigned long long)allocInfo.allocationSize,
+           getMemoryTagName(tag), heap,
+           (unsigned long long)budget.usage,
+           (unsigned long long)budget.budget,
+           (unsigned long long)impl->memory->heaps[heap].bytes);
+    PANIC_AND_EXIT("Out of device memory");
+  }
+
+  impl->memory->add(memory, allocInfo.allocationSize, heap, tag);
+
+  return memory;
+}
+
+void
+GPUDevice::freeMemory(VkDeviceMemory memory) const
+{
+  impl->memory->remove(memory);
+  vkFreeMemory(dev, memory, nullptr);
+}
+
+MemoryTracker &
+GPUDevice::memoryTracker() const
+{
+  return *impl->memory;
+}
+
+uint64
+GPUDevice::getMaxStorageBufferRange() const
+{
+  return impl->properties.limits.maxStorageBufferRange;
+}
+
 static uint32 
 findMemoryType(VkPhysicalDevice physicalDevice,
                VkMemoryPropertyFlags properties, 
@@ -840,17 +1616,26 @@ findMemoryType(VkPhysicalDevice physicalDevice,
 }
 
 static VkDeviceMemory 
-allocateBufferMemory(VkDevice dev,
+allocateBufferMemory(const GPUDevice &gpu,
                      VkPhysicalDevice physicalDevice,
                      VkBuffer buffer, 
                      VkMemoryPropertyFlags properties,
-                     bool shouldExport = false) 
+                     MemoryTag tag,
+                     bool shouldExport = false,
+                     bool deviceAddress = false) 
 {
+  VkDevice dev = gpu.dev;
+
   VkMemoryRequirements requirements = {};
   vkGetBufferMemoryRequirements(dev, buffer, &requirements);
 
   VkExportMemoryAllocateInfoKHR exportInfo = {};
 
+  VkMemoryAllocateFlagsInfoKHR flagsInfo = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO_KHR,
+    .flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT_KHR
+  };
+
   VkMemoryAllocateInfo allocInfo = {
     .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
     .allocationSize = requirements.size,
@@ -865,21 +1650,28 @@ allocateBufferMemory(VkDevice dev,
     allocInfo.pNext = &exportInfo;
   }
 
-  VkDeviceMemory memory;
-  vkAllocateMemory(dev, &allocInfo, nullptr, &memory);
+  if (deviceAddress)
+  {
+    flagsInfo.pNext = allocInfo.pNext;
+    allocInfo.pNext = &flagsInfo;
+  }
+
+  VkDeviceMemory memory = gpu.allocateMemory(allocInfo, tag);
   vkBindBufferMemory(dev, buffer, memory, 0);
 
   return memory;
 }
 
 static VkDeviceMemory 
-allocateImageMemory(VkDevice dev,
+allocateImageMemory(const GPUDevice &gpu,
                       VkPhysicalDevice physicalDevice,
                       VkImage image, 
                       VkMemoryPropertyFlags properties,
                       uint64 *size,
                       bool shouldExport = false) 
 {
+  VkDevice dev = gpu.dev;
+
   VkMemoryRequirements requirements = {};
   vkGetImageMemoryRequirements(dev, image, &requirements);
 
@@ -899,8 +1691,7 @@ allocateImageMemory(VkDevice dev,
     allocInfo.pNext = &exportInfo;
   }
 
-  VkDeviceMemory memory;
-  vkAllocateMemory(dev, &allocInfo, nullptr, &memory);
+  VkDeviceMemory memory = gpu.allocateMemory(allocInfo, MemoryTag::Image);
 
   if (size)
     *size = requirements.size;
@@ -909,7 +1700,7 @@ allocateImageMemory(VkDevice dev,
 }
 
 static VkBuffer
-makeBuffer(VkDevice dev, uint32 size, VkBufferUsageFlags usage, 
+makeBuffer(VkDevice dev, uint64 size, VkBufferUsageFlags usage, 
            bool shouldExport = false)
 {
   VkExternalMemoryBufferCreateInfo externalInfo = {};
@@ -935,41 +1726,602 @@ makeBuffer(VkDevice dev, uint32 size, VkBufferUsageFlags usage,
   return buffer;
 }
 
+static VkDeviceAddress
+getBufferAddress(VkDevice dev, VkBuffer buffer)
+{
+  VkBufferDeviceAddressInfoKHR info = {
+    .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO_KHR,
+    .buffer = buffer
+  };
+
+  return vkGetBufferDeviceAddressKHRProc(dev, &info);
+}
+
 StagingBuffer 
-GPUDevice::makeStagingBuffer(uint64 size) const
+GPUDevice::makeStagingBuffer(uint64 size, VkBufferUsageFlags usage) const
 {
+  if (features.bufferDeviceAddress)
+    usage |= VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_KHR;
+
   StagingBuffer ret = {};
-  ret.hdl = makeBuffer(dev, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
-  ret.mem = allocateBufferMemory(dev, impl->physicalDevice, ret.hdl, 
+  ret.hdl = makeBuffer(dev, size, usage);
+  ret.mem = allocateBufferMemory(*this, impl->physicalDevice, ret.hdl, 
                                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | 
-                                 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+                                 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                 MemoryTag::Staging,
+                                 false, features.bufferDeviceAddress);
   vkMapMemory(dev, ret.mem, 0, size, 0, &ret.ptr);
+
+  if (features.bufferDeviceAddress)
+    ret.addr = getBufferAddress(dev, ret.hdl);
+
   ret.mDev = this;
   return ret;
 }
 
+/* Of device buffers, made here or imported. */
+static VkBufferUsageFlags
+getDeviceBufferUsage(const DeviceFeatures &features)
+{
+  /* Any of them may hold parameters written on the device for indirect
+   * dispatches (see IndirectCount). */
+  VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                             VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                             VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                             VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+  if (features.bufferDeviceAddress)
+    usage |= VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_KHR;
+
+  return usage;
+}
+
 DeviceBuffer
 GPUDevice::makeDeviceBuffer(uint64 size, bool shouldExport) const
 {
+  VkBufferUsageFlags usage = getDeviceBufferUsage(features);
+
   DeviceBuffer ret = {};
-  ret.hdl = makeBuffer(dev, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, shouldExport);
-  ret.mem = allocateBufferMemory(dev, impl->physicalDevice, ret.hdl, 
+  ret.hdl = makeBuffer(dev, size, usage, shouldExport);
+  ret.mem = allocateBufferMemory(*this, impl->physicalDevice, ret.hdl, 
                                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                 shouldExport);
+                                 MemoryTag::Device,
+                                 shouldExport, features.bufferDeviceAddress);
+  ret.size = size;
+
+  if (features.bufferDeviceAddress)
+    ret.addr = getBufferAddress(dev, ret.hdl);
+
+  ret.mDev = this;
+  return ret;
+}
+
+DeviceBuffer
+GPUDevice::makeSparseDeviceBuffer(uint64 size) const
+{
+  assert(features.sparseBuffer);
+
+  if (size > impl->properties.limits.sparseAddressSpaceSize)
+  {
+    printf("Sparse buffer of %llu bytes is too large\n",
+           (unsigned long long)size);
+    PANIC_AND_EXIT("Sparse address space exhausted");
+  }
+
+  /* Same as makeDeviceBuffer. */
+  VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                             VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                             VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                             VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+  if (features.bufferDeviceAddress)
+    usage |= VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_KHR;
+
+  /* Residency, so that the buffer may be used while only some of it has
+   * memory. */
+  VkBufferCreateInfo bufferInfo = {
+    .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+    .flags = VK_BUFFER_CREATE_SPARSE_BINDING_BIT |
+             VK_BUFFER_CREATE_SPARSE_RESIDENCY_BIT,
+    .size = size,
+    .usage = usage,
+    .sharingMode = VK_SHARING_MODE_EXCLUSIVE
+  };
+
+  DeviceBuffer ret = {};
+  VK_CHECK(vkCreateBuffer(dev, &bufferInfo, nullptr, &ret.hdl));
+  ret.mem = VK_NULL_HANDLE;
   ret.size = size;
 
+  if (features.bufferDeviceAddress)
+    ret.addr = getBufferAddress(dev, ret.hdl);
+
   ret.mDev = this;
   return ret;
 }
 
+uint64
+GPUDevice::getSparseBlockSize(const DeviceBuffer &buffer) const
+{
+  VkMemoryRequirements requirements = {};
+  vkGetBufferMemoryRequirements(dev, buffer.hdl, &requirements);
+
+  return requirements.alignment;
+}
+
+VkDeviceMemory
+GPUDevice::bindSparseMemory(const DeviceBuffer &buffer,
+                            uint64 offset,
+                            uint64 size) const
+{
+  VkMemoryRequirements requirements = {};
+  vkGetBufferMemoryRequirements(dev, buffer.hdl, &requirements);
+
+  /* Only the last block may be cut short by the end of the buffer. */
+  assert(offset % requirements.alignment == 0);
+  assert(size % requirements.alignment == 0 || offset + size == buffer.size);
+  assert(offset + size <= buffer.size);
+
+  VkMemoryAllocateFlagsInfoKHR flagsInfo = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO_KHR,
+    .flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT_KHR
+  };
+
+  VkMemoryAllocateInfo allocInfo = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+    .pNext = features.bufferDeviceAddress ? &flagsInfo : nullptr,
+    .allocationSize = roundUp(size, requirements.alignment),
+    .memoryTypeIndex = findMemoryType(impl->physicalDevice,
+                                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                      requirements)
+  };
+
+  VkDeviceMemory memory = allocateMemory(allocInfo, MemoryTag::Sparse);
+
+  VkSparseMemoryBind bind = {
+    .resourceOffset = offset,
+    .size = size,
+    .memory = memory,
+    .memoryOffset = 0
+  };
+
+  VkSparseBufferMemoryBindInfo bufferBind = {
+    .buffer = buffer.hdl,
+    .bindCount = 1,
+    .pBinds = &bind
+  };
+
+  VkBindSparseInfo bindInfo = {
+    .sType = VK_STRUCTURE_TYPE_BIND_SPARSE_INFO,
+    .bufferBindCount = 1,
+    .pBufferBinds = &bufferBind
+  };
+
+  VkFenceCreateInfo fenceInfo = {
+    .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO
+  };
+
+  /* Binds aren't ordered with the submits around them, so the ones which
+   * use the new memory may only be made once the bind is done. */
+  VkFence fence;
+  VK_CHECK(vkCreateFence(dev, &fenceInfo, nullptr, &fence));
+  VK_CHECK(vkQueueBindSparse(impl->graphicsQueue, 1, &bindInfo, fence));
+  VK_CHECK(vkWaitForFences(dev, 1, &fence, VK_TRUE, UINT64_MAX));
+  vkDestroyFence(dev, fence, nullptr);
+
+  return memory;
+}
+
+/* Returns VK_NULL_HANDLE if the memory can't be imported. */
+static VkDeviceMemory
+importHostMemory(const GPUDevice &gpu,
+                 VkPhysicalDevice physicalDevice,
+                 VkBuffer buffer,
+                 void *base,
+                 uint64 size,
+                 bool deviceAddress)
+{
+  VkDevice dev = gpu.dev;
+
+  VkMemoryHostPointerPropertiesEXT pointerProperties = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT
+  };
+
+  VkResult result = vkGetMemoryHostPointerPropertiesEXTProc(
+    dev, VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT, base,
+    &pointerProperties);
+
+  if (result != VK_SUCCESS)
+    return VK_NULL_HANDLE;
+
+  VkMemoryRequirements requirements = {};
+  vkGetBufferMemoryRequirements(dev, buffer, &requirements);
+  requirements.memoryTypeBits &= pointerProperties.memoryTypeBits;
+
+  /* Coherent, so that the host sees what the GPU wrote without
+   * invalidating. */
+  VkPhysicalDeviceMemoryProperties memProperties;
+  vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+
+  int32 memoryType = -1;
+  for (uint32 i = 0; i < memProperties.memoryTypeCount; ++i)
+  {
+    if ((requirements.memoryTypeBits & (1 << i)) &&
+        (memProperties.memoryTypes[i].propertyFlags &
+         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+    {
+      memoryType = i;
+      break;
+    }
+  }
+
+  if (memoryType < 0)
+    return VK_NULL_HANDLE;
+
+  VkImportMemoryHostPointerInfoEXT importInfo = {
+    .sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT,
+    .handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
+    .pHostPointer = base
+  };
+
+  VkMemoryAllocateFlagsInfoKHR flagsInfo = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO_KHR,
+    .flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT_KHR
+  };
+
+  if (deviceAddress)
+    importInfo.pNext = &flagsInfo;
+
+  VkMemoryAllocateInfo allocInfo = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+    .pNext = &importInfo,
+    .allocationSize = size,
+    .memoryTypeIndex = (uint32)memoryType
+  };
+
+  VkDeviceMemory memory = gpu.allocateMemory(allocInfo, MemoryTag::Import,
+                                             true);
+  if (memory == VK_NULL_HANDLE)
+    return VK_NULL_HANDLE;
+
+  if (vkBindBufferMemory(dev, buffer, memory, 0) != VK_SUCCESS)
+  {
+    gpu.freeMemory(memory);
+    return VK_NULL_HANDLE;
+  }
+
+  return memory;
+}
+
+HostBuffer
+GPUDevice::importHostBuffer(void *ptr, uint64 size) const
+{
+  VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                             VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                             VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  if (features.bufferDeviceAddress)
+    usage |= VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT_KHR;
+
+  HostBuffer ret = {};
+  ret.ptr = ptr;
+  ret.size = size;
+
+  /* Vulkan has no buffers of 0 bytes. Nothing needs to be copied either,
+   * so this behaves like an import of nothing. */
+  if (size == 0)
+  {
+    ret.hdl = VK_NULL_HANDLE;
+    ret.mem = VK_NULL_HANDLE;
+    ret.offset = 0;
+    ret.addr = 0;
+    ret.imported = true;
+    return ret;
+  }
+
+  ret.mDev = this;
+
+  if (features.externalMemoryHost)
+  {
+    /* Widened to whole aligned blocks. These are mapped as long as the
+     * alignment isn't above the page size, and the import fails (leaving a
+     * copy) if they aren't. */
+    uint64 alignment = impl->minImportedHostPointerAlignment;
+    uint64 begin = (uint64)(uintptr_t)ptr / alignment * alignment;
+    uint64 end = roundUp((uint64)(uintptr_t)ptr + size, alignment);
+    uint64 offset = (uint64)(uintptr_t)ptr - begin;
+
+    uint64 offsetAlignment =
+      impl->properties.limits.minStorageBufferOffsetAlignment;
+
+    if (features.bufferDeviceAddress || offset % offsetAlignment == 0)
+    {
+      VkExternalMemoryBufferCreateInfo externalInfo = {
+        .sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO,
+        .handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT
+      };
+
+      VkBufferCreateInfo bufferInfo = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .pNext = &externalInfo,
+        .size = end - begin,
+        .usage = usage,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE
+      };
+
+      VkBuffer buffer;
+      VK_CHECK(vkCreateBuffer(dev, &bufferInfo, nullptr, &buffer));
+
+      VkDeviceMemory memory = importHostMemory(
+        *this, impl->physicalDevice, buffer, (void *)(uintptr_t)begin,
+        end - begin, features.bufferDeviceAddress);
+
+      if (memory != VK_NULL_HANDLE)
+      {
+        ret.hdl = buffer;
+        ret.mem = memory;
+        ret.offset = offset;
+        ret.imported = true;
+
+        if (features.bufferDeviceAddress)
+          ret.addr = getBufferAddress(dev, buffer);
+
+        return ret;
+      }
+
+      vkDestroyBuffer(dev, buffer, nullptr);
+    }
+  }
+
+  ret.mCopy = makeStagingBuffer(size, usage);
+  ret.hdl = ret.mCopy.hdl;
+  ret.mem = ret.mCopy.mem;
+  ret.offset = 0;
+  ret.addr = ret.mCopy.addr;
+  ret.imported = false;
+
+  ret.upload();
+
+  return ret;
+}
+
+BufferRange
+HostBuffer::range(uint64 rangeOffset, uint64 rangeSize) const
+{
+  assert(rangeOffset <= size);
+
+  if (rangeSize == VK_WHOLE_SIZE)
+    rangeSize = size - rangeOffset;
+
+  assert(rangeOffset + rangeSize <= size);
+
+  return {
+    .hdl = hdl,
+    .offset = offset + rangeOffset,
+    .size = rangeSize,
+    .addr = addr ? addr + offset + rangeOffset : 0
+  };
+}
+
+void
+HostBuffer::upload() const
+{
+  if (!imported)
+    memcpy(mCopy.ptr, ptr, size);
+}
+
+void
+HostBuffer::download() const
+{
+  if (!imported)
+    memcpy(ptr, mCopy.ptr, size);
+}
+
+HostBuffer::HostBuffer(HostBuffer &&other)
+  : hdl(other.hdl), mem(other.mem), ptr(other.ptr), size(other.size),
+    offset(other.offset), addr(other.addr), imported(other.imported),
+    mCopy(std::move(other.mCopy)), mDev(other.mDev)
+{
+  other.mDev = nullptr;
+}
+
+HostBuffer &
+HostBuffer::operator=(HostBuffer &&other)
+{
+  if (this != &other)
+  {
+    if (mDev && imported)
+    {
+      vkDestroyBuffer(mDev->dev, hdl, nullptr);
+      mDev->freeMemory(mem);
+    }
+
+    hdl = other.hdl;
+    mem = other.mem;
+    ptr = other.ptr;
+    size = other.size;
+    offset = other.offset;
+    addr = other.addr;
+    imported = other.imported;
+    mCopy = std::move(other.mCopy);
+    mDev = other.mDev;
+
+    other.mDev = nullptr;
+  }
+
+  return *this;
+}
+
+HostBuffer::~HostBuffer()
+{
+  /* Copies are freed by mCopy. */
+  if (!mDev || !imported)
+    return;
+
+  vkDestroyBuffer(mDev->dev, hdl, nullptr);
+  mDev->freeMemory(mem);
+}
+
+BufferRange
+DeviceBuffer::range(uint64 offset, uint64 rangeSize) const
+{
+  assert(offset <= size);
+
+  if (rangeSize == VK_WHOLE_SIZE)
+    rangeSize = size - offset;
+
+  assert(offset + rangeSize <= size);
+
+  return {
+    .hdl = hdl,
+    .offset = offset,
+    .size = rangeSize,
+    .addr = addr ? addr + offset : 0
+  };
+}
+
+BufferRange
+BufferRange::range(uint64 rangeOffset, uint64 rangeSize) const
+{
+  assert(rangeOffset <= size);
+
+  if (rangeSize == VK_WHOLE_SIZE)
+    rangeSize = size - rangeOffset;
+
+  assert(rangeOffset + rangeSize <= size);
+
+  return {
+    .hdl = hdl,
+    .offset = offset + rangeOffset,
+    .size = rangeSize,
+    .addr = addr ? addr + rangeOffset : 0
+  };
+}
+
+StagingBuffer::StagingBuffer(StagingBuffer &&other)
+  : hdl(other.hdl), mem(other.mem), ptr(other.ptr), addr(other.addr),
+    mDev(other.mDev)
+{
+  other.mDev = nullptr;
+}
+
+StagingBuffer &
+StagingBuffer::operator=(StagingBuffer &&other)
+{
+  if (this != &other)
+  {
+    this->~StagingBuffer();
+
+    hdl = other.hdl;
+    mem = other.mem;
+    ptr = other.ptr;
+    addr = other.addr;
+    mDev = other.mDev;
+
+    other.mDev = nullptr;
+  }
+
+  return *this;
+}
+
 StagingBuffer::~StagingBuffer()
 {
+  /* Moved from or never made. */
+  if (!mDev)
+    return;
+
   vkUnmapMemory(mDev->dev, mem);
 
-  vkFreeMemory(mDev->dev, mem, nullptr);
+  mDev->freeMemory(mem);
   vkDestroyBuffer(mDev->dev, hdl, nullptr);
 }
 
+DeviceBuffer
+GPUDevice::importDeviceBuffer(int fd, uint64 size) const
+{
+  VkBuffer buffer = makeBuffer(dev, size, getDeviceBufferUsage(features),
+                               true);
+
+  /* The exporting process made the same buffer with makeDeviceBuffer,
+   * which is how both end up with the same size and memory type. */
+  VkMemoryRequirements requirements = {};
+  vkGetBufferMemoryRequirements(dev, buffer, &requirements);
+
+  VkImportMemoryFdInfoKHR importInfo = {
+    .sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_FD_INFO_KHR,
+    .handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT_KHR,
+    .fd = fd
+  };
+
+  VkMemoryAllocateFlagsInfoKHR flagsInfo = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO_KHR,
+    .flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT_KHR
+  };
+
+  if (features.bufferDeviceAddress)
+    importInfo.pNext = &flagsInfo;
+
+  VkMemoryAllocateInfo allocInfo = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+    .pNext = &importInfo,
+    .allocationSize = requirements.size,
+    .memoryTypeIndex = findMemoryType(impl->physicalDevice,
+                                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                      requirements)
+  };
+
+  DeviceBuffer ret = {};
+
+  VkDeviceMemory memory = allocateMemory(allocInfo, MemoryTag::Import, true);
+  if (memory == VK_NULL_HANDLE)
+  {
+    vkDestroyBuffer(dev, buffer, nullptr);
+    return ret;
+  }
+
+  vkBindBufferMemory(dev, buffer, memory, 0);
+
+  ret.hdl = buffer;
+  ret.mem = memory;
+  ret.size = size;
+
+  if (features.bufferDeviceAddress)
+    ret.addr = getBufferAddress(dev, buffer);
+
+  ret.mDev = this;
+  return ret;
+}
+
+VkSemaphore
+GPUDevice::importSemaphore(int fd) const
+{
+  VkSemaphoreCreateInfo semaphoreInfo = {
+    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO
+  };
+
+  VkSemaphore semaphore;
+  VK_CHECK(vkCreateSemaphore(dev, &semaphoreInfo, nullptr, &semaphore));
+
+  VkImportSemaphoreFdInfoKHR importInfo = {
+    .sType = VK_STRUCTURE_TYPE_IMPORT_SEMAPHORE_FD_INFO_KHR,
+    .semaphore = semaphore,
+    .flags = 0,
+    .handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_FD_BIT,
+    .fd = fd
+  };
+
+  if (vkImportSemaphoreFdKHRProc(dev, &importInfo) != VK_SUCCESS)
+  {
+    vkDestroySemaphore(dev, semaphore, nullptr);
+    return VK_NULL_HANDLE;
+  }
+
+  return semaphore;
+}
+
+void
+GPUDevice::getDeviceUUID(uint8 *uuid) const
+{
+  memcpy(uuid, impl->deviceUUID, VK_UUID_SIZE);
+}
+
 VkSemaphore 
 GPUDevice::makeExportSemaphore() const
 {
@@ -1029,7 +2381,7 @@ GPUDevice::make2DSampledColorDeviceImage(VkFormat format,
   VK_CHECK(vkCreateImage(dev, &imageInfo, nullptr, &image));
 
   uint64 size;
-  VkDeviceMemory memory = allocateImageMemory(dev, impl->physicalDevice, image, 
+  VkDeviceMemory memory = allocateImageMemory(*this, impl->physicalDevice, image, 
                                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
                                               &size,
                                               shouldExport);
@@ -1060,6 +2412,55 @@ GPUDevice::make2DSampledColorDeviceImage(VkFormat format,
   };
 }
 
+void
+GPUDevice::enableProfiling(bool pipelineStatistics, uint32 maxScopes)
+{
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(impl->physicalDevice, &properties);
+
+  uint32 queueFamilyCount = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(impl->physicalDevice,
+                                           &queueFamilyCount, nullptr);
+
+  std::vector<VkQueueFamilyProperties> queueProperties(queueFamilyCount);
+  vkGetPhysicalDeviceQueueFamilyProperties(impl->physicalDevice,
+                                           &queueFamilyCount,
+                                           queueProperties.data());
+
+  uint32 validBits = queueProperties[impl->graphicsFamily].timestampValidBits;
+  if (validBits == 0)
+  {
+    printf("Queue doesn't support timestamps, profiling stays off\n");
+    return;
+  }
+
+  profiler = std::make_unique<Profiler>(
+    Profiler::make(*this, properties.limits.timestampPeriod, validBits,
+                   pipelineStatistics && features.pipelineStatistics,
+                   maxScopes));
+}
+
+void
+GPUDevice::beginLabel(VkCommandBuffer cmdbuf, const char *name) const
+{
+  if (!vkCmdBeginDebugUtilsLabelEXTProc)
+    return;
+
+  VkDebugUtilsLabelEXT label = {
+    .sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_LABEL_EXT,
+    .pLabelName = name
+  };
+
+  vkCmdBeginDebugUtilsLabelEXTProc(cmdbuf, &label);
+}
+
+void
+GPUDevice::endLabel(VkCommandBuffer cmdbuf) const
+{
+  if (vkCmdEndDebugUtilsLabelEXTProc)
+    vkCmdEndDebugUtilsLabelEXTProc(cmdbuf);
+}
+
 int 
 GPUDevice::getSemaphoreHandle(VkExternalSemaphoreHandleTypeFlagBitsKHR type,
                               VkSemaphore semaphore) const
@@ -1101,16 +2502,30 @@ GPUDevice::getMemoryHandle(VkExternalMemoryHandleTypeFlagsKHR type,
 }
 
 VkDescriptorSetLayout GPUDevice::makeDescriptorSetLayoutImpl(VkDescriptorSetLayoutBinding *bindings,
-                                                             uint32 numBindings) const
+                                                             uint32 numBindings,
+                                                             VkDescriptorSetLayoutCreateFlags flags) const
 {
   VkDescriptorSetLayout ret;
 
+  std::vector<VkDescriptorBindingFlagsEXT> bindingFlags(
+    numBindings, VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT);
+
+  VkDescriptorSetLayoutBindingFlagsCreateInfoEXT flagsInfo = {
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT,
+    .bindingCount = numBindings,
+    .pBindingFlags = bindingFlags.data()
+  };
+
   VkDescriptorSetLayoutCreateInfo info = {
     .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+    .flags = flags,
     .bindingCount = numBindings,
     .pBindings = bindings
   };
 
+  if (flags & VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT)
+    info.pNext = &flagsInfo;
+
   vkCreateDescriptorSetLayout(dev, &info, nullptr, &ret);
 
   return ret;
@@ -1162,11 +2577,101 @@ ComputePipeline GPUDevice::makeComputePipeline(void *spirvCode,
   };
 
   VkPipeline pipeline;
-  vkCreateComputePipelines(dev, VK_NULL_HANDLE, 1, &info, nullptr, &pipeline);
+  vkCreateComputePipelines(dev, impl->pipelineCache, 1, &info, nullptr,
+                           &pipeline);
 
   return { pipeline, pipelineLayout };
 }
 
+static std::vector<uint32>
+readSPIRV(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file)
+  {
+    printf("Failed to open %s\n", path);
+    PANIC_AND_EXIT("Missing shader");
+  }
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  std::vector<uint32> code(size / sizeof(uint32));
+  fread(code.data(), sizeof(uint32), code.size(), file);
+  fclose(file);
+
+  return code;
+}
+
+ComputePipeline GPUDevice::makeComputePipeline(const char *shaderName,
+                                               uint32 pushConstantSize,
+                                               uint32 setLayoutCount,
+                                               VkDescriptorSetLayout *layouts) const
+{
+  if (const EmbeddedShader *embedded = findEmbeddedShader(shaderName))
+  {
+    return makeComputePipeline((void *)embedded->code, embedded->codeSize,
+                               pushConstantSize, setLayoutCount, layouts);
+  }
+
+  std::string path = std::string(VUB_SHADER_DIR) + "/" + shaderName + ".spv";
+  std::vector<uint32> code = readSPIRV(path.c_str());
+
+  return makeComputePipeline(code.data(), code.size() * sizeof(uint32),
+                             pushConstantSize, setLayoutCount, layouts);
+}
+
+ComputePipeline GPUDevice::makeComputePipelineVariant(
+  const char *sourceName,
+  const std::vector<ShaderDefine> &defines,
+  uint32 pushConstantSize,
+  uint32 setLayoutCount,
+  VkDescriptorSetLayout *layouts) const
+{
+  const std::vector<uint32> &code =
+    shaderCompiler().compile(sourceName, defines);
+
+  return makeComputePipeline((void *)code.data(),
+                             code.size() * sizeof(uint32),
+                             pushConstantSize, setLayoutCount, layouts);
+}
+
+void
+GPUDevice::savePipelineCache() const
+{
+  if (impl->pipelineCachePath.empty())
+    return;
+
+  size_t size = 0;
+  vkGetPipelineCacheData(dev, impl->pipelineCache, &size, nullptr);
+
+  std::vector<uint8> data(size);
+  if (vkGetPipelineCacheData(dev, impl->pipelineCache, &size,
+                             data.data()) != VK_SUCCESS)
+    return;
+
+  /* Like the SPIR-V of ShaderCompiler: only there to save time, and other
+   * processes only ever see whole files. */
+  std::error_code error;
+  std::filesystem::create_directories(
+    std::filesystem::path(impl->pipelineCachePath).parent_path(), error);
+
+  std::string temporary =
+    impl->pipelineCachePath + "." + std::to_string(getpid()) + ".tmp";
+
+  FILE *file = fopen(temporary.c_str(), "wb");
+  if (!file)
+    return;
+
+  size_t written = fwrite(data.data(), 1, size, file);
+  bool closed = fclose(file) == 0;
+
+  if (written != size || !closed ||
+      rename(temporary.c_str(), impl->pipelineCachePath.c_str()) != 0)
+    remove(temporary.c_str());
+}
+
 VkDescriptorSet GPUDevice::makeDescriptorSet(VkDescriptorSetLayout layout) const
 {
   VkDescriptorSetAllocateInfo info = {
@@ -1182,8 +2687,60 @@ VkDescriptorSet GPUDevice::makeDescriptorSet(VkDescriptorSetLayout layout) const
   return set;
 }
 
+static void
+makeStorageBufferWrites(VkDescriptorSet set,
+                        const VkDescriptorBufferInfo *infos,
+                        uint32 count,
+                        VkWriteDescriptorSet *writes)
+{
+  for (uint32 i = 0; i < count; ++i)
+  {
+    writes[i] = {
+      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+      .dstSet = set,
+      .dstBinding = i,
+      .dstArrayElement = 0,
+      .descriptorCount = 1,
+      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      .pBufferInfo = &infos[i]
+    };
+  }
+}
+
+void GPUDevice::writeStorageBufferDescriptors(VkDescriptorSet set,
+                                              const VkDescriptorBufferInfo *infos,
+                                              uint32 count) const
+{
+  VkWriteDescriptorSet writes[8];
+  assert(count <= sizeof(writes)/sizeof(writes[0]));
+
+  makeStorageBufferWrites(set, infos, count, writes);
+  vkUpdateDescriptorSets(dev, count, writes, 0, nullptr);
+}
+
+void GPUDevice::pushStorageBufferDescriptors(VkCommandBuffer cmdbuf,
+                                             VkPipelineLayout layout,
+                                             const VkDescriptorBufferInfo *infos,
+                                             uint32 count) const
+{
+  VkWriteDescriptorSet writes[8];
+  assert(count <= sizeof(writes)/sizeof(writes[0]));
+
+  /* dstSet is ignored for pushed descriptors. */
+  makeStorageBufferWrites(VK_NULL_HANDLE, infos, count, writes);
+  vkCmdPushDescriptorSetKHRProc(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                layout, 0, count, writes);
+}
+
 PFN_vkCmdBeginRenderingKHR vkCmdBeginRenderingKHRProc;
 PFN_vkCmdEndRenderingKHR vkCmdEndRenderingKHRProc;
 PFN_vkGetMemoryFdKHR vkGetMemoryFdKHRProc;
 PFN_vkGetSemaphoreFdKHR vkGetSemaphoreFdKHRProc;
+PFN_vkImportSemaphoreFdKHR vkImportSemaphoreFdKHRProc;
 PFN_vkGetPhysicalDeviceProperties2 vkGetPhysicalDeviceProperties2Proc;
+PFN_vkGetBufferDeviceAddressKHR vkGetBufferDeviceAddressKHRProc;
+PFN_vkCmdPushDescriptorSetKHR vkCmdPushDescriptorSetKHRProc;
+PFN_vkCmdBeginDebugUtilsLabelEXT vkCmdBeginDebugUtilsLabelEXTProc;
+PFN_vkCmdEndDebugUtilsLabelEXT vkCmdEndDebugUtilsLabelEXTProc;
+PFN_vkGetMemoryHostPointerPropertiesEXT vkGetMemoryHostPointerPropertiesEXTProc;
+PFN_vkGetSemaphoreCounterValueKHR vkGetSemaphoreCounterValueKHRProc;
@@ -2,6 +2,7 @@
 
 
 #include <memory>
+#include <vector>
 #include "types.h"
 #include <vulkan/vulkan.h>
 
@@ -11,31 +12,111 @@
 
 struct Surface;
 struct GPUDevice;
+struct Profiler;
+struct ScratchAllocator;
+struct MemoryTracker;
+struct ShaderCompiler;
+struct ShaderDefine;
+enum class MemoryTag;
 
 struct StagingBuffer {
   VkBuffer hdl;
   VkDeviceMemory mem;
   void *ptr;
 
+  /* Only set if features.bufferDeviceAddress is. */
+  VkDeviceAddress addr;
+
+  StagingBuffer() = default;
+  StagingBuffer(StagingBuffer &&other);
+  StagingBuffer &operator=(StagingBuffer &&other);
   ~StagingBuffer();
 
 private:
-  const GPUDevice *mDev;
+  const GPUDevice *mDev = nullptr;
 
   friend class GPUDevice;
 };
 
+/* A range of bytes inside of a buffer. Primitives take these instead of
+ * whole buffers so that they can work on parts of pooled allocations. */
+struct BufferRange {
+  VkBuffer hdl;
+  uint64 offset;
+  uint64 size;
+
+  /* Address of the first byte of the range (0 without
+   * features.bufferDeviceAddress). */
+  VkDeviceAddress addr;
+
+  /* Same as DeviceBuffer::range, relative to this range. */
+  BufferRange range(uint64 offset, uint64 size = VK_WHOLE_SIZE) const;
+};
+
 struct DeviceBuffer {
   VkBuffer hdl;
   VkDeviceMemory mem;
   uint64 size;
 
+  /* Only set if features.bufferDeviceAddress is. */
+  VkDeviceAddress addr;
+
+  /* size defaults to the rest of the buffer. Ranges which are bound through
+   * descriptors need an offset aligned to minStorageBufferOffsetAlignment. */
+  BufferRange range(uint64 offset = 0, uint64 size = VK_WHOLE_SIZE) const;
+  operator BufferRange() const { return range(); }
+
 private:
   const GPUDevice *mDev;
 
   friend class GPUDevice;
 };
 
+/* Memory owned by the caller which vub primitives can use in place. Made
+ * by GPUDevice::importHostBuffer.
+ *
+ * Imports have to start and end on multiples of
+ * minImportedHostPointerAlignment, so the import covers the pages around
+ * the caller's memory and ptr starts offset bytes into hdl. When the memory
+ * can't be imported, hdl is a host visible copy instead: upload copies the
+ * caller's memory into it and download copies it back (both do nothing for
+ * imports). */
+struct HostBuffer {
+  VkBuffer hdl;
+  VkDeviceMemory mem;
+
+  /* What was passed to importHostBuffer. */
+  void *ptr;
+  uint64 size;
+  uint64 offset;
+
+  /* Of the start of hdl (0 without features.bufferDeviceAddress). */
+  VkDeviceAddress addr;
+
+  /* False if this is a copy. */
+  bool imported;
+
+  /* Same as DeviceBuffer::range, relative to ptr. */
+  BufferRange range(uint64 offset = 0, uint64 size = VK_WHOLE_SIZE) const;
+  operator BufferRange() const { return range(); }
+
+  void upload() const;
+  void download() const;
+
+  HostBuffer() = default;
+  HostBuffer(HostBuffer &&other);
+  HostBuffer &operator=(HostBuffer &&other);
+  ~HostBuffer();
+
+private:
+  /* Only used by copies. */
+  StagingBuffer mCopy;
+
+  const GPUDevice *mDev = nullptr;
+
+  friend class GPUDevice;
+};
+
 struct DeviceImage {
   VkImage image;
   VkImageView view;
@@ -44,6 +125,21 @@ struct DeviceImage {
   uint64 memorySize;
 };
 
+/* How much of a memory heap the process may still use. */
+struct MemoryBudget {
+  uint32 heap;
+  uint64 heapSize;
+
+  /* With features.memoryBudget, what VK_EXT_memory_budget reports for the
+   * whole process (vub or not). Without, the heap size and what vub has
+   * allocated from it. */
+  uint64 budget;
+  uint64 usage;
+
+  /* budget - usage, or 0 past the budget. */
+  uint64 available;
+};
+
 struct ComputePipeline {
   VkPipeline hdl;
   VkPipelineLayout layout;
@@ -57,13 +153,66 @@ struct BindingDesc {
   uint32 descriptorCount;
 };
 
+/* Optional device functionality, filled in when the device is made. */
+struct DeviceFeatures {
+  /* VK_EXT_descriptor_indexing: descriptor sets may be rewritten while bound
+   * in a recorded command buffer. */
+  bool updateAfterBind;
+
+  /* VK_KHR_buffer_device_address: kernels get pointers to their buffers
+   * in push constants instead of descriptor sets. */
+  bool bufferDeviceAddress;
+
+  /* VK_KHR_push_descriptor: descriptors can be pushed straight into a
+   * command buffer without allocating a set. */
+  bool pushDescriptor;
+
+  /* VK_QUERY_TYPE_PIPELINE_STATISTICS queries can be used. */
+  bool pipelineStatistics;
+
+  /* VK_EXT_external_memory_host: host allocations can be imported, so
+   * importHostBuffer doesn't need a staging copy. */
+  bool externalMemoryHost;
+
+  /* shaderFloat64: kernels can work on doubles. */
+  bool float64;
+
+  /* VK_KHR_timeline_semaphore: submits signal a counter, so the host knows
+   * which of them have finished without a fence per submit. */
+  bool timelineSemaphore;
+
+  /* sparseBinding and sparseResidencyBuffer, on a queue which can bind:
+   * buffers can be made without memory, which then gets bound to them a
+   * range at a time (see makeSparseDeviceBuffer). */
+  bool sparseBuffer;
+
+  /* VK_EXT_memory_budget: the driver says how much of every heap the
+   * process may use, taking other processes into account. */
+  bool memoryBudget;
+
+  /* storageBuffer8BitAccess (VK_KHR_8bit_storage) and
+   * storageBuffer16BitAccess: kernels can read and write buffers of 8 and
+   * 16-bit elements, converting them to 32 bits in registers. */
+  bool storage8Bit;
+  bool storage16Bit;
+};
+
 struct GPUDevice {
   struct Impl;
 
   VkDevice dev;
   std::unique_ptr<Impl> impl;
+  DeviceFeatures features;
 
-  static GPUDevice make(const Surface *surface);
+  /* Null unless enableProfiling was called. */
+  std::unique_ptr<Profiler> profiler;
+
+  /* Validation is skipped if the layer isn't installed. Turn it off when
+   * timing anything. */
+  static GPUDevice make(const Surface *surface, bool enableValidation = true);
+  /* Whether make would find a device, without failing if there is no Vulkan
+   * driver at all. */
+  static bool isAvailable();
   static VkImageMemoryBarrier makeBarrier(VkImage image, 
                                           VkImageAspectFlags aspect,
                                           VkImageLayout oldLayout, 
@@ -71,13 +220,14 @@ struct GPUDevice {
                                           uint32 levelCount = 1, 
                                           uint32 layerCount = 1);
   static VkBufferMemoryBarrier makeBarrier(VkBuffer buffer,
-                                           uint32 offset,
-                                           uint32 size,
+                                           uint64 offset,
+                                           uint64 size,
                                            VkPipelineStageFlags src,
                                            VkPipelineStageFlags dst);
 
   void waitIdle() const;
-  VkCommandBuffer makeCommandBuffer() const;
+  VkCommandBuffer makeCommandBuffer(
+    VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY) const;
   void freeCommandBuffer(VkCommandBuffer cmdbuf) const;
   void beginCommandBuffer(VkCommandBuffer cmdbuf) const;
   void beginSingleUseCommandBuffer(VkCommandBuffer cmdbuf) const;
@@ -93,35 +243,153 @@ struct GPUDevice {
                            VkSemaphore signal,
                            VkPipelineStageFlags *waitStage,
                            VkFence signalFence) const;
+  /* Every submitCommandBuffer signals the next value of a timeline of the
+   * queue. Without features.timelineSemaphore, the completed value only
+   * moves on waitIdle and on waitForFence. */
+  uint64 submittedValue() const;
+  uint64 completedValue() const;
+  /* vkWaitForFences on a fence given to submitCommandBuffer, which, once
+   * it is signalled, also completes the values up to its submit. */
+  VkResult waitForFence(VkFence fence, uint64 timeout = UINT64_MAX) const;
+  /* Where primitives take their scratch from when the caller passes
+   * none. */
+  ScratchAllocator &scratchAllocator() const;
+  /* Compiles the variants which makeComputePipelineVariant makes. */
+  ShaderCompiler &shaderCompiler() const;
   uint32 acquireNextImage(VkSemaphore semaphore) const;
   void present(VkSemaphore wait, uint32 imageIndex) const;
   VkImage getSwapchainImage(uint32 index) const;
   VkImageView getSwapchainImageView(uint32 index) const;
   VkExtent2D getSwapchainExtent() const;
-  StagingBuffer makeStagingBuffer(uint64 size) const;
+  const char *getDeviceName() const;
+  /* Size of the largest device local heap. */
+  uint64 getDeviceLocalMemorySize() const;
+  MemoryBudget getMemoryBudget(uint32 heap) const;
+  /* Budget of the largest device local heap, for primitives which size
+   * their batches to the memory which is left. */
+  MemoryBudget getDeviceLocalMemoryBudget() const;
+  /* Every allocation of device memory goes through here. Panics with the
+   * usage and budget of the heap if it fails, unless mayFail is set, in
+   * which case it returns VK_NULL_HANDLE. */
+  VkDeviceMemory allocateMemory(const VkMemoryAllocateInfo &allocInfo,
+                                MemoryTag tag,
+                                bool mayFail = false) const;
+  void freeMemory(VkDeviceMemory memory) const;
+  MemoryTracker &memoryTracker() const;
+  /* Largest range a storage buffer descriptor can cover. */
+  uint64 getMaxStorageBufferRange() const;
+  StagingBuffer makeStagingBuffer(
+    uint64 size,
+    VkBufferUsageFlags usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT) const;
   DeviceBuffer makeDeviceBuffer(uint64 size, bool shouldExport = false) const;
+  /* Needs features.sparseBuffer. Only reserves size bytes of address space:
+   * mem stays VK_NULL_HANDLE and nothing may be accessed before memory was
+   * bound to it with bindSparseMemory. size may be at most
+   * sparseAddressSpaceSize. */
+  DeviceBuffer makeSparseDeviceBuffer(uint64 size) const;
+  /* Memory of sparse buffers is bound in blocks of this many bytes. */
+  uint64 getSparseBlockSize(const DeviceBuffer &buffer) const;
+  /* Allocates size bytes and binds them to [offset, offset + size) of a
+   * sparse buffer, both multiples of getSparseBlockSize (size may instead
+   * run up to the end of the buffer). Waits on the host
+   * for the bind to be done. Work in flight may go on using the rest of the
+   * buffer, whose memory stays where it is. The memory is the caller's to
+   * free. */
+  VkDeviceMemory bindSparseMemory(const DeviceBuffer &buffer,
+                                  uint64 offset,
+                                  uint64 size) const;
+  /* ptr has to stay valid for as long as the HostBuffer is around, and
+   * mustn't be touched by the host while the GPU uses it. Falls back to a
+   * copy (see HostBuffer) if the device can't import it, or if it would have
+   * to be bound through descriptors (no features.bufferDeviceAddress) at an
+   * offset the device can't take. A size of 0 gives a buffer without hdl. */
+  HostBuffer importHostBuffer(void *ptr, uint64 size) const;
   VkSemaphore makeExportSemaphore() const;
   DeviceImage make2DSampledColorDeviceImage(VkFormat format, 
                                             VkExtent2D extent,
                                             bool shouldExport = false) const;
   VkDescriptorSetLayout makeDescriptorSetLayoutImpl(VkDescriptorSetLayoutBinding *bindings,
-                                                    uint32 numBindings) const;
+                                                    uint32 numBindings,
+                                                    VkDescriptorSetLayoutCreateFlags flags = 0) const;
   VkDescriptorSet makeDescriptorSet(VkDescriptorSetLayout layout) const;
+  /* Writes storage buffer descriptors to bindings 0..count-1 of the set. */
+  void writeStorageBufferDescriptors(VkDescriptorSet set,
+                                     const VkDescriptorBufferInfo *infos,
+                                     uint32 count) const;
+  /* Same but for set 0 of a layout made by makePushDescriptorSetLayout. */
+  void pushStorageBufferDescriptors(VkCommandBuffer cmdbuf,
+                                    VkPipelineLayout layout,
+                                    const VkDescriptorBufferInfo *infos,
+                                    uint32 count) const;
   ComputePipeline makeComputePipeline(void *spirvCode,
                                       uint32 codeSize,
                                       uint32 pushConstantSize,
                                       uint32 setLayoutCount,
                                       VkDescriptorSetLayout *layouts) const;
+  /* Takes the SPIR-V for shaderName from the library if the build embedded
+   * it (VUB_EMBED_SHADERS), and loads it from the directory the build
+   * compiled the shaders into if not. */
+  ComputePipeline makeComputePipeline(const char *shaderName,
+                                      uint32 pushConstantSize,
+                                      uint32 setLayoutCount,
+                                      VkDescriptorSetLayout *layouts) const;
+  /* Compiles sourceName of the include directory with defines at runtime
+   * (see ShaderCompiler) instead of loading what the build compiled. */
+  ComputePipeline makeComputePipelineVariant(
+    const char *sourceName,
+    const std::vector<ShaderDefine> &defines,
+    uint32 pushConstantSize,
+    uint32 setLayoutCount,
+    VkDescriptorSetLayout *layouts) const;
+  /* Pipelines are made through a pipeline cache which make loads from
+   * getDefaultCacheDir, so that a process making the kernels a previous one
+   * made skips most of what the driver compiles. This writes it back with
+   * what this process added. Call it once the kernels are made. */
+  void savePipelineCache() const;
 
   /* BindingT has to be of type BindingDesc */
   template <typename ...BindingT>
-  VkDescriptorSetLayout makeDescriptorSetLayout(BindingT ...bindings);
+  VkDescriptorSetLayout makeDescriptorSetLayout(BindingT ...bindings) const;
+
+  /* Sets made from this layout may be updated while bound in a recorded
+   * command buffer if features.updateAfterBind is set. Otherwise this is the
+   * same as makeDescriptorSetLayout. */
+  template <typename ...BindingT>
+  VkDescriptorSetLayout makeRebindableDescriptorSetLayout(BindingT ...bindings) const;
+
+  /* Needs features.pushDescriptor. */
+  template <typename ...BindingT>
+  VkDescriptorSetLayout makePushDescriptorSetLayout(BindingT ...bindings) const;
+
+  template <typename ...BindingT>
+  VkDescriptorSetLayout makeDescriptorSetLayoutWithFlags(
+    VkDescriptorSetLayoutCreateFlags flags, BindingT ...bindings) const;
+
+  /* Makes vub primitives record GPU timestamps (and pipeline statistics if
+   * asked for and supported) into profiler. */
+  void enableProfiling(bool pipelineStatistics = false,
+                       uint32 maxScopes = 1024);
+
+  /* Wraps commands in a VK_EXT_debug_utils label. Does nothing if the
+   * extension isn't enabled (release builds). */
+  void beginLabel(VkCommandBuffer cmdbuf, const char *name) const;
+  void endLabel(VkCommandBuffer cmdbuf) const;
 
   /* External functionality. */
   int getSemaphoreHandle(VkExternalSemaphoreHandleTypeFlagBitsKHR type,
                          VkSemaphore semaphore) const;
   int getMemoryHandle(VkExternalMemoryHandleTypeFlagsKHR type,
                       VkDeviceMemory mem) const;
+  /* Memory and semaphores can only be shared with devices of the same
+   * VK_UUID_SIZE bytes of UUID. */
+  void getDeviceUUID(uint8 *uuid) const;
+  /* Memory of a makeDeviceBuffer(size, true) of another process, from
+   * getMemoryHandle, as a buffer of the same size. Owns fd if the import
+   * works, hdl is VK_NULL_HANDLE if it doesn't. */
+  DeviceBuffer importDeviceBuffer(int fd, uint64 size) const;
+  /* Same for a semaphore of makeExportSemaphore, from getSemaphoreHandle.
+   * VK_NULL_HANDLE if the import fails. */
+  VkSemaphore importSemaphore(int fd) const;
 
   ~GPUDevice();
 };
@@ -130,10 +398,40 @@ extern PFN_vkCmdBeginRenderingKHR vkCmdBeginRenderingKHRProc;
 extern PFN_vkCmdEndRenderingKHR vkCmdEndRenderingKHRProc;
 extern PFN_vkGetMemoryFdKHR vkGetMemoryFdKHRProc;
 extern PFN_vkGetSemaphoreFdKHR vkGetSemaphoreFdKHRProc;
+extern PFN_vkImportSemaphoreFdKHR vkImportSemaphoreFdKHRProc;
 extern PFN_vkGetPhysicalDeviceProperties2 vkGetPhysicalDeviceProperties2Proc;
+extern PFN_vkGetBufferDeviceAddressKHR vkGetBufferDeviceAddressKHRProc;
+extern PFN_vkCmdPushDescriptorSetKHR vkCmdPushDescriptorSetKHRProc;
+extern PFN_vkCmdBeginDebugUtilsLabelEXT vkCmdBeginDebugUtilsLabelEXTProc;
+extern PFN_vkCmdEndDebugUtilsLabelEXT vkCmdEndDebugUtilsLabelEXTProc;
+extern PFN_vkGetMemoryHostPointerPropertiesEXT vkGetMemoryHostPointerPropertiesEXTProc;
+extern PFN_vkGetSemaphoreCounterValueKHR vkGetSemaphoreCounterValueKHRProc;
+
+template <typename ...BindingT>
+VkDescriptorSetLayout GPUDevice::makeDescriptorSetLayout(BindingT ...bindingsIn) const
+{
+  return makeDescriptorSetLayoutWithFlags(0, bindingsIn...);
+}
+
+template <typename ...BindingT>
+VkDescriptorSetLayout GPUDevice::makeRebindableDescriptorSetLayout(BindingT ...bindingsIn) const
+{
+  return makeDescriptorSetLayoutWithFlags(
+    features.updateAfterBind ?
+      VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT : 0,
+    bindingsIn...);
+}
+
+template <typename ...BindingT>
+VkDescriptorSetLayout GPUDevice::makePushDescriptorSetLayout(BindingT ...bindingsIn) const
+{
+  return makeDescriptorSetLayoutWithFlags(
+    VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR, bindingsIn...);
+}
 
 template <typename ...BindingT>
-VkDescriptorSetLayout GPUDevice::makeDescriptorSetLayout(BindingT ...bindingsIn)
+VkDescriptorSetLayout GPUDevice::makeDescriptorSetLayoutWithFlags(
+  VkDescriptorSetLayoutCreateFlags flags, BindingT ...bindingsIn) const
 {
   auto makeDescriptorBindingInfo = [](BindingDesc desc, uint32 id)
   {
@@ -151,5 +449,5 @@ VkDescriptorSetLayout GPUDevice::makeDescriptorSetLayout(BindingT ...bindingsIn)
     makeDescriptorBindingInfo(bindingsIn, id++)...
   };
 
-  return makeDescriptorSetLayoutImpl(bindings, sizeof...(BindingT));
+  return makeDescriptorSetLayoutImpl(bindings, sizeof...(BindingT), flags);
 }
@@ -0,0 +1,476 @@
+#include "graph.h"
+
+#include <cassert>
+#include <algorithm>
+#include "helper.h"
+#include "kernel.h"
+#include "memory-tracker.h"
+
+namespace vub {
+
+/* Offsets of transients, which get bound through descriptors. */
+static const uint64 TRANSIENT_ALIGNMENT = 256;
+
+static thread_local GraphNodeScope *sCurrentNode = nullptr;
+
+static bool
+isWrite(GraphUsage usage)
+{
+  return usage == GraphUsage::ShaderWrite ||
+         usage == GraphUsage::TransferWrite;
+}
+
+/* Primitive scratch, and node scratch shared by the calls of the node, is
+ * written by kernels and by transfers (clears). */
+static bool
+isPrimitiveScratch(GraphResourceKind kind)
+{
+  return kind == GraphResourceKind::Primitive ||
+         kind == GraphResourceKind::Scratch;
+}
+
+static VkPipelineStageFlags
+findStageFor(GraphUsage usage)
+{
+  switch (usage)
+  {
+  case GraphUsage::ShaderRead:
+  case GraphUsage::ShaderWrite:
+    return VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+           VK_PIPELINE_STAGE_TRANSFER_BIT;
+
+  case GraphUsage::TransferRead:
+  case GraphUsage::TransferWrite:
+    return VK_PIPELINE_STAGE_TRANSFER_BIT;
+
+  case GraphUsage::IndirectRead:
+    return VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT;
+  }
+
+  return 0;
+}
+
+static VkAccessFlags
+findAccessFlagsFor(GraphUsage usage)
+{
+  switch (usage)
+  {
+  case GraphUsage::ShaderRead:
+    return VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+
+  case GraphUsage::ShaderWrite:
+    return VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT |
+           VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+
+  case GraphUsage::TransferRead:
+    return VK_ACCESS_TRANSFER_READ_BIT;
+
+  case GraphUsage::TransferWrite:
+    return VK_ACCESS_TRANSFER_WRITE_BIT;
+
+  case GraphUsage::IndirectRead:
+    return VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+  }
+
+  return 0;
+}
+
+Graph
+Graph::make(const GPUDevice &gpu, uint64 arenaSize)
+{
+  MemoryScope memoryScope(gpu, "Graph");
+
+  Graph ret = {};
+  ret.cmdbuf = gpu.makeCommandBuffer();
+  ret.arena = gpu.makeDeviceBuffer(std::max<uint64>(arenaSize,
+                                                    TRANSIENT_ALIGNMENT));
+  ret.mDev = &gpu;
+  return ret;
+}
+
+void
+Graph::clear()
+{
+  mResources.clear();
+  mNodes.clear();
+  mOrder.clear();
+}
+
+GraphBuffer
+Graph::importBuffer(const BufferRange &range)
+{
+  GraphResource resource = {
+    .kind = GraphResourceKind::Import,
+    .range = range,
+    .size = range.size
+  };
+
+  mResources.push_back(resource);
+  return { (uint32)mResources.size() - 1 };
+}
+
+GraphBuffer
+Graph::makeTransient(uint64 size)
+{
+  GraphResource resource = {
+    .kind = GraphResourceKind::Transient,
+    .range = {},
+    .size = size
+  };
+
+  mResources.push_back(resource);
+  return { (uint32)mResources.size() - 1 };
+}
+
+GraphBuffer
+Graph::importPrimitive(const void *primitive)
+{
+  for (uint32 i = 0; i < mResources.size(); ++i)
+  {
+    if (mResources[i].kind == GraphResourceKind::Primitive &&
+        mResources[i].primitive == primitive)
+      return { i };
+  }
+
+  GraphResource resource = {
+    .kind = GraphResourceKind::Primitive,
+    .range = {},
+    .size = 0,
+    .primitive = primitive
+  };
+
+  mResources.push_back(resource);
+  return { (uint32)mResources.size() - 1 };
+}
+
+void
+Graph::addNode(const char *name,
+               std::vector<GraphAccess> accesses,
+               std::function<void(VkCommandBuffer)> record,
+               uint64 scratchBytes)
+{
+  for (const GraphAccess &access : accesses)
+    assert(access.buffer.id < mResources.size());
+
+  GraphNode node = {
+    .name = name,
+    .accesses = std::move(accesses),
+    .record = std::move(record),
+    .level = 0,
+    .scratch = {},
+    .scratchBytes = scratchBytes
+  };
+
+  if (scratchBytes > 0)
+  {
+    GraphResource resource = {
+      .kind = GraphResourceKind::Scratch,
+      .range = {},
+      .size = scratchBytes
+    };
+
+    mResources.push_back(resource);
+    node.scratch = { (uint32)mResources.size() - 1 };
+    node.accesses.push_back({ node.scratch, GraphUsage::ShaderWrite });
+  }
+
+  mNodes.push_back(std::move(node));
+}
+
+BufferRange
+Graph::range(GraphBuffer buffer) const
+{
+  const GraphResource &resource = mResources[buffer.id];
+  assert(resource.kind != GraphResourceKind::Primitive);
+  assert(resource.range.hdl != VK_NULL_HANDLE);
+
+  return resource.range;
+}
+
+/* Transients only overlap other resources once they are placed. */
+bool
+Graph::overlap(uint32 a, uint32 b) const
+{
+  if (a == b)
+    return true;
+
+  const BufferRange &ra = mResources[a].range;
+  const BufferRange &rb = mResources[b].range;
+
+  if (ra.hdl == VK_NULL_HANDLE || ra.hdl != rb.hdl)
+    return false;
+
+  return ra.offset < rb.offset + rb.size && rb.offset < ra.offset + ra.size;
+}
+
+void
+Graph::schedule()
+{
+  levelCount = 0;
+
+  for (uint32 i = 0; i < mNodes.size(); ++i)
+  {
+    GraphNode &node = mNodes[i];
+    node.level = 0;
+
+    for (uint32 j = 0; j < i; ++j)
+    {
+      const GraphNode &before = mNodes[j];
+      if (before.level + 1 <= node.level)
+        continue;
+
+      bool depends = false;
+      for (const GraphAccess &a : node.accesses)
+      {
+        for (const GraphAccess &b : before.accesses)
+        {
+          if ((isWrite(a.usage) || isWrite(b.usage)) &&
+              overlap(a.buffer.id, b.buffer.id))
+            depends = true;
+        }
+      }
+
+      if (depends)
+        node.level = before.level + 1;
+    }
+
+    levelCount = std::max(levelCount, node.level + 1);
+  }
+
+  /* Stable, so nodes of a level keep the order they were added in. */
+  mOrder.resize(mNodes.size());
+  for (uint32 i = 0; i < mNodes.size(); ++i)
+    mOrder[i] = i;
+
+  std::stable_sort(mOrder.begin(), mOrder.end(), [this](uint32 a, uint32 b) {
+    return mNodes[a].level < mNodes[b].level;
+  });
+
+  for (GraphResource &resource : mResources)
+  {
+    resource.firstLevel = UINT32_MAX;
+    resource.lastLevel = 0;
+  }
+
+  for (const GraphNode &node : mNodes)
+  {
+    for (const GraphAccess &access : node.accesses)
+    {
+      GraphResource &resource = mResources[access.buffer.id];
+      resource.firstLevel = std::min(resource.firstLevel, node.level);
+      resource.lastLevel = std::max(resource.lastLevel, node.level);
+    }
+  }
+}
+
+/* Largest first, each at the lowest offset which doesn't collide with a
+ * placed transient of an overlapping lifetime. */
+void
+Graph::placeTransients()
+{
+  std::vector<uint32> transients;
+  for (uint32 i = 0; i < mResources.size(); ++i)
+  {
+    if (mResources[i].kind == GraphResourceKind::Transient ||
+        mResources[i].kind == GraphResourceKind::Scratch)
+    {
+      mResources[i].range = {};
+      transients.push_back(i);
+    }
+  }
+
+  std::stable_sort(transients.begin(), transients.end(),
+                   [this](uint32 a, uint32 b) {
+    return mResources[a].size > mResources[b].size;
+  });
+
+  arenaUsed = 0;
+
+  std::vector<uint32> placed;
+  std::vector<uint32> colliding;
+
+  for (uint32 id : transients)
+  {
+    GraphResource &resource = mResources[id];
+
+    colliding.clear();
+    for (uint32 other : placed)
+    {
+      const GraphResource &o = mResources[other];
+      if (o.firstLevel <= resource.lastLevel &&
+          resource.firstLevel <= o.lastLevel)
+        colliding.push_back(other);
+    }
+
+    std::sort(colliding.begin(), colliding.end(), [this](uint32 a, uint32 b) {
+      return mResources[a].range.offset < mResources[b].range.offset;
+    });
+
+    uint64 offset = 0;
+    for (uint32 other : colliding)
+    {
+      const BufferRange &o = mResources[other].range;
+      if (offset + resource.size <= o.offset)
+        break;
+
+      offset = std::max(offset, roundUp(o.offset + o.size,
+                                        TRANSIENT_ALIGNMENT));
+    }
+
+    if (offset + resource.size > arena.size)
+    {
+      printf("Graph transients need more than %llu bytes of arena\n",
+             (unsigned long long)arena.size);
+      PANIC_AND_EXIT("Graph arena too small");
+    }
+
+    resource.range = arena.range(offset, resource.size);
+    arenaUsed = std::max(arenaUsed, offset + resource.size);
+    placed.push_back(id);
+  }
+}
+
+/* Merges everything the nodes of level wait for into one barrier. Returns
+ * false if they wait for nothing. */
+bool
+Graph::recordBarrier(VkCommandBuffer cmdbuf, uint32 level) const
+{
+  VkPipelineStageFlags srcStages = 0, dstStages = 0;
+  VkAccessFlags srcAccess = 0, dstAccess = 0;
+
+  for (const GraphNode &node : mNodes)
+  {
+    if (node.level != level)
+      continue;
+
+    for (const GraphNode &before : mNodes)
+    {
+      if (before.level >= level)
+        continue;
+
+      for (const GraphAccess &a : node.accesses)
+      {
+        for (const GraphAccess &b : before.accesses)
+        {
+          if (!(isWrite(a.usage) || isWrite(b.usage)) ||
+              !overlap(a.buffer.id, b.buffer.id))
+            continue;
+
+          srcStages |= findStageFor(b.usage);
+          dstStages |= findStageFor(a.usage);
+
+          /* Write after read only needs the execution dependency. */
+          if (isWrite(b.usage))
+          {
+            srcAccess |= findAccessFlagsFor(b.usage);
+            dstAccess |= findAccessFlagsFor(a.usage);
+          }
+
+          if (isPrimitiveScratch(mResources[a.buffer.id].kind) ||
+              isPrimitiveScratch(mResources[b.buffer.id].kind))
+          {
+            srcStages |= VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                         VK_PIPELINE_STAGE_TRANSFER_BIT;
+            dstStages |= VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                         VK_PIPELINE_STAGE_TRANSFER_BIT;
+            srcAccess |= VK_ACCESS_SHADER_WRITE_BIT |
+                         VK_ACCESS_TRANSFER_WRITE_BIT;
+            dstAccess |= VK_ACCESS_SHADER_READ_BIT |
+                         VK_ACCESS_SHADER_WRITE_BIT |
+                         VK_ACCESS_TRANSFER_READ_BIT |
+                         VK_ACCESS_TRANSFER_WRITE_BIT;
+          }
+        }
+      }
+    }
+  }
+
+  if (srcStages == 0)
+    return false;
+
+  VkMemoryBarrier barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = srcAccess,
+    .dstAccessMask = dstAccess
+  };
+
+  vkCmdPipelineBarrier(cmdbuf, srcStages, dstStages,
+                       0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+  return true;
+}
+
+void
+Graph::submit(VkFence fence)
+{
+  schedule();
+  placeTransients();
+
+  vkResetCommandBuffer(cmdbuf, 0);
+  mDev->beginSingleUseCommandBuffer(cmdbuf);
+
+  /* The nodes of the first level leave their entry barriers out too, which
+   * order them after what was submitted before the graph. */
+  recordEntryBarrier(cmdbuf);
+  barrierCount = 1;
+
+  uint32 level = UINT32_MAX;
+  for (uint32 index : mOrder)
+  {
+    GraphNode &node = mNodes[index];
+
+    if (node.level != level)
+    {
+      level = node.level;
+      if (level > 0 && recordBarrier(cmdbuf, level))
+        ++barrierCount;
+    }
+
+    BufferRange scratch = node.scratchBytes > 0 ?
+      range(node.scratch) : BufferRange{};
+    GraphNodeScope scope(cmdbuf, scratch);
+
+    mDev->beginLabel(cmdbuf, node.name);
+    node.record(cmdbuf);
+    mDev->endLabel(cmdbuf);
+
+    barrierCount += scope.barrierCount;
+  }
+
+  /* Same for the exit barriers of the last level. */
+  recordExitBarrier(cmdbuf);
+  ++barrierCount;
+
+  mDev->endCommandBuffer(cmdbuf);
+  mDev->submitCommandBuffer(cmdbuf, VK_NULL_HANDLE, VK_NULL_HANDLE,
+                            0, fence);
+}
+
+GraphNodeScope::GraphNodeScope(VkCommandBuffer cmdbuf,
+                               const BufferRange &scratch)
+  : cmdbuf(cmdbuf), scratch(scratch), scratchUsed(0), barrierCount(0),
+    recorded(false), exitPending(false), mOuter(sCurrentNode)
+{
+  sCurrentNode = this;
+}
+
+GraphNodeScope::~GraphNodeScope()
+{
+  assert(sCurrentNode == this);
+  sCurrentNode = mOuter;
+}
+
+GraphNodeScope *
+GraphNodeScope::current()
+{
+  return sCurrentNode;
+}
+
+GraphNodeScope *
+GraphNodeScope::find(VkCommandBuffer cmdbuf)
+{
+  return sCurrentNode && sCurrentNode->cmdbuf == cmdbuf ?
+    sCurrentNode : nullptr;
+}
+
+} /* namespace vub */
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include "gpu-device.h"
+
+namespace vub {
+
+/* How a graph node uses a buffer. Writes include read-modify-writes.
+ *
+ * Shader usages are those of primitive calls, which may also clear or
+ * copy the buffers their kernels use (like the sorts copying their result
+ * back), without barriers of their own at the edges of the call. */
+enum class GraphUsage {
+  ShaderRead,
+  ShaderWrite,
+  TransferRead,
+  TransferWrite,
+  /* Parameters of vkCmdDispatchIndirect. */
+  IndirectRead
+};
+
+/* A buffer known to a Graph, see Graph::importBuffer and
+ * Graph::makeTransient. */
+struct GraphBuffer {
+  uint32 id;
+};
+
+struct GraphAccess {
+  GraphBuffer buffer;
+  GraphUsage usage;
+};
+
+enum class GraphResourceKind {
+  Import,
+  Transient,
+  Primitive,
+  /* A transient only its node uses, as the temp storage of its primitive
+   * calls. */
+  Scratch
+};
+
+struct GraphResource {
+  GraphResourceKind kind;
+
+  /* Of imports, and of transients once the graph is scheduled. */
+  BufferRange range;
+  uint64 size;
+
+  /* Of Primitive resources. */
+  const void *primitive;
+
+  /* Levels of the first and last node using the resource. */
+  uint32 firstLevel;
+  uint32 lastLevel;
+};
+
+struct GraphNode {
+  const char *name;
+  std::vector<GraphAccess> accesses;
+  std::function<void(VkCommandBuffer)> record;
+  uint32 level;
+
+  /* Of Scratch kind, if the node asked for any. */
+  GraphBuffer scratch;
+  uint64 scratchBytes;
+};
+
+/* Lives around the recording of every node of Graph::submit, on the thread
+ * recording it.
+ *
+ * The graph places the barriers between the nodes, so the barriers at the
+ * edges of the primitive calls of a node are left out: recordEntryBarrier
+ * records nothing before the first command of the node, and
+ * recordExitBarrier waits for the next one, which a call ending the node
+ * doesn't have. The barriers primitives record in between (see
+ * recordPipelineBarrier) are counted.
+ *
+ * ScratchScopes of the calls which pass no tempStorage take theirs from
+ * the node's scratch, as long as it has room left. */
+struct GraphNodeScope {
+  VkCommandBuffer cmdbuf;
+  BufferRange scratch;
+  uint64 scratchUsed;
+
+  uint32 barrierCount;
+
+  /* Whether the node recorded a command yet, and whether a call of the
+   * node ended without its barrier. */
+  bool recorded;
+  bool exitPending;
+
+  GraphNodeScope(VkCommandBuffer cmdbuf, const BufferRange &scratch);
+  ~GraphNodeScope();
+
+  GraphNodeScope(const GraphNodeScope &) = delete;
+  GraphNodeScope &operator=(const GraphNodeScope &) = delete;
+
+  /* The innermost scope of this thread, and the same if it records into
+   * cmdbuf. */
+  static GraphNodeScope *current();
+  static GraphNodeScope *find(VkCommandBuffer cmdbuf);
+
+private:
+  GraphNodeScope *mOuter;
+};
+
+/* Primitive calls recorded as nodes, with the buffers each one reads and
+ * writes, and submitted as one command buffer.
+ *
+ * Every node is placed one level after the last node it depends on (read
+ * after write, write after read or write after write on overlapping bytes),
+ * keeping the order they were added in otherwise. Nodes of the same level
+ * don't touch each other's memory, so a level gets recorded without
+ * anything in between, and the dependencies into it become one merged
+ * pipeline barrier with just the stages and accesses involved.
+ *
+ * Transient buffers only live from the level of their first node to the
+ * level of their last. Those whose lifetimes don't overlap share bytes of
+ * one arena, made with the graph.
+ *
+ * Barriers between the nodes are the graph's business, those inside of a
+ * primitive call remain the primitive's (see GraphNodeScope). A primitive
+ * object keeps its scratch to itself, so nodes calling the same object
+ * have to declare a write to importPrimitive(&object) to be ordered. Temp
+ * storage is different: a node may ask for scratch, which is placed in
+ * the arena like the transients. */
+struct Graph {
+  VkCommandBuffer cmdbuf;
+  DeviceBuffer arena;
+
+  /* Of the last submit. barrierCount has both the barriers of the graph
+   * and those the primitives recorded inside of the nodes. */
+  uint32 levelCount;
+  uint32 barrierCount;
+  uint64 arenaUsed;
+
+  static Graph make(const GPUDevice &gpu, uint64 arenaSize);
+
+  /* Drops the nodes and buffers of the previous graph. May only be called
+   * once its submit has finished. */
+  void clear();
+
+  GraphBuffer importBuffer(const BufferRange &range);
+  GraphBuffer makeTransient(uint64 size);
+
+  /* Not memory, only orders the nodes which use primitive. */
+  GraphBuffer importPrimitive(const void *primitive);
+
+  /* record gets called by submit, when the transients have their place in
+   * the arena (see range). With scratchBytes, the primitive calls of the
+   * node which pass no tempStorage share that much of the arena, so size it
+   * with their tempStorageBytes (aligned to 256 bytes each, for calls which
+   * are recorded inside of others). */
+  void addNode(const char *name,
+               std::vector<GraphAccess> accesses,
+               std::function<void(VkCommandBuffer)> record,
+               uint64 scratchBytes = 0);
+
+  /* Where the buffer is. Only valid for transients once submit has
+   * scheduled the graph. */
+  BufferRange range(GraphBuffer buffer) const;
+
+  void submit(VkFence fence = VK_NULL_HANDLE);
+
+private:
+  void schedule();
+  void placeTransients();
+  bool recordBarrier(VkCommandBuffer cmdbuf, uint32 level) const;
+
+  bool overlap(uint32 a, uint32 b) const;
+
+  std::vector<GraphResource> mResources;
+  std::vector<GraphNode> mNodes;
+
+  /* Indices into mNodes by level. */
+  std::vector<uint32> mOrder;
+
+  const GPUDevice *mDev = nullptr;
+};
+
+} /* namespace vub */
@@ -28,3 +28,13 @@ inline T roundUp(T input, T boundary)
 {
   return boundary * ((input + (boundary - 1)) / boundary);
 }
+
+/* Spreads a workgroup count over x and y so that neither exceeds the minimum
+ * maxComputeWorkGroupCount guaranteed by the spec. */
+inline void splitGroupCount(uint32 groupCount, uint32 &x, uint32 &y)
+{
+  const uint32 maxGroupsPerDimension = 65535;
+
+  x = groupCount < maxGroupsPerDimension ? groupCount : maxGroupsPerDimension;
+  y = (groupCount + maxGroupsPerDimension - 1) / maxGroupsPerDimension;
+}
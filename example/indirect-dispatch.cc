@@ -0,0 +1,50 @@
+#include "indirect-dispatch.h"
+
+#include <cassert>
+#include "helper.h"
+#include "indirect-params.h"
+
+using namespace IndirectParams;
+
+namespace vub {
+
+IndirectDispatch
+IndirectDispatch::make(const GPUDevice &gpu)
+{
+  IndirectDispatch ret = {};
+
+  /* Count and parameter block out. */
+  ret.kernel = Kernel::make(gpu, "indirect-params", 2,
+                            sizeof(IndirectPushConstant));
+
+  return ret;
+}
+
+void
+IndirectDispatch::record(VkCommandBuffer cmdbuf,
+                         const IndirectCount &count,
+                         const BufferRange &out,
+                         uint32 elementsPerGroup,
+                         uint32 maxCount,
+                         uint32 countDivisor,
+                         uint32 countMultiplier) const
+{
+  assert(elementsPerGroup > 0 && countDivisor > 0);
+
+  IndirectPushConstant pushConstant = {
+    .elementsPerGroup = elementsPerGroup,
+    .maxCount = maxCount,
+    .countDivisor = countDivisor,
+    .countMultiplier = countMultiplier
+  };
+
+  /* The count was just written, by a shader or a transfer. */
+  recordIndirectBarrier(cmdbuf);
+
+  BufferRange buffers[] = { count.params, out };
+  kernel.dispatch(cmdbuf, buffers, &pushConstant, 1);
+
+  recordIndirectBarrier(cmdbuf);
+}
+
+} /* namespace vub */
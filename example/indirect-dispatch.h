@@ -0,0 +1,40 @@
+#pragma once
+
+#include "kernel.h"
+#include "gpu-device.h"
+
+namespace vub {
+
+/* A number of elements which only the device knows, like how many entries
+ * a hash table extract wrote. params is a ScanParams block: a
+ * VkDispatchIndirectCommand (of the producer's own workgroup size)
+ * followed by the count.
+ *
+ * Primitives which produce such a count hand it out as one of these, and
+ * primitives which take one derive their own dispatch from it with
+ * IndirectDispatch, so a chain of primitives never waits on the host. */
+struct IndirectCount {
+  BufferRange params;
+};
+
+/* Writes the parameter block of a primitive from the count of another,
+ * with one thread on the device. */
+struct IndirectDispatch {
+  Kernel kernel;
+
+  static IndirectDispatch make(const GPUDevice &gpu);
+
+  /* Writes min(count, maxCount), divided by countDivisor (rounding up) and
+   * multiplied by countMultiplier, to out (a ScanParams block), with a
+   * dispatch of enough elementsPerGroup workgroups to cover it. out may be
+   * count.params itself. Leaves out ready for vkCmdDispatchIndirect. */
+  void record(VkCommandBuffer cmdbuf,
+              const IndirectCount &count,
+              const BufferRange &out,
+              uint32 elementsPerGroup,
+              uint32 maxCount,
+              uint32 countDivisor = 1,
+              uint32 countMultiplier = 1) const;
+};
+
+} /* namespace vub */
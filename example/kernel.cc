@@ -0,0 +1,269 @@
+#include "kernel.h"
+
+#include <cassert>
+#include "graph.h"
+#include "helper.h"
+
+namespace vub {
+
+static void
+recordEdgeBarrier(VkCommandBuffer cmdbuf)
+{
+  VkMemoryBarrier barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT |
+                     VK_ACCESS_TRANSFER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+                     VK_ACCESS_SHADER_WRITE_BIT |
+                     VK_ACCESS_TRANSFER_READ_BIT |
+                     VK_ACCESS_TRANSFER_WRITE_BIT |
+                     VK_ACCESS_INDIRECT_COMMAND_READ_BIT
+  };
+
+  recordPipelineBarrier(cmdbuf,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                        VK_PIPELINE_STAGE_TRANSFER_BIT |
+                        VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                        &barrier);
+}
+
+/* Records the exit barrier a call of the Graph node left pending before the
+ * next command of the node. */
+static void
+recordCommand(VkCommandBuffer cmdbuf)
+{
+  GraphNodeScope *node = GraphNodeScope::find(cmdbuf);
+  if (!node)
+    return;
+
+  node->recorded = true;
+
+  if (node->exitPending)
+  {
+    node->exitPending = false;
+    recordEdgeBarrier(cmdbuf);
+  }
+}
+
+Kernel
+Kernel::make(const GPUDevice &gpu, const char *shaderName,
+             uint32 bindingCount, uint32 pushConstantSize)
+{
+  Kernel ret = makeLayout(gpu, bindingCount, pushConstantSize);
+  ret.pipeline = gpu.makeComputePipeline(shaderName, pushConstantSize,
+                                         1, &ret.layout);
+
+  return ret;
+}
+
+Kernel
+Kernel::makeVariant(const GPUDevice &gpu, const char *sourceName,
+                    const std::vector<ShaderDefine> &defines,
+                    uint32 bindingCount, uint32 pushConstantSize)
+{
+  Kernel ret = makeLayout(gpu, bindingCount, pushConstantSize);
+  ret.pipeline = gpu.makeComputePipelineVariant(sourceName, defines,
+                                                pushConstantSize,
+                                                1, &ret.layout);
+
+  return ret;
+}
+
+Kernel
+Kernel::makeLayout(const GPUDevice &gpu, uint32 bindingCount,
+                   uint32 pushConstantSize)
+{
+  assert(bindingCount <= DescriptorCache::MAX_BINDINGS);
+
+  VkDescriptorSetLayoutBinding bindings[DescriptorCache::MAX_BINDINGS];
+  for (uint32 i = 0; i < bindingCount; ++i)
+  {
+    bindings[i] = {
+      .binding = i,
+      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      .descriptorCount = 1,
+      .stageFlags = VK_SHADER_STAGE_ALL,
+      .pImmutableSamplers = nullptr
+    };
+  }
+
+  Kernel ret = {};
+  ret.bindingCount = bindingCount;
+  ret.pushConstantSize = pushConstantSize;
+  ret.mDev = &gpu;
+
+  if (gpu.features.pushDescriptor)
+  {
+    ret.layout = gpu.makeDescriptorSetLayoutImpl(
+      bindings, bindingCount,
+      VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR);
+  }
+  else
+  {
+    ret.layout = gpu.makeDescriptorSetLayoutImpl(bindings, bindingCount);
+    ret.mDescriptorCache = DescriptorCache::make(gpu);
+  }
+
+  return ret;
+}
+
+void
+Kernel::bind(VkCommandBuffer cmdbuf,
+             const BufferRange *buffers,
+             const void *pushConstant) const
+{
+  VkDescriptorBufferInfo infos[DescriptorCache::MAX_BINDINGS];
+  for (uint32 i = 0; i < bindingCount; ++i)
+    infos[i] = { buffers[i].hdl, buffers[i].offset, buffers[i].size };
+
+  vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.hdl);
+
+  if (mDev->features.pushDescriptor)
+  {
+    mDev->pushStorageBufferDescriptors(cmdbuf, pipeline.layout,
+                                       infos, bindingCount);
+  }
+  else
+  {
+    VkDescriptorSet set = mDescriptorCache.get(layout, infos, bindingCount);
+    vkCmdBindDescriptorSets(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            pipeline.layout, 0, 1, &set, 0, nullptr);
+  }
+
+  if (pushConstantSize > 0)
+    vkCmdPushConstants(cmdbuf, pipeline.layout, VK_SHADER_STAGE_ALL,
+                       0, pushConstantSize, pushConstant);
+}
+
+void
+Kernel::dispatch(VkCommandBuffer cmdbuf,
+                 const BufferRange *buffers,
+                 const void *pushConstant,
+                 uint32 groupCount) const
+{
+  recordCommand(cmdbuf);
+  bind(cmdbuf, buffers, pushConstant);
+
+  uint32 groupCountX, groupCountY;
+  splitGroupCount(groupCount, groupCountX, groupCountY);
+
+  vkCmdDispatch(cmdbuf, groupCountX, groupCountY, 1);
+}
+
+void
+Kernel::dispatchIndirect(VkCommandBuffer cmdbuf,
+                         const BufferRange *buffers,
+                         const void *pushConstant,
+                         const BufferRange &params) const
+{
+  recordCommand(cmdbuf);
+  bind(cmdbuf, buffers, pushConstant);
+  vkCmdDispatchIndirect(cmdbuf, params.hdl, params.offset);
+}
+
+void
+recordPipelineBarrier(VkCommandBuffer cmdbuf,
+                      VkPipelineStageFlags srcStages,
+                      VkPipelineStageFlags dstStages,
+                      const VkMemoryBarrier *barrier,
+                      const VkBufferMemoryBarrier *bufferBarrier)
+{
+  recordCommand(cmdbuf);
+
+  vkCmdPipelineBarrier(cmdbuf, srcStages, dstStages, 0,
+                       barrier ? 1 : 0, barrier,
+                       bufferBarrier ? 1 : 0, bufferBarrier,
+                       0, nullptr);
+
+  if (GraphNodeScope *node = GraphNodeScope::find(cmdbuf))
+    ++node->barrierCount;
+}
+
+void
+recordEntryBarrier(VkCommandBuffer cmdbuf)
+{
+  GraphNodeScope *node = GraphNodeScope::find(cmdbuf);
+
+  /* The graph orders the first call of a node. Between two calls of a
+   * node, this and the exit barrier of the first are the same. */
+  if (node)
+  {
+    bool first = !node->recorded;
+    node->recorded = true;
+    node->exitPending = false;
+
+    if (first)
+      return;
+  }
+
+  recordEdgeBarrier(cmdbuf);
+}
+
+void
+recordExitBarrier(VkCommandBuffer cmdbuf)
+{
+  if (GraphNodeScope *node = GraphNodeScope::find(cmdbuf))
+    node->exitPending = true;
+  else
+    recordEdgeBarrier(cmdbuf);
+}
+
+void
+recordComputeBarrier(VkCommandBuffer cmdbuf)
+{
+  VkMemoryBarrier barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+                     VK_ACCESS_SHADER_WRITE_BIT |
+                     VK_ACCESS_TRANSFER_READ_BIT
+  };
+
+  recordPipelineBarrier(cmdbuf,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        &barrier);
+}
+
+void
+recordIndirectBarrier(VkCommandBuffer cmdbuf)
+{
+  VkMemoryBarrier barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT |
+                     VK_ACCESS_TRANSFER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+                     VK_ACCESS_SHADER_WRITE_BIT |
+                     VK_ACCESS_INDIRECT_COMMAND_READ_BIT
+  };
+
+  recordPipelineBarrier(cmdbuf,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                        VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                        &barrier);
+}
+
+void
+recordUpdateBarrier(VkCommandBuffer cmdbuf)
+{
+  VkMemoryBarrier barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT |
+                     VK_ACCESS_TRANSFER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT
+  };
+
+  recordPipelineBarrier(cmdbuf,
+                        VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        &barrier);
+}
+
+} /* namespace vub */
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "binding.h"
+#include "gpu-device.h"
+
+namespace vub {
+
+/* A compute kernel which takes its buffers as storage buffers at bindings
+ * 0 to bindingCount-1 of set 0, and everything else in a push constant
+ * block. Buffers are pushed (features.pushDescriptor) or bound through a
+ * DescriptorCache.
+ *
+ * Primitives which don't need recordings or device addresses are made of
+ * these instead of handling every BindingMode themselves. */
+struct Kernel {
+  ComputePipeline pipeline;
+  VkDescriptorSetLayout layout;
+  uint32 bindingCount;
+  uint32 pushConstantSize;
+
+  static Kernel make(const GPUDevice &gpu, const char *shaderName,
+                     uint32 bindingCount, uint32 pushConstantSize);
+
+  /* Same with a variant of the kernel in sourceName, compiled with defines
+   * (see GPUDevice::makeComputePipelineVariant). */
+  static Kernel makeVariant(const GPUDevice &gpu, const char *sourceName,
+                            const std::vector<ShaderDefine> &defines,
+                            uint32 bindingCount, uint32 pushConstantSize);
+
+  /* Binds the kernel with bindingCount buffers and dispatches groupCount
+   * workgroups, spread over x and y (see splitGroupCount). */
+  void dispatch(VkCommandBuffer cmdbuf,
+                const BufferRange *buffers,
+                const void *pushConstant,
+                uint32 groupCount) const;
+
+  /* Same with the workgroup count read from params, a
+   * VkDispatchIndirectCommand written on the device. */
+  void dispatchIndirect(VkCommandBuffer cmdbuf,
+                        const BufferRange *buffers,
+                        const void *pushConstant,
+                        const BufferRange &params) const;
+
+private:
+  /* Everything but the pipeline. */
+  static Kernel makeLayout(const GPUDevice &gpu, uint32 bindingCount,
+                           uint32 pushConstantSize);
+
+  void bind(VkCommandBuffer cmdbuf,
+            const BufferRange *buffers,
+            const void *pushConstant) const;
+
+  mutable DescriptorCache mDescriptorCache;
+  const GPUDevice *mDev = nullptr;
+};
+
+/* vkCmdPipelineBarrier with one memory barrier, one buffer barrier or both
+ * (either may be null). Barriers of primitives go through this, or the
+ * helpers below, to be counted inside of a Graph (see GraphNodeScope). */
+void recordPipelineBarrier(VkCommandBuffer cmdbuf,
+                           VkPipelineStageFlags srcStages,
+                           VkPipelineStageFlags dstStages,
+                           const VkMemoryBarrier *barrier,
+                           const VkBufferMemoryBarrier *bufferBarrier =
+                             nullptr);
+
+/* Makes shader writes visible to the shaders and transfers after it. */
+void recordComputeBarrier(VkCommandBuffer cmdbuf);
+
+/* Barriers at the start of a primitive call, for whatever wrote its input
+ * or still uses its scratch, and at its end, for whatever reads its
+ * output. Both make shader and transfer writes visible to the shaders,
+ * transfers and indirect dispatches after them. A Graph places these
+ * itself between its nodes. */
+void recordEntryBarrier(VkCommandBuffer cmdbuf);
+void recordExitBarrier(VkCommandBuffer cmdbuf);
+
+/* Makes shader and transfer writes visible to the shaders and indirect
+ * dispatches after it. */
+void recordIndirectBarrier(VkCommandBuffer cmdbuf);
+
+/* Makes transfers after it wait for the shaders, indirect dispatches and
+ * transfers before it, so that vkCmdUpdateBuffer or vkCmdFillBuffer don't
+ * overwrite what those still read. */
+void recordUpdateBarrier(VkCommandBuffer cmdbuf);
+
+} /* namespace vub */
@@ -0,0 +1,173 @@
+#include "load-balanced-expand.h"
+
+#include <cassert>
+#include "helper.h"
+#include "memory-tracker.h"
+#include "profiler.h"
+#include "prefix-sum.h"
+#include "load-balance.h"
+
+using namespace LoadBalance;
+
+namespace vub {
+
+/* Workgroups loop over the tiles, of which there is a number only the
+ * device knows. */
+static const uint32 MAX_EXPAND_GROUPS = 4096;
+
+LoadBalancedExpand
+LoadBalancedExpand::make(const GPUDevice &gpu, uint32 maxItems)
+{
+  MemoryScope memoryScope(gpu, "LoadBalancedExpand");
+
+  LoadBalancedExpand ret = {};
+
+  /* Counts, offsets, items, ranks, dispatch parameters and item
+   * parameters. */
+  ret.expand = Kernel::make(gpu, "load-balance-expand", 6,
+                            sizeof(LoadBalancePushConstant));
+
+  ret.scan = DeviceScan::make(gpu, maxItems);
+  ret.offsets = gpu.makeDeviceBuffer((uint64)maxItems * sizeof(uint32));
+  ret.params = gpu.makeDeviceBuffer(sizeof(PrefixSum::ScanParams));
+  ret.maxItems = maxItems;
+  ret.indirect = IndirectDispatch::make(gpu);
+  ret.itemParams = gpu.makeDeviceBuffer(SCAN_PARAMS_STRIDE);
+  ret.mDev = &gpu;
+
+  return ret;
+}
+
+BufferRange
+LoadBalancedExpand::dispatchParams() const
+{
+  return params.range(0, sizeof(PrefixSum::ScanParams));
+}
+
+IndirectCount
+LoadBalancedExpand::outputCount() const
+{
+  return { dispatchParams() };
+}
+
+BufferRange
+LoadBalancedExpand::itemOffsets() const
+{
+  return offsets.range(0, (uint64)maxItems * sizeof(uint32));
+}
+
+void
+LoadBalancedExpand::record(VkCommandBuffer cmdbuf,
+                           const BufferRange &counts,
+                           uint32 numItems,
+                           const BufferRange &itemsOut,
+                           const BufferRange &ranksOut,
+                           uint32 maxOutputs,
+                           uint32 groupSize) const
+{
+  assert(numItems <= maxItems && groupSize > 0);
+
+  if (numItems == 0)
+  {
+    /* Still leave an empty dispatch behind, once the dispatches of a
+     * previous call are done reading the block. */
+    PrefixSum::ScanParams empty = { 0, 1, 1, 0 };
+    recordUpdateBarrier(cmdbuf);
+    vkCmdUpdateBuffer(cmdbuf, params.hdl, 0, sizeof(empty), &empty);
+
+    VkBufferMemoryBarrier barrier = GPUDevice::makeBarrier(
+      params.hdl, 0, sizeof(empty),
+      VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT);
+
+    recordPipelineBarrier(cmdbuf,
+                          VK_PIPELINE_STAGE_TRANSFER_BIT,
+                          VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                          nullptr, &barrier);
+    return;
+  }
+
+  /* The number of outputs is only known on the device. */
+  ProfileScope profile(*mDev, cmdbuf, "LoadBalancedExpand");
+
+  BufferRange offsetRange = offsets.range(0, numItems * sizeof(uint32));
+
+  /* A previous call may still be reading the offsets, and the counts may
+   * have just been written. */
+  recordEntryBarrier(cmdbuf);
+
+  scan.record(cmdbuf, counts, offsetRange, numItems);
+
+  recordExpand(cmdbuf, counts, numItems, itemsOut, ranksOut, maxOutputs,
+               groupSize);
+}
+
+void
+LoadBalancedExpand::record(VkCommandBuffer cmdbuf,
+                           const BufferRange &counts,
+                           const IndirectCount &count,
+                           const BufferRange &itemsOut,
+                           const BufferRange &ranksOut,
+                           uint32 maxOutputs,
+                           uint32 groupSize) const
+{
+  assert(groupSize > 0);
+
+  ProfileScope profile(*mDev, cmdbuf, "LoadBalancedExpand (indirect)");
+
+  IndirectCount items = {
+    itemParams.range(0, SCAN_PARAMS_STRIDE)
+  };
+
+  /* Only the count is used: the scan derives its own dispatch from it and
+   * the expand loops over its tiles. */
+  indirect.record(cmdbuf, count, items.params, 1, maxItems);
+
+  /* A previous call may still be reading the offsets, and the counts may
+   * have just been written. */
+  recordEntryBarrier(cmdbuf);
+
+  scan.record(cmdbuf, counts, itemOffsets(), items);
+
+  recordExpand(cmdbuf, counts, SCAN_INDIRECT_COUNT, itemsOut,
+               ranksOut, maxOutputs, groupSize);
+}
+
+void
+LoadBalancedExpand::recordExpand(VkCommandBuffer cmdbuf,
+                                 const BufferRange &counts,
+                                 uint32 numItems,
+                                 const BufferRange &itemsOut,
+                                 const BufferRange &ranksOut,
+                                 uint32 maxOutputs,
+                                 uint32 groupSize) const
+{
+  bool hasRanks = ranksOut.size > 0;
+  bool isIndirect = numItems == SCAN_INDIRECT_COUNT;
+
+  BufferRange offsetRange = isIndirect ?
+    itemOffsets() : offsets.range(0, numItems * sizeof(uint32));
+
+  /* The scan just wrote the offsets. */
+  recordComputeBarrier(cmdbuf);
+
+  LoadBalancePushConstant pushConstant = {
+    .numItems = numItems,
+    .maxOutputs = maxOutputs,
+    .groupSize = groupSize,
+    .flags = hasRanks ? (uint32)LOAD_BALANCE_FLAG_RANKS : 0u
+  };
+
+  BufferRange buffers[] = {
+    counts, offsetRange, itemsOut,
+    /* Unused without ranks, but still needs a binding. */
+    hasRanks ? ranksOut : itemsOut,
+    dispatchParams(), itemParams.range(0, SCAN_PARAMS_STRIDE)
+  };
+
+  expand.dispatch(cmdbuf, buffers, &pushConstant, MAX_EXPAND_GROUPS);
+
+  /* Both the outputs and the dispatch parameters get read next. */
+  recordExitBarrier(cmdbuf);
+}
+
+} /* namespace vub */
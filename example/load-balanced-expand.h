@@ -0,0 +1,88 @@
+#pragma once
+
+#include "kernel.h"
+#include "gpu-device.h"
+#include "device-scan.h"
+#include "indirect-dispatch.h"
+
+namespace vub {
+
+/* Expands items which each produce a variable number of outputs (CSR
+ * neighbour lists, split strings, ...) into one (item, rank) pair per
+ * output: output j belongs to item items[j], of which it is output
+ * ranks[j].
+ *
+ * The counts are scanned with DeviceScan and the pairs found with a
+ * load-balanced search (see load-balance-expand.comp), so the cost only
+ * depends on the number of items and outputs, never on how skewed the
+ * counts are. A kernel over the outputs then runs one invocation per pair
+ * with perfect balance, dispatched with vkCmdDispatchIndirect from
+ * dispatchParams() since only the device knows how many outputs there
+ * are. */
+struct LoadBalancedExpand {
+  Kernel expand;
+
+  /* Scratch shared by every call, which therefore run one after the
+   * other. */
+  DeviceScan scan;
+  DeviceBuffer offsets;
+  DeviceBuffer params;
+  uint32 maxItems;
+
+  /* Writes the parameter block of the items of calls over an
+   * IndirectCount. */
+  IndirectDispatch indirect;
+  DeviceBuffer itemParams;
+
+  static LoadBalancedExpand make(const GPUDevice &gpu, uint32 maxItems);
+
+  /* Expands numItems items with the given counts into itemsOut and, if its
+   * size isn't 0, ranksOut. Outputs past maxOutputs are dropped.
+   * groupSize is the workgroup size of the kernel to be dispatched over
+   * the outputs. */
+  void record(VkCommandBuffer cmdbuf,
+              const BufferRange &counts,
+              uint32 numItems,
+              const BufferRange &itemsOut,
+              const BufferRange &ranksOut,
+              uint32 maxOutputs,
+              uint32 groupSize = 256) const;
+
+  /* Same with as many items as count holds (at most maxItems), so that the
+   * items of one expand can come from another primitive on the device. */
+  void record(VkCommandBuffer cmdbuf,
+              const BufferRange &counts,
+              const IndirectCount &count,
+              const BufferRange &itemsOut,
+              const BufferRange &ranksOut,
+              uint32 maxOutputs,
+              uint32 groupSize = 256) const;
+
+  /* ScanParams of the last call: a VkDispatchIndirectCommand of enough
+   * groupSize workgroups to cover the outputs which were written, followed
+   * by their number. Written by the compute shader stage. */
+  BufferRange dispatchParams() const;
+
+  /* The number of outputs of the last call (at most maxOutputs), for
+   * primitives which work on itemsOut and ranksOut. */
+  IndirectCount outputCount() const;
+
+  /* Exclusive scan of the counts of the last call: where the outputs of
+   * every item start. */
+  BufferRange itemOffsets() const;
+
+private:
+  /* numItems is SCAN_INDIRECT_COUNT for the calls over an IndirectCount,
+   * which then have the item parameter block written already. */
+  void recordExpand(VkCommandBuffer cmdbuf,
+                    const BufferRange &counts,
+                    uint32 numItems,
+                    const BufferRange &itemsOut,
+                    const BufferRange &ranksOut,
+                    uint32 maxOutputs,
+                    uint32 groupSize) const;
+
+  const GPUDevice *mDev = nullptr;
+};
+
+} /* namespace vub */
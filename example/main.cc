@@ -1,18 +1,188 @@
+#include <stdio.h>
+#include <chrono>
 #include "gpu-device.h"
+#include "device-scan.h"
+#include "profiler.h"
 
 #define NUM_INPUTS (2048*2048)
 
+static void
+copyBuffer(const GPUDevice &gpu, VkBuffer src, VkBuffer dst, uint64 size)
+{
+  VkCommandBuffer cmdbuf = gpu.makeCommandBuffer();
+  gpu.beginSingleUseCommandBuffer(cmdbuf);
+
+  VkBufferCopy region = { 0, 0, size };
+  vkCmdCopyBuffer(cmdbuf, src, dst, 1, &region);
+
+  gpu.endCommandBuffer(cmdbuf);
+  gpu.submitCommandBuffer(cmdbuf, VK_NULL_HANDLE, VK_NULL_HANDLE, 0,
+                          VK_NULL_HANDLE);
+  gpu.waitIdle();
+  gpu.freeCommandBuffer(cmdbuf);
+}
+
+/* Returns the number of elements which differ from an exclusive scan of
+ * inputs. */
+static uint32
+countMismatches(const uint32 *inputs, const uint32 *outputs, uint32 size)
+{
+  uint32 expected = 0;
+  uint32 mismatches = 0;
+  for (uint32 i = 0; i < size; ++i)
+  {
+    mismatches += (outputs[i] != expected);
+    expected += inputs[i];
+  }
+
+  return mismatches;
+}
+
+/* Dispatches per second of scans over tiny inputs, which is bound by how
+ * fast buffers get to the kernel rather than by the scan itself. Every
+ * dispatch uses one of a few different ranges of the buffers. */
+static void
+benchmarkDispatches(const GPUDevice &gpu,
+                    const DeviceBuffer &input,
+                    const DeviceBuffer &output)
+{
+  const uint32 numElements = 256;
+  const uint32 numRanges = 16;
+  const uint32 dispatchesPerBatch = 1000;
+  const uint32 numBatches = 20;
+
+  vub::BindingMode modes[] = {
+    vub::BindingMode::Addresses,
+    vub::BindingMode::PushDescriptors,
+    vub::BindingMode::CachedSets
+  };
+
+  for (vub::BindingMode mode : modes)
+  {
+    if (vub::resolveBindingMode(gpu, mode) != mode)
+    {
+      printf("%s: not supported\n", vub::bindingModeName(mode));
+      continue;
+    }
+
+    vub::DeviceScan scan = vub::DeviceScan::make(gpu, numElements, mode);
+    VkCommandBuffer cmdbuf = gpu.makeCommandBuffer();
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32 batch = 0; batch < numBatches; ++batch)
+    {
+      gpu.beginSingleUseCommandBuffer(cmdbuf);
+
+      for (uint32 i = 0; i < dispatchesPerBatch; ++i)
+      {
+        uint64 offset = (i % numRanges) * numElements * sizeof(uint32);
+        uint64 size = numElements * sizeof(uint32);
+
+        scan.record(cmdbuf, input.range(offset, size),
+                    output.range(offset, size), numElements);
+      }
+
+      gpu.endCommandBuffer(cmdbuf);
+      gpu.submitCommandBuffer(cmdbuf, VK_NULL_HANDLE, VK_NULL_HANDLE, 0,
+                              VK_NULL_HANDLE);
+      gpu.waitIdle();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(end - start).count();
+
+    printf("%s: %.0f dispatches/s\n", vub::bindingModeName(mode),
+           numBatches * dispatchesPerBatch / seconds);
+
+    gpu.freeCommandBuffer(cmdbuf);
+  }
+}
+
 int main(int argc, char **argv)
 {
   /* Initialize Vulkan instance, device, etc. */
   GPUDevice gpu = GPUDevice::make(nullptr);
-
-  VkDescriptorSetLayout layout = gpu.makeDescriptorSetLayout(
-    BindingDesc{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1}
-  );
+  gpu.enableProfiling(true);
 
   StagingBuffer inputStaging = gpu.makeStagingBuffer(NUM_INPUTS * sizeof(uint32));
+  StagingBuffer outputStaging = gpu.makeStagingBuffer(
+    NUM_INPUTS * sizeof(uint32), VK_BUFFER_USAGE_TRANSFER_DST_BIT);
   DeviceBuffer inputBuffer = gpu.makeDeviceBuffer(NUM_INPUTS * sizeof(uint32));
+  DeviceBuffer outputBuffer = gpu.makeDeviceBuffer(NUM_INPUTS * sizeof(uint32));
+
+  uint32 *inputs = (uint32 *)inputStaging.ptr;
+  for (uint32 i = 0; i < NUM_INPUTS; ++i)
+    inputs[i] = i % 7;
+
+  copyBuffer(gpu, inputStaging.hdl, inputBuffer.hdl, NUM_INPUTS * sizeof(uint32));
+
+  vub::DeviceScan scan = vub::DeviceScan::make(gpu, NUM_INPUTS);
+
+  /* Record the scan once and replay it for different sizes. */
+  vub::Recording recording = vub::Recording::make(gpu, 1);
+  recording.begin();
+  vub::RecordedCall call = scan.record(recording, inputBuffer, outputBuffer);
+  recording.end();
+
+  uint32 sizes[] = { NUM_INPUTS, 12345, 1 };
+  for (uint32 size : sizes)
+  {
+    recording.setNumElements(call, size);
+    recording.submit();
+    gpu.waitIdle();
+
+    if (gpu.profiler)
+      gpu.profiler->collect();
+
+    copyBuffer(gpu, outputBuffer.hdl, outputStaging.hdl, size * sizeof(uint32));
+
+    uint32 mismatches = countMismatches(inputs,
+                                        (uint32 *)outputStaging.ptr, size);
+
+    printf("Scan of %u elements: %u mismatches\n", size, mismatches);
+  }
+
+  /* Scan a part of the buffers. The offset keeps the descriptor path happy
+   * (minStorageBufferOffsetAlignment is at most 256). */
+  uint32 offset = 1024;
+  uint32 size = 100000;
+
+  VkCommandBuffer cmdbuf = gpu.makeCommandBuffer();
+  gpu.beginSingleUseCommandBuffer(cmdbuf);
+  scan.record(cmdbuf,
+              inputBuffer.range(offset * sizeof(uint32), size * sizeof(uint32)),
+              outputBuffer.range(offset * sizeof(uint32), size * sizeof(uint32)),
+              size);
+  gpu.endCommandBuffer(cmdbuf);
+  gpu.submitCommandBuffer(cmdbuf, VK_NULL_HANDLE, VK_NULL_HANDLE, 0,
+                          VK_NULL_HANDLE);
+  gpu.waitIdle();
+  gpu.freeCommandBuffer(cmdbuf);
+
+  copyBuffer(gpu, outputBuffer.hdl, outputStaging.hdl, NUM_INPUTS * sizeof(uint32));
+
+  uint32 mismatches = countMismatches(inputs + offset,
+                                      (uint32 *)outputStaging.ptr + offset,
+                                      size);
+
+  printf("Scan of %u elements at offset %u: %u mismatches\n",
+         size, offset, mismatches);
+
+  if (gpu.profiler)
+  {
+    gpu.profiler->collect();
+
+    for (const ProfileEvent &event : gpu.profiler->events)
+      printf("%s: %.3f ms, %.2f GB/s, %llu invocations\n",
+             event.name.c_str(), event.durationMs, event.gigabytesPerSecond,
+             (unsigned long long)event.computeInvocations);
+
+    gpu.profiler->writeChromeTrace("vub-trace.json");
+  }
 
+  /* Timestamps would get in the way of measuring recording overhead. */
+  gpu.profiler.reset();
 
+  benchmarkDispatches(gpu, inputBuffer, outputBuffer);
 }
@@ -0,0 +1,136 @@
+#include "memory-tracker.h"
+
+#include <cassert>
+#include <algorithm>
+#include "helper.h"
+
+const char *
+getMemoryTagName(MemoryTag tag)
+{
+  switch (tag)
+  {
+  case MemoryTag::Device: return "device";
+  case MemoryTag::Staging: return "staging";
+  case MemoryTag::Import: return "import";
+  case MemoryTag::Sparse: return "sparse";
+  case MemoryTag::Image: return "image";
+  default: return "unknown";
+  }
+}
+
+static void
+addTo(MemoryUsage &usage, uint64 size)
+{
+  usage.bytes += size;
+  usage.allocationCount++;
+  usage.peakBytes = std::max(usage.peakBytes, usage.bytes);
+}
+
+static void
+removeFrom(MemoryUsage &usage, uint64 size)
+{
+  assert(usage.bytes >= size && usage.allocationCount > 0);
+
+  usage.bytes -= size;
+  usage.allocationCount--;
+}
+
+MemoryTracker
+MemoryTracker::make(uint32 heapCount)
+{
+  MemoryTracker ret = {};
+  ret.heaps.resize(heapCount, MemoryUsage{});
+  return ret;
+}
+
+void
+MemoryTracker::add(VkDeviceMemory memory, uint64 size, uint32 heap,
+                   MemoryTag tag)
+{
+  assert(heap < heaps.size());
+
+  /* Map nodes don't move, so allocations can point at theirs. */
+  MemoryUsage &primitive =
+    primitives[mScopes.empty() ? "other" : mScopes.front()];
+
+  addTo(heaps[heap], size);
+  addTo(tags[(uint32)tag], size);
+  addTo(primitive, size);
+  addTo(total, size);
+
+  mAllocations[memory] = { size, heap, tag, &primitive };
+}
+
+void
+MemoryTracker::remove(VkDeviceMemory memory)
+{
+  auto allocation = mAllocations.find(memory);
+  if (allocation == mAllocations.end())
+    return;
+
+  const Allocation &a = allocation->second;
+  removeFrom(heaps[a.heap], a.size);
+  removeFrom(tags[(uint32)a.tag], a.size);
+  removeFrom(*a.primitive, a.size);
+  removeFrom(total, a.size);
+
+  mAllocations.erase(allocation);
+}
+
+void
+MemoryTracker::beginScope(const char *primitive)
+{
+  mScopes.push_back(primitive);
+}
+
+void
+MemoryTracker::endScope()
+{
+  assert(!mScopes.empty());
+  mScopes.pop_back();
+}
+
+static void
+printUsage(const char *name, const MemoryUsage &usage)
+{
+  printf("  %-24s %10.1f MiB %10.1f MiB peak %6u allocations\n", name,
+         usage.bytes / (1024.0 * 1024.0),
+         usage.peakBytes / (1024.0 * 1024.0),
+         usage.allocationCount);
+}
+
+void
+MemoryTracker::print() const
+{
+  printf("Device memory:\n");
+  printUsage("total", total);
+
+  for (uint32 i = 0; i < heaps.size(); ++i)
+  {
+    if (heaps[i].peakBytes == 0)
+      continue;
+
+    std::string name = "heap " + std::to_string(i);
+    printUsage(name.c_str(), heaps[i]);
+  }
+
+  for (uint32 i = 0; i < (uint32)MemoryTag::Count; ++i)
+  {
+    if (tags[i].peakBytes > 0)
+      printUsage(getMemoryTagName((MemoryTag)i), tags[i]);
+  }
+
+  for (const auto &primitive : primitives)
+    printUsage(primitive.first.c_str(), primitive.second);
+}
+
+MemoryScope::MemoryScope(const GPUDevice &gpu, const char *primitive)
+  : mTracker(&gpu.memoryTracker())
+{
+  mTracker->beginScope(primitive);
+}
+
+MemoryScope::~MemoryScope()
+{
+  mTracker->endScope();
+}
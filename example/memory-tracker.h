@@ -0,0 +1,83 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "gpu-device.h"
+
+/* What an allocation of device memory is for. */
+enum class MemoryTag {
+  /* makeDeviceBuffer. */
+  Device,
+  /* makeStagingBuffer, and the copies of HostBuffers. */
+  Staging,
+  /* Host memory imported by importHostBuffer, and memory of other
+   * processes imported by importDeviceBuffer. */
+  Import,
+  /* Memory bound to sparse buffers. */
+  Sparse,
+  Image,
+  Count
+};
+
+const char *getMemoryTagName(MemoryTag tag);
+
+/* Memory of one heap, tag or primitive. */
+struct MemoryUsage {
+  uint64 bytes;
+  uint32 allocationCount;
+
+  /* High-water mark of bytes. */
+  uint64 peakBytes;
+};
+
+/* Every device memory allocation vub makes, by heap, by tag and by
+ * primitive. Made along with the GPUDevice, see
+ * GPUDevice::memoryTracker.
+ *
+ * Allocations are put down to the primitive of the outermost MemoryScope
+ * open when they are made, so what a primitive makes for the primitives
+ * it is built from counts as its own. Those made outside of any scope go
+ * to "other". */
+struct MemoryTracker {
+  /* By heap index of VkPhysicalDeviceMemoryProperties. */
+  std::vector<MemoryUsage> heaps;
+  MemoryUsage tags[(uint32)MemoryTag::Count];
+  std::map<std::string, MemoryUsage> primitives;
+  MemoryUsage total;
+
+  static MemoryTracker make(uint32 heapCount);
+
+  void add(VkDeviceMemory memory, uint64 size, uint32 heap, MemoryTag tag);
+  /* Memory which isn't known (imports which failed to bind, say) is
+   * ignored. */
+  void remove(VkDeviceMemory memory);
+
+  void beginScope(const char *primitive);
+  void endScope();
+
+  /* Current and peak bytes of everything, to stdout. */
+  void print() const;
+
+private:
+  struct Allocation {
+    uint64 size;
+    uint32 heap;
+    MemoryTag tag;
+    MemoryUsage *primitive;
+  };
+
+  std::unordered_map<VkDeviceMemory, Allocation> mAllocations;
+  std::vector<const char *> mScopes;
+};
+
+/* Puts the memory allocated during its lifetime down to primitive (see
+ * MemoryTracker). primitive has to outlive the scope. */
+struct MemoryScope {
+  MemoryScope(const GPUDevice &gpu, const char *primitive);
+  ~MemoryScope();
+
+private:
+  MemoryTracker *mTracker;
+};
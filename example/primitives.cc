@@ -0,0 +1,455 @@
+#include "primitives.h"
+
+#include <string.h>
+#include <algorithm>
+#include "helper.h"
+#include "select-scatter.h"
+
+using namespace SelectScatter;
+
+namespace vub {
+
+const char *
+backendName(Backend backend)
+{
+  switch (backend)
+  {
+  case Backend::Auto: return "auto";
+  case Backend::Vulkan: return "vulkan";
+  case Backend::CPU: return "cpu";
+  case Backend::Daemon: return "daemon";
+  default: return "unknown";
+  }
+}
+
+Primitives
+Primitives::make(Backend backend, uint32 chunkElements)
+{
+  Primitives ret = {};
+
+  /* A daemon is checked for first, since it saves making a device. */
+  if (backend == Backend::Auto || backend == Backend::Daemon)
+  {
+    std::string path = getDefaultDaemonSocketPath();
+
+    if (ret.mDaemon.connect(path))
+    {
+      backend = Backend::Daemon;
+    }
+    else if (backend == Backend::Daemon)
+    {
+      printf("No vub daemon is listening at %s\n", path.c_str());
+      PANIC_AND_EXIT("Daemon backend isn't available");
+    }
+  }
+
+  if (backend == Backend::Auto)
+    backend = GPUDevice::isAvailable() ? Backend::Vulkan : Backend::CPU;
+
+  ret.backend = backend;
+  ret.mCpu = CPUBackend::make();
+  ret.mChunkElements = chunkElements;
+
+  if (backend == Backend::Daemon)
+  {
+    ret.mChunkElements = std::min(chunkElements,
+                                  ret.mDaemon.hello.maxElements);
+
+    uint64 bytes = (uint64)ret.mChunkElements * sizeof(uint32);
+    ret.mSharedOutput = roundUp<uint64>(bytes, DAEMON_BUFFER_ALIGNMENT);
+    ret.mShared = SharedMemory::make(2 * ret.mSharedOutput);
+    ret.mSharedHandle = ret.mDaemon.registerHost(ret.mShared);
+
+    if (ret.mSharedHandle == 0)
+      PANIC_AND_EXIT("vub daemon can't import shared memory");
+  }
+
+  if (backend == Backend::Vulkan)
+  {
+    /* GPUDevice can't be moved, but it can be made in place. */
+    ret.gpu.reset(new GPUDevice(GPUDevice::make(nullptr, false)));
+
+    uint64 bytes = (uint64)chunkElements * sizeof(uint32);
+    uint64 flagBytes = roundUp<uint64>(chunkElements, sizeof(uint32));
+
+    ret.mStagingFlags = bytes;
+    ret.mStaging = ret.gpu->makeStagingBuffer(
+      bytes + flagBytes,
+      VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    ret.mInput = ret.gpu->makeDeviceBuffer(bytes);
+    ret.mOutput = ret.gpu->makeDeviceBuffer(bytes);
+    ret.mScan = DeviceScan::make(*ret.gpu, chunkElements);
+    ret.mSort = DeviceRadixSort::make(*ret.gpu, chunkElements);
+
+    if (ret.gpu->features.storage8Bit)
+    {
+      /* The scan gives every selected element one past where it goes. */
+      ScanFusion flagFusion = {};
+      flagFusion.input = typedInput(ScanType::Uint8);
+
+      ret.mFlagScan = DeviceScan::make(*ret.gpu, chunkElements,
+                                       BindingMode::Auto, true, flagFusion);
+
+      /* Elements, their scanned flags and the selected elements. */
+      ret.mSelectScatter = Kernel::make(*ret.gpu, "select-scatter", 3,
+                                        sizeof(SelectScatterPushConstant));
+      ret.mFlags = ret.gpu->makeDeviceBuffer(flagBytes);
+      ret.mSelected = ret.gpu->makeDeviceBuffer(bytes);
+    }
+  }
+
+  return ret;
+}
+
+uint32
+Primitives::scanChunk(const uint32 *in, uint32 *out, uint32 count,
+                      uint32 carry, bool inclusive)
+{
+  uint64 bytes = (uint64)count * sizeof(uint32);
+
+  /* Read before out (which may be in) gets written. */
+  uint32 lastInput = in[count - 1];
+
+  memcpy(mStaging.ptr, in, bytes);
+
+  VkCommandBuffer cmdbuf = gpu->makeCommandBuffer();
+  gpu->beginSingleUseCommandBuffer(cmdbuf);
+
+  VkBufferCopy region = { 0, 0, bytes };
+  vkCmdCopyBuffer(cmdbuf, mStaging.hdl, mInput.hdl, 1, &region);
+
+  VkBufferMemoryBarrier inputBarrier = GPUDevice::makeBarrier(
+    mInput.hdl, 0, bytes,
+    VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+  vkCmdPipelineBarrier(cmdbuf,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       0, 0, nullptr, 1, &inputBarrier, 0, nullptr);
+
+  mScan.record(cmdbuf, mInput.range(0, bytes), mOutput.range(0, bytes),
+               count, inclusive);
+
+  VkBufferMemoryBarrier outputBarrier = GPUDevice::makeBarrier(
+    mOutput.hdl, 0, bytes,
+    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+  vkCmdPipelineBarrier(cmdbuf,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       0, 0, nullptr, 1, &outputBarrier, 0, nullptr);
+
+  vkCmdCopyBuffer(cmdbuf, mOutput.hdl, mStaging.hdl, 1, &region);
+
+  gpu->endCommandBuffer(cmdbuf);
+  gpu->submitCommandBuffer(cmdbuf, VK_NULL_HANDLE, VK_NULL_HANDLE, 0,
+                           VK_NULL_HANDLE);
+  gpu->waitIdle();
+  gpu->freeCommandBuffer(cmdbuf);
+
+  /* The kernel starts every chunk from 0. */
+  const uint32 *scanned = (const uint32 *)mStaging.ptr;
+  for (uint32 i = 0; i < count; ++i)
+    out[i] = scanned[i] + carry;
+
+  return inclusive ? out[count - 1] : out[count - 1] + lastInput;
+}
+
+void
+Primitives::runCommands(const std::function<void(VkCommandBuffer)> &record)
+{
+  VkCommandBuffer cmdbuf = gpu->makeCommandBuffer();
+  gpu->beginSingleUseCommandBuffer(cmdbuf);
+
+  record(cmdbuf);
+
+  gpu->endCommandBuffer(cmdbuf);
+  gpu->submitCommandBuffer(cmdbuf, VK_NULL_HANDLE, VK_NULL_HANDLE, 0,
+                           VK_NULL_HANDLE);
+  gpu->waitIdle();
+  gpu->freeCommandBuffer(cmdbuf);
+}
+
+uint64
+Primitives::selectChunk(const uint32 *in, const uint8 *flags, uint32 *out,
+                        uint32 count)
+{
+  uint64 bytes = (uint64)count * sizeof(uint32);
+
+  memcpy(mStaging.ptr, in, bytes);
+
+  /* The scan counts the flags, so they have to be 0 or 1. */
+  uint8 *stagingFlags = (uint8 *)mStaging.ptr + mStagingFlags;
+  for (uint32 i = 0; i < count; ++i)
+    stagingFlags[i] = flags[i] != 0;
+
+  runCommands([&](VkCommandBuffer cmdbuf)
+  {
+    VkBufferCopy inputRegion = { 0, 0, bytes };
+    vkCmdCopyBuffer(cmdbuf, mStaging.hdl, mInput.hdl, 1, &inputRegion);
+
+    VkBufferCopy flagRegion = { mStagingFlags, 0, count };
+    vkCmdCopyBuffer(cmdbuf, mStaging.hdl, mFlags.hdl, 1, &flagRegion);
+
+    recordIndirectBarrier(cmdbuf);
+
+    BufferRange offsets = mOutput.range(0, bytes);
+    mFlagScan.record(cmdbuf, mFlags.range(0, count), offsets, count, true);
+
+    SelectScatterPushConstant pushConstant = { .numElements = count };
+    BufferRange buffers[] = { mInput.range(0, bytes), offsets, mSelected };
+
+    mSelectScatter.dispatch(cmdbuf, buffers, &pushConstant,
+                            (count + SELECT_THREADS_PER_BLOCK - 1) /
+                            SELECT_THREADS_PER_BLOCK);
+    recordComputeBarrier(cmdbuf);
+
+    /* The last offset is how many were selected, which isn't known yet,
+     * so every element which may have been comes back. */
+    VkBufferCopy countRegion = { bytes - sizeof(uint32), mStagingFlags,
+                                 sizeof(uint32) };
+    vkCmdCopyBuffer(cmdbuf, mOutput.hdl, mStaging.hdl, 1, &countRegion);
+
+    VkBufferCopy selectedRegion = { 0, 0, bytes };
+    vkCmdCopyBuffer(cmdbuf, mSelected.hdl, mStaging.hdl, 1,
+                    &selectedRegion);
+  });
+
+  uint32 selected = *(const uint32 *)((uint8 *)mStaging.ptr + mStagingFlags);
+  memcpy(out, mStaging.ptr, (uint64)selected * sizeof(uint32));
+
+  return selected;
+}
+
+void
+Primitives::checkDaemonStatus(DaemonStatus status) const
+{
+  if (status != DaemonStatus::Ok)
+  {
+    printf("vub daemon returned status %u\n", (uint32)status);
+    PANIC_AND_EXIT("Daemon request failed");
+  }
+}
+
+uint32
+Primitives::scanDaemonChunk(const uint32 *in, uint32 *out, uint32 count,
+                            uint32 carry, bool inclusive)
+{
+  uint64 bytes = (uint64)count * sizeof(uint32);
+
+  /* Read before out (which may be in) gets written. */
+  uint32 lastInput = in[count - 1];
+
+  uint32 *input = (uint32 *)mShared.ptr;
+  const uint32 *scanned = (const uint32 *)((uint8 *)mShared.ptr +
+                                           mSharedOutput);
+
+  memcpy(input, in, bytes);
+
+  checkDaemonStatus(mDaemon.scan({ mSharedHandle, 0, bytes },
+                                 { mSharedHandle, mSharedOutput, bytes },
+                                 count, inclusive));
+
+  /* The daemon starts every chunk from 0 too. */
+  for (uint32 i = 0; i < count; ++i)
+    out[i] = scanned[i] + carry;
+
+  return inclusive ? out[count - 1] : out[count - 1] + lastInput;
+}
+
+bool
+Primitives::scanImported(const uint32 *in, uint32 *out, uint32 count,
+                         bool inclusive)
+{
+  uint64 bytes = (uint64)count * sizeof(uint32);
+
+  /* The GPU only reads the input, the const_cast is to import it. */
+  HostBuffer input = gpu->importHostBuffer((uint32 *)in, bytes);
+  HostBuffer output = gpu->importHostBuffer(out, bytes);
+
+  if (!input.imported || !output.imported)
+    return false;
+
+  VkCommandBuffer cmdbuf = gpu->makeCommandBuffer();
+  gpu->beginSingleUseCommandBuffer(cmdbuf);
+
+  mScan.record(cmdbuf, input, output, count, inclusive);
+
+  /* Makes the writes available to the host. */
+  VkMemoryBarrier barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_HOST_READ_BIT
+  };
+
+  vkCmdPipelineBarrier(cmdbuf,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_HOST_BIT,
+                       0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+  gpu->endCommandBuffer(cmdbuf);
+  gpu->submitCommandBuffer(cmdbuf, VK_NULL_HANDLE, VK_NULL_HANDLE, 0,
+                           VK_NULL_HANDLE);
+  gpu->waitIdle();
+  gpu->freeCommandBuffer(cmdbuf);
+
+  return true;
+}
+
+void
+Primitives::scan(const uint32 *in, uint32 *out, uint64 count, bool inclusive)
+{
+  if (backend == Backend::CPU)
+  {
+    mCpu.scan(in, out, count, inclusive);
+    return;
+  }
+
+  if (backend == Backend::Daemon)
+  {
+    uint32 carry = 0;
+    for (uint64 begin = 0; begin < count; begin += mChunkElements)
+    {
+      uint32 size = (uint32)std::min<uint64>(mChunkElements, count - begin);
+      carry = scanDaemonChunk(in + begin, out + begin, size, carry,
+                              inclusive);
+    }
+
+    return;
+  }
+
+  /* Scanning in place into the input isn't supported by the kernel. */
+  if (gpu->features.externalMemoryHost && in != out && count > 0 &&
+      count <= mChunkElements &&
+      scanImported(in, out, (uint32)count, inclusive))
+    return;
+
+  uint32 carry = 0;
+  for (uint64 begin = 0; begin < count; begin += mChunkElements)
+  {
+    uint32 size = (uint32)std::min<uint64>(mChunkElements, count - begin);
+    carry = scanChunk(in + begin, out + begin, size, carry, inclusive);
+  }
+}
+
+uint32
+Primitives::reduce(const uint32 *in, uint64 count)
+{
+  if (backend == Backend::CPU)
+    return mCpu.reduce(in, count);
+
+  if (backend == Backend::Daemon)
+  {
+    uint32 total = 0;
+    for (uint64 begin = 0; begin < count; begin += mChunkElements)
+    {
+      uint32 size = (uint32)std::min<uint64>(mChunkElements, count - begin);
+      uint64 bytes = (uint64)size * sizeof(uint32);
+
+      memcpy(mShared.ptr, in + begin, bytes);
+
+      uint32 sum = 0;
+      checkDaemonStatus(mDaemon.reduce({ mSharedHandle, 0, bytes }, size,
+                                       sum));
+      total += sum;
+    }
+
+    return total;
+  }
+
+  if (count == 0)
+    return 0;
+
+  /* The total is carried from chunk to chunk on the device, and only it
+   * comes back. */
+  for (uint64 begin = 0; begin < count; begin += mChunkElements)
+  {
+    uint32 size = (uint32)std::min<uint64>(mChunkElements, count - begin);
+    uint64 bytes = (uint64)size * sizeof(uint32);
+    bool isLast = begin + size == count;
+
+    memcpy(mStaging.ptr, in + begin, bytes);
+
+    runCommands([&](VkCommandBuffer cmdbuf)
+    {
+      VkBufferCopy region = { 0, 0, bytes };
+      vkCmdCopyBuffer(cmdbuf, mStaging.hdl, mInput.hdl, 1, &region);
+      recordIndirectBarrier(cmdbuf);
+
+      mScan.record(cmdbuf, mInput.range(0, bytes), mOutput.range(0, bytes),
+                   size, true,
+                   begin == 0 ? ScanCarry::Start : ScanCarry::Continue);
+
+      if (isLast)
+      {
+        recordComputeBarrier(cmdbuf);
+
+        BufferRange total = mScan.carryOut();
+        VkBufferCopy totalRegion = { total.offset, 0, sizeof(uint32) };
+        vkCmdCopyBuffer(cmdbuf, total.hdl, mStaging.hdl, 1, &totalRegion);
+      }
+    });
+  }
+
+  return *(const uint32 *)mStaging.ptr;
+}
+
+uint64
+Primitives::select(const uint32 *in, const uint8 *flags, uint32 *out,
+                   uint64 count)
+{
+  if (backend != Backend::Vulkan || !gpu->features.storage8Bit)
+    return mCpu.select(in, flags, out, count);
+
+  uint64 selected = 0;
+  for (uint64 begin = 0; begin < count; begin += mChunkElements)
+  {
+    uint32 size = (uint32)std::min<uint64>(mChunkElements, count - begin);
+    selected += selectChunk(in + begin, flags + begin, out + selected, size);
+  }
+
+  return selected;
+}
+
+void
+Primitives::sort(uint32 *keys, uint64 count)
+{
+  if (backend == Backend::Daemon && count > 0 && count <= mChunkElements)
+  {
+    uint64 bytes = count * sizeof(uint32);
+
+    memcpy(mShared.ptr, keys, bytes);
+    checkDaemonStatus(mDaemon.sort({ mSharedHandle, 0, bytes }, {}, count));
+    memcpy(keys, mShared.ptr, bytes);
+
+    return;
+  }
+
+  if (backend == Backend::Vulkan && count > 0 && count <= mChunkElements)
+  {
+    uint64 bytes = count * sizeof(uint32);
+
+    memcpy(mStaging.ptr, keys, bytes);
+
+    runCommands([&](VkCommandBuffer cmdbuf)
+    {
+      VkBufferCopy region = { 0, 0, bytes };
+      vkCmdCopyBuffer(cmdbuf, mStaging.hdl, mInput.hdl, 1, &region);
+      recordIndirectBarrier(cmdbuf);
+
+      /* The keys end up back in mInput. */
+      mSort.record(cmdbuf, mInput.range(0, bytes), mOutput.range(0, bytes),
+                   {}, {}, (uint32)count);
+      recordComputeBarrier(cmdbuf);
+
+      vkCmdCopyBuffer(cmdbuf, mInput.hdl, mStaging.hdl, 1, &region);
+    });
+
+    memcpy(keys, mStaging.ptr, bytes);
+    return;
+  }
+
+  mCpu.sort(keys, count);
+}
+
+} /* namespace vub */
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <memory>
+#include <functional>
+#include "kernel.h"
+#include "gpu-device.h"
+#include "cpu-backend.h"
+#include "device-scan.h"
+#include "device-radix-sort.h"
+#include "daemon-client.h"
+
+namespace vub {
+
+enum class Backend {
+  /* A vub daemon if one is listening, Vulkan if GPUDevice::isAvailable,
+   * the CPU if not. */
+  Auto,
+  Vulkan,
+  CPU,
+  /* A vub daemon at getDefaultDaemonSocketPath, whose device is already
+   * made and warm (see Daemon). */
+  Daemon
+};
+
+const char *backendName(Backend backend);
+
+/* Scan, reduce, select and sort over host memory on whichever backend was
+ * picked when making it, so callers which have to run with and without a
+ * GPU need a single code path.
+ *
+ * The Vulkan backend scans host memory in place if the device can import
+ * it (features.externalMemoryHost). If not, or if the input is longer than
+ * chunkElements, it goes through staging buffers one chunk at a time.
+ * Reductions are scans which carry their total from chunk to chunk on the
+ * device, and only read back the total. Sorts of up to chunkElements keys
+ * run on DeviceRadixSort, longer ones on the CPU backend. Selects are a
+ * scan of the flags and a scatter, a chunk at a time; they need
+ * features.storage8Bit and run on the CPU backend without it.
+ *
+ * The daemon backend makes no device at all. It copies the elements into
+ * memory it shares with the daemon, a chunk at a time, and the daemon
+ * scans, reduces and sorts them there. Sorts of more elements than fit in
+ * a chunk run on the CPU. */
+struct Primitives {
+  Backend backend;
+
+  /* Null with the CPU and daemon backends. */
+  std::unique_ptr<GPUDevice> gpu;
+
+  static Primitives make(Backend backend = Backend::Auto,
+                         uint32 chunkElements = 1 << 24);
+
+  /* in and out may be the same. */
+  void scan(const uint32 *in, uint32 *out, uint64 count,
+            bool inclusive = false);
+  uint32 reduce(const uint32 *in, uint64 count);
+
+  /* See CPUBackend::select. */
+  uint64 select(const uint32 *in, const uint8 *flags, uint32 *out,
+                uint64 count);
+  void sort(uint32 *keys, uint64 count);
+
+private:
+  /* Scans straight out of and into imported host memory. Returns false if
+   * either one would have been a copy. */
+  bool scanImported(const uint32 *in, uint32 *out, uint32 count,
+                    bool inclusive);
+
+  /* Scans count (at most mChunkElements) elements on the GPU and returns
+   * the inclusive scan of the last one. */
+  uint32 scanChunk(const uint32 *in, uint32 *out, uint32 count,
+                   uint32 carry, bool inclusive);
+
+  /* Selects among count (at most mChunkElements) elements on the GPU and
+   * returns how many there were. */
+  uint64 selectChunk(const uint32 *in, const uint8 *flags, uint32 *out,
+                     uint32 count);
+
+  /* Records commands into a new command buffer, submits it and waits for
+   * it to be done. */
+  void runCommands(const std::function<void(VkCommandBuffer)> &record);
+
+  /* Same on the daemon. */
+  uint32 scanDaemonChunk(const uint32 *in, uint32 *out, uint32 count,
+                         uint32 carry, bool inclusive);
+
+  /* Panics with what the daemon said if it isn't Ok. */
+  void checkDaemonStatus(DaemonStatus status) const;
+
+  CPUBackend mCpu;
+
+  DeviceScan mScan;
+  DeviceRadixSort mSort;
+
+  /* Only made with features.storage8Bit. */
+  DeviceScan mFlagScan;
+  Kernel mSelectScatter;
+  DeviceBuffer mFlags;
+  DeviceBuffer mSelected;
+
+  /* A chunk of elements and, mStagingFlags bytes in, a chunk of flags. */
+  StagingBuffer mStaging;
+  uint64 mStagingFlags;
+  DeviceBuffer mInput;
+  DeviceBuffer mOutput;
+  uint32 mChunkElements;
+
+  /* A chunk of input and, mSharedOutput bytes in, a chunk of output. */
+  DaemonClient mDaemon;
+  SharedMemory mShared;
+  uint64 mSharedHandle;
+  uint64 mSharedOutput;
+};
+
+} /* namespace vub */
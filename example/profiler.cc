@@ -0,0 +1,348 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include "helper.h"
+
+Profiler
+Profiler::make(const GPUDevice &gpu,
+               float32 timestampPeriod,
+               uint32 timestampValidBits,
+               bool pipelineStatistics,
+               uint32 maxScopes)
+{
+  Profiler ret = {};
+
+  /* Two timestamps per scope. */
+  VkQueryPoolCreateInfo timestampInfo = {
+    .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+    .queryType = VK_QUERY_TYPE_TIMESTAMP,
+    .queryCount = maxScopes * 2
+  };
+
+  VK_CHECK(vkCreateQueryPool(gpu.dev, &timestampInfo, nullptr,
+                             &ret.timestamps));
+
+  ret.statistics = VK_NULL_HANDLE;
+  if (pipelineStatistics)
+  {
+    VkQueryPoolCreateInfo statisticsInfo = {
+      .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+      .queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS,
+      .queryCount = maxScopes,
+      .pipelineStatistics =
+        VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT
+    };
+
+    VK_CHECK(vkCreateQueryPool(gpu.dev, &statisticsInfo, nullptr,
+                               &ret.statistics));
+  }
+
+  ret.maxScopes = maxScopes;
+  ret.timestampPeriod = timestampPeriod;
+  ret.timestampMask = timestampValidBits >= 64 ?
+    ~0ull : ((1ull << timestampValidBits) - 1);
+  ret.mDev = &gpu;
+
+  ret.mScopes.resize(maxScopes);
+  for (uint32 i = maxScopes; i > 0; --i)
+    ret.mFreeScopes.push_back(i - 1);
+
+  return ret;
+}
+
+Profiler::Profiler(Profiler &&other)
+  : timestamps(other.timestamps), statistics(other.statistics),
+    maxScopes(other.maxScopes), timestampPeriod(other.timestampPeriod),
+    timestampMask(other.timestampMask), events(std::move(other.events)),
+    mScopes(std::move(other.mScopes)),
+    mFreeScopes(std::move(other.mFreeScopes)),
+    mReplayable(std::move(other.mReplayable)),
+    mExecuted(std::move(other.mExecuted)),
+    mDepths(std::move(other.mDepths)), mBaseTimestamp(other.mBaseTimestamp),
+    mHasBase(other.mHasBase), mDev(other.mDev)
+{
+  other.mDev = nullptr;
+}
+
+Profiler::~Profiler()
+{
+  if (!mDev)
+    return;
+
+  vkDestroyQueryPool(mDev->dev, timestamps, nullptr);
+  if (statistics != VK_NULL_HANDLE)
+    vkDestroyQueryPool(mDev->dev, statistics, nullptr);
+}
+
+bool
+Profiler::isReplayable(VkCommandBuffer cmdbuf) const
+{
+  for (VkCommandBuffer replayable : mReplayable)
+    if (replayable == cmdbuf)
+      return true;
+
+  return false;
+}
+
+void
+Profiler::beginReplayable(VkCommandBuffer cmdbuf)
+{
+  for (uint32 i = 0; i < mScopes.size(); ++i)
+  {
+    if (mScopes[i].used && mScopes[i].cmdbuf == cmdbuf)
+    {
+      mScopes[i].used = false;
+      mFreeScopes.push_back(i);
+    }
+  }
+
+  if (!isReplayable(cmdbuf))
+    mReplayable.push_back(cmdbuf);
+}
+
+void
+Profiler::executed(VkCommandBuffer cmdbuf, VkCommandBuffer primary)
+{
+  mExecuted[primary].push_back(cmdbuf);
+}
+
+void
+Profiler::discardUnsubmitted(VkCommandBuffer cmdbuf)
+{
+  /* Replayable scopes are freed by beginReplayable instead. */
+  for (uint32 i = 0; i < mScopes.size(); ++i)
+  {
+    Scope &scope = mScopes[i];
+    if (scope.used && scope.cmdbuf == cmdbuf && !scope.pending &&
+        !scope.replayable)
+    {
+      scope.used = false;
+      mFreeScopes.push_back(i);
+    }
+  }
+
+  mExecuted.erase(cmdbuf);
+  mDepths.erase(cmdbuf);
+}
+
+void
+Profiler::submitted(VkCommandBuffer cmdbuf)
+{
+  std::vector<VkCommandBuffer> cmdbufs = { cmdbuf };
+
+  auto executed = mExecuted.find(cmdbuf);
+  if (executed != mExecuted.end())
+  {
+    cmdbufs.insert(cmdbufs.end(), executed->second.begin(),
+                   executed->second.end());
+    mExecuted.erase(executed);
+  }
+
+  for (Scope &scope : mScopes)
+  {
+    if (scope.used && std::find(cmdbufs.begin(), cmdbufs.end(),
+                                scope.cmdbuf) != cmdbufs.end())
+      scope.pending = true;
+  }
+}
+
+int32
+Profiler::begin(VkCommandBuffer cmdbuf, const char *name, uint64 bytes)
+{
+  uint32 &depth = mDepths[cmdbuf];
+  ++depth;
+
+  if (mFreeScopes.empty())
+    return -1;
+
+  uint32 index = mFreeScopes.back();
+  mFreeScopes.pop_back();
+
+  Scope &scope = mScopes[index];
+  scope.name = name;
+  scope.bytes = bytes;
+  scope.cmdbuf = cmdbuf;
+  scope.used = true;
+  scope.replayable = isReplayable(cmdbuf);
+  scope.pending = false;
+  scope.statistics = statistics != VK_NULL_HANDLE && depth == 1;
+
+  vkCmdResetQueryPool(cmdbuf, timestamps, index * 2, 2);
+
+  /* Written once all earlier commands are done, so the time spent waiting
+   * on them isn't counted. */
+  vkCmdWriteTimestamp(cmdbuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                      timestamps, index * 2);
+
+  if (scope.statistics)
+  {
+    vkCmdResetQueryPool(cmdbuf, statistics, index, 1);
+    vkCmdBeginQuery(cmdbuf, statistics, index, 0);
+  }
+
+  return (int32)index;
+}
+
+void
+Profiler::end(VkCommandBuffer cmdbuf, int32 index)
+{
+  /* Scopes which got no queries still count towards the depth. */
+  auto depth = mDepths.find(cmdbuf);
+  if (depth != mDepths.end() && --depth->second == 0)
+    mDepths.erase(depth);
+
+  if (index < 0)
+    return;
+
+  if (mScopes[index].statistics)
+    vkCmdEndQuery(cmdbuf, statistics, index);
+
+  vkCmdWriteTimestamp(cmdbuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                      timestamps, index * 2 + 1);
+}
+
+void
+Profiler::collect()
+{
+  std::vector<ProfileEvent> collected;
+  std::vector<uint64> starts;
+
+  for (uint32 i = 0; i < mScopes.size(); ++i)
+  {
+    Scope &scope = mScopes[i];
+    if (!scope.used || !scope.pending)
+      continue;
+
+    uint64 ticks[2];
+    VK_CHECK(vkGetQueryPoolResults(mDev->dev, timestamps, i * 2, 2,
+                                   sizeof(ticks), ticks, sizeof(uint64),
+                                   VK_QUERY_RESULT_64_BIT |
+                                   VK_QUERY_RESULT_WAIT_BIT));
+
+    uint64 invocations = 0;
+    if (scope.statistics)
+    {
+      VK_CHECK(vkGetQueryPoolResults(mDev->dev, statistics, i, 1,
+                                     sizeof(invocations), &invocations,
+                                     sizeof(uint64),
+                                     VK_QUERY_RESULT_64_BIT |
+                                     VK_QUERY_RESULT_WAIT_BIT));
+    }
+
+    uint64 start = ticks[0] & timestampMask;
+    uint64 end = ticks[1] & timestampMask;
+
+    /* The counter may have wrapped around. */
+    uint64 elapsed = (end - start) & timestampMask;
+
+    ProfileEvent event = {};
+    event.name = scope.name;
+    event.durationMs = (float64)elapsed * timestampPeriod * 1e-6;
+    event.bytes = scope.bytes;
+    event.gigabytesPerSecond = event.durationMs > 0.0 ?
+      (float64)event.bytes / (event.durationMs * 1e6) : 0.0;
+    event.computeInvocations = invocations;
+
+    collected.push_back(event);
+    starts.push_back(start);
+
+    /* A replayable scope's queries are written again by the next replay. */
+    scope.pending = false;
+    if (!scope.replayable)
+    {
+      scope.used = false;
+      mFreeScopes.push_back(i);
+    }
+  }
+
+  if (collected.empty())
+    return;
+
+  /* Queries aren't handed out in order, the timestamps are. */
+  std::vector<uint32> order(collected.size());
+  for (uint32 i = 0; i < order.size(); ++i)
+    order[i] = i;
+
+  std::sort(order.begin(), order.end(),
+            [&starts](uint32 a, uint32 b) { return starts[a] < starts[b]; });
+
+  if (!mHasBase)
+  {
+    mBaseTimestamp = starts[order[0]];
+    mHasBase = true;
+  }
+
+  for (uint32 i : order)
+  {
+    collected[i].startMs =
+      (float64)((starts[i] - mBaseTimestamp) & timestampMask) *
+      timestampPeriod * 1e-6;
+
+    events.push_back(std::move(collected[i]));
+  }
+}
+
+/* Names are chosen by the primitives, but quotes and backslashes would still
+ * break the JSON. */
+static void
+writeJSONString(FILE *file, const std::string &str)
+{
+  fputc('"', file);
+  for (char c : str)
+  {
+    if (c == '"' || c == '\\')
+      fputc('\\', file);
+    fputc(c, file);
+  }
+  fputc('"', file);
+}
+
+void
+Profiler::writeChromeTrace(const char *path) const
+{
+  FILE *file = fopen(path, "w");
+  if (!file)
+  {
+    printf("Failed to open %s\n", path);
+    return;
+  }
+
+  fprintf(file, "{\"traceEvents\":[\n");
+
+  for (uint32 i = 0; i < events.size(); ++i)
+  {
+    const ProfileEvent &event = events[i];
+
+    /* Times are in microseconds. */
+    fprintf(file, "  {\"name\":");
+    writeJSONString(file, event.name);
+    fprintf(file, ",\"cat\":\"vub\",\"ph\":\"X\",\"pid\":0,\"tid\":0,"
+                  "\"ts\":%.3f,\"dur\":%.3f,\"args\":{"
+                  "\"bytes\":%llu,\"GB/s\":%.3f,\"invocations\":%llu}}%s\n",
+            event.startMs * 1e3, event.durationMs * 1e3,
+            (unsigned long long)event.bytes, event.gigabytesPerSecond,
+            (unsigned long long)event.computeInvocations,
+            i + 1 < events.size() ? "," : "");
+  }
+
+  fprintf(file, "],\"displayTimeUnit\":\"ms\"}\n");
+  fclose(file);
+}
+
+ProfileScope::ProfileScope(const GPUDevice &gpu, VkCommandBuffer cmdbuf,
+                           const char *name, uint64 bytes)
+  : mDev(&gpu), mProfiler(gpu.profiler.get()), mCmdbuf(cmdbuf), mScope(-1)
+{
+  gpu.beginLabel(cmdbuf, name);
+
+  if (mProfiler)
+    mScope = mProfiler->begin(cmdbuf, name, bytes);
+}
+
+ProfileScope::~ProfileScope()
+{
+  if (mProfiler)
+    mProfiler->end(mCmdbuf, mScope);
+
+  mDev->endLabel(mCmdbuf);
+}
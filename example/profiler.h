@@ -0,0 +1,128 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "gpu-device.h"
+
+/* A profiled piece of GPU work, once its queries have been read back. */
+struct ProfileEvent {
+  std::string name;
+
+  /* Relative to the first event the profiler collected. */
+  float64 startMs;
+  float64 durationMs;
+
+  /* Bytes the work read and wrote (0 if unknown). */
+  uint64 bytes;
+  float64 gigabytesPerSecond;
+
+  /* Only with pipeline statistics, and only for scopes which aren't nested
+   * in another one (those count the nested work as well). */
+  uint64 computeInvocations;
+};
+
+/* Measures how long vub primitives run on the GPU. Made by
+ * GPUDevice::enableProfiling; primitives mark their commands with a
+ * ProfileScope.
+ *
+ * Every scope takes a pair of timestamp queries (and a pipeline statistics
+ * query if enabled) which are reset inside of the command buffer, so
+ * nothing has to happen before recording. Scopes only become pending once
+ * GPUDevice::submitCommandBuffer submits their command buffer (or the one
+ * a secondary Recording was executed into). Once the work is done, collect
+ * reads the queries of the pending scopes back into events and frees them
+ * for the next scopes.
+ * A Recording which is replayed reuses the queries of the scopes recorded
+ * into it, so collect has to run after each replay. Those are kept until
+ * the Recording is recorded again. */
+struct Profiler {
+  VkQueryPool timestamps;
+  VkQueryPool statistics;
+  uint32 maxScopes;
+
+  /* Nanoseconds per timestamp tick. */
+  float32 timestampPeriod;
+  uint64 timestampMask;
+
+  std::vector<ProfileEvent> events;
+
+  static Profiler make(const GPUDevice &gpu,
+                       float32 timestampPeriod,
+                       uint32 timestampValidBits,
+                       bool pipelineStatistics,
+                       uint32 maxScopes);
+
+  /* Returns the scope index, or -1 if all queries are taken. */
+  int32 begin(VkCommandBuffer cmdbuf, const char *name, uint64 bytes);
+  void end(VkCommandBuffer cmdbuf, int32 scope);
+
+  /* Waits for the queries of every scope which was submitted since the
+   * last collect. */
+  void collect();
+
+  /* Used by GPUDevice. Scopes of a command buffer which is recorded again
+   * or freed before it was submitted are dropped. */
+  void discardUnsubmitted(VkCommandBuffer cmdbuf);
+  void submitted(VkCommandBuffer cmdbuf);
+
+  /* Used by Recording. Scopes begun in cmdbuf from now on survive collect
+   * and are read back after every submit; the ones recorded into it before
+   * are freed. A secondary cmdbuf's scopes are pending once primary is
+   * submitted. */
+  void beginReplayable(VkCommandBuffer cmdbuf);
+  void executed(VkCommandBuffer cmdbuf, VkCommandBuffer primary);
+
+  /* Chrome's about://tracing (or Perfetto) format. */
+  void writeChromeTrace(const char *path) const;
+
+  Profiler() = default;
+  Profiler(Profiler &&other);
+  ~Profiler();
+
+private:
+  struct Scope {
+    std::string name;
+    uint64 bytes;
+    VkCommandBuffer cmdbuf;
+
+    bool used;
+    bool replayable;
+    /* Submitted since the last collect: its queries will have been
+     * written once the submission is done. */
+    bool pending;
+    /* Only the outermost scope of a command buffer, as statistics queries
+     * can't nest. */
+    bool statistics;
+  };
+
+  bool isReplayable(VkCommandBuffer cmdbuf) const;
+
+  /* Indexed by the scope's queries. */
+  std::vector<Scope> mScopes;
+  std::vector<uint32> mFreeScopes;
+  std::vector<VkCommandBuffer> mReplayable;
+  /* Secondary command buffers executed into each primary one since it was
+   * last submitted. */
+  std::unordered_map<VkCommandBuffer, std::vector<VkCommandBuffer>>
+    mExecuted;
+  std::unordered_map<VkCommandBuffer, uint32> mDepths;
+  uint64 mBaseTimestamp = 0;
+  bool mHasBase = false;
+  const GPUDevice *mDev = nullptr;
+};
+
+/* Profiles the commands recorded during its lifetime if the device has
+ * profiling enabled, and labels them with VK_EXT_debug_utils if that is
+ * enabled. */
+struct ProfileScope {
+  ProfileScope(const GPUDevice &gpu, VkCommandBuffer cmdbuf,
+               const char *name, uint64 bytes = 0);
+  ~ProfileScope();
+
+private:
+  const GPUDevice *mDev;
+  Profiler *mProfiler;
+  VkCommandBuffer mCmdbuf;
+  int32 mScope;
+};
@@ -0,0 +1,200 @@
+#include "recording.h"
+
+#include <cassert>
+#include "helper.h"
+#include "memory-tracker.h"
+#include "profiler.h"
+#include "prefix-sum.h"
+
+namespace vub {
+
+Recording
+Recording::make(const GPUDevice &gpu, uint32 maxCalls, VkCommandBufferLevel level)
+{
+  MemoryScope memoryScope(gpu, "Recording");
+
+  Recording ret = {};
+  ret.cmdbuf = gpu.makeCommandBuffer(level);
+  ret.params = gpu.makeStagingBuffer(maxCalls * SCAN_PARAMS_STRIDE,
+                                     VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  ret.level = level;
+  ret.maxCalls = maxCalls;
+  ret.callCount = 0;
+  ret.mDev = &gpu;
+  return ret;
+}
+
+void
+Recording::beginImpl()
+{
+  VkCommandBufferInheritanceInfo inheritanceInfo = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO
+  };
+
+  VkCommandBufferBeginInfo beginInfo = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .pInheritanceInfo = (level == VK_COMMAND_BUFFER_LEVEL_SECONDARY) ?
+                        &inheritanceInfo : nullptr
+  };
+
+  VK_CHECK(vkBeginCommandBuffer(cmdbuf, &beginInfo));
+}
+
+void
+Recording::begin()
+{
+  callCount = 0;
+  mCalls.clear();
+  mDirty = false;
+
+  /* The scopes of the calls are read back after every replay. */
+  if (mDev->profiler)
+    mDev->profiler->beginReplayable(cmdbuf);
+
+  beginImpl();
+}
+
+void
+Recording::end()
+{
+  mDev->endCommandBuffer(cmdbuf);
+}
+
+RecordedCall
+Recording::reserveCall(uint32 elementsPerGroup, uint32 maxElements,
+                       VkDescriptorSet set)
+{
+  assert(callCount < maxCalls);
+
+  RecordedCall call = {
+    .slot = callCount++,
+    .set = set,
+    .elementsPerGroup = elementsPerGroup,
+    .maxElements = maxElements
+  };
+
+  setNumElements(call, 0);
+
+  return call;
+}
+
+void
+Recording::recordCall(const RecordedCall &call,
+                      std::function<void(VkCommandBuffer)> record)
+{
+  assert(call.slot == mCalls.size());
+
+  record(cmdbuf);
+  mCalls.push_back(std::move(record));
+}
+
+VkDeviceSize
+Recording::paramsOffset(const RecordedCall &call) const
+{
+  return (VkDeviceSize)call.slot * SCAN_PARAMS_STRIDE;
+}
+
+VkDeviceAddress
+Recording::paramsAddress(const RecordedCall &call) const
+{
+  return params.addr + paramsOffset(call);
+}
+
+VkDescriptorBufferInfo
+Recording::paramsInfo(const RecordedCall &call) const
+{
+  return {
+    .buffer = params.hdl,
+    .offset = paramsOffset(call),
+    .range = sizeof(PrefixSum::ScanParams)
+  };
+}
+
+void
+Recording::setNumElements(const RecordedCall &call, uint32 numElements)
+{
+  /* More would overrun the primitive's scratch on the next replay. */
+  assert(numElements <= call.maxElements);
+
+  uint32 groupCount = (uint32)(((uint64)numElements + call.elementsPerGroup - 1) /
+                               call.elementsPerGroup);
+
+  PrefixSum::ScanParams *block = (PrefixSum::ScanParams *)
+    ((uint8 *)params.ptr + paramsOffset(call));
+
+  splitGroupCount(groupCount, block->groupCountX, block->groupCountY);
+  block->groupCountZ = 1;
+  block->numElements = numElements;
+}
+
+void
+Recording::setBuffers(const RecordedCall &call,
+                      const VkDescriptorBufferInfo *infos,
+                      uint32 count)
+{
+  mDev->writeStorageBufferDescriptors(call.set, infos, count);
+
+  /* Writing to a set that's already bound invalidates the command buffer
+   * unless the set is update-after-bind. */
+  if (!mDev->features.updateAfterBind && call.slot < mCalls.size())
+    mDirty = true;
+}
+
+void
+Recording::setAddresses(const RecordedCall &call,
+                        const VkDeviceAddress *addresses,
+                        uint32 count)
+{
+  assert(count <= SCAN_PARAMS_MAX_ADDRESSES);
+
+  VkDeviceAddress *dst = (VkDeviceAddress *)
+    ((uint8 *)params.ptr + paramsOffset(call) + sizeof(PrefixSum::ScanParams));
+
+  for (uint32 i = 0; i < count; ++i)
+    dst[i] = addresses[i];
+}
+
+void
+Recording::rerecord()
+{
+  vkResetCommandBuffer(cmdbuf, 0);
+
+  if (mDev->profiler)
+    mDev->profiler->beginReplayable(cmdbuf);
+
+  beginImpl();
+  for (auto &record : mCalls)
+    record(cmdbuf);
+  end();
+
+  mDirty = false;
+}
+
+void
+Recording::submit(VkFence fence)
+{
+  assert(level == VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+
+  if (mDirty)
+    rerecord();
+
+  mDev->submitCommandBuffer(cmdbuf, VK_NULL_HANDLE, VK_NULL_HANDLE,
+                            0, fence);
+}
+
+void
+Recording::execute(VkCommandBuffer primary)
+{
+  assert(level == VK_COMMAND_BUFFER_LEVEL_SECONDARY);
+
+  if (mDirty)
+    rerecord();
+
+  if (mDev->profiler)
+    mDev->profiler->executed(cmdbuf, primary);
+
+  vkCmdExecuteCommands(primary, 1, &cmdbuf);
+}
+
+} /* namespace vub */
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include "gpu-device.h"
+
+namespace vub {
+
+/* One primitive invocation inside a Recording. */
+struct RecordedCall {
+  uint32 slot;
+  VkDescriptorSet set;
+
+  /* Elements covered by one workgroup of the primitive. */
+  uint32 elementsPerGroup;
+
+  /* Most elements the primitive's scratch was made for. */
+  uint32 maxElements;
+};
+
+/* A command buffer which is recorded once and replayed many times.
+ *
+ * Every call recorded into it gets a parameter block (ScanParams) in a
+ * host-visible buffer. Calls are dispatched with vkCmdDispatchIndirect and
+ * the kernels read their element count from the same block, so sizes change
+ * between replays by writing to memory.
+ *
+ * With features.bufferDeviceAddress, the addresses of the buffers follow
+ * the ScanParams in the block and rebinding is a memory write as well.
+ * Otherwise buffers are rebound by rewriting the call's descriptor set. With
+ * features.updateAfterBind that doesn't invalidate the command buffer;
+ * without it, the recording re-records itself before the next submit.
+ *
+ * Primitives recorded into it must outlive it. */
+struct Recording {
+  VkCommandBuffer cmdbuf;
+  StagingBuffer params;
+  VkCommandBufferLevel level;
+  uint32 maxCalls;
+  uint32 callCount;
+
+  static Recording make(const GPUDevice &gpu, uint32 maxCalls,
+                        VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+
+  void begin();
+  void end();
+
+  /* Used by primitives. A call is reserved first so that its descriptor set
+   * can be written before it gets bound; recordCall then records it and
+   * keeps the function around in case the recording has to be redone. */
+  RecordedCall reserveCall(uint32 elementsPerGroup, uint32 maxElements,
+                           VkDescriptorSet set);
+  void recordCall(const RecordedCall &call,
+                  std::function<void(VkCommandBuffer)> record);
+  VkDeviceSize paramsOffset(const RecordedCall &call) const;
+  VkDeviceAddress paramsAddress(const RecordedCall &call) const;
+  VkDescriptorBufferInfo paramsInfo(const RecordedCall &call) const;
+
+  /* None of these may be called while a replay is still executing.
+   * numElements may be at most the call's maxElements. */
+  void setNumElements(const RecordedCall &call, uint32 numElements);
+  void setBuffers(const RecordedCall &call,
+                  const VkDescriptorBufferInfo *infos,
+                  uint32 count);
+  void setAddresses(const RecordedCall &call,
+                    const VkDeviceAddress *addresses,
+                    uint32 count);
+
+  /* Primary recordings are submitted on their own, secondary ones get
+   * executed inside the caller's command buffer. */
+  void submit(VkFence fence = VK_NULL_HANDLE);
+  void execute(VkCommandBuffer primary);
+
+private:
+  void beginImpl();
+  void rerecord();
+
+  std::vector<std::function<void(VkCommandBuffer)>> mCalls;
+  const GPUDevice *mDev = nullptr;
+  bool mDirty = false;
+};
+
+} /* namespace vub */
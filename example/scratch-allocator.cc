@@ -0,0 +1,132 @@
+#include "scratch-allocator.h"
+
+#include <cassert>
+#include <algorithm>
+#include "graph.h"
+#include "helper.h"
+#include "memory-tracker.h"
+
+/* Blocks of SCRATCH_MIN_BLOCK_SIZE << bin bytes. */
+static uint32
+binFor(uint64 size)
+{
+  uint32 bin = 0;
+  while ((ScratchAllocator::SCRATCH_MIN_BLOCK_SIZE << bin) < size)
+    ++bin;
+
+  return bin;
+}
+
+ScratchAllocator
+ScratchAllocator::make(const GPUDevice &gpu)
+{
+  ScratchAllocator ret = {};
+  ret.reservedBytes = 0;
+  ret.usedBytes = 0;
+  ret.mDev = &gpu;
+  return ret;
+}
+
+void
+ScratchAllocator::reclaim()
+{
+  if (mPending.empty())
+    return;
+
+  uint64 completed = mDev->completedValue();
+
+  uint32 count = 0;
+  for (; count < mPending.size() && mPending[count].value <= completed;
+       ++count)
+  {
+    uint32 index = mPending[count].index;
+    uint32 bin = mBlockBins[index];
+
+    mFreeLists[bin].push_back(index);
+    usedBytes -= SCRATCH_MIN_BLOCK_SIZE << bin;
+  }
+
+  mPending.erase(mPending.begin(), mPending.begin() + count);
+}
+
+ScratchBlock
+ScratchAllocator::allocate(uint64 size)
+{
+  assert(size > 0);
+
+  reclaim();
+
+  uint32 bin = binFor(size);
+  uint64 blockSize = SCRATCH_MIN_BLOCK_SIZE << bin;
+
+  if (bin >= mFreeLists.size())
+    mFreeLists.resize(bin + 1);
+
+  uint32 index;
+  if (!mFreeLists[bin].empty())
+  {
+    index = mFreeLists[bin].back();
+    mFreeLists[bin].pop_back();
+  }
+  else
+  {
+    MemoryScope memoryScope(*mDev, "ScratchAllocator");
+
+    index = (uint32)mBlocks.size();
+    mBlocks.push_back(mDev->makeDeviceBuffer(blockSize));
+    mBlockBins.push_back(bin);
+    reservedBytes += blockSize;
+  }
+
+  usedBytes += blockSize;
+
+  return { mBlocks[index].range(0, size), index };
+}
+
+void
+ScratchAllocator::free(const ScratchBlock &block)
+{
+  assert(block.index < mBlocks.size());
+
+  /* The submit which runs what was recorded with the block so far. */
+  mPending.push_back({ mDev->submittedValue() + 1, block.index });
+}
+
+ScratchScope::ScratchScope(const GPUDevice &gpu,
+                           const BufferRange &tempStorage,
+                           uint64 size)
+  : mAllocator(nullptr), mBlock(), mNode(vub::GraphNodeScope::current()),
+    mNodeUsed(0)
+{
+  if (tempStorage.size > 0)
+  {
+    assert(tempStorage.size >= size);
+    range = tempStorage;
+    mNode = nullptr;
+  }
+  else if (mNode && mNode->scratchUsed + size <= mNode->scratch.size)
+  {
+    /* Calls recorded inside of this one get the bytes after it. */
+    mNodeUsed = mNode->scratchUsed;
+    range = mNode->scratch.range(mNodeUsed, size);
+    uint64 end = roundUp<uint64>(mNodeUsed + size,
+                                 ScratchAllocator::SCRATCH_MIN_BLOCK_SIZE);
+    mNode->scratchUsed = std::min(end, mNode->scratch.size);
+  }
+  else
+  {
+    mNode = nullptr;
+    mAllocator = &gpu.scratchAllocator();
+    mBlock = mAllocator->allocate(size);
+    range = mBlock.range;
+  }
+}
+
+ScratchScope::~ScratchScope()
+{
+  if (mAllocator)
+    mAllocator->free(mBlock);
+
+  if (mNode)
+    mNode->scratchUsed = mNodeUsed;
+}
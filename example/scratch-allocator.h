@@ -0,0 +1,84 @@
+#pragma once
+
+#include <vector>
+#include "gpu-device.h"
+
+/* Scratch memory handed out by a ScratchAllocator. range covers the size
+ * which was asked for; the block behind it may be larger. */
+struct ScratchBlock {
+  BufferRange range;
+  uint32 index;
+};
+
+/* Caching allocator for the scratch memory of primitives, ordered by the
+ * queue like cudaMallocAsync. Made by GPUDevice::scratchAllocator.
+ *
+ * Blocks are powers of two, from SCRATCH_MIN_BLOCK_SIZE up, with a free list
+ * per size. A freed block isn't reused right away: it goes back to its free
+ * list once the queue timeline reaches the value of the next submit (see
+ * GPUDevice::submittedValue), which is the one running the commands that
+ * use it. So free a block right after recording those commands, and submit
+ * them with GPUDevice::submitCommandBuffer. Command buffers which are
+ * submitted more than once need scratch of their own. Without timeline
+ * semaphores, the blocks come back on GPUDevice::waitIdle, or when
+ * GPUDevice::waitForFence sees the fence of their submit (or a later
+ * one) signalled.
+ *
+ * Memory is never given back to the device, so the cache settles at the
+ * most scratch that was ever in flight at once. */
+struct ScratchAllocator {
+  static constexpr uint64 SCRATCH_MIN_BLOCK_SIZE = 256;
+
+  /* Device memory of every block, and of the blocks which are handed out
+   * or waiting for their submit to finish. */
+  uint64 reservedBytes;
+  uint64 usedBytes;
+
+  static ScratchAllocator make(const GPUDevice &gpu);
+
+  ScratchBlock allocate(uint64 size);
+  void free(const ScratchBlock &block);
+
+private:
+  struct PendingFree {
+    /* Timeline value after which the block is free. */
+    uint64 value;
+    uint32 index;
+  };
+
+  /* Moves the blocks whose submits have finished back to the free
+   * lists. */
+  void reclaim();
+
+  std::vector<DeviceBuffer> mBlocks;
+  std::vector<uint32> mBlockBins;
+  std::vector<std::vector<uint32>> mFreeLists;
+
+  /* In the order of their values. */
+  std::vector<PendingFree> mPending;
+
+  const GPUDevice *mDev = nullptr;
+};
+
+namespace vub {
+struct GraphNodeScope;
+}
+
+/* The temp storage of a primitive call: what the caller passed if it has a
+ * size, the scratch of the Graph node being recorded if it has room left,
+ * and otherwise a block of the device's ScratchAllocator. The last two are
+ * given back at the end of the scope. */
+struct ScratchScope {
+  BufferRange range;
+
+  ScratchScope(const GPUDevice &gpu, const BufferRange &tempStorage,
+               uint64 size);
+  ~ScratchScope();
+
+private:
+  ScratchAllocator *mAllocator;
+  ScratchBlock mBlock;
+
+  vub::GraphNodeScope *mNode;
+  uint64 mNodeUsed;
+};
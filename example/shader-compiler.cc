@@ -0,0 +1,384 @@
+#include "shader-compiler.h"
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <algorithm>
+#include <filesystem>
+#include <unistd.h>
+#include "helper.h"
+
+#ifdef VUB_SHADERC
+#include <shaderc/shaderc.hpp>
+#endif
+
+static const uint32 SPIRV_MAGIC = 0x07230203;
+
+static bool
+readText(const std::string &path, std::string &text)
+{
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file)
+    return false;
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  text.resize(size);
+  size_t read = fread(text.data(), 1, text.size(), file);
+  fclose(file);
+
+  return read == text.size();
+}
+
+#ifdef VUB_SHADERC
+
+/* What GetInclude hands to shaderc, kept alive until ReleaseInclude. */
+struct IncludedFile {
+  shaderc_include_result result;
+  std::string name;
+  std::string content;
+};
+
+/* Finds #include "file" in the include directory, like -I of glslc. */
+struct IncludeDirIncluder : shaderc::CompileOptions::IncluderInterface {
+  shaderc_include_result *GetInclude(const char *requestedSource,
+                                     shaderc_include_type type,
+                                     const char *requestingSource,
+                                     size_t includeDepth) override
+  {
+    IncludedFile *file = new IncludedFile;
+    std::string path = std::string(VUB_INCLUDE_DIR) + "/" + requestedSource;
+
+    /* An empty name tells shaderc that content is an error message. */
+    if (readText(path, file->content))
+      file->name = path;
+    else
+      file->content = "Can't open " + path;
+
+    file->result = {
+      .source_name = file->name.c_str(),
+      .source_name_length = file->name.size(),
+      .content = file->content.c_str(),
+      .content_length = file->content.size(),
+      .user_data = file
+    };
+
+    return &file->result;
+  }
+
+  void ReleaseInclude(shaderc_include_result *data) override
+  {
+    delete (IncludedFile *)data->user_data;
+  }
+};
+
+#endif
+
+const EmbeddedShader *
+findEmbeddedShader(const char *name)
+{
+  for (const EmbeddedShader *shader = gEmbeddedShaders; shader->name;
+       ++shader)
+  {
+    if (shader->code && !strcmp(shader->name, name))
+      return shader;
+  }
+
+  return nullptr;
+}
+
+const EmbeddedShader *
+findEmbeddedVariant(const std::string &variant)
+{
+  const EmbeddedShader *shader = findBuiltVariant(variant);
+  return shader && shader->code ? shader : nullptr;
+}
+
+const EmbeddedShader *
+findBuiltVariant(const std::string &variant)
+{
+  for (const EmbeddedShader *shader = gEmbeddedShaders; shader->name;
+       ++shader)
+  {
+    if (variant == shader->variant)
+      return shader;
+  }
+
+  return nullptr;
+}
+
+std::string
+getDefaultCacheDir()
+{
+  if (const char *dir = getenv("VUB_SHADER_CACHE_DIR"))
+    return dir;
+
+  if (const char *dir = getenv("XDG_CACHE_HOME"))
+    return std::string(dir) + "/vub";
+
+  if (const char *home = getenv("HOME"))
+    return std::string(home) + "/.cache/vub";
+
+  return "";
+}
+
+ShaderCompiler
+ShaderCompiler::make()
+{
+  ShaderCompiler ret = {};
+  ret.cacheDir = getDefaultCacheDir();
+  ret.compiledCount = 0;
+  ret.diskHitCount = 0;
+  ret.embeddedHitCount = 0;
+  ret.shaderDirHitCount = 0;
+  return ret;
+}
+
+bool
+ShaderCompiler::isAvailable()
+{
+#ifdef VUB_SHADERC
+  return true;
+#else
+  return false;
+#endif
+}
+
+std::string
+ShaderCompiler::variantKey(const char *sourceName,
+                           const std::vector<ShaderDefine> &defines)
+{
+  std::vector<std::string> arguments;
+  for (const ShaderDefine &define : defines)
+  {
+    arguments.push_back("-D" + define.name);
+    if (!define.value.empty())
+      arguments.back() += "=" + define.value;
+  }
+
+  /* The same order as list(SORT) of add_vub_shader. */
+  std::sort(arguments.begin(), arguments.end());
+
+  std::string key = sourceName;
+  for (const std::string &argument : arguments)
+    key += " " + argument;
+
+  return key;
+}
+
+/* FNV-1a. */
+static uint64
+hashBytes(uint64 hash, const std::string &bytes)
+{
+  for (char byte : bytes)
+  {
+    hash ^= (uint8)byte;
+    hash *= 0x100000001B3ull;
+  }
+
+  return hash;
+}
+
+/* Hashes a file of the include directory, then every file it includes
+ * which wasn't hashed yet. */
+static uint64
+hashSource(uint64 hash, const std::string &name,
+           std::vector<std::string> &hashed)
+{
+  if (std::find(hashed.begin(), hashed.end(), name) != hashed.end())
+    return hash;
+
+  hashed.push_back(name);
+
+  /* The compiler will say what is missing. */
+  std::string text;
+  if (!readText(std::string(VUB_INCLUDE_DIR) + "/" + name, text))
+    return hash;
+
+  hash = hashBytes(hashBytes(hash, name), text);
+
+  /* The kernels only use #include "file". Commented out ones are hashed
+   * too, which at worst compiles a variant again. */
+  static const char DIRECTIVE[] = "#include \"";
+
+  size_t at = 0;
+  while ((at = text.find(DIRECTIVE, at)) != std::string::npos)
+  {
+    at += sizeof(DIRECTIVE) - 1;
+
+    size_t end = text.find('"', at);
+    if (end == std::string::npos)
+      break;
+
+    hash = hashSource(hash, text.substr(at, end - at), hashed);
+  }
+
+  return hash;
+}
+
+/* Everything which changes the SPIR-V of a variant besides its sources.
+ * shaderc_get_spv_version is only the SPIR-V version it targets, which
+ * stays the same across most compiler updates, so the build says which
+ * libshaderc it linked (VUB_SHADERC_IDENTITY). */
+static std::string
+compilerIdentity()
+{
+#ifdef VUB_SHADERC
+  unsigned int version, revision;
+  shaderc_get_spv_version(&version, &revision);
+
+  return std::string("shaderc ") + VUB_SHADERC_IDENTITY + " spv " +
+         std::to_string(version) + "." + std::to_string(revision) +
+         " vulkan1.1 performance";
+#else
+  return "";
+#endif
+}
+
+std::string
+ShaderCompiler::cachePath(const char *sourceName,
+                          const std::string &variant) const
+{
+  std::vector<std::string> hashed;
+
+  uint64 hash = 0xCBF29CE484222325ull;
+  hash = hashBytes(hash, variant);
+  hash = hashBytes(hash, compilerIdentity());
+  hash = hashSource(hash, sourceName, hashed);
+
+  char name[17];
+  snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+
+  return cacheDir + "/" + sourceName + "-" + name + ".spv";
+}
+
+bool
+ShaderCompiler::readCache(const std::string &path,
+                          std::vector<uint32> &code) const
+{
+  std::string bytes;
+  if (!readText(path, bytes))
+    return false;
+
+  /* Anything but SPIR-V (a write which didn't finish, say) is compiled
+   * again. */
+  if (bytes.size() < sizeof(uint32) || bytes.size() % sizeof(uint32) != 0)
+    return false;
+
+  code.resize(bytes.size() / sizeof(uint32));
+  memcpy(code.data(), bytes.data(), bytes.size());
+
+  return code[0] == SPIRV_MAGIC;
+}
+
+void
+ShaderCompiler::writeCache(const std::string &path,
+                           const std::vector<uint32> &code) const
+{
+  /* The cache is only there to save time, so failing to write it isn't an
+   * error. */
+  std::error_code error;
+  std::filesystem::create_directories(cacheDir, error);
+
+  /* Other processes may look for the same variant: they only ever see
+   * whole files. */
+  std::string temporary = path + "." + std::to_string(getpid()) + ".tmp";
+
+  FILE *file = fopen(temporary.c_str(), "wb");
+  if (!file)
+    return;
+
+  size_t written = fwrite(code.data(), sizeof(uint32), code.size(), file);
+  bool closed = fclose(file) == 0;
+
+  if (written != code.size() || !closed ||
+      rename(temporary.c_str(), path.c_str()) != 0)
+    remove(temporary.c_str());
+}
+
+const std::vector<uint32> &
+ShaderCompiler::compile(const char *sourceName,
+                        const std::vector<ShaderDefine> &defines)
+{
+  std::string variant = variantKey(sourceName, defines);
+
+  auto known = mVariants.find(variant);
+  if (known != mVariants.end())
+    return known->second;
+
+  if (const EmbeddedShader *built = findBuiltVariant(variant))
+  {
+    if (built->code)
+    {
+      embeddedHitCount++;
+
+      return mVariants[variant] = std::vector<uint32>(
+        built->code, built->code + built->codeSize / sizeof(uint32));
+    }
+
+    /* Where makeComputePipeline finds it too. If it's gone, it can still
+     * be compiled. */
+    std::vector<uint32> code;
+    if (readCache(std::string(VUB_SHADER_DIR) + "/" + built->name + ".spv",
+                  code))
+    {
+      shaderDirHitCount++;
+      return mVariants[variant] = std::move(code);
+    }
+  }
+
+#ifdef VUB_SHADERC
+  std::string cached = cacheDir.empty() ?
+    std::string() : cachePath(sourceName, variant);
+
+  std::vector<uint32> code;
+  if (!cached.empty() && readCache(cached, code))
+  {
+    diskHitCount++;
+    return mVariants[variant] = std::move(code);
+  }
+
+  std::string path = std::string(VUB_INCLUDE_DIR) + "/" + sourceName;
+
+  std::string source;
+  if (!readText(path, source))
+  {
+    printf("Failed to open %s\n", path.c_str());
+    PANIC_AND_EXIT("Missing shader source");
+  }
+
+  shaderc::CompileOptions options;
+  options.SetTargetEnvironment(shaderc_target_env_vulkan,
+                               shaderc_env_version_vulkan_1_1);
+  options.SetOptimizationLevel(shaderc_optimization_level_performance);
+  options.SetIncluder(std::make_unique<IncludeDirIncluder>());
+
+  for (const ShaderDefine &define : defines)
+    options.AddMacroDefinition(define.name, define.value);
+
+  shaderc::Compiler compiler;
+  shaderc::SpvCompilationResult result = compiler.CompileGlslToSpv(
+    source, shaderc_glsl_compute_shader, path.c_str(), options);
+
+  if (result.GetCompilationStatus() != shaderc_compilation_status_success)
+  {
+    printf("%s", result.GetErrorMessage().c_str());
+    printf("Failed to compile %s\n", variant.c_str());
+    PANIC_AND_EXIT("Failed to compile shader variant");
+  }
+
+  compiledCount++;
+
+  code.assign(result.begin(), result.end());
+  if (!cached.empty())
+    writeCache(cached, code);
+
+  return mVariants[variant] = std::move(code);
+#else
+  printf("%s isn't a kernel of the build and can't be compiled at "
+         "runtime\n", variant.c_str());
+  PANIC_AND_EXIT("vub was built without libshaderc");
+#endif
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "types.h"
+
+/* A define of a kernel variant, like -Dname=value of glslc. name may be
+ * that of a function-like macro, as in "SCAN_INPUT_TRANSFORM(x, i)". */
+struct ShaderDefine {
+  std::string name;
+  std::string value;
+};
+
+/* A kernel the build compiled, one per add_vub_shader. Its SPIR-V is put
+ * into the library with VUB_EMBED_SHADERS, and is in VUB_SHADER_DIR
+ * without. */
+struct EmbeddedShader {
+  /* NAME of add_vub_shader, as given to makeComputePipeline. */
+  const char *name;
+  /* ShaderCompiler::variantKey of the source and defines it was built
+   * from. */
+  const char *variant;
+  /* Null unless embedded. */
+  const uint32 *code;
+  uint32 codeSize;
+};
+
+/* Generated by embed-shaders.cmake, ends with an entry of null names. */
+extern const EmbeddedShader gEmbeddedShaders[];
+
+/* Null if the build didn't embed a shader of that name. */
+const EmbeddedShader *findEmbeddedShader(const char *name);
+const EmbeddedShader *findEmbeddedVariant(const std::string &variant);
+
+/* Null if the build didn't compile the variant, whether embedded or not. */
+const EmbeddedShader *findBuiltVariant(const std::string &variant);
+
+/* Where vub keeps what it compiled for the next process: the SPIR-V of
+ * variants and the pipeline cache of the device. VUB_SHADER_CACHE_DIR of
+ * the environment if set, $XDG_CACHE_HOME/vub or ~/.cache/vub if not.
+ * Empty if none of them are set. */
+std::string getDefaultCacheDir();
+
+/* Compiles variants of the kernels in the include directory at runtime,
+ * for those which depend on code of the caller (see ScanFusion), or on
+ * defines no build compiled them with. Made along with the GPUDevice on
+ * first use, see GPUDevice::shaderCompiler.
+ *
+ * Variants are looked for, in order:
+ *  - in memory, for those this process already asked for;
+ *  - among the kernels of the build, which is how a binary avoids
+ *    compiling anything when it first uses a kernel: list the variants it
+ *    needs with add_vub_shader. They are embedded with VUB_EMBED_SHADERS
+ *    and read from VUB_SHADER_DIR without;
+ *  - in cacheDir, under a hash of the variant key, of the source and
+ *    every file it includes, and of the compiler. Editing a kernel or
+ *    updating the compiler therefore never loads stale SPIR-V;
+ *  - and are compiled last, with libshaderc, which comes with the Vulkan
+ *    SDK and is used if the build finds it (VUB_SHADERC). The SPIR-V is
+ *    then written to cacheDir for the next run.
+ * Without libshaderc, variants which aren't embedded can't be made. */
+struct ShaderCompiler {
+  /* getDefaultCacheDir. Empty turns the disk cache off. */
+  std::string cacheDir;
+
+  /* Where the variants this process asked for came from. */
+  uint32 compiledCount;
+  uint32 diskHitCount;
+  uint32 embeddedHitCount;
+  uint32 shaderDirHitCount;
+
+  static ShaderCompiler make();
+  static bool isAvailable();
+
+  /* The source followed by its defines as glslc arguments, sorted, like
+   * "prefix-sum.comp -DSCAN_INPUT_COUNTING -DVUB_BUFFER_REFERENCES". This
+   * is what add_vub_shader embeds its shaders under, so the order the
+   * defines are given in doesn't matter. */
+  static std::string variantKey(const char *sourceName,
+                                const std::vector<ShaderDefine> &defines);
+
+  /* sourceName is a file of the include directory, like "prefix-sum.comp",
+   * compiled for Vulkan 1.1 like the kernels of the build. Panics with the
+   * messages of the compiler if the variant doesn't compile. The SPIR-V
+   * stays valid for as long as the compiler is around. */
+  const std::vector<uint32> &compile(const char *sourceName,
+                                     const std::vector<ShaderDefine> &defines);
+
+private:
+  std::string cachePath(const char *sourceName,
+                        const std::string &variant) const;
+  bool readCache(const std::string &path, std::vector<uint32> &code) const;
+  void writeCache(const std::string &path,
+                  const std::vector<uint32> &code) const;
+
+  /* By variant key. */
+  std::unordered_map<std::string, std::vector<uint32>> mVariants;
+};
@@ -0,0 +1,206 @@
+#include "thread-pool.h"
+
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include <algorithm>
+
+namespace vub {
+
+struct Range {
+  uint64 begin;
+  uint64 end;
+};
+
+struct WorkerQueue {
+  std::mutex lock;
+  std::deque<Range> ranges;
+};
+
+struct ThreadPool::Impl {
+  std::vector<std::thread> threads;
+  std::unique_ptr<WorkerQueue[]> queues;
+  uint32 workerCount;
+
+  /* Guards generation and quit, which wake the workers up. */
+  std::mutex lock;
+  std::condition_variable wake;
+  std::condition_variable done;
+  uint64 generation = 0;
+  bool quit = false;
+
+  const std::function<void(uint64, uint64, uint32)> *fn = nullptr;
+  std::atomic<uint64> remaining = 0;
+
+  bool popLocal(uint32 worker, Range &range);
+  bool steal(uint32 worker, Range &range);
+  void runRanges(uint32 worker);
+  void workerLoop(uint32 worker);
+};
+
+bool
+ThreadPool::Impl::popLocal(uint32 worker, Range &range)
+{
+  WorkerQueue &queue = queues[worker];
+  std::lock_guard<std::mutex> guard(queue.lock);
+
+  if (queue.ranges.empty())
+    return false;
+
+  range = queue.ranges.back();
+  queue.ranges.pop_back();
+  return true;
+}
+
+bool
+ThreadPool::Impl::steal(uint32 worker, Range &range)
+{
+  for (uint32 i = 1; i < workerCount; ++i)
+  {
+    WorkerQueue &victim = queues[(worker + i) % workerCount];
+    std::lock_guard<std::mutex> guard(victim.lock);
+
+    /* The front is furthest from what the victim works on now. */
+    if (!victim.ranges.empty())
+    {
+      range = victim.ranges.front();
+      victim.ranges.pop_front();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void
+ThreadPool::Impl::runRanges(uint32 worker)
+{
+  Range range;
+  while (popLocal(worker, range) || steal(worker, range))
+  {
+    (*fn)(range.begin, range.end, worker);
+
+    if (remaining.fetch_sub(1) == 1)
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      done.notify_all();
+    }
+  }
+}
+
+void
+ThreadPool::Impl::workerLoop(uint32 worker)
+{
+  uint64 seen = 0;
+
+  for (;;)
+  {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [&] { return quit || generation != seen; });
+
+      if (quit)
+        return;
+
+      seen = generation;
+    }
+
+    runRanges(worker);
+  }
+}
+
+ThreadPool
+ThreadPool::make(uint32 workerCount)
+{
+  if (workerCount == 0)
+    workerCount = std::max(std::thread::hardware_concurrency(), 1u);
+
+  ThreadPool ret = {};
+  ret.impl = std::make_unique<Impl>();
+  ret.workerCount = workerCount;
+
+  Impl *impl = ret.impl.get();
+  impl->workerCount = workerCount;
+  impl->queues = std::make_unique<WorkerQueue[]>(workerCount);
+
+  /* Worker 0 is whoever calls parallelFor. */
+  for (uint32 i = 1; i < workerCount; ++i)
+    impl->threads.emplace_back([impl, i] { impl->workerLoop(i); });
+
+  return ret;
+}
+
+void
+ThreadPool::parallelFor(uint64 count, uint64 grain,
+                        const std::function<void(uint64, uint64, uint32)> &fn)
+{
+  if (count == 0)
+    return;
+
+  grain = std::max<uint64>(grain, 1);
+  uint64 rangeCount = (count + grain - 1) / grain;
+
+  if (workerCount == 1 || rangeCount == 1)
+  {
+    for (uint64 begin = 0; begin < count; begin += grain)
+      fn(begin, std::min(begin + grain, count), 0);
+
+    return;
+  }
+
+  impl->fn = &fn;
+  impl->remaining = rangeCount;
+
+  /* Neighbouring ranges go to the same worker, which only gives them up if
+   * it falls behind. */
+  for (uint32 worker = 0; worker < workerCount; ++worker)
+  {
+    uint64 first = rangeCount * worker / workerCount;
+    uint64 last = rangeCount * (worker + 1) / workerCount;
+
+    WorkerQueue &queue = impl->queues[worker];
+    std::lock_guard<std::mutex> guard(queue.lock);
+
+    /* Reversed, since the owner pops from the back. */
+    for (uint64 r = last; r > first; --r)
+    {
+      uint64 begin = (r - 1) * grain;
+      queue.ranges.push_back({ begin, std::min(begin + grain, count) });
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(impl->lock);
+    ++impl->generation;
+  }
+  impl->wake.notify_all();
+
+  impl->runRanges(0);
+
+  std::unique_lock<std::mutex> guard(impl->lock);
+  impl->done.wait(guard, [&] { return impl->remaining == 0; });
+}
+
+ThreadPool::ThreadPool() = default;
+ThreadPool::ThreadPool(ThreadPool &&other) = default;
+ThreadPool &ThreadPool::operator=(ThreadPool &&other) = default;
+
+ThreadPool::~ThreadPool()
+{
+  if (!impl)
+    return;
+
+  {
+    std::lock_guard<std::mutex> guard(impl->lock);
+    impl->quit = true;
+  }
+  impl->wake.notify_all();
+
+  for (std::thread &thread : impl->threads)
+    thread.join();
+}
+
+} /* namespace vub */
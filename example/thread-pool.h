@@ -0,0 +1,37 @@
+#pragma once
+
+#include <memory>
+#include <functional>
+#include "types.h"
+
+namespace vub {
+
+/* Runs loops over all cores for the CPU backend.
+ *
+ * Every worker has its own queue of ranges. A worker takes ranges from the
+ * back of its own queue and steals from the front of the others when it
+ * runs out, so uneven ranges (or workers the OS doesn't schedule) even out.
+ * The thread calling parallelFor is one of the workers. */
+struct ThreadPool {
+  struct Impl;
+
+  std::unique_ptr<Impl> impl;
+  uint32 workerCount;
+
+  /* 0 workers means one per hardware thread. */
+  static ThreadPool make(uint32 workerCount = 0);
+
+  /* Calls fn(begin, end, worker) on ranges of at most grain of [0, count)
+   * and returns once all of them returned. worker is below workerCount and
+   * no two calls running at the same time get the same one, so it can index
+   * per worker scratch. Calls to parallelFor mustn't nest. */
+  void parallelFor(uint64 count, uint64 grain,
+                   const std::function<void(uint64, uint64, uint32)> &fn);
+
+  ThreadPool();
+  ThreadPool(ThreadPool &&other);
+  ThreadPool &operator=(ThreadPool &&other);
+  ~ThreadPool();
+};
+
+} /* namespace vub */
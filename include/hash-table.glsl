@@ -0,0 +1,31 @@
+/* Key type of the hash table kernels. Included after hash-table.h. */
+
+#ifdef HASH_KEY64
+#define HASH_KEY uvec2
+#define HASH_KEY_WORDS HASH_KEY64_WORDS
+#else
+#define HASH_KEY uint
+#define HASH_KEY_WORDS HASH_KEY32_WORDS
+#endif
+
+/* Finalizer of MurmurHash3, which is enough to spread out keys which are
+ * close to each other (like row IDs). */
+uint mixBits(uint h)
+{
+  h ^= h >> 16;
+  h *= 0x85EBCA6B;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35;
+  h ^= h >> 16;
+  return h;
+}
+
+uint hashKey(uint key)
+{
+  return mixBits(key);
+}
+
+uint hashKey(uvec2 key)
+{
+  return mixBits(key.x ^ mixBits(key.y));
+}
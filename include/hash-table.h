@@ -0,0 +1,70 @@
+#ifndef _HASH_TABLE_H_
+#define _HASH_TABLE_H_
+
+#if defined(__cplusplus)
+namespace HashTable {
+typedef unsigned int uint;
+#endif
+
+/* Push constant block of hash-table.comp and hash-table-extract.comp. */
+struct HashTablePushConstant {
+  /* SCAN_INDIRECT_COUNT to read the count from the parameter block (not
+   * for extracts). */
+  uint numElements;
+
+  /* The capacity is a power of two. */
+  uint capacityMask;
+  uint op;
+  uint flags;
+};
+
+/* Sits at the start of the table's buffer. Begins like a ScanParams block
+ * so the entry count can be handed to other primitives as it is. */
+struct HashTableHeader {
+  /* Dispatch of one thread per entry of the last extract. */
+  uint groupCountX;
+  uint groupCountY;
+  uint groupCountZ;
+
+  /* Number of entries written by the last extract. */
+  uint count;
+
+  /* Set when an insert found no free slot. */
+  uint overflow;
+  uint pad[3];
+};
+
+/* What hash-table.comp does with every input key. */
+#define HASH_OP_INSERT 0
+#define HASH_OP_PROBE 1
+#define HASH_OP_SUM 2
+#define HASH_OP_MIN 3
+#define HASH_OP_MAX 4
+#define HASH_OP_COUNT 5
+
+/* A probe which doesn't find its key writes this. */
+#define HASH_NOT_FOUND 0xFFFFFFFF
+
+/* A free slot has every word of its key set to this, which is why 32-bit
+ * tables can't hold the key 0xFFFFFFFF. 64-bit keys have a state word in
+ * front of them which goes from empty through busy (while the key is being
+ * written) to full, so any key can be stored. */
+#define HASH_EMPTY 0xFFFFFFFF
+#define HASH_BUSY 0
+#define HASH_FULL 1
+
+/* Words of a slot's key: the key, or the state and the two halves. */
+#define HASH_KEY32_WORDS 1
+#define HASH_KEY64_WORDS 3
+
+#define HASH_THREADS_PER_BLOCK 256
+
+/* The regions of the table's buffer start at multiples of this, which
+ * satisfies minStorageBufferOffsetAlignment. */
+#define HASH_REGION_ALIGNMENT 256
+
+#if defined(__cplusplus)
+} /* namespace HashTable */
+#endif
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef _IMAGE_REDUCE_H_
+#define _IMAGE_REDUCE_H_
+
+#if defined(__cplusplus)
+namespace ImageReduce {
+typedef unsigned int uint;
+#endif
+
+/* What a texel of the pyramid holds about the elements it covers. */
+struct ImageStats {
+  float minValue;
+  float maxValue;
+  float sum;
+};
+
+/* Written by the last workgroup of image-reduce.comp. */
+struct ImageReduceResult {
+  /* Workgroups which are done, which is how the last one finds out it is.
+   * Has to be 0 before every call. */
+  uint finishedGroups;
+
+  /* Elements, width x height. */
+  uint count;
+  float mean;
+  uint pad;
+
+  ImageStats total;
+};
+
+/* Push constant block of image-reduce.comp. */
+struct ImageReducePushConstant {
+  uint width;
+  uint height;
+
+  /* Elements from the start of one row to the next. */
+  uint pitch;
+  uint flags;
+
+  /* binCount bins evenly spread over [histogramMin, histogramMax], which
+   * isn't empty. Values out of that range go to the first or last bin, and
+   * NaNs to the first. No histogram with a binCount of 0. */
+  uint binCount;
+  float histogramMin;
+  float histogramMax;
+};
+
+/* Elements are uints instead of floats. */
+#define IMAGE_REDUCE_FLAG_UINT 0x1
+/* Values are binned by their log2, which is what auto exposure wants. */
+#define IMAGE_REDUCE_FLAG_LOG2_HISTOGRAM 0x2
+
+#define IMAGE_REDUCE_MAX_BINS 256
+
+/* Every workgroup takes a tile of 32x32 elements through the first 5
+ * levels of the pyramid in shared memory (one thread per texel of level
+ * 1), the last one to finish reduces the rest. */
+#define IMAGE_REDUCE_TILE 32
+#define IMAGE_REDUCE_TILE_LEVELS 5
+#define IMAGE_REDUCE_THREADS 16
+#define IMAGE_REDUCE_THREADS_PER_BLOCK \
+  (IMAGE_REDUCE_THREADS * IMAGE_REDUCE_THREADS)
+
+#if defined(__cplusplus)
+} /* namespace ImageReduce */
+#endif
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef _IMAGE_SCAN_H_
+#define _IMAGE_SCAN_H_
+
+#if defined(__cplusplus)
+namespace ImageScan {
+typedef unsigned int uint;
+#endif
+
+/* Push constant block of image-scan.comp, which scans the rows of a width
+ * x height array into the columns of the output. */
+struct ImageScanPushConstant {
+  uint width;
+  uint height;
+
+  /* Elements from the start of one row to the next. */
+  uint inPitch;
+  uint outPitch;
+
+  /* One of IMAGE_SCAN_PASS_*. */
+  uint pass;
+};
+
+/* Sums the part of every row which falls into every tile. */
+#define IMAGE_SCAN_PASS_REDUCE 0
+/* Exclusive scan of those sums along every row, in place. */
+#define IMAGE_SCAN_PASS_CARRY 1
+/* Scans the rows of every tile from the scanned sums and writes them
+ * transposed. */
+#define IMAGE_SCAN_PASS_DOWNSWEEP 2
+
+/* Tiles are IMAGE_SCAN_TILE x IMAGE_SCAN_TILE elements, one per
+ * workgroup. The carry pass has a thread per row instead. */
+#define IMAGE_SCAN_TILE 32
+#define IMAGE_SCAN_THREADS_X 32
+#define IMAGE_SCAN_THREADS_Y 8
+#define IMAGE_SCAN_THREADS_PER_BLOCK \
+  (IMAGE_SCAN_THREADS_X * IMAGE_SCAN_THREADS_Y)
+
+#if defined(__cplusplus)
+} /* namespace ImageScan */
+#endif
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef _INDIRECT_PARAMS_H_
+#define _INDIRECT_PARAMS_H_
+
+#if defined(__cplusplus)
+namespace IndirectParams {
+typedef unsigned int uint;
+#endif
+
+/* Push constant block of indirect-params.comp. The count written out is
+ * min(count, maxCount), divided by countDivisor (rounding up) and
+ * multiplied by countMultiplier, which is how a count of elements becomes
+ * one of tiles or of per-tile counters. */
+struct IndirectPushConstant {
+  uint elementsPerGroup;
+  uint maxCount;
+  uint countDivisor;
+  uint countMultiplier;
+};
+
+/* Same limit as splitGroupCount. */
+#define INDIRECT_MAX_GROUPS_PER_DIMENSION 65535
+
+#if defined(__cplusplus)
+} /* namespace IndirectParams */
+#endif
+
+#endif
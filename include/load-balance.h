@@ -0,0 +1,39 @@
+#ifndef _LOAD_BALANCE_H_
+#define _LOAD_BALANCE_H_
+
+#if defined(__cplusplus)
+namespace LoadBalance {
+typedef unsigned int uint;
+#endif
+
+/* Push constant block of load-balance-expand.comp. */
+struct LoadBalancePushConstant {
+  /* SCAN_INDIRECT_COUNT to read the count from the parameter block of the
+   * items. */
+  uint numItems;
+
+  /* Outputs past this many aren't written. */
+  uint maxOutputs;
+
+  /* Workgroup size of the kernel to be dispatched over the outputs, for
+   * the dispatch parameters. */
+  uint groupSize;
+  uint flags;
+};
+
+/* Ranks are written along with the items. */
+#define LOAD_BALANCE_FLAG_RANKS 0x1
+
+/* Every tile covers this many outputs and items together, however they
+ * are spread, which is what balances the work. Tiles are found with the
+ * merge path search of merge-path.comp. */
+#define LOAD_BALANCE_THREADS_PER_BLOCK 128
+#define LOAD_BALANCE_VALUES_PER_THREAD 8
+#define LOAD_BALANCE_VALUES_PER_BLOCK \
+  (LOAD_BALANCE_THREADS_PER_BLOCK * LOAD_BALANCE_VALUES_PER_THREAD)
+
+#if defined(__cplusplus)
+} /* namespace LoadBalance */
+#endif
+
+#endif
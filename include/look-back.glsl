@@ -0,0 +1,65 @@
+/* Decoupled look-back, shared by the kernels which carry something from
+ * tile to tile. Included after prefix-sum.h with ELEMT, SCAN_OP,
+ * SCAN_IDENTITY and STATUS_BUFFER (the status buffer of prefix-sum.comp)
+ * defined. SCAN_OP only has to be associative. */
+
+#define PROCESSOR_DESCRIPTOR_STATUS_X 0
+#define PROCESSOR_DESCRIPTOR_STATUS_A 1
+#define PROCESSOR_DESCRIPTOR_STATUS_P 2
+
+/* Done by a single thread: publishes the aggregate of this tile and walks
+ * back over the predecessors until it finds an inclusive prefix. */
+ELEMT lookBack(uint tileID, ELEMT aggregate, bool carry)
+{
+  if (tileID == 0)
+  {
+    ELEMT carryIn = carry ? STATUS_BUFFER.header.carryIn : SCAN_IDENTITY;
+
+    STATUS_BUFFER.descriptors[0].blockInclusivePrefix =
+      SCAN_OP(carryIn, aggregate);
+    memoryBarrierBuffer();
+    atomicExchange(STATUS_BUFFER.descriptors[0].status,
+                   PROCESSOR_DESCRIPTOR_STATUS_P);
+    return carryIn;
+  }
+
+  STATUS_BUFFER.descriptors[tileID].blockAggregate = aggregate;
+  memoryBarrierBuffer();
+  atomicExchange(STATUS_BUFFER.descriptors[tileID].status,
+                 PROCESSOR_DESCRIPTOR_STATUS_A);
+
+  ELEMT exclusivePrefix = SCAN_IDENTITY;
+
+  int predecessor = int(tileID) - 1;
+  while (predecessor >= 0)
+  {
+    int status = atomicAdd(STATUS_BUFFER.descriptors[predecessor].status, 0);
+
+    /* Predecessor hasn't published anything yet - spin. */
+    if (status == PROCESSOR_DESCRIPTOR_STATUS_X)
+      continue;
+
+    memoryBarrierBuffer();
+
+    if (status == PROCESSOR_DESCRIPTOR_STATUS_P)
+    {
+      exclusivePrefix = SCAN_OP(
+        STATUS_BUFFER.descriptors[predecessor].blockInclusivePrefix,
+        exclusivePrefix);
+      break;
+    }
+
+    exclusivePrefix = SCAN_OP(
+      STATUS_BUFFER.descriptors[predecessor].blockAggregate,
+      exclusivePrefix);
+    --predecessor;
+  }
+
+  STATUS_BUFFER.descriptors[tileID].blockInclusivePrefix =
+    SCAN_OP(exclusivePrefix, aggregate);
+  memoryBarrierBuffer();
+  atomicExchange(STATUS_BUFFER.descriptors[tileID].status,
+                 PROCESSOR_DESCRIPTOR_STATUS_P);
+
+  return exclusivePrefix;
+}
@@ -0,0 +1,43 @@
+#ifndef _MERGE_COMPARATORS_H_
+#define _MERGE_COMPARATORS_H_
+
+/* Comparators of the merge kernels. Every variant of the kernels is
+ * compiled with one of the MERGE_COMPARATOR_* defines (see
+ * add_vub_comparator in CMakeLists.txt), which picks the key type and the
+ * strict weak ordering MERGE_LESS on it.
+ *
+ * To add a comparator, add a case here and a matching add_vub_comparator
+ * line, and pass its name to the primitives in a Comparator. Variants with
+ * MERGE_COMPARATOR_CUSTOM get MERGE_KEY and MERGE_LESS from the
+ * ShaderCompiler instead (see Comparator::custom). */
+
+#if defined(MERGE_COMPARATOR_DESCENDING)
+
+#define MERGE_KEY uint
+#define MERGE_LESS(a, b) ((a) > (b))
+
+#elif defined(MERGE_COMPARATOR_UVEC2)
+
+/* Composite keys, ordered by x and then by y. */
+#define MERGE_KEY uvec2
+#define MERGE_LESS(a, b) ((a).x < (b).x || ((a).x == (b).x && (a).y < (b).y))
+
+#elif defined(MERGE_COMPARATOR_FLOAT)
+
+#define MERGE_KEY float
+#define MERGE_LESS(a, b) ((a) < (b))
+
+#elif defined(MERGE_COMPARATOR_CUSTOM)
+
+#if !defined(MERGE_KEY) || !defined(MERGE_LESS)
+#error "Custom comparators need MERGE_KEY and MERGE_LESS"
+#endif
+
+#else
+
+#define MERGE_KEY uint
+#define MERGE_LESS(a, b) ((a) < (b))
+
+#endif
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef _MERGE_PATH_H_
+#define _MERGE_PATH_H_
+
+#if defined(__cplusplus)
+namespace MergePath {
+typedef unsigned int uint;
+#endif
+
+/* Push constant block of merge-path.comp. Offsets and counts are in
+ * elements, so that both inputs can live in the same buffer. */
+struct MergePushConstant {
+  uint aOffset;
+  uint aCount;
+  uint bOffset;
+  uint bCount;
+  uint outOffset;
+  uint flags;
+};
+
+/* Push constant block of merge-sort-block.comp and of merge-path.comp with
+ * MERGE_SORT_PASS, which merges every pair of neighbouring sorted runs of
+ * width elements. */
+struct MergeSortPushConstant {
+  /* SCAN_INDIRECT_COUNT to read the count from the parameter block. */
+  uint numElements;
+  uint width;
+  uint flags;
+};
+
+/* Values are moved along with the keys. */
+#define MERGE_FLAG_VALUES 0x1
+
+/* Makes merge-sort-block.comp keep keys that compare equal in order. */
+#define MERGE_FLAG_STABLE 0x2
+
+#define MERGE_THREADS_PER_BLOCK 128
+#define MERGE_VALUES_PER_THREAD 8
+#define MERGE_VALUES_PER_BLOCK \
+  (MERGE_THREADS_PER_BLOCK * MERGE_VALUES_PER_THREAD)
+
+#if defined(__cplusplus)
+} /* namespace MergePath */
+#endif
+
+#endif
@@ -4,9 +4,12 @@
 #if defined(__cplusplus)
 namespace PrefixSum {
 typedef unsigned int ELEMT;
+typedef unsigned int uint;
 #else
+#ifndef ELEMT
 #define ELEMT uint
 #endif
+#endif
 
 struct ProcessorDescriptor {
   int status;
@@ -18,6 +21,45 @@ struct ProcessorDescriptor {
   ELEMT pad;
 };
 
+/* Sits in front of the descriptors in the status buffer. The tile counter
+ * hands out tile IDs in the order in which blocks actually start running so
+ * that the look-back never waits on a block that hasn't been scheduled.
+ *
+ * With SCAN_FLAG_CARRY, the scan starts from carryIn instead of the
+ * identity and the last tile writes the total (including carryIn) to
+ * carryOut, so that a long input can be scanned in several calls. */
+struct StatusHeader {
+  uint tileCounter;
+  ELEMT carryIn;
+  ELEMT carryOut;
+  uint pad;
+};
+
+/* Parameter block of a scan. The first three members have the layout of
+ * VkDispatchIndirectCommand so the same block can be handed to
+ * vkCmdDispatchIndirect and read by the kernel. */
+struct ScanParams {
+  uint groupCountX;
+  uint groupCountY;
+  uint groupCountZ;
+  uint numElements;
+};
+
+/* Passing this as the push constant numElements makes the kernel read the
+ * element count from the parameter block instead. */
+#define SCAN_INDIRECT_COUNT 0xFFFFFFFF
+
+#define SCAN_FLAG_INCLUSIVE 0x1
+#define SCAN_FLAG_CARRY 0x2
+
+/* Stride between parameter blocks in a parameter buffer. Has to satisfy
+ * minStorageBufferOffsetAlignment, which is at most 256. */
+#define SCAN_PARAMS_STRIDE 256
+
+/* With buffer references, up to this many 64-bit device addresses follow the
+ * ScanParams inside of a parameter block. */
+#define SCAN_PARAMS_MAX_ADDRESSES 8
+
 /* Unfortunately, these have to be compile-time constants. */
 #define WARP_SIZE 32
 
@@ -0,0 +1,37 @@
+/* Ordering of keys for the radix select kernels. Included after
+ * radix-select.h. */
+
+/* Maps a key to an unsigned integer which orders like the key does, in the
+ * order asked for by the flags. */
+uint orderKey(uint key, uint flags)
+{
+  /* Flipping the sign bit of positive floats and every bit of negative
+   * ones orders them like unsigned integers. */
+  if ((flags & RADIX_SELECT_FLAG_FLOAT) != 0)
+    key ^= (key & 0x80000000) != 0 ? 0xFFFFFFFF : 0x80000000;
+
+  if ((flags & RADIX_SELECT_FLAG_LARGEST) != 0)
+    key = ~key;
+
+  return key;
+}
+
+/* Inverse of orderKey. */
+uint keyFromOrder(uint key, uint flags)
+{
+  if ((flags & RADIX_SELECT_FLAG_LARGEST) != 0)
+    key = ~key;
+
+  if ((flags & RADIX_SELECT_FLAG_FLOAT) != 0)
+    key ^= (key & 0x80000000) != 0 ? 0x80000000 : 0xFFFFFFFF;
+
+  return key;
+}
+
+/* Whether an ordered key is still a candidate in the pass looking at the
+ * digit at shift, i.e. whether it starts with the digits found so far. */
+bool isCandidate(uint key, uint prefix, uint shift)
+{
+  uint high = shift + RADIX_SELECT_BITS;
+  return high >= 32 || (key >> high) == (prefix >> high);
+}
@@ -0,0 +1,60 @@
+#ifndef _RADIX_SELECT_H_
+#define _RADIX_SELECT_H_
+
+#include "radix-sort.h"
+
+#if defined(__cplusplus)
+namespace RadixSelect {
+typedef unsigned int uint;
+#endif
+
+/* Each pass looks at a digit of this many bits, so that selecting among
+ * 32-bit keys takes four passes. */
+#define RADIX_SELECT_BITS 8
+#define RADIX_SELECT_DIGITS (1 << RADIX_SELECT_BITS)
+
+/* Push constant block of the radix select kernels. */
+struct RadixSelectPushConstant {
+  /* SCAN_INDIRECT_COUNT to read the count from the parameter block, in
+   * which case ranks past the keys are those of the last key. */
+  uint numElements;
+
+  /* Rank of the key being looked for, 0 being the first in order. */
+  uint rank;
+
+  /* Lowest bit of the digit looked at by this pass. */
+  uint shift;
+  uint flags;
+};
+
+/* Lives on the device for the length of a selection. Every pass narrows
+ * the candidates down to the keys starting with prefix, among which the
+ * key looked for has rank rank. After the last pass, prefix is that key.
+ *
+ * Has to be set to 0 before the first pass. */
+struct RadixSelectState {
+  uint prefix;
+  uint rank;
+
+  /* Slots handed out by radix-select-compact.comp. */
+  uint lessCount;
+  uint equalCount;
+
+  uint histogram[RADIX_SELECT_DIGITS];
+};
+
+/* Keys are floats instead of unsigned integers. */
+#define RADIX_SELECT_FLAG_FLOAT 0x1
+/* Keys are ranked from the largest instead of from the smallest. */
+#define RADIX_SELECT_FLAG_LARGEST 0x2
+
+/* Tiles are those of the radix sort. */
+#define RADIX_SELECT_THREADS_PER_BLOCK RADIX_THREADS_PER_BLOCK
+#define RADIX_SELECT_VALUES_PER_THREAD RADIX_VALUES_PER_THREAD
+#define RADIX_SELECT_VALUES_PER_BLOCK RADIX_VALUES_PER_BLOCK
+
+#if defined(__cplusplus)
+} /* namespace RadixSelect */
+#endif
+
+#endif
@@ -0,0 +1,85 @@
+/* Sorts a tile of RADIX_VALUES_PER_BLOCK keys (and values) held by a
+ * workgroup by one digit, with one stable split per bit. Included by the
+ * kernels which need it, after radix-sort.h and the subgroup extensions. */
+
+shared uint sKeys[RADIX_VALUES_PER_BLOCK];
+shared uint sValues[RADIX_VALUES_PER_BLOCK];
+
+/* Worst case is a subgroup size of 1. */
+shared uint sSubgroupSums[RADIX_THREADS_PER_BLOCK];
+shared uint sTotal;
+
+uint workgroupExclusiveAdd(uint value, out uint total)
+{
+  uint subgroupExclusive = subgroupExclusiveAdd(value);
+  uint subgroupSum = subgroupAdd(value);
+
+  if (subgroupElect())
+    sSubgroupSums[gl_SubgroupID] = subgroupSum;
+  barrier();
+
+  /* There are only a few subgroups. */
+  if (gl_LocalInvocationID.x == 0)
+  {
+    uint sum = 0;
+    for (uint i = 0; i < gl_NumSubgroups; ++i)
+    {
+      uint count = sSubgroupSums[i];
+      sSubgroupSums[i] = sum;
+      sum += count;
+    }
+    sTotal = sum;
+  }
+  barrier();
+
+  total = sTotal;
+  uint ret = sSubgroupSums[gl_SubgroupID] + subgroupExclusive;
+  barrier();
+
+  return ret;
+}
+
+/* Each thread holds RADIX_VALUES_PER_THREAD consecutive elements of the
+ * tile, before and after. The sorted tile is also left in sKeys and
+ * sValues. Bits from endBit on aren't sorted by. */
+void sortTileByDigit(inout uint keys[RADIX_VALUES_PER_THREAD],
+                     inout uint values[RADIX_VALUES_PER_THREAD],
+                     uint shift,
+                     uint endBit)
+{
+  uint localThreadID = gl_LocalInvocationID.x;
+  uint digitEnd = min(shift + RADIX_BITS, endBit);
+
+  for (uint bit = shift; bit < digitEnd; ++bit)
+  {
+    uint zeros = 0;
+    for (uint i = 0; i < RADIX_VALUES_PER_THREAD; ++i)
+      zeros += ((keys[i] >> bit) & 1) ^ 1;
+
+    uint totalZeros;
+    uint zerosBefore = workgroupExclusiveAdd(zeros, totalZeros);
+
+    for (uint i = 0; i < RADIX_VALUES_PER_THREAD; ++i)
+    {
+      uint local = localThreadID * RADIX_VALUES_PER_THREAD + i;
+
+      uint position;
+      if (((keys[i] >> bit) & 1) == 0)
+        position = zerosBefore++;
+      else
+        position = totalZeros + local - zerosBefore;
+
+      sKeys[position] = keys[i];
+      sValues[position] = values[i];
+    }
+    barrier();
+
+    for (uint i = 0; i < RADIX_VALUES_PER_THREAD; ++i)
+    {
+      uint local = localThreadID * RADIX_VALUES_PER_THREAD + i;
+      keys[i] = sKeys[local];
+      values[i] = sValues[local];
+    }
+    barrier();
+  }
+}
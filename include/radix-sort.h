@@ -0,0 +1,40 @@
+#ifndef _RADIX_SORT_H_
+#define _RADIX_SORT_H_
+
+#if defined(__cplusplus)
+namespace RadixSort {
+typedef unsigned int uint;
+#endif
+
+/* Push constant block of radix-sort-histogram.comp and
+ * radix-sort-scatter.comp. */
+struct RadixSortPushConstant {
+  /* SCAN_INDIRECT_COUNT to read the count from the parameter block, in
+   * which case numTiles is derived from it too. */
+  uint numElements;
+  uint numTiles;
+
+  /* Lowest bit of the digit sorted by this pass. Bits from endBit on are
+   * ignored, so the last pass may sort by fewer than RADIX_BITS. */
+  uint shift;
+  uint endBit;
+  uint flags;
+};
+
+/* Values are moved along with the keys. */
+#define RADIX_FLAG_VALUES 0x1
+
+/* Each pass sorts by a digit of this many bits. */
+#define RADIX_BITS 4
+#define RADIX_DIGITS (1 << RADIX_BITS)
+
+#define RADIX_THREADS_PER_BLOCK 256
+#define RADIX_VALUES_PER_THREAD 4
+#define RADIX_VALUES_PER_BLOCK \
+  (RADIX_THREADS_PER_BLOCK * RADIX_VALUES_PER_THREAD)
+
+#if defined(__cplusplus)
+} /* namespace RadixSort */
+#endif
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef _SEGMENTED_SORT_H_
+#define _SEGMENTED_SORT_H_
+
+#if defined(__cplusplus)
+namespace SegmentedSort {
+typedef unsigned int uint;
+#endif
+
+/* Push constant block of the segmented sort kernels. Segment i is
+ * [offsets[i], offsets[i+1]) of the keys. */
+struct SegmentedSortPushConstant {
+  /* SCAN_INDIRECT_COUNT to read the count from the parameter block, which
+   * only the binning needs. */
+  uint numSegments;
+
+  /* Length of each bin's list in the bin buffer. */
+  uint maxSegments;
+  uint flags;
+};
+
+/* Segments are binned by size. Small ones are sorted by a thread in its
+ * registers, medium ones by a workgroup in shared memory and large ones by
+ * a workgroup running a radix sort in global memory. */
+#define SEGMENTED_BIN_SMALL 0
+#define SEGMENTED_BIN_MEDIUM 1
+#define SEGMENTED_BIN_LARGE 2
+#define SEGMENTED_BIN_COUNT 3
+
+#define SEGMENTED_SMALL_MAX 16
+/* MERGE_VALUES_PER_BLOCK, the tile of merge-sort-block.comp. */
+#define SEGMENTED_MEDIUM_MAX 1024
+
+/* Layout of the bin buffer: the number of segments in each bin (padded to
+ * four), followed by the list of segments of each bin, maxSegments long. */
+#define SEGMENTED_BIN_HEADER 4
+
+#define SEGMENTED_THREADS_PER_BLOCK 128
+
+#if defined(__cplusplus)
+} /* namespace SegmentedSort */
+#endif
+
+#endif
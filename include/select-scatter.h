@@ -0,0 +1,20 @@
+#ifndef _SELECT_SCATTER_H_
+#define _SELECT_SCATTER_H_
+
+#if defined(__cplusplus)
+namespace SelectScatter {
+typedef unsigned int uint;
+#endif
+
+/* Push constant block of select-scatter.comp. */
+struct SelectScatterPushConstant {
+  uint numElements;
+};
+
+#define SELECT_THREADS_PER_BLOCK 256
+
+#if defined(__cplusplus)
+} /* namespace SelectScatter */
+#endif
+
+#endif
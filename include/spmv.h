@@ -0,0 +1,36 @@
+#ifndef _SPMV_H_
+#define _SPMV_H_
+
+#if defined(__cplusplus)
+namespace Spmv {
+typedef unsigned int uint;
+#endif
+
+/* Push constant block of spmv.comp and spmv-rows.comp. */
+struct SpmvPushConstant {
+  /* SCAN_INDIRECT_COUNT to read the row count from the parameter block,
+   * in which case numNonzeros is the most there may be and the nonzeros
+   * are counted from the row offsets. */
+  uint numRows;
+  uint numNonzeros;
+  uint flags;
+  uint pad;
+};
+
+/* Every tile of spmv.comp covers this many row ends and nonzeros
+ * together, however they are spread over the rows. */
+#define SPMV_THREADS_PER_BLOCK 128
+#define SPMV_ITEMS_PER_THREAD 8
+#define SPMV_ITEMS_PER_BLOCK (SPMV_THREADS_PER_BLOCK * SPMV_ITEMS_PER_THREAD)
+
+/* Upper bounds on the size of the look-back status header and of a
+ * descriptor with a carry of a float or a double, which is what the
+ * status buffer is sized by. */
+#define SPMV_STATUS_HEADER_SIZE 64
+#define SPMV_STATUS_DESCRIPTOR_SIZE 64
+
+#if defined(__cplusplus)
+} /* namespace Spmv */
+#endif
+
+#endif
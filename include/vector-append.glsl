@@ -0,0 +1,22 @@
+/* Appending to a DeviceVector from a kernel. Included after
+ * vector-append.h.
+ *
+ * DEFINE_VECTOR_APPEND(name, header) defines uint name(uint n), where
+ * header is the VectorHeader of the vector inside of a buffer block. It
+ * reserves n elements at the end of the vector and returns the index of the
+ * first, or VECTOR_APPEND_FULL if they don't all fit in its capacity, in
+ * which case none of them may be written. Appends should be made once per
+ * subgroup or workgroup rather than per element, like the tiles of
+ * hash-table-extract.comp do, to keep the atomics on count down. */
+
+#define DEFINE_VECTOR_APPEND(name, header)                               \
+  uint name(uint n)                                                      \
+  {                                                                      \
+    uint first = atomicAdd(header.count, n);                             \
+    if (first + n > header.capacity || first + n < first)                \
+    {                                                                    \
+      header.overflow = 1;                                               \
+      return VECTOR_APPEND_FULL;                                         \
+    }                                                                    \
+    return first;                                                        \
+  }
@@ -0,0 +1,37 @@
+#ifndef _VECTOR_APPEND_H_
+#define _VECTOR_APPEND_H_
+
+#if defined(__cplusplus)
+namespace VectorAppend {
+typedef unsigned int uint;
+#endif
+
+/* Header of a DeviceVector which kernels append to (see
+ * vector-append.glsl). Begins like a ScanParams block so the count can be
+ * handed to IndirectDispatch as it is. */
+struct VectorHeader {
+  /* Left at 0, for IndirectDispatch to fill in. */
+  uint groupCountX;
+  uint groupCountY;
+  uint groupCountZ;
+
+  /* Elements in the vector plus all that were appended, including those
+   * which didn't fit. */
+  uint count;
+
+  /* Elements the vector has memory for. */
+  uint capacity;
+
+  /* Set when an append didn't fit. */
+  uint overflow;
+  uint pad[2];
+};
+
+/* What an append which doesn't fit returns. */
+#define VECTOR_APPEND_FULL 0xFFFFFFFF
+
+#if defined(__cplusplus)
+} /* namespace VectorAppend */
+#endif
+
+#endif